@@ -17,7 +17,10 @@
 #include "elasticsearch.h"
 #include "elasticsearch/mapping.h"
 #include "elasticsearch/querygen.h"
+#include "elasticsearch/refresh_coordinator.h"
 #include "highlighting/highlighting.h"
+#include "json/smile.h"
+#include "rest/admission.h"
 #include "rest/rest.h"
 
 #include "access/transam.h"
@@ -25,34 +28,80 @@
 #include "catalog/index.h"
 #include "catalog/pg_collation.h"
 #include "commands/dbcommands.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
 #include "utils/formatting.h"
+#include "utils/json.h"
 #include "utils/lsyscache.h"
+#include "utils/timestamp.h"
 
 /* an ES limit introduced around Elasticsearch v5 */
 #define MAX_DOCS_PER_REQUEST 10000
 
-#define ES_BULK_RESPONSE_FILTER "errors,items.*.error"
+#define ES_BULK_RESPONSE_FILTER "errors,items.*.error,items.*.status"
 #define ES_SEARCH_RESPONSE_FILTER "_scroll_id,_shards.failed,hits.total,hits.hits.fields.*,hits.hits._id,hits.hits._score,hits.hits.highlight.*"
 
+/* how long we sleep, at most, waiting for a page of a scroll to arrive before looking around again */
+#define SCROLL_SLICE_WAIT_MS 1000
+
+/* while we read through a page of a scroll, we let curl receive the next ones every this many hits */
+#define SCROLL_POLL_HITS 1000
+
+/*
+ * While a batch is being built we only let curl make progress on the batches already in flight
+ * once this many more bytes have been added to the current batch...
+ */
+#define BULK_POLL_BYTES (256 * 1024)
+/* ...or, checked every BULK_POLL_ROWS rows, when this much time has passed since we last did */
+#define BULK_POLL_INTERVAL_MS 50
+#define BULK_POLL_ROWS 64
+
+/* how long we sleep, at most, waiting for the bulk I/O thread to finish a batch */
+#define BULK_IO_THREAD_WAIT_MS 10
+
+/* and for one of our in-flight batches to finish, when we're over zdb.max_bulk_memory */
+#define BULK_MEMORY_WAIT_MS 100
+
 #define validate_alias(indexRel) \
 	do { \
         if (ZDBIndexOptionsGetAlias((indexRel)) == NULL) \
             elog(ERROR, "index '%s' doesn't have an alias", RelationGetRelationName((indexRel))); \
 	} while(0)
 
+/* defined in zdbam.c */
+extern bool zdb_bulk_io_thread_guc;
+extern bool zdb_curl_verbose_guc;
+extern int  zdb_max_bulk_memory_guc;
+
+/*
+ * The search contexts a scroll is holding open in Elasticsearch, which they do until they expire
+ * unless we clear them.  These live in TopMemoryContext so that we can still clear those of
+ * scrolls nobody closed once their transaction is over
+ */
+typedef struct ElasticsearchScrollIds {
+	char *url;
+	int  nids;
+	char **ids;    /* the latest scroll id of each slice, or NULL if it doesn't have one yet */
+} ElasticsearchScrollIds;
+
+static List *open_scroll_ids      = NIL;    /* of the scrolls we haven't closed */
+static List *abandoned_scroll_ids = NIL;    /* of those whose transaction ended before they were */
 
-static PostDataEntry *checkout_batch_pool(ElasticsearchBulkContext *context) {
+static PostDataEntry *checkout_batch_pool(ElasticsearchBulkStream *stream) {
 	int i;
 
-	for (i = 0; i < context->rest->nhandles + 1; i++) {
-		if (context->pool[i] != NULL) {
-			PostDataEntry *entry = palloc(sizeof(PostDataEntry));
+	for (i = 0; i < stream->rest->nhandles + 1; i++) {
+		if (stream->pool[i] != NULL) {
+			PostDataEntry *entry = palloc0(sizeof(PostDataEntry));
 
-			entry->buff            = context->pool[i];
-			entry->pool_idx        = i;
-			entry->compressed_data = NULL;
+			entry->buff        = stream->pool[i];
+			entry->pool_idx    = i;
+			entry->contentType = stream->smile ? SMILE_CONTENT_TYPE : NULL;
+			entry->separator   = stream->smile ? SMILE_STREAM_SEPARATOR : '\n';
 
-			context->pool[i] = NULL;
+			stream->pool[i] = NULL;
 			return entry;
 		}
 	}
@@ -112,13 +161,43 @@ char *ElasticsearchArbitraryRequest(Relation indexRel, char *method, char *endpo
 	}
 }
 
+/*
+ * Tombstones are children of their rows through a 'join' field, which Elasticsearch 5.x doesn't have
+ */
+static void check_tombstones_supported(Relation indexRel) {
+	StringInfo request = makeStringInfo();
+	StringInfo response;
+	void       *json;
+	const char *number;
+
+	appendStringInfo(request, "%s", ZDBIndexOptionsGetUrl(indexRel));
+	response = rest_call("GET", request, NULL, ZDBIndexOptionsGetCompressionLevel(indexRel));
+	json     = parse_json_object(response, CurrentMemoryContext);
+	number   = get_json_object_string(get_json_object_object(json, "version", false), "number");
+
+	if (atoi(number) < 6)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("'tombstones' index option requires Elasticsearch 6.x"),
+						errdetail("The cluster at '%s' is running Elasticsearch %s",
+								  ZDBIndexOptionsGetUrl(indexRel), number)));
+
+	freeStringInfo(request);
+	freeStringInfo(response);
+}
+
 char *ElasticsearchCreateIndex(Relation heapRel, Relation indexRel, TupleDesc tupdesc, char *aliasName) {
 	char       *indexName = generate_uuid_index_name(indexRel);
 	StringInfo request    = makeStringInfo();
 	StringInfo settings   = makeStringInfo();
-	StringInfo mapping    = generate_mapping(heapRel, tupdesc);
+	StringInfo mapping;
 	StringInfo response;
 
+	if (ZDBIndexOptionsGetTombstones(indexRel))
+		check_tombstones_supported(indexRel);
+
+	mapping = generate_mapping(heapRel, tupdesc, ZDBIndexOptionsGetTombstones(indexRel));
+
 	if (ZDBIndexOptionsGetIndexName(indexRel) != NULL) {
 		elog(LOG, "[zombodb] Reusing index with name '%s'", ZDBIndexOptionsGetIndexName(indexRel));
 		pfree(indexName);
@@ -211,18 +290,6 @@ void ElasticsearchDeleteIndex(Relation indexRel) {
 	freeStringInfo(response);
 }
 
-void ElasticsearchDeleteIndexDirect(char *index_url) {
-	StringInfo request = makeStringInfo();
-	StringInfo response;
-
-	elog(LOG, "[ZomboDB] DELETING remote index %s", index_url);
-	appendStringInfo(request, "%s", index_url);
-	response = rest_call("DELETE", request, NULL, 0);
-
-	freeStringInfo(request);
-	freeStringInfo(response);
-}
-
 void ElasticsearchFinalizeIndexCreation(Relation indexRel) {
 	StringInfo request    = makeStringInfo();
 	StringInfo settings   = makeStringInfo();
@@ -283,7 +350,7 @@ void ElasticsearchUpdateSettings(Relation indexRel, char *oldAlias, char *newAli
 void ElasticsearchPutMapping(Relation heapRel, Relation indexRel, TupleDesc tupdesc) {
 	StringInfo request    = makeStringInfo();
 	StringInfo settings   = makeStringInfo();
-	StringInfo mapping    = generate_mapping(heapRel, tupdesc);
+	StringInfo mapping    = generate_mapping(heapRel, tupdesc, ZDBIndexOptionsGetTombstones(indexRel));
 	StringInfo response;
 
 	appendStringInfo(settings, ""
@@ -302,10 +369,48 @@ void ElasticsearchPutMapping(Relation heapRel, Relation indexRel, TupleDesc tupd
 }
 
 
-ElasticsearchBulkContext *ElasticsearchStartBulkProcess(Relation indexRel, char *indexName, TupleDesc tupdesc, bool ignore_version_conflicts) {
-	ElasticsearchBulkContext *context = palloc0(sizeof(ElasticsearchBulkContext));
-	int                      i;
+/*
+ * A stream that sends batches to 'path' ("index/type/") on the index's cluster, or if it's NULL,
+ * to whichever indexes its action lines name
+ */
+static ElasticsearchBulkStream *bulk_stream_create(Relation indexRel, char *name, char *path, bool ignore_version_conflicts) {
+	ElasticsearchBulkStream *stream = palloc0(sizeof(ElasticsearchBulkStream));
+	MemoryContext           oldContext;
+	int                     i;
+
+	stream->url              = pstrdup(ZDBIndexOptionsGetUrl(indexRel));
+	stream->name             = name;
+	stream->path             = path;
+	stream->batchSize        = ZDBIndexOptionsGetBatchSize(indexRel);
+	stream->bulkConcurrency  = ZDBIndexOptionsGetBulkConcurrency(indexRel);
+	stream->compressionLevel = ZDBIndexOptionsGetCompressionLevel(indexRel);
+	stream->rest             = rest_multi_init(stream->url, stream->bulkConcurrency, ignore_version_conflicts);
+	stream->smile            = strcmp("smile", ZDBIndexOptionsGetBulkFormat(indexRel)) == 0;
+	stream->line             = stream->smile ? makeStringInfo() : NULL;
+	stream->ignoreVersionConflicts = ignore_version_conflicts;
+
+	if (zdb_bulk_io_thread_guc)
+		stream->io = bulk_thread_start(stream->bulkConcurrency, stream->compressionLevel, zdb_curl_verbose_guc);
+
+	/* so that it's obvious in a memory context dump how much our batches are using */
+	stream->bufferContext = AllocSetContextCreate(CurrentMemoryContext, "zombodb bulk buffers", ALLOCSET_DEFAULT_SIZES);
+	stream->pool          = palloc(sizeof(StringInfo) * (stream->bulkConcurrency + 1));
+	oldContext = MemoryContextSwitchTo(stream->bufferContext);
+	for (i = 0; i < stream->bulkConcurrency + 1; i++)
+		stream->pool[i] = makeStringInfo();
+	MemoryContextSwitchTo(oldContext);
+
+	stream->rest->pool          = stream->pool;
+	stream->current             = checkout_batch_pool(stream);
+	stream->waitForActiveShards = false;
+
+	return stream;
+}
 
+/*
+ * The name of the Elasticsearch index we're sending 'indexRel's changes to, if the caller didn't say
+ */
+static char *bulk_index_name(Relation indexRel, char *indexName) {
 	if (indexName == NULL) {
 		indexName = ZDBIndexOptionsGetIndexName(indexRel);
 		if (indexName == NULL) {
@@ -315,22 +420,36 @@ ElasticsearchBulkContext *ElasticsearchStartBulkProcess(Relation indexRel, char
 		}
 	}
 
-	context->url              = pstrdup(ZDBIndexOptionsGetUrl(indexRel));
-	context->pgIndexName      = pstrdup(RelationGetRelationName(indexRel));
-	context->esIndexName      = pstrdup(indexName);
-	context->typeName         = pstrdup(ZDBIndexOptionsGetTypeName(indexRel));
-	context->batchSize        = ZDBIndexOptionsGetBatchSize(indexRel);
-	context->bulkConcurrency  = ZDBIndexOptionsGetBulkConcurrency(indexRel);
-	context->compressionLevel = ZDBIndexOptionsGetCompressionLevel(indexRel);
-	context->shouldRefresh    = strcmp("-1", ZDBIndexOptionsGetRefreshInterval(indexRel)) == 0;
-	context->rest             = rest_multi_init(context->bulkConcurrency, ignore_version_conflicts);
+	return indexName;
+}
 
-	for (i = 0; i < context->bulkConcurrency + 1; i++)
-		context->pool[i] = makeStringInfo();
+static ElasticsearchBulkContext *bulk_context_create(ElasticsearchBulkStream *stream, Relation indexRel, char *indexName, TupleDesc tupdesc) {
+	ElasticsearchBulkContext *context = palloc0(sizeof(ElasticsearchBulkContext));
 
-	context->rest->pool          = context->pool;
-	context->current             = checkout_batch_pool(context);
-	context->waitForActiveShards = false;
+	context->stream        = stream;
+	context->pgIndexName   = pstrdup(RelationGetRelationName(indexRel));
+	context->esIndexName   = pstrdup(indexName);
+	context->typeName      = pstrdup(ZDBIndexOptionsGetTypeName(indexRel));
+	context->shouldRefresh = strcmp("-1", ZDBIndexOptionsGetRefreshInterval(indexRel)) == 0;
+	context->indexRelid    = RelationGetRelid(indexRel);
+	context->tombstones    = ZDBIndexOptionsGetTombstones(indexRel);
+
+	if (stream->path == NULL) {
+		StringInfo target = makeStringInfo();
+
+		/* the properties we put first in each of our action lines, before their "_id" */
+		appendStringInfoString(target, "\"_index\":");
+		escape_json(target, context->esIndexName);
+		appendStringInfoString(target, ",\"_type\":");
+		escape_json(target, context->typeName);
+		appendStringInfoChar(target, ',');
+
+		context->target    = target->data;
+		context->targetLen = target->len;
+	} else {
+		context->target    = "";
+		context->targetLen = 0;
+	}
 
 	if (tupdesc != NULL) {
 		/*
@@ -341,374 +460,1632 @@ ElasticsearchBulkContext *ElasticsearchStartBulkProcess(Relation indexRel, char
 		 */
 		context->containsJson      = tuple_desc_contains_json(tupdesc);
 		context->containsJsonIsSet = true;
+
+		/* and figure out how we'll write its rows */
+		context->serializer = row_serializer_create(tupdesc, stream->smile);
 	}
 
+	stream->ncontexts++;
 	return context;
 }
 
-static inline void bulk_prologue(ElasticsearchBulkContext *context, bool is_final) {
-	if (rest_multi_perform(context->rest))
-		rest_multi_partial_cleanup(context->rest, false, true);
+ElasticsearchBulkContext *ElasticsearchStartBulkProcess(Relation indexRel, char *indexName, TupleDesc tupdesc, bool ignore_version_conflicts) {
+	ElasticsearchBulkStream *stream;
 
-	if (context->current->buff->len >= context->batchSize || context->nrows == MAX_DOCS_PER_REQUEST || is_final) {
-		StringInfo request = makeStringInfo();
+	indexName = bulk_index_name(indexRel, indexName);
+	stream    = bulk_stream_create(indexRel,
+								   pstrdup(RelationGetRelationName(indexRel)),
+								   psprintf("%s/%s/", indexName, ZDBIndexOptionsGetTypeName(indexRel)),
+								   ignore_version_conflicts);
 
-		if (!is_final) {
-			elog(ZDB_LOG_LEVEL,
-				 "[zombodb] processed %d rows in %s (nbytes=%d, nrows=%d, active=%d of %d)",
-				 context->ntotal,
-				 context->pgIndexName,
-				 context->current->buff->len,
-				 context->nrows,
-				 context->bulkConcurrency - context->rest->available,
-				 context->bulkConcurrency);
-		}
+	return bulk_context_create(stream, indexRel, indexName, tupdesc);
+}
 
-		appendStringInfo(request, "%s%s/%s/_bulk?filter_path=%s", context->url, context->esIndexName, context->typeName,
-						 ES_BULK_RESPONSE_FILTER);
-		if (context->waitForActiveShards)
-			appendStringInfo(request, "&wait_for_active_shards=all");
+/*
+ * Like ElasticsearchStartBulkProcess(), but the index shares its batches with the other indexes
+ * in 'streams' that are on the same cluster and that we'd send the same way, each action line
+ * naming its own index.  A transaction that changes hundreds of partitions then only has as many
+ * requests in flight, and buffers, as one index would.
+ *
+ * 'streams' is the caller's list of them, and each finishes once all of its contexts have
+ */
+ElasticsearchBulkContext *ElasticsearchStartSharedBulkProcess(Relation indexRel, TupleDesc tupdesc, List **streams) {
+	ElasticsearchBulkStream *stream    = NULL;
+	char                    *indexName = bulk_index_name(indexRel, NULL);
+	bool                    smile      = strcmp("smile", ZDBIndexOptionsGetBulkFormat(indexRel)) == 0;
+	ListCell                *lc;
+
+	foreach (lc, *streams) {
+		ElasticsearchBulkStream *candidate = lfirst(lc);
+
+		if (!candidate->finalSent &&
+			candidate->smile == smile &&
+			candidate->batchSize == ZDBIndexOptionsGetBatchSize(indexRel) &&
+			candidate->bulkConcurrency == ZDBIndexOptionsGetBulkConcurrency(indexRel) &&
+			candidate->compressionLevel == ZDBIndexOptionsGetCompressionLevel(indexRel) &&
+			strcmp(candidate->url, ZDBIndexOptionsGetUrl(indexRel)) == 0) {
+			stream = candidate;
+			break;
+		}
+	}
 
-		if (is_final && context->shouldRefresh && context->nrequests == 0)
-			appendStringInfo(request, "&refresh=true");
+	if (stream == NULL) {
+		stream   = bulk_stream_create(indexRel, psprintf("%s_bulk", ZDBIndexOptionsGetUrl(indexRel)), NULL, false);
+		*streams = lappend(*streams, stream);
+	}
 
-		rest_multi_call(context->rest, "POST", request, context->current, context->compressionLevel);
-		freeStringInfo(request);
+	return bulk_context_create(stream, indexRel, indexName, tupdesc);
+}
 
-		context->nrows = 0;
-		context->nrequests++;
+/*
+ * Can we give the I/O thread another batch?  When Elasticsearch rejects them, we let it have
+ * fewer in flight, just like our own requests.  See rest_multi_note_rejection()
+ */
+static inline bool bulk_thread_has_room(ElasticsearchBulkStream *stream) {
+	return stream->ioOutstanding < Min(bulk_thread_capacity(stream->io), stream->rest->limit + 1);
+}
 
-		if (!is_final) {
-			context->current = checkout_batch_pool(context);
-		}
+/*
+ * Give a batch, which has its admission token, to the I/O thread
+ */
+static void bulk_submit_thread_job(ElasticsearchBulkStream *stream, BulkIOJob *job) {
+	job->started = GetCurrentTimestamp();
+	if (!bulk_thread_submit(stream->io, job)) {
+		admission_release(stream->rest->admission);
+		bulk_thread_free_job(job);
+		elog(ERROR, "bulk I/O thread queue is unexpectedly full");
 	}
+	stream->ioOutstanding++;
 }
 
-static inline void bulk_epilogue(ElasticsearchBulkContext *context) {
-	context->nrows++;
-	context->ntotal++;
-}
+/*
+ * Elasticsearch was too busy for a batch, or for the items of it at the positions in 'rejected',
+ * so we'll submit it again, with only those items, after a backoff
+ */
+static void bulk_defer_thread_job(ElasticsearchBulkStream *stream, BulkIOJob *job, List *rejected) {
+	int backoff;
 
-void ElasticsearchBulkInsertRow(ElasticsearchBulkContext *context, ItemPointerData *ctid, text *json, CommandId cmin, CommandId cmax, uint64 xmin, uint64 xmax) {
-	text *possible_copy;
-	int  len;
-	char *as_string;
+	if (rejected != NIL)
+		job->len = rest_keep_only_actions(job->data, job->len, stream->smile ? SMILE_STREAM_SEPARATOR : '\n', rejected);
+	bulk_thread_reset_job(job);
 
-	bulk_prologue(context, false);
+	backoff        = rest_retry_backoff(job->attempt);
+	job->attempt++;
+	job->notBefore = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), backoff);
+	bulk_thread_defer(stream->io, job);
 
-	/* convert the input json text into a c-string */
-	as_string = text_to_cstring_maybe_no_copy(json, &len, &possible_copy);
+	rest_multi_note_rejection(stream->rest);
 
-	/*
-	 * ES' _bulk endpoint requires that the document json be on a single line.
-	 * In general, Postgres' row_to_json() function will have already done this for us, but
-	 * if the row contains a field of type ::json, that'll be encoded as-is, and
-	 * that means in that case we need to find and replace line breaks with spaces
-	 */
-	if (context->containsJson)
-		replace_line_breaks(as_string, len, ' ');
+	elog(ZDB_LOG_LEVEL, "[zombodb] Elasticsearch rejected %s, retrying in %dms (attempt %d, now allowing %d concurrent requests)",
+		 rejected != NIL ? psprintf("%d items of a request", list_length(rejected)) : "a request",
+		 backoff, job->attempt, Min(bulk_thread_capacity(stream->io), stream->rest->limit + 1));
+	list_free(rejected);
+}
 
-	/*
-	 * The first line is telling Elasticsearch that we intend to index a document.
-	 *
-	 * We don't specify _index or _type because they're already in our request URL,
-	 * and we don't specify an _id because we let Elasticsearch autogenerate one for us --
-	 * we'll never use the _id for ourselves, so we don't care what it is
-	 */
-	if (ctid != NULL) {
-		appendStringInfo(context->current->buff, "{\"index\":{\"_id\":\"%lu\"}}\n", ItemPointerToUint64(ctid));
-	} else {
-		appendStringInfo(context->current->buff, "{\"index\":{}}\n");
-	}
+/*
+ * Check the response of a batch the I/O thread has finished with, and free it.  Unless, like
+ * rest.c does with our own requests, we're going to send it again because Elasticsearch rejected
+ * it, in which case we return true
+ */
+static bool bulk_check_thread_job(ElasticsearchBulkStream *stream, BulkIOJob *job) {
+	List *rejected = NIL;
 
-	/* the second line is the json form of the document... */
-	appendBinaryStringInfo(context->current->buff, strip_json_ending(as_string, len), len);
+	if (job->zlib_rc != Z_OK) {
+		int rc = job->zlib_rc;
 
-	if (ctid != NULL) {
-		/* ...but we tack on our zdb_ctid property */
-		appendStringInfo(context->current->buff, ",\"zdb_ctid\":%lu", ItemPointerToUint64(ctid));
+		bulk_thread_free_job(job);
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+						errmsg("compression error, code=%d", rc)));
 	}
 
-	/* ...and cmin/cmax */
-	appendStringInfo(context->current->buff, ",\"zdb_cmin\":%d", cmin);
-	if (cmax != InvalidCommandId)
-		appendStringInfo(context->current->buff, ",\"zdb_cmax\":%d", cmax);
+	if (job->curl_rc != CURLE_OK || job->response_code != 200 ||
+		(job->response != NULL && strstr(job->response, "\"errors\":true"))) {
+		bool ignoreError;
+
+		if (job->curl_rc == CURLE_OK && job->attempt < MAX_REQUEST_RETRIES &&
+			(job->response_code == 429 ||
+			 (job->response_code == 200 && job->response != NULL &&
+			  rest_find_rejected_items(job->response, stream->ignoreVersionConflicts, &rejected)))) {
+			/* Elasticsearch is too busy for (some of) this batch, so we'll send it again shortly */
+			bulk_defer_thread_job(stream, job, rejected);
+			return true;
+		}
 
-	/* ...and xmin/xmax */
-	appendStringInfo(context->current->buff, ",\"zdb_xmin\":%lu", xmin);
-	if (xmax != InvalidTransactionId)
-		appendStringInfo(context->current->buff, ",\"zdb_xmax\":%lu", xmax);
+		ignoreError = stream->ignoreVersionConflicts && job->response != NULL &&
+					  rest_contains_version_conflict_error(job->response);
 
-	appendStringInfo(context->current->buff, "}\n");
+		if (!ignoreError) {
+			char *message = psprintf("libcurl error:  %s: %s, response_code=%ld, result=%d",
+									 job->errorbuff, job->response != NULL ? job->response : "",
+									 job->response_code, job->curl_rc);
 
-	if (possible_copy != json)
-		pfree(possible_copy);
-	pfree(json);
+			bulk_thread_free_job(job);
+			ereport(ERROR,
+					(errcode(ERRCODE_IO_ERROR),
+							errmsg("%s", message)));
+		}
+	} else {
+		rest_multi_note_success(stream->rest, job->started);
+	}
 
-	context->nindex++;
-	bulk_epilogue(context);
+	bulk_thread_free_job(job);
+	return false;
 }
 
-void ElasticsearchBulkUpdateTuple(ElasticsearchBulkContext *context, ItemPointer ctid, char *llapi_id, CommandId cmax, uint64 xmax) {
-	bulk_prologue(context, false);
+static void bulk_collect_thread_jobs(ElasticsearchBulkStream *stream) {
+	BulkIOJob   *job;
+	TimestampTz now;
 
-	if (ctid != NULL) {
-		appendStringInfo(context->current->buff, "{\"update\":{\"_id\":\"%lu\",\"_retry_on_conflict\":1}}\n",
-						 ItemPointerToUint64(ctid));
-	} else {
-		appendStringInfo(context->current->buff, "{\"update\":{\"_id\":\"%s\",\"_retry_on_conflict\":1}}\n", llapi_id);
+	while ((job = bulk_thread_next_completed(stream->io)) != NULL) {
+		size_t len = job->len;
+
+		stream->ioOutstanding--;
+		admission_release(stream->rest->admission);
+		stream->rest->nbytesSent += job->sent;
+
+		/* if it's going again, it might only be some of it */
+		if (bulk_check_thread_job(stream, job))
+			rest_post_data_memory_add(-(int64) (len - job->len));
+		else
+			rest_post_data_memory_add(-(int64) len);
 	}
-	appendStringInfo(context->current->buff,
-					 "{\"script\":{\"source\":\""
-					 "ctx._source.zdb_cmax=params.CMAX;"
-					 "ctx._source.zdb_xmax=params.XMAX;\",\"lang\":\"painless\",\"params\":{\"CMAX\":%u,\"XMAX\":%lu}}}\n",
-					 cmax, xmax);
 
-	context->nupdate++;
-	bulk_epilogue(context);
+	/* the rejected batches whose backoff is over go back to the thread, ahead of new ones */
+	if (bulk_thread_deferred(stream->io) > 0) {
+		now = GetCurrentTimestamp();
+		while ((job = bulk_thread_first_deferred(stream->io)) != NULL && job->notBefore <= now &&
+			   bulk_thread_has_room(stream) && admission_try_acquire(stream->rest->admission)) {
+			bulk_thread_undefer(stream->io);
+			bulk_submit_thread_job(stream, job);
+		}
+	}
 }
 
-void ElasticsearchBulkVacuumXmax(ElasticsearchBulkContext *context, char *_id, uint64 expected_xmax) {
-	bulk_prologue(context, false);
+/*
+ * Sleep a little while the I/O thread works, then collect whatever it's finished
+ */
+static void bulk_wait_for_thread(ElasticsearchBulkStream *stream) {
+	int rc;
 
-	appendStringInfo(context->current->buff, "{\"update\":{\"_id\":\"%s\",\"_retry_on_conflict\":0}}\n", _id);
-	appendStringInfo(context->current->buff,
-					 "{\"script\":{\"source\":\""
-					 "if (ctx._source.zdb_xmax != params.EXPECTED_XMAX) {"
-					 "   ctx.op='none';"
-					 "} else {"
-					 "   ctx._source.zdb_xmax=null;"
-					 "}\",\"lang\":\"painless\",\"params\":{\"EXPECTED_XMAX\":%lu}}}\n",
-					 expected_xmax);
+	if (bulk_thread_has_exited(stream->io))
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+						errmsg("bulk I/O thread for %s exited unexpectedly", stream->name)));
+
+	rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, BULK_IO_THREAD_WAIT_MS,
+				   PG_WAIT_EXTENSION);
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
 
-	context->nvacuum++;
-	bulk_epilogue(context);
+	bulk_collect_thread_jobs(stream);
 }
 
-void ElasticsearchBulkDeleteRowByXmin(ElasticsearchBulkContext *context, char *_id, uint64 xmin) {
-	/* important to tag this before we do the work in bulk_prologue() */
-	context->waitForActiveShards = true;
+/*
+ * Let curl make progress on in-flight batches and reclaim any that have finished
+ */
+static void bulk_poll(ElasticsearchBulkStream *stream) {
+	instr_time start, end;
 
-	bulk_prologue(context, false);
+	INSTR_TIME_SET_CURRENT(start);
 
-	appendStringInfo(context->current->buff, "{\"update\":{\"_id\":\"%s\"}}\n", _id);
-	appendStringInfo(context->current->buff,
-					 "{\"script\":{\"source\":\""
-					 "if (ctx._source.zdb_xmin == params.EXPECTED_XMIN) {"
-					 "   ctx.op='delete';"
-					 "} else {"
-					 "   ctx.op='none';"
-					 "}\",\"lang\":\"painless\",\"params\":{\"EXPECTED_XMIN\":%lu}}}\n",
-					 xmin);
+	if (stream->io != NULL) {
+		bulk_collect_thread_jobs(stream);
+	} else {
+		rest_multi_perform(stream->rest);
+		rest_multi_partial_cleanup(stream->rest, false, false);
+	}
 
-	context->ndelete++;
-	bulk_epilogue(context);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(stream->pollTime, end, start);
+	stream->lastPoll    = end;
+	stream->lastPollLen = (int) PostDataEntryLength(stream->current);
+	stream->npolls++;
 }
 
-void ElasticsearchBulkDeleteRowByXmax(ElasticsearchBulkContext *context, char *_id, uint64 xmax) {
-	/* important to tag this before we do the work in bulk_prologue() */
-	context->waitForActiveShards = true;
+static inline bool bulk_should_poll(ElasticsearchBulkStream *stream) {
+	if (stream->io != NULL ? stream->ioOutstanding == 0 && bulk_thread_deferred(stream->io) == 0
+							: stream->rest->available == stream->bulkConcurrency && stream->rest->retries == NIL)
+		return false;    /* nothing in flight */
 
-	bulk_prologue(context, false);
+	if ((int) PostDataEntryLength(stream->current) - stream->lastPollLen >= BULK_POLL_BYTES)
+		return true;
 
-	appendStringInfo(context->current->buff, "{\"update\":{\"_id\":\"%s\"}}\n", _id);
-	appendStringInfo(context->current->buff,
-					 "{\"script\":{\"source\":\""
-					 "if (ctx._source.zdb_xmax == params.EXPECTED_XMAX) {"
-					 "   ctx.op='delete';"
-					 "} else {"
-					 "   ctx.op='none';"
-					 "}\",\"lang\":\"painless\",\"params\":{\"EXPECTED_XMAX\":%lu}}}\n",
-					 xmax);
+	if (stream->nrows % BULK_POLL_ROWS == 0) {
+		instr_time elapsed = stream->rowStart;
+
+		INSTR_TIME_SUBTRACT(elapsed, stream->lastPoll);
+		return INSTR_TIME_GET_MILLISEC(elapsed) >= BULK_POLL_INTERVAL_MS;
+	}
 
-	context->ndelete++;
-	bulk_epilogue(context);
+	return false;
 }
 
-void ElasticsearchBulkMarkTransactionInProgress(ElasticsearchBulkContext *context) {
-	uint64 xid = convert_xid(GetCurrentTransactionId());
+/*
+ * An "index" action, and its document, that's in a part of the current batch curl hasn't seen yet
+ */
+typedef struct BulkPendingKey {
+	Oid    indexRelid;    /* a shared stream has the ctids of many indexes */
+	uint64 ctid;
+} BulkPendingKey;
+
+typedef struct BulkPendingIndex {
+	BulkPendingKey key;       /* hash key */
+	StringInfo     buff;      /* the batch buffer it's in... */
+	int            offset;    /* ...starting here... */
+	int            len;       /* ...for this many bytes */
+	int            mvcc;      /* where, from 'offset', bulk_append_mvcc_properties() started */
+	CommandId      cmin;
+	uint64         xmin;
+} BulkPendingIndex;
+
+/*
+ * Bytes of the current batch we took back, and need to cut out before curl sees them
+ */
+typedef struct BulkDeadSpan {
+	StringInfo buff;
+	int        offset;
+	int        len;
+} BulkDeadSpan;
+
+static int dead_span_cmp(const void *a, const void *b) {
+	const BulkDeadSpan *left  = *((const BulkDeadSpan **) a);
+	const BulkDeadSpan *right = *((const BulkDeadSpan **) b);
+
+	if (left->buff != right->buff)
+		return left->buff < right->buff ? -1 : 1;
+	return left->offset < right->offset ? -1 : left->offset > right->offset ? 1 : 0;
+}
 
-	bulk_prologue(context, false);
+static void bulk_reset_coalescing(ElasticsearchBulkStream *stream) {
+	HASHCTL ctl;
 
-	appendStringInfo(context->current->buff,
-					 "{\"update\":{\"_id\":\"zdb_aborted_xids\",\"_retry_on_conflict\":128}}\n");
-	appendStringInfo(context->current->buff,
-					 "{\"upsert\":{\"zdb_aborted_xids\":[%lu]},"
-					 "\"script\":{\"source\":\"ctx._source.zdb_aborted_xids.add(params.XID);\",\"lang\":\"painless\",\"params\":{\"XID\":%lu}}}\n",
-					 xid, xid);
+	MemoryContextReset(stream->coalesceContext);
 
-	context->nxid++;
-	bulk_epilogue(context);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize   = sizeof(BulkPendingKey);
+	ctl.entrysize = sizeof(BulkPendingIndex);
+	ctl.hcxt      = stream->coalesceContext;
+	stream->pendingIndex = hash_create("bulk pending index actions", 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	stream->deadSpans    = NIL;
 }
 
-void ElasticsearchBulkMarkTransactionCommitted(ElasticsearchBulkContext *context) {
-	uint64 xid = convert_xid(GetCurrentTransactionId());
+/*
+ * In batch mode, a row that's indexed and then updated or deleted in the same transaction would
+ * go out as an "index" action followed by an "update".  Instead, as long as curl hasn't seen the
+ * "index" action yet, we fold the update into it
+ */
+void ElasticsearchBulkEnableCoalescing(ElasticsearchBulkContext *context) {
+	ElasticsearchBulkStream *stream = context->stream;
 
-	appendStringInfo(context->current->buff,
-					 "{\"update\":{\"_id\":\"zdb_aborted_xids\",\"_retry_on_conflict\":128}}\n");
-	appendStringInfo(context->current->buff, ""
-							   "{"
-							   "\"script\":{"
-							   "\"source\":\"ctx._source.zdb_aborted_xids.remove(ctx._source.zdb_aborted_xids.indexOf(params.XID));\","
-							   "\"params\":{\"XID\":%lu},"
-							   "\"lang\":\"painless\""
-							   "}"
-							   "}\n", xid);
-	context->nxid++;
+	/* the stream might be shared with an index that's already turned it on */
+	if (stream->coalesceContext != NULL)
+		return;
+
+	stream->coalesceContext = AllocSetContextCreate(CurrentMemoryContext, "bulk coalescing", ALLOCSET_DEFAULT_SIZES);
+	bulk_reset_coalescing(stream);
 }
 
-void ElasticsearchFinishBulkProcess(ElasticsearchBulkContext *context) {
-	StringInfo request = makeStringInfo();
+/*
+ * Cut what we took back out of the current batch, as curl is about to see it.  After this,
+ * nothing in the batch can be taken back
+ */
+static void bulk_settle_coalescing(ElasticsearchBulkStream *stream) {
+	PostDataEntry *entry = stream->current;
+	BulkDeadSpan  **spans;
+	ListCell      *lc;
+	int           nspans, i, j;
+
+	if (stream->coalesceContext == NULL)
+		return;
+
+	nspans = list_length(stream->deadSpans);
+	if (nspans > 0) {
+		List *chunks = NIL;
+
+		spans = palloc(sizeof(BulkDeadSpan *) * nspans);
+		i     = 0;
+		foreach (lc, stream->deadSpans) {
+			spans[i++] = lfirst(lc);
+		}
+		qsort(spans, nspans, sizeof(BulkDeadSpan *), dead_span_cmp);
 
-	if (context->current->buff->len > 0) {
-		/* we have more data to send to ES via curl */
-		bulk_prologue(context, true);
+		for (i = 0; i < nspans; i = j) {
+			StringInfo buff = spans[i]->buff;
+			int        dst  = spans[i]->offset;
+			int        removed;
 
-		/* we only want to log if we required more than 1 batch */
-		if (context->nrequests > 1) {
-			elog(ZDB_LOG_LEVEL,
-				 "[zombodb] processed %d total rows in %d batches for %s (nindex=%d, nupdate=%d, ndelete=%d, nvacuum=%d, nxid=%d)",
-				 context->ntotal,
-				 context->nrequests,
-				 context->pgIndexName,
-				 context->nindex,
-				 context->nupdate,
-				 context->ndelete,
-				 context->nvacuum,
-				 context->nxid);
+			/* slide everything between this buffer's dead spans down over them */
+			for (j = i; j < nspans && spans[j]->buff == buff; j++) {
+				int from = spans[j]->offset + spans[j]->len;
+				int to   = j + 1 < nspans && spans[j + 1]->buff == buff ? spans[j + 1]->offset : buff->len;
+
+				memmove(buff->data + dst, buff->data + from, to - from);
+				dst += to - from;
+			}
+
+			removed = buff->len - dst;
+			buff->len = dst;
+			buff->data[dst] = '\0';
+
+			if (buff != entry->buff)
+				entry->nchunked -= removed;
 		}
-	}
+		pfree(spans);
 
-	/* wait for all outstanding HTTP requests to finish */
-	if (context->nrequests > 0) {
-		while (!rest_multi_all_done(context->rest)) {
-			rest_multi_is_available(context->rest);
-			CHECK_FOR_INTERRUPTS();
+		/* curl would take an empty chunk as the end of the batch */
+		foreach (lc, entry->chunks) {
+			StringInfo chunk = lfirst(lc);
+
+			if (chunk->len > 0)
+				chunks = lappend(chunks, chunk);
 		}
+		list_free(entry->chunks);
+		entry->chunks = chunks;
 	}
 
-	/* after this call, context->rest is no longer usable */
-	rest_multi_partial_cleanup(context->rest, true, false);
+	bulk_reset_coalescing(stream);
+}
 
-	if (context->shouldRefresh && context->nrequests > 1) {
-		/* we did more than 1 request, so force a full refresh across the entire index */
-		resetStringInfo(request);
-		appendStringInfo(request, "%s%s/_refresh", context->url, context->esIndexName);
-		rest_call("GET", request, NULL, context->compressionLevel);
-	}
+/*
+ * Hand the current batch to curl.  If it isn't finished yet, curl starts sending what we've
+ * got and waits for the rest as we add it
+ */
+static void bulk_start_request(ElasticsearchBulkStream *stream) {
+	StringInfo request = makeStringInfo();
 
-	freeStringInfo(request);
+	bulk_settle_coalescing(stream);
 
-	pfree(context->esIndexName);
-	pfree(context->pgIndexName);
-	pfree(context);
-}
+	appendStringInfo(request, "%s%s_bulk?filter_path=%s", stream->url, stream->path != NULL ? stream->path : "",
+					 ES_BULK_RESPONSE_FILTER);
+	if (stream->waitForActiveShards)
+		appendStringInfo(request, "&wait_for_active_shards=all");
 
-uint64 ElasticsearchCountAllDocs(Relation indexRel) {
-	StringInfo request    = makeStringInfo();
-	StringInfo postData   = makeStringInfo();
-	StringInfo response;
-	Datum      count;
+	if (stream->io != NULL) {
+		PostDataEntry *entry = stream->current;
+		BulkIOJob     *job   = bulk_thread_make_job(request->data, PostDataEntryLength(entry), entry->contentType);
+		size_t        len    = 0;
+		ListCell      *lc;
 
-	appendStringInfo(postData, "{\"query\":{\"match_all\":{}}}");
-	appendStringInfo(request,
-					 "%s%s/%s/_count?filter_path=count",
-					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
-					 ZDBIndexOptionsGetTypeName(indexRel));
-	response = rest_call("GET", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
-	count    = DirectFunctionCall2(json_object_field_text, CStringGetTextDatum(response->data),
-								   CStringGetTextDatum("count"));
+		/* the thread only works with malloc'd memory, so it gets a copy of the batch */
+		foreach (lc, entry->chunks) {
+			StringInfo chunk = lfirst(lc);
 
-	/* convert the count property to an int8 and return as uint64 */
-	return DatumGetUInt64(DirectFunctionCall1(int8in, PointerGetDatum(TextDatumGetCString(count))));
-}
+			memcpy(job->data + len, chunk->data, chunk->len);
+			len += chunk->len;
+		}
+		memcpy(job->data + len, entry->buff->data, entry->buff->len);
+
+		/* and we can reuse the entry for the next batch */
+		rest_multi_post_data_reset(entry);
+
+		/* if the thread is as far behind as we let it get, wait for it to catch up */
+		if (!bulk_thread_has_room(stream)) {
+			instr_time start, end;
+
+			INSTR_TIME_SET_CURRENT(start);
+			bulk_collect_thread_jobs(stream);
+			while (!bulk_thread_has_room(stream))
+				bulk_wait_for_thread(stream);
+			INSTR_TIME_SET_CURRENT(end);
+			INSTR_TIME_ACCUM_DIFF(stream->stallTime, end, start);
+			stream->nstalls++;
+		}
 
-uint64 ElasticsearchEstimateSelectivity(Relation indexRel, ZDBQueryType *query) {
-	StringInfo request    = makeStringInfo();
-	StringInfo postData   = makeStringInfo();
-	StringInfo response;
-	Datum      count;
+		/* and the thread's requests count against the cluster-wide limit just like our own */
+		while (!admission_try_acquire(stream->rest->admission))
+			bulk_wait_for_thread(stream);
 
-	appendStringInfo(postData, "{\"query\":%s}", convert_to_query_dsl(indexRel, query));
-	appendStringInfo(request,
-					 "%s%s/%s/_count?filter_path=count",
-					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
-					 ZDBIndexOptionsGetTypeName(indexRel));
-	response = rest_call("GET", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
-	count    = DirectFunctionCall2(json_object_field_text, CStringGetTextDatum(response->data),
-								   CStringGetTextDatum("count"));
+		rest_post_data_memory_add((int64) job->len);
+		bulk_submit_thread_job(stream, job);
+	} else {
+		rest_multi_call(stream->rest, "POST", request, stream->current, stream->compressionLevel);
+	}
+	freeStringInfo(request);
 
-	/* convert the count property to an int8 and return as uint64 */
-	return DatumGetUInt64(DirectFunctionCall1(int8in, PointerGetDatum(TextDatumGetCString(count))));
+	stream->streamWaitForActiveShards = stream->waitForActiveShards;
+	stream->nrequests++;
 }
 
-ElasticsearchScrollContext *ElasticsearchOpenScroll(Relation indexRel, ZDBQueryType *userQuery, bool use_id, bool needSort, bool needScore, uint64 limit, char *sortField, SortByDir direction, List *highlights, char **extraFields, int nextraFields) {
-	ElasticsearchScrollContext *context       = palloc0(sizeof(ElasticsearchScrollContext));
-	char                       *queryDSL      = convert_to_query_dsl(indexRel, userQuery);
-	StringInfo                 request        = makeStringInfo();
-	StringInfo                 postData       = makeStringInfo();
-	StringInfo                 docvalueFields = makeStringInfo();
-	StringInfo                 response;
-	void                       *jsonResponse, *hitsObject;
-	char                       *error;
-	int                        i;
-
-	/* we'll assume we want scoring if we have a limit, so that we get the top scoring docs when the limit is applied */
-	needScore = needScore || limit > 0;
+/*
+ * Is this backend holding on to more request bodies than zdb.max_bulk_memory allows?
+ */
+static inline bool bulk_over_budget(void) {
+	return zdb_max_bulk_memory_guc > 0 && rest_post_data_memory() >= (uint64) zdb_max_bulk_memory_guc * 1024;
+}
 
-	if (sortField != NULL) {
-		needSort = true;
-	} else if (needSort) {
-		/* need a default sorting here */
-		sortField     = needScore ? "_score" : "zdb_ctid";
-		if (direction == SORTBY_DEFAULT)
-			direction = needScore ? SORTBY_DESC : SORTBY_ASC;
+/*
+ * Wait for our in-flight batches to finish until we're back under zdb.max_bulk_memory.  If what's
+ * over it isn't ours to wait for, we carry on
+ */
+static void bulk_wait_for_budget(ElasticsearchBulkStream *stream) {
+	instr_time start, end;
+	bool       waited = false;
+
+	INSTR_TIME_SET_CURRENT(start);
+	while (bulk_over_budget()) {
+		if (stream->io != NULL) {
+			if (stream->ioOutstanding == 0 && bulk_thread_deferred(stream->io) == 0)
+				break;
+			bulk_wait_for_thread(stream);
+		} else {
+			if (rest_multi_all_done(stream->rest))
+				break;
+			rest_multi_wait(stream->rest, BULK_MEMORY_WAIT_MS);
+			rest_multi_partial_cleanup(stream->rest, false, false);
+		}
+		waited = true;
 	}
 
+	if (waited) {
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(stream->throttleTime, end, start);
+		stream->nthrottles++;
+	}
+}
 
-	if (needSort)
-		appendStringInfo(postData, "{\"track_scores\":%s,\"sort\":[{\"%s\":\"%s\"}],\"query\":%s",
-						 needScore ? "true" : "false", sortField,
-						 direction == SORTBY_DEFAULT || direction == SORTBY_ASC ? "asc" : "desc", queryDSL);
-	else
-		appendStringInfo(postData, "{\"track_scores\":%s,\"sort\":[\"%s\"],\"query\":%s",
-						 needScore ? "true" : "false", needScore ? "_score" : "_doc", queryDSL);
+static inline void bulk_prologue(ElasticsearchBulkStream *stream, bool is_final) {
+	bool over_budget;
 
-	if (highlights != NULL) {
-		ListCell *lc;
-		int      cnt = 0;
+	if (bulk_should_poll(stream))
+		bulk_poll(stream);
 
-		appendStringInfo(postData, ",\"highlight\":{\"fields\":{");
-		foreach (lc, highlights) {
-			ZDBHighlightInfo *info = lfirst(lc);
+	/*
+	 * If Elasticsearch has been rejecting our requests, we send smaller batches until it catches up.
+	 * If we're using all the memory we're allowed, the batch we're building is sent now (once it's
+	 * at least a chunk, so we aren't sending a row at a time) so that it can be freed sooner
+	 */
+	over_budget = bulk_over_budget() && PostDataEntryLength(stream->current) >= POST_DATA_CHUNK_SIZE;
+	if (PostDataEntryLength(stream->current) >= (uint64) (stream->batchSize * stream->rest->batch_scale) ||
+		stream->nrows == MAX_DOCS_PER_REQUEST || is_final || over_budget ||
+		(stream->current->handle != NULL && stream->streamWaitForActiveShards != stream->waitForActiveShards)) {
 
-			if (cnt > 0) appendStringInfoCharMacro(postData, ',');
-			appendStringInfo(postData, "\"%s\":%s", info->name, info->json);
-			cnt++;
+		if (!is_final) {
+			elog(ZDB_LOG_LEVEL,
+				 "[zombodb] processed %d rows in %s (nbytes=%lu, nrows=%d, active=%d of %d)",
+				 stream->ntotal,
+				 stream->name,
+				 PostDataEntryLength(stream->current),
+				 stream->nrows,
+				 stream->io != NULL ? stream->ioOutstanding : stream->bulkConcurrency - stream->rest->available,
+				 stream->bulkConcurrency);
 		}
-		appendStringInfo(postData, "}}");
-	}
 
-	appendStringInfoCharMacro(postData, '}');
+		if (stream->current->handle != NULL)
+			bulk_settle_coalescing(stream);
+		rest_multi_post_data_add_chunk(stream->current, true);
 
-	appendStringInfo(docvalueFields, "zdb_ctid");
-	for (i = 0; i < nextraFields; i++) {
-		appendStringInfo(docvalueFields, ",%s", extraFields[i]);
-	}
+		/* if curl is already sending this batch, it'll now see the end of it */
+		if (stream->current->handle == NULL)
+			bulk_start_request(stream);
 
-	appendStringInfo(request,
-					 "%s%s/%s/_search?_source=false&size=%lu&scroll=10m&filter_path=%s&stored_fields=%s&docvalue_fields=%s",
-					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
-					 ZDBIndexOptionsGetTypeName(indexRel),
-					 limit == 0 ? MAX_DOCS_PER_REQUEST : limit, ES_SEARCH_RESPONSE_FILTER,
-					 highlights ? "type" : use_id ? "_id" : "_none_",
-					 docvalueFields->data);
+		stream->nrows = 0;
 
-	response = rest_call("POST", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
+		if (!is_final) {
+			if (over_budget)
+				bulk_wait_for_budget(stream);
 
-	/* create a memory context in which to allocate json data */
-	context->jsonMemoryContext = AllocSetContextCreate(CurTransactionContext, "scroll", ALLOCSET_DEFAULT_MINSIZE,
-													   4 * 1024 * 1024, ALLOCSET_DEFAULT_MAXSIZE);
+			/* the I/O thread copied the batch, so we're still able to use the current entry */
+			if (stream->io == NULL)
+				stream->current = checkout_batch_pool(stream);
+			stream->lastPollLen = 0;
+		}
+	}
+
+	INSTR_TIME_SET_CURRENT(stream->rowStart);
+}
+
+static inline void bulk_epilogue(ElasticsearchBulkStream *stream) {
+	instr_time end;
+
+	if (stream->current->buff->len >= POST_DATA_CHUNK_SIZE) {
+		if (stream->current->handle != NULL)
+			bulk_settle_coalescing(stream);
+		rest_multi_post_data_add_chunk(stream->current, false);
+
+		/*
+		 * start sending the current batch as soon as a curl slot is free rather than waiting until it's full.
+		 * Not in batch mode (when we're coalescing), though, where the batch can sit unfinished across
+		 * statements, and idle time between them, holding its curl handle and admission to the cluster
+		 */
+		if (stream->io == NULL && stream->coalesceContext == NULL && stream->current->handle == NULL &&
+			rest_multi_has_capacity(stream->rest) &&
+			(stream->rest->reserved > 0 || rest_multi_try_reserve(stream->rest)))
+			bulk_start_request(stream);
+	}
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(stream->serializeTime, end, stream->rowStart);
+
+	stream->nrows++;
+	stream->ntotal++;
+}
+
+/*
+ * Append a line of json, an action or its script, to 'dest'.  If we're sending Smile, it becomes
+ * a document of its own
+ */
+static void bulk_append_line_to(ElasticsearchBulkStream *stream, StringInfo dest, const char *fmt, ...) pg_attribute_printf(3, 4);
+
+static void bulk_append_line_to(ElasticsearchBulkStream *stream, StringInfo dest, const char *fmt, ...) {
+	StringInfo buff = stream->smile ? stream->line : dest;
+
+	for (;;) {
+		va_list args;
+		int     needed;
+
+		va_start(args, fmt);
+		needed = appendStringInfoVA(buff, fmt, args);
+		va_end(args);
+
+		if (needed == 0)
+			break;
+		enlargeStringInfo(buff, needed);
+	}
+
+	if (stream->smile) {
+		smile_append_header(dest);
+		smile_append_json(dest, buff->data, buff->len);
+		appendStringInfoCharMacro(dest, SMILE_STREAM_SEPARATOR);
+		resetStringInfo(buff);
+	} else {
+		appendStringInfoCharMacro(buff, '\n');
+	}
+}
+
+#define bulk_append_line(context, ...) bulk_append_line_to((context)->stream, (context)->stream->current->buff, __VA_ARGS__)
+
+/*
+ * When the stream is shared, the "_index" and "_type" properties that tell Elasticsearch which of
+ * its indexes a Smile action line is for
+ */
+static inline void bulk_append_smile_target(ElasticsearchBulkContext *context, StringInfo buff) {
+	if (context->stream->path != NULL)
+		return;
+
+	smile_append_key(buff, "_index", 6);
+	smile_append_string(buff, context->esIndexName, (int) strlen(context->esIndexName));
+	smile_append_key(buff, "_type", 5);
+	smile_append_string(buff, context->typeName, (int) strlen(context->typeName));
+}
+
+/*
+ * The first line of an "index" action is telling Elasticsearch that we intend to index a document.
+ *
+ * We only specify _index and _type if the stream is shared, as otherwise they're already in our
+ * request URL.  If we don't have a ctid, we let Elasticsearch autogenerate the _id -- we'll never
+ * use it for ourselves
+ */
+static inline void bulk_append_index_action(ElasticsearchBulkContext *context, ItemPointerData *ctid) {
+	StringInfo buff = context->stream->current->buff;
+
+	if (context->stream->smile) {
+		smile_append_header(buff);
+		smile_append_start_object(buff);
+		smile_append_key(buff, "index", 5);
+		smile_append_start_object(buff);
+		bulk_append_smile_target(context, buff);
+		if (ctid != NULL) {
+			char id[21];
+
+			snprintf(id, sizeof(id), "%lu", ItemPointerToUint64(ctid));
+			smile_append_key(buff, "_id", 3);
+			smile_append_string(buff, id, (int) strlen(id));
+		}
+		smile_append_end_object(buff);
+		smile_append_end_object(buff);
+		appendStringInfoCharMacro(buff, SMILE_STREAM_SEPARATOR);
+	} else if (ctid != NULL) {
+		appendStringInfoString(buff, "{\"index\":{");
+		appendBinaryStringInfo(buff, context->target, context->targetLen);
+		appendStringInfoString(buff, "\"_id\":\"");
+		json_append_uint64(buff, ItemPointerToUint64(ctid));
+		appendStringInfoString(buff, "\"}}\n");
+	} else {
+		appendStringInfoString(buff, "{\"index\":{");
+		if (context->targetLen > 0)
+			appendBinaryStringInfo(buff, context->target, context->targetLen - 1);    /* without its trailing comma */
+		appendStringInfoString(buff, "}}\n");
+	}
+}
+
+/*
+ * Finish a document whose closing brace we left off with our zdb_ctid, cmin/cmax, and xmin/xmax properties
+ */
+static inline void bulk_append_mvcc_properties(ElasticsearchBulkContext *context, ItemPointerData *ctid, CommandId cmin, CommandId cmax, uint64 xmin, uint64 xmax) {
+	StringInfo buff = context->stream->current->buff;
+
+	if (context->stream->smile) {
+		if (ctid != NULL) {
+			smile_append_key(buff, "zdb_ctid", 8);
+			smile_append_int64(buff, (int64) ItemPointerToUint64(ctid));
+		}
+
+		smile_append_key(buff, "zdb_cmin", 8);
+		smile_append_int64(buff, (int32) cmin);
+		if (cmax != InvalidCommandId) {
+			smile_append_key(buff, "zdb_cmax", 8);
+			smile_append_int64(buff, (int32) cmax);
+		}
+
+		smile_append_key(buff, "zdb_xmin", 8);
+		smile_append_int64(buff, (int64) xmin);
+		if (xmax != InvalidTransactionId) {
+			smile_append_key(buff, "zdb_xmax", 8);
+			smile_append_int64(buff, (int64) xmax);
+		}
+
+		if (context->tombstones) {
+			smile_append_key(buff, "zdb_join", 8);
+			smile_append_string(buff, "zdb_row", 7);
+		}
+
+		smile_append_end_object(buff);
+		appendStringInfoCharMacro(buff, SMILE_STREAM_SEPARATOR);
+		return;
+	}
+
+	if (ctid != NULL) {
+		appendStringInfoString(buff, ",\"zdb_ctid\":");
+		json_append_uint64(buff, ItemPointerToUint64(ctid));
+	}
+
+	appendStringInfoString(buff, ",\"zdb_cmin\":");
+	json_append_int32(buff, (int32) cmin);
+	if (cmax != InvalidCommandId) {
+		appendStringInfoString(buff, ",\"zdb_cmax\":");
+		json_append_int32(buff, (int32) cmax);
+	}
+
+	appendStringInfoString(buff, ",\"zdb_xmin\":");
+	json_append_uint64(buff, xmin);
+	if (xmax != InvalidTransactionId) {
+		appendStringInfoString(buff, ",\"zdb_xmax\":");
+		json_append_uint64(buff, xmax);
+	}
+
+	if (context->tombstones)
+		appendStringInfoString(buff, ",\"zdb_join\":\"zdb_row\"");
+
+	appendStringInfoString(buff, "}\n");
+}
+
+static void bulk_take_back(ElasticsearchBulkStream *stream, BulkPendingIndex *pending) {
+	MemoryContext oldContext = MemoryContextSwitchTo(stream->coalesceContext);
+	BulkDeadSpan  *span      = palloc(sizeof(BulkDeadSpan));
+
+	span->buff   = pending->buff;
+	span->offset = pending->offset;
+	span->len    = pending->len;
+	stream->deadSpans = lappend(stream->deadSpans, span);
+	MemoryContextSwitchTo(oldContext);
+
+	hash_search(stream->pendingIndex, &pending->key, HASH_REMOVE, NULL);
+	stream->ncoalesced++;
+}
+
+static inline void bulk_pending_key(ElasticsearchBulkContext *context, ItemPointerData *ctid, BulkPendingKey *key) {
+	/* it's hashed as bytes, padding and all */
+	memset(key, 0, sizeof(BulkPendingKey));
+	key->indexRelid = context->indexRelid;
+	key->ctid       = ItemPointerToUint64(ctid);
+}
+
+/*
+ * Remember the "index" action for 'ctid' that we just finished writing, starting at 'offset',
+ * and whose MVCC properties start at 'mvcc', in case the row is updated or deleted before curl
+ * sees it.  It replaces whatever document we were going to send for the ctid before
+ */
+static void bulk_note_index_action(ElasticsearchBulkContext *context, ItemPointerData *ctid, int offset, int mvcc, CommandId cmin, uint64 xmin, uint64 xmax) {
+	ElasticsearchBulkStream *stream = context->stream;
+	BulkPendingIndex        *pending;
+	BulkPendingKey          key;
+
+	if (stream->pendingIndex == NULL || ctid == NULL)
+		return;
+
+	bulk_pending_key(context, ctid, &key);
+	pending = hash_search(stream->pendingIndex, &key, HASH_FIND, NULL);
+	if (pending != NULL)
+		bulk_take_back(stream, pending);
+
+	if (xmax != InvalidTransactionId)
+		return;    /* it's already as updated as it'll get */
+
+	pending = hash_search(stream->pendingIndex, &key, HASH_ENTER, NULL);
+	pending->buff   = stream->current->buff;
+	pending->offset = offset;
+	pending->len    = stream->current->buff->len - offset;
+	pending->mvcc   = mvcc - offset;
+	pending->cmin   = cmin;
+	pending->xmin   = xmin;
+}
+
+/*
+ * If we've yet to send the row's "index" action, take its update or delete by 'xmax' into
+ * account there instead of sending an "update".  Returns true if we did
+ */
+static bool bulk_coalesce_xmax(ElasticsearchBulkContext *context, ItemPointer ctid, CommandId cmax, uint64 xmax) {
+	ElasticsearchBulkStream *stream = context->stream;
+	BulkPendingIndex        *pending;
+	BulkPendingKey          key;
+	StringInfo              buff;
+
+	if (stream->pendingIndex == NULL || ctid == NULL)
+		return false;
+
+	bulk_pending_key(context, ctid, &key);
+	pending = hash_search(stream->pendingIndex, &key, HASH_FIND, NULL);
+	if (pending == NULL)
+		return false;
+
+	if (pending->xmin == xmax) {
+		/*
+		 * The (sub)transaction that inserted the row deleted it, so once this command is over, nobody
+		 * will ever see it.  Batch mode already means our own transaction won't, so we send nothing
+		 */
+		bulk_take_back(stream, pending);
+		return true;
+	}
+
+	if (context->tombstones) {
+		/* the row still has to be there for its tombstone to hide it, and it can't be taken back now */
+		hash_search(stream->pendingIndex, &key, HASH_REMOVE, NULL);
+		return false;
+	}
+
+	/*
+	 * Otherwise we send the row's document again, up to its MVCC properties, and then those with
+	 * the zdb_cmax and zdb_xmax it would have had after the "update"
+	 */
+	buff = stream->current->buff;
+	enlargeStringInfo(buff, pending->mvcc);
+	memcpy(buff->data + buff->len, pending->buff->data + pending->offset, pending->mvcc);
+	buff->len += pending->mvcc;
+	buff->data[buff->len] = '\0';
+
+	bulk_append_mvcc_properties(context, ctid, pending->cmin, cmax, pending->xmin, xmax);
+
+	bulk_take_back(stream, pending);
+	return true;
+}
+
+void ElasticsearchBulkInsertRow(ElasticsearchBulkContext *context, ItemPointerData *ctid, text *json, CommandId cmin, CommandId cmax, uint64 xmin, uint64 xmax) {
+	ElasticsearchBulkStream *stream = context->stream;
+	text                    *possible_copy;
+	int                     len;
+	char                    *as_string;
+	int                     offset, mvcc;
+
+	bulk_prologue(stream, false);
+	offset = stream->current->buff->len;
+
+	/* convert the input json text into a c-string */
+	as_string = text_to_cstring_maybe_no_copy(json, &len, &possible_copy);
+
+	/*
+	 * ES' _bulk endpoint requires that the document json be on a single line.
+	 * In general, Postgres' row_to_json() function will have already done this for us, but
+	 * if the row contains a field of type ::json, that'll be encoded as-is, and
+	 * that means in that case we need to find and replace line breaks with spaces
+	 */
+	if (context->containsJson && !stream->smile)
+		replace_line_breaks(as_string, len, ' ');
+
+	bulk_append_index_action(context, ctid);
+
+	/* the second line is the json form of the document... */
+	if (stream->smile) {
+		StringInfo buff = stream->current->buff;
+
+		/* ...without its end-object marker, which is the last byte... */
+		smile_append_header(buff);
+		smile_append_json(buff, as_string, len);
+		buff->len--;
+		buff->data[buff->len] = '\0';
+	} else {
+		appendBinaryStringInfo(stream->current->buff, strip_json_ending(as_string, len), len);
+	}
+
+	/* ...but we tack on our own properties */
+	mvcc = stream->current->buff->len;
+	bulk_append_mvcc_properties(context, ctid, cmin, cmax, xmin, xmax);
+	bulk_note_index_action(context, ctid, offset, mvcc, cmin, xmin, xmax);
+
+	if (possible_copy != json)
+		pfree(possible_copy);
+	pfree(json);
+
+	stream->nindex++;
+	bulk_epilogue(stream);
+}
+
+/*
+ * Like ElasticsearchBulkInsertRow(), but we write the record's json form ourselves, straight
+ * into the current batch
+ */
+void ElasticsearchBulkInsertRecord(ElasticsearchBulkContext *context, ItemPointerData *ctid, Datum record, MemoryContext scratch, CommandId cmin, CommandId cmax, uint64 xmin, uint64 xmax) {
+	ElasticsearchBulkStream *stream = context->stream;
+	int                     offset, mvcc;
+
+	bulk_prologue(stream, false);
+	offset = stream->current->buff->len;
+
+	if (context->serializer == NULL)
+		context->serializer = row_serializer_create(NULL, stream->smile);
+
+	bulk_append_index_action(context, ctid);
+	row_serializer_append(context->serializer, stream->current->buff, record, scratch);
+	mvcc = stream->current->buff->len;
+	bulk_append_mvcc_properties(context, ctid, cmin, cmax, xmin, xmax);
+	bulk_note_index_action(context, ctid, offset, mvcc, cmin, xmin, xmax);
+
+	stream->nindex++;
+	bulk_epilogue(stream);
+}
+
+/*
+ * Rather than update a row's document with the xmax of the transaction that deleted it, add a tombstone
+ * document, a child of the row's, that says so.  It has to be routed to the row's shard, and its _id is
+ * the row's, and the xmax, so that each transaction that deletes the row has its own
+ */
+static void bulk_append_tombstone(ElasticsearchBulkContext *context, const char *parent, CommandId cmax, uint64 xmax) {
+	bulk_append_line(context, "{\"index\":{%s\"_id\":\"%s.%lu\",\"routing\":\"%s\"}}", context->target, parent, xmax, parent);
+	bulk_append_line(context, "{\"zdb_join\":{\"name\":\"zdb_tombstone\",\"parent\":\"%s\"},\"zdb_cmax\":%u,\"zdb_xmax\":%lu}",
+					 parent, cmax, xmax);
+}
+
+void ElasticsearchBulkUpdateTuple(ElasticsearchBulkContext *context, ItemPointer ctid, char *llapi_id, CommandId cmax, uint64 xmax) {
+	bulk_prologue(context->stream, false);
+
+	if (bulk_coalesce_xmax(context, ctid, cmax, xmax)) {
+		bulk_epilogue(context->stream);
+		return;
+	}
+
+	if (context->tombstones) {
+		char id[21];
+
+		if (ctid != NULL)
+			snprintf(id, sizeof(id), "%lu", ItemPointerToUint64(ctid));
+		bulk_append_tombstone(context, ctid != NULL ? id : llapi_id, cmax, xmax);
+	} else {
+		if (ctid != NULL) {
+			bulk_append_line(context, "{\"update\":{%s\"_id\":\"%lu\",\"_retry_on_conflict\":1}}",
+							 context->target, ItemPointerToUint64(ctid));
+		} else {
+			bulk_append_line(context, "{\"update\":{%s\"_id\":\"%s\",\"_retry_on_conflict\":1}}", context->target, llapi_id);
+		}
+		bulk_append_line(context,
+						 "{\"script\":{\"source\":\""
+						 "ctx._source.zdb_cmax=params.CMAX;"
+						 "ctx._source.zdb_xmax=params.XMAX;\",\"lang\":\"painless\",\"params\":{\"CMAX\":%u,\"XMAX\":%lu}}}",
+						 cmax, xmax);
+	}
+
+	context->stream->nupdate++;
+	bulk_epilogue(context->stream);
+}
+
+/*
+ * Like ElasticsearchBulkUpdateTuple(), for a number of rows that were all updated or deleted by the same
+ * command.  Their scripts are all the same, so we only need to format it once
+ */
+void ElasticsearchBulkUpdateTuples(ElasticsearchBulkContext *context, ItemPointerData *ctids, int nctids, CommandId cmax, uint64 xmax) {
+	ElasticsearchBulkStream *stream = context->stream;
+	StringInfo              script;
+	int                     i;
+
+	if (context->tombstones) {
+		for (i = 0; i < nctids; i++)
+			ElasticsearchBulkUpdateTuple(context, &ctids[i], NULL, cmax, xmax);
+		return;
+	}
+
+	script = makeStringInfo();
+	bulk_append_line_to(stream, script,
+						"{\"script\":{\"source\":\""
+						"ctx._source.zdb_cmax=params.CMAX;"
+						"ctx._source.zdb_xmax=params.XMAX;\",\"lang\":\"painless\",\"params\":{\"CMAX\":%u,\"XMAX\":%lu}}}",
+						cmax, xmax);
+
+	for (i = 0; i < nctids; i++) {
+		StringInfo buff;
+
+		bulk_prologue(stream, false);
+
+		if (bulk_coalesce_xmax(context, &ctids[i], cmax, xmax)) {
+			bulk_epilogue(stream);
+			continue;
+		}
+
+		buff = stream->current->buff;
+		if (stream->smile) {
+			char id[21];
+
+			snprintf(id, sizeof(id), "%lu", ItemPointerToUint64(&ctids[i]));
+			smile_append_header(buff);
+			smile_append_start_object(buff);
+			smile_append_key(buff, "update", 6);
+			smile_append_start_object(buff);
+			bulk_append_smile_target(context, buff);
+			smile_append_key(buff, "_id", 3);
+			smile_append_string(buff, id, (int) strlen(id));
+			smile_append_key(buff, "_retry_on_conflict", 18);
+			smile_append_int64(buff, 1);
+			smile_append_end_object(buff);
+			smile_append_end_object(buff);
+			appendStringInfoCharMacro(buff, SMILE_STREAM_SEPARATOR);
+		} else {
+			appendStringInfoString(buff, "{\"update\":{");
+			appendBinaryStringInfo(buff, context->target, context->targetLen);
+			appendStringInfoString(buff, "\"_id\":\"");
+			json_append_uint64(buff, ItemPointerToUint64(&ctids[i]));
+			appendStringInfoString(buff, "\",\"_retry_on_conflict\":1}}\n");
+		}
+		appendBinaryStringInfo(buff, script->data, script->len);
+
+		stream->nupdate++;
+		bulk_epilogue(stream);
+	}
+
+	freeStringInfo(script);
+}
+
+void ElasticsearchBulkVacuumXmax(ElasticsearchBulkContext *context, char *_id, uint64 expected_xmax) {
+	bulk_prologue(context->stream, false);
+
+	bulk_append_line(context, "{\"update\":{%s\"_id\":\"%s\",\"_retry_on_conflict\":0}}", context->target, _id);
+	bulk_append_line(context,
+					 "{\"script\":{\"source\":\""
+					 "if (ctx._source.zdb_xmax != params.EXPECTED_XMAX) {"
+					 "   ctx.op='none';"
+					 "} else {"
+					 "   ctx._source.zdb_xmax=null;"
+					 "}\",\"lang\":\"painless\",\"params\":{\"EXPECTED_XMAX\":%lu}}}",
+					 expected_xmax);
+
+	context->stream->nvacuum++;
+	bulk_epilogue(context->stream);
+}
+
+void ElasticsearchBulkDeleteRowByXmin(ElasticsearchBulkContext *context, char *_id, uint64 xmin) {
+	/* important to tag this before we do the work in bulk_prologue() */
+	context->stream->waitForActiveShards = true;
+
+	bulk_prologue(context->stream, false);
+
+	bulk_append_line(context, "{\"update\":{%s\"_id\":\"%s\"}}", context->target, _id);
+	bulk_append_line(context,
+					 "{\"script\":{\"source\":\""
+					 "if (ctx._source.zdb_xmin == params.EXPECTED_XMIN) {"
+					 "   ctx.op='delete';"
+					 "} else {"
+					 "   ctx.op='none';"
+					 "}\",\"lang\":\"painless\",\"params\":{\"EXPECTED_XMIN\":%lu}}}",
+					 xmin);
+
+	context->stream->ndelete++;
+	bulk_epilogue(context->stream);
+}
+
+void ElasticsearchBulkDeleteRowByXmax(ElasticsearchBulkContext *context, char *_id, uint64 xmax) {
+	/* important to tag this before we do the work in bulk_prologue() */
+	context->stream->waitForActiveShards = true;
+
+	bulk_prologue(context->stream, false);
+
+	bulk_append_line(context, "{\"update\":{%s\"_id\":\"%s\"}}", context->target, _id);
+	bulk_append_line(context,
+					 "{\"script\":{\"source\":\""
+					 "if (ctx._source.zdb_xmax == params.EXPECTED_XMAX) {"
+					 "   ctx.op='delete';"
+					 "} else {"
+					 "   ctx.op='none';"
+					 "}\",\"lang\":\"painless\",\"params\":{\"EXPECTED_XMAX\":%lu}}}",
+					 xmax);
+
+	context->stream->ndelete++;
+	bulk_epilogue(context->stream);
+}
+
+/*
+ * Delete the row a tombstone says was deleted by a committed transaction, and then the tombstone itself
+ */
+void ElasticsearchBulkDeleteRowByTombstone(ElasticsearchBulkContext *context, char *tombstone_id) {
+	char *dot = strrchr(tombstone_id, '.');
+	int  len  = dot != NULL ? (int) (dot - tombstone_id) : (int) strlen(tombstone_id);
+
+	/* important to tag this before we do the work in bulk_prologue() */
+	context->stream->waitForActiveShards = true;
+
+	bulk_prologue(context->stream, false);
+
+	bulk_append_line(context, "{\"update\":{%s\"_id\":\"%.*s\"}}", context->target, len, tombstone_id);
+	bulk_append_line(context, "{\"script\":{\"source\":\"ctx.op='delete';\",\"lang\":\"painless\"}}");
+
+	context->stream->ndelete++;
+	bulk_epilogue(context->stream);
+
+	ElasticsearchBulkDeleteTombstone(context, tombstone_id);
+}
+
+/*
+ * Delete a tombstone whose transaction aborted, so its row is still live
+ */
+void ElasticsearchBulkDeleteTombstone(ElasticsearchBulkContext *context, char *tombstone_id) {
+	char *dot = strrchr(tombstone_id, '.');
+	int  len  = dot != NULL ? (int) (dot - tombstone_id) : (int) strlen(tombstone_id);
+
+	bulk_prologue(context->stream, false);
+
+	bulk_append_line(context, "{\"update\":{%s\"_id\":\"%s\",\"routing\":\"%.*s\"}}", context->target, tombstone_id, len, tombstone_id);
+	bulk_append_line(context, "{\"script\":{\"source\":\"ctx.op='delete';\",\"lang\":\"painless\"}}");
+
+	context->stream->nvacuum++;
+	bulk_epilogue(context->stream);
+}
+
+void ElasticsearchBulkMarkTransactionInProgress(ElasticsearchBulkContext *context) {
+	uint64 xid = convert_xid(GetCurrentTransactionId());
+
+	bulk_prologue(context->stream, false);
+
+	bulk_append_line(context,
+					 "{\"update\":{%s\"_id\":\"zdb_aborted_xids\",\"_retry_on_conflict\":128}}", context->target);
+	bulk_append_line(context,
+					 "{\"upsert\":{\"zdb_aborted_xids\":[%lu]},"
+					 "\"script\":{\"source\":\"ctx._source.zdb_aborted_xids.add(params.XID);\",\"lang\":\"painless\",\"params\":{\"XID\":%lu}}}",
+					 xid, xid);
+
+	context->stream->nxid++;
+	bulk_epilogue(context->stream);
+}
+
+void ElasticsearchBulkMarkTransactionCommitted(ElasticsearchBulkContext *context) {
+	uint64 xid = convert_xid(GetCurrentTransactionId());
+
+	bulk_append_line(context,
+					 "{\"update\":{%s\"_id\":\"zdb_aborted_xids\",\"_retry_on_conflict\":128}}", context->target);
+	bulk_append_line(context, ""
+							   "{"
+							   "\"script\":{"
+							   "\"source\":\"ctx._source.zdb_aborted_xids.remove(ctx._source.zdb_aborted_xids.indexOf(params.XID));\","
+							   "\"params\":{\"XID\":%lu},"
+							   "\"lang\":\"painless\""
+							   "}"
+							   "}", xid);
+	context->stream->nxid++;
+}
+
+/*
+ * Hand the last batch to curl without waiting for it, so that the caller can have several bulk
+ * processes finish at once.  It still needs to call ElasticsearchFinishBulkProcess() for each.
+ *
+ * When the stream is shared, that's its last batch, so the caller can't add anything to it after
+ * this for any of the indexes that share it
+ */
+void ElasticsearchBulkSendFinal(ElasticsearchBulkContext *context) {
+	ElasticsearchBulkStream *stream = context->stream;
+
+	if (stream->finalSent)
+		return;
+	stream->finalSent = true;
+
+	if (PostDataEntryLength(stream->current) > 0) {
+		/* we have more data to send to ES via curl */
+		bulk_prologue(stream, true);
+
+		/* we only want to log if we required more than 1 batch */
+		if (stream->nrequests > 1) {
+			elog(ZDB_LOG_LEVEL,
+				 "[zombodb] processed %d total rows in %d batches for %s (nindex=%d, nupdate=%d, ndelete=%d, nvacuum=%d, nxid=%d, ncoalesced=%d)",
+				 stream->ntotal,
+				 stream->nrequests,
+				 stream->name,
+				 stream->nindex,
+				 stream->nupdate,
+				 stream->ndelete,
+				 stream->nvacuum,
+				 stream->nxid,
+				 stream->ncoalesced);
+			elog(ZDB_LOG_LEVEL,
+				 "[zombodb] %s spent %.3fms polling the network in %d polls and %.3fms serializing (%.3fus/row)",
+				 stream->name,
+				 INSTR_TIME_GET_MILLISEC(stream->pollTime),
+				 stream->npolls,
+				 INSTR_TIME_GET_MILLISEC(stream->serializeTime),
+				 stream->ntotal > 0 ? (double) INSTR_TIME_GET_MICROSEC(stream->serializeTime) / stream->ntotal : 0.0);
+			if (stream->rest->nrejected > 0)
+				elog(ZDB_LOG_LEVEL,
+					 "[zombodb] Elasticsearch rejected %d requests for %s; finished allowing %d of %d concurrent requests at %.0f%% of batch_size",
+					 stream->rest->nrejected,
+					 stream->name,
+					 stream->rest->limit,
+					 stream->bulkConcurrency,
+					 stream->rest->batch_scale * 100);
+			if (stream->io != NULL)
+				elog(ZDB_LOG_LEVEL,
+					 "[zombodb] %s waited %.3fms for the bulk I/O thread %d times",
+					 stream->name,
+					 INSTR_TIME_GET_MILLISEC(stream->stallTime),
+					 stream->nstalls);
+			if (stream->nthrottles > 0)
+				elog(ZDB_LOG_LEVEL,
+					 "[zombodb] %s waited %.3fms for its batches to finish %d times to stay under zdb.max_bulk_memory",
+					 stream->name,
+					 INSTR_TIME_GET_MILLISEC(stream->throttleTime),
+					 stream->nthrottles);
+		}
+	}
+}
+
+/*
+ * Wait for everything we've sent, then free the stream
+ */
+static void bulk_stream_finish(ElasticsearchBulkStream *stream) {
+	ListCell *lc;
+
+	if (stream->io != NULL) {
+		/* wait for the I/O thread to finish everything we gave it */
+		bulk_collect_thread_jobs(stream);
+		while (stream->ioOutstanding > 0 || bulk_thread_deferred(stream->io) > 0)
+			bulk_wait_for_thread(stream);
+
+		bulk_thread_stop(stream->io);
+		stream->io = NULL;
+	}
+
+	/* wait for all outstanding HTTP requests to finish */
+	if (stream->nrequests > 0)
+		rest_multi_wait_all(stream->rest);
+
+	if (stream->nrequests > 1)
+		elog(ZDB_LOG_LEVEL,
+			 "[zombodb] %s sent " UINT64_FORMAT " bytes of %s in %d batches (compression_level=%d)",
+			 stream->name,
+			 stream->rest->nbytesSent,
+			 stream->smile ? "smile" : "json",
+			 stream->nrequests,
+			 stream->compressionLevel);
+
+	/* after this call, stream->rest is no longer usable */
+	rest_multi_partial_cleanup(stream->rest, true, false);
+
+	/* what we sent becomes searchable the next time the index is searched.  See refresh_coordinator.c */
+	foreach (lc, stream->written) {
+		refresh_coordinator_wrote(lfirst_oid(lc));
+	}
+
+	if (stream->coalesceContext != NULL)
+		MemoryContextDelete(stream->coalesceContext);
+	MemoryContextDelete(stream->bufferContext);
+	pfree(stream->pool);
+	if (stream->line != NULL)
+		freeStringInfo(stream->line);
+	list_free(stream->written);
+	pfree(stream->url);
+	pfree(stream->name);
+	if (stream->path != NULL)
+		pfree(stream->path);
+	pfree(stream);
+}
+
+/*
+ * The index is done with its bulk process.  Its stream finishes once every index sharing it is,
+ * so the caller should get them all there together
+ */
+void ElasticsearchFinishBulkProcess(ElasticsearchBulkContext *context) {
+	ElasticsearchBulkStream *stream = context->stream;
+
+	ElasticsearchBulkSendFinal(context);
+
+	if (context->shouldRefresh)
+		stream->written = lappend_oid(stream->written, context->indexRelid);
+
+	if (--stream->ncontexts == 0)
+		bulk_stream_finish(stream);
+
+	if (context->serializer != NULL)
+		row_serializer_free(context->serializer);
+	if (context->targetLen > 0)
+		pfree(context->target);
+	pfree(context->esIndexName);
+	pfree(context->pgIndexName);
+	pfree(context->typeName);
+	pfree(context);
+}
+
+/*
+ * Refresh the index if it's been written to since it was last refreshed, so that searching
+ * it sees everything that's been written
+ */
+void ElasticsearchRefreshIfNeeded(Relation indexRel) {
+	Oid    indexRelid = RelationGetRelid(indexRel);
+	uint64 generation;
+
+	if (!refresh_coordinator_begin(indexRelid, &generation))
+		return;
+
+	PG_TRY();
+	{
+		StringInfo request = makeStringInfo();
+		StringInfo response;
+
+		appendStringInfo(request, "%s%s/_refresh", ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel));
+		response = rest_call("GET", request, NULL, ZDBIndexOptionsGetCompressionLevel(indexRel));
+
+		freeStringInfo(request);
+		freeStringInfo(response);
+	}
+	PG_CATCH();
+	{
+		refresh_coordinator_end(indexRelid, generation, false);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	refresh_coordinator_end(indexRelid, generation, true);
+}
+
+uint64 ElasticsearchCountAllDocs(Relation indexRel) {
+	StringInfo request    = makeStringInfo();
+	StringInfo postData   = makeStringInfo();
+	StringInfo response;
+	Datum      count;
+
+	ElasticsearchRefreshIfNeeded(indexRel);
+
+	if (ZDBIndexOptionsGetTombstones(indexRel))
+		appendStringInfo(postData, "{\"query\":{\"bool\":{\"must_not\":{\"term\":{\"zdb_join\":\"zdb_tombstone\"}}}}}");
+	else
+		appendStringInfo(postData, "{\"query\":{\"match_all\":{}}}");
+	appendStringInfo(request,
+					 "%s%s/%s/_count?filter_path=count",
+					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
+					 ZDBIndexOptionsGetTypeName(indexRel));
+	response = rest_call("GET", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
+	count    = DirectFunctionCall2(json_object_field_text, CStringGetTextDatum(response->data),
+								   CStringGetTextDatum("count"));
+
+	/* convert the count property to an int8 and return as uint64 */
+	return DatumGetUInt64(DirectFunctionCall1(int8in, PointerGetDatum(TextDatumGetCString(count))));
+}
+
+uint64 ElasticsearchEstimateSelectivity(Relation indexRel, ZDBQueryType *query) {
+	StringInfo request    = makeStringInfo();
+	StringInfo postData   = makeStringInfo();
+	StringInfo response;
+	Datum      count;
+
+	ElasticsearchRefreshIfNeeded(indexRel);
+
+	appendStringInfo(postData, "{\"query\":%s}", convert_to_query_dsl(indexRel, query));
+	appendStringInfo(request,
+					 "%s%s/%s/_count?filter_path=count",
+					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
+					 ZDBIndexOptionsGetTypeName(indexRel));
+	response = rest_call("GET", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
+	count    = DirectFunctionCall2(json_object_field_text, CStringGetTextDatum(response->data),
+								   CStringGetTextDatum("count"));
+
+	/* convert the count property to an int8 and return as uint64 */
+	return DatumGetUInt64(DirectFunctionCall1(int8in, PointerGetDatum(TextDatumGetCString(count))));
+}
+
+static ElasticsearchScrollIds *track_scroll_ids(char *url, int nids) {
+	MemoryContext          oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	ElasticsearchScrollIds *ids       = palloc0(sizeof(ElasticsearchScrollIds));
+
+	ids->url        = pstrdup(url);
+	ids->nids       = nids;
+	ids->ids        = palloc0(sizeof(char *) * nids);
+	open_scroll_ids = lappend(open_scroll_ids, ids);
+
+	MemoryContextSwitchTo(oldContext);
+	return ids;
+}
+
+static void set_scroll_id(ElasticsearchScrollIds *ids, int i, const char *scrollId) {
+	if (ids->ids[i] != NULL && strcmp(ids->ids[i], scrollId) == 0)
+		return;
+
+	if (ids->ids[i] != NULL)
+		pfree(ids->ids[i]);
+	ids->ids[i] = MemoryContextStrdup(TopMemoryContext, scrollId);
+}
+
+static void free_scroll_ids(ElasticsearchScrollIds *ids) {
+	int i;
+
+	for (i = 0; i < ids->nids; i++) {
+		if (ids->ids[i] != NULL)
+			pfree(ids->ids[i]);
+	}
+	pfree(ids->ids);
+	pfree(ids->url);
+	pfree(ids);
+}
+
+/*
+ * Clear the search contexts of 'scrolls', with one request per cluster, and free them
+ */
+static void clear_scrolls(List *scrolls) {
+	while (scrolls != NIL) {
+		char       *url      = pstrdup(((ElasticsearchScrollIds *) linitial(scrolls))->url);
+		List       *others   = NIL;
+		StringInfo request   = makeStringInfo();
+		StringInfo postData  = makeStringInfo();
+		int        nids      = 0;
+		ListCell   *lc;
+
+		appendStringInfoString(postData, "{\"scroll_id\":[");
+		foreach (lc, scrolls) {
+			ElasticsearchScrollIds *ids = lfirst(lc);
+			int                    i;
+
+			if (strcmp(ids->url, url) != 0) {
+				others = lappend(others, ids);
+				continue;
+			}
+
+			for (i = 0; i < ids->nids; i++) {
+				if (ids->ids[i] != NULL) {
+					if (nids++ > 0) appendStringInfoCharMacro(postData, ',');
+					appendStringInfo(postData, "\"%s\"", ids->ids[i]);
+				}
+			}
+			free_scroll_ids(ids);
+		}
+		appendStringInfoString(postData, "]}");
+		list_free(scrolls);
+		scrolls = others;
+
+		if (nids > 0) {
+			/* a 404 only means they had already expired */
+			appendStringInfo(request, "%s_search/scroll", url);
+			freeStringInfo(rest_call("DELETE", request, postData, 0));
+		}
+
+		freeStringInfo(request);
+		freeStringInfo(postData);
+		pfree(url);
+	}
+}
+
+/*
+ * 'context' won't need the search contexts it's holding open anymore.  Rather than wait on
+ * Elasticsearch to clear them now, they're cleared along with any others the next time we open
+ * a scroll
+ */
+static void release_scroll_ids(ElasticsearchScrollContext *context) {
+	if (context->openIds != NULL && list_member_ptr(open_scroll_ids, context->openIds)) {
+		MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+
+		open_scroll_ids      = list_delete_ptr(open_scroll_ids, context->openIds);
+		abandoned_scroll_ids = lappend(abandoned_scroll_ids, context->openIds);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+	context->openIds = NULL;
+}
+
+/*
+ * Our transaction is over, and whatever scrolls it didn't close never will be.  Rather than talk
+ * to Elasticsearch while a transaction is ending, we clear them the next time we open one
+ */
+void ElasticsearchAbandonOpenScrolls(void) {
+	MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+
+	abandoned_scroll_ids = list_concat(abandoned_scroll_ids, open_scroll_ids);
+	open_scroll_ids      = NIL;
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * A page of one of the scroll's slices has arrived.  It's queued for
+ * ElasticsearchGetNextItemPointer() to read through after the pages that arrived before it
+ */
+static void scroll_slice_response(void *arg, StringInfo response) {
+	ElasticsearchScrollSlice   *slice   = (ElasticsearchScrollSlice *) arg;
+	ElasticsearchScrollContext *context = slice->scroll;
+	MemoryContext              pageContext;
+	MemoryContext              oldContext;
+	ElasticsearchScrollPage    *page;
+	void                       *jsonResponse, *hitsObject, *hits;
+	int                        nhits;
+
+	pageContext  = AllocSetContextCreate(context->jsonMemoryContext, "scroll page", ALLOCSET_DEFAULT_MINSIZE,
+										 4 * 1024 * 1024, ALLOCSET_DEFAULT_MAXSIZE);
+	jsonResponse = parse_json_object(response, pageContext);
+	if (get_json_object_object(jsonResponse, "error", true) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+						errmsg("%s", response->data)));
+
+	hitsObject = get_json_object_object(jsonResponse, "hits", false);
+	hits       = get_json_object_array(hitsObject, "hits", true);
+	nhits      = hits == NULL ? 0 : get_json_array_length(hits);
+
+	if (!slice->started) {
+		/* the first page of each slice tells us how many hits it has */
+		slice->remaining = get_json_object_uint64(hitsObject, "total");
+		slice->started   = true;
+		context->total += slice->remaining;
+	} else if (nhits == 0 && slice->remaining > 0) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+						errmsg("No results found when loading next scroll context")));
+	}
+	slice->remaining -= Min((uint64) nhits, slice->remaining);
+
+	if (slice->scrollId != NULL)
+		pfree(slice->scrollId);
+	slice->scrollId = MemoryContextStrdup(context->jsonMemoryContext, get_json_object_string(jsonResponse, "_scroll_id"));
+	set_scroll_id(context->openIds, slice->id, slice->scrollId);
+
+	if (nhits > 0) {
+		page = MemoryContextAlloc(pageContext, sizeof(ElasticsearchScrollPage));
+		page->memoryContext = pageContext;
+		page->slice         = slice;
+		page->hits          = hits;
+		page->nhits         = nhits;
+
+		oldContext     = MemoryContextSwitchTo(context->jsonMemoryContext);
+		context->pages = lappend(context->pages, page);
+		MemoryContextSwitchTo(oldContext);
+	} else {
+		MemoryContextDelete(pageContext);
+	}
+
+	pfree(response->data);
+	pfree(response);
+}
+
+/*
+ * Ask for the next page of the slice.  Each slice only has one request in flight at a time,
+ * so it always uses the same buffer from the MultiRestState's pool
+ */
+static void scroll_slice_call(ElasticsearchScrollSlice *slice, StringInfo url, char *body) {
+	ElasticsearchScrollContext *context = slice->scroll;
+	PostDataEntry              *entry   = palloc0(sizeof(PostDataEntry));
+
+	entry->buff            = context->rest->pool[slice->id];
+	entry->pool_idx        = slice->id;
+	entry->separator       = '\n';
+	entry->on_response     = scroll_slice_response;
+	entry->on_response_arg = slice;
+	context->rest->pool[slice->id] = NULL;
+
+	appendStringInfoString(entry->buff, body);
+	rest_multi_post_data_add_chunk(entry, true);
+
+	rest_multi_call(context->rest, "POST", url, entry, context->compressionLevel);
+}
+
+/*
+ * Start the scroll as 'nslices' slices, all at once, and wait for the first page of each, which
+ * tells us how many hits there are in all.  After that, ElasticsearchGetNextItemPointer() keeps
+ * the next page of each slice coming while it reads through the pages that have arrived.
+ *
+ * A single slice is just the scroll itself, so its hits come back in the order we asked for
+ */
+static void scroll_open_slices(ElasticsearchScrollContext *context, StringInfo request, StringInfo postData, int nslices) {
+	StringInfo body = makeStringInfo();
+	int        i;
+
+	context->nslices    = nslices;
+	context->slices     = palloc0(sizeof(ElasticsearchScrollSlice) * nslices);
+	context->openIds    = track_scroll_ids(context->url, nslices);
+	context->rest       = rest_multi_init(NULL, nslices, false);
+	context->rest->pool = palloc(sizeof(StringInfo) * nslices);
+
+	for (i = 0; i < nslices; i++) {
+		ElasticsearchScrollSlice *slice = &context->slices[i];
+
+		slice->scroll          = context;
+		slice->id              = i;
+		context->rest->pool[i] = makeStringInfo();
+
+		/* 'postData' is a json object, so the slice goes at the front of it */
+		resetStringInfo(body);
+		if (nslices > 1)
+			appendStringInfo(body, "{\"slice\":{\"id\":%d,\"max\":%d},%s", i, nslices, postData->data + 1);
+		else
+			appendStringInfoString(body, postData->data);
+		scroll_slice_call(slice, request, body->data);
+	}
+
+	for (i = 0; i < nslices; i++) {
+		while (!context->slices[i].started) {
+			rest_multi_wait(context->rest, SCROLL_SLICE_WAIT_MS);
+			rest_multi_partial_cleanup(context->rest, false, false);
+		}
+	}
+
+	/* if the first page of every slice has all of its hits, we'll never ask for another */
+	for (i = 0; i < nslices; i++) {
+		if (context->slices[i].remaining > 0)
+			break;
+	}
+	if (i == nslices)
+		release_scroll_ids(context);
+
+	freeStringInfo(body);
+}
+
+/*
+ * Move on to the next page to have arrived from any of the slices, and ask for the page after it
+ * from the same slice while we read through this one.  If there isn't one, 'hits' is NULL
+ */
+static void scroll_next_sliced_page(ElasticsearchScrollContext *context) {
+	ElasticsearchScrollPage  *page;
+	ElasticsearchScrollSlice *slice;
+
+	if (context->page != NULL) {
+		MemoryContextDelete(context->page->memoryContext);
+		context->page = NULL;
+	}
+	context->hits    = NULL;
+	context->nhits   = 0;
+	context->currpos = 0;
+
+	while (context->pages == NIL && !rest_multi_all_done(context->rest)) {
+		rest_multi_wait(context->rest, SCROLL_SLICE_WAIT_MS);
+		rest_multi_partial_cleanup(context->rest, false, false);
+	}
+
+	if (context->pages == NIL)
+		return;
+
+	page           = linitial(context->pages);
+	context->pages = list_delete_first(context->pages);
+	context->page  = page;
+	context->hits  = page->hits;
+	context->nhits = page->nhits;
+
+	slice = page->slice;
+	if (slice->remaining > 0) {
+		StringInfo request  = makeStringInfo();
+		StringInfo postData = makeStringInfo();
+
+		appendStringInfo(postData, "{\"scroll\":\"10m\",\"scroll_id\":\"%s\"}", slice->scrollId);
+		appendStringInfo(request, "%s_search/scroll?filter_path=%s", context->url, ES_SEARCH_RESPONSE_FILTER);
+		scroll_slice_call(slice, request, postData->data);
+
+		freeStringInfo(request);
+		freeStringInfo(postData);
+	}
+}
+
+/*
+ * The body of a search for 'queryDSL', sorted by 'sort', which is the contents of a json sort
+ * array.  'highlights' is the highlight clause, if any, including its leading comma
+ */
+static void append_search_body(StringInfo postData, int slice, int nslices, bool needScore, char *sort, char *queryDSL, char *highlights) {
+	appendStringInfoCharMacro(postData, '{');
+	if (nslices > 1)
+		appendStringInfo(postData, "\"slice\":{\"id\":%d,\"max\":%d},", slice, nslices);
+	appendStringInfo(postData, "\"track_scores\":%s,\"sort\":[%s],\"query\":%s%s}",
+					 needScore ? "true" : "false", sort, queryDSL, highlights);
+}
+
+/*
+ * Make the page of hits returned by the search or scroll 'request' the one we're reading
+ */
+static void load_page(ElasticsearchScrollContext *context, StringInfo request, StringInfo postData) {
+	StringInfo response;
+	void       *jsonResponse, *hitsObject;
+	char       *error;
+
+	response = rest_call("POST", request, postData, context->compressionLevel);
+
+	/* make sure we don't leak the hits json from the previous request */
+	if (context->hits != NULL)
+		MemoryContextReset(context->jsonMemoryContext);
 
 	jsonResponse = parse_json_object(response, context->jsonMemoryContext);
 	error        = get_json_object_object(jsonResponse, "error", true);
@@ -719,72 +2096,287 @@ ElasticsearchScrollContext *ElasticsearchOpenScroll(Relation indexRel, ZDBQueryT
 
 	hitsObject = get_json_object_object(jsonResponse, "hits", false);
 
+	if (context->openIds != NULL) {
+		context->scrollId = get_json_object_string(jsonResponse, "_scroll_id");
+		set_scroll_id(context->openIds, 0, context->scrollId);
+	}
+	context->total   = get_json_object_uint64(hitsObject, "total");
+	context->currpos = 0;
+	context->hits    = get_json_object_array(hitsObject, "hits", true);
+	context->nhits   = context->hits == NULL ? 0 : get_json_array_length(context->hits);
+
+	freeStringInfo(response);
+}
+
+static int ctid64_cmp(const void *a, const void *b) {
+	uint64 ctid_a = *((const uint64 *) a);
+	uint64 ctid_b = *((const uint64 *) b);
+
+	return ctid_a < ctid_b ? -1 : ctid_a > ctid_b ? 1 : 0;
+}
+
+/*
+ * Our search's one page didn't have enough hits visible to us after all, so we scroll through all
+ * of them, from a point in time, starting over.  Hits with the same score can come back in any
+ * order, and the index may have been refreshed in between, so we can't count on the scroll's first
+ * hits being those we've read.  Instead, ElasticsearchGetNextItemPointer() tells the caller to skip
+ * any hit of the scroll it's already been given
+ */
+static void scroll_past_search_page(ElasticsearchScrollContext *context) {
+	StringInfo request = makeStringInfo();
+
+	qsort(context->searched, context->nsearched, sizeof(uint64), ctid64_cmp);
+
+	appendStringInfo(request, "%s&size=%d&scroll=10m", context->searchRequest->data, MAX_DOCS_PER_REQUEST);
+	context->openIds = track_scroll_ids(context->url, 1);
+	load_page(context, request, context->searchPostData);
+	context->cnt = 0;
+	if (context->nhits >= context->total)
+		release_scroll_ids(context);
+
+	freeStringInfo(context->searchRequest);
+	freeStringInfo(context->searchPostData);
+	context->searchRequest  = NULL;
+	context->searchPostData = NULL;
+
+	freeStringInfo(request);
+}
+
+/*
+ * An unordered search's first page didn't have all of its hits.  We asked for them by ctid, so
+ * the rest are those past the last ctid it had, and we read them from a scroll, as concurrent
+ * slices.  Those are the hits of a different search, so they count towards our total themselves.
+ *
+ * Each slice costs a search context on every shard, so there's no more than one for each page
+ * of the hits that are left, or for each shard, whichever is fewer
+ */
+static void scroll_past_first_page(ElasticsearchScrollContext *context, Relation indexRel, StringInfo request, bool needScore, char *sort, char *queryDSL, char *highlights) {
+	StringInfo postData = makeStringInfo();
+	StringInfo query    = makeStringInfo();
+	uint64     npages   = (context->total - context->nhits + MAX_DOCS_PER_REQUEST - 1) / MAX_DOCS_PER_REQUEST;
+	int        nslices  = Max(1, Min(ZDBIndexOptionsGetNumberOfShards(indexRel), MAX_SCROLL_SLICES));
+	void       *lastHit, *zdb_ctid;
+
+	lastHit  = get_json_array_element_object(context->hits, context->nhits - 1, context->jsonMemoryContext);
+	zdb_ctid = get_json_object_array(get_json_object_object(lastHit, "fields", false), "zdb_ctid", false);
+	appendStringInfo(query, "{\"bool\":{\"must\":%s,\"filter\":{\"range\":{\"zdb_ctid\":{\"gt\":%lu}}}}}",
+					 queryDSL, get_json_array_element_uint64(zdb_ctid, 0, context->jsonMemoryContext));
+	append_search_body(postData, 0, 1, needScore, sort, query->data, highlights);
+
+	appendStringInfo(request, "&size=%d&scroll=10m", MAX_DOCS_PER_REQUEST);
+	context->total = context->nhits;
+	scroll_open_slices(context, request, postData, (int) Min((uint64) nslices, npages));
+
+	freeStringInfo(query);
+	freeStringInfo(postData);
+}
+
+/*
+ * Make the scroll's next page the one we're reading
+ */
+static void load_next_scroll_page(ElasticsearchScrollContext *context) {
+	StringInfo request  = makeStringInfo();
+	StringInfo postData = makeStringInfo();
+
+	appendStringInfo(postData, "{\"scroll\":\"10m\",\"scroll_id\":\"%s\"}", context->scrollId);
+	appendStringInfo(request, "%s_search/scroll?filter_path=%s", context->url, ES_SEARCH_RESPONSE_FILTER);
+	load_page(context, request, postData);
+
+	freeStringInfo(request);
+	freeStringInfo(postData);
+}
+
+/*
+ * Start a scroll of the hits of 'userQuery'.  If 'nslices' is more than one, only those of slice
+ * 'slice' of them, for when several backends are reading the rest.  See ElasticsearchOpenScrollSlice()
+ */
+static ElasticsearchScrollContext *open_scroll(Relation indexRel, ZDBQueryType *userQuery, bool use_id, bool needSort, bool needScore, uint64 limit, char *sortField, SortByDir direction, List *highlights, char **extraFields, int nextraFields, int slice, int nslices) {
+	ElasticsearchScrollContext *context        = palloc0(sizeof(ElasticsearchScrollContext));
+	char                       *queryDSL       = convert_to_query_dsl(indexRel, userQuery);
+	StringInfo                 request         = makeStringInfo();
+	StringInfo                 postData        = makeStringInfo();
+	StringInfo                 sort            = makeStringInfo();
+	StringInfo                 highlightClause = makeStringInfo();
+	StringInfo                 docvalueFields  = makeStringInfo();
+	int                        i;
+
+	/* before we start another, clear the search contexts of the scrolls we're done with, all at once */
+	if (abandoned_scroll_ids != NIL) {
+		List *abandoned = abandoned_scroll_ids;
+
+		abandoned_scroll_ids = NIL;
+		clear_scrolls(abandoned);
+	}
+
+	ElasticsearchRefreshIfNeeded(indexRel);
+
+	/* we'll assume we want scoring if we have a limit, so that we get the top scoring docs when the limit is applied */
+	needScore = needScore || limit > 0;
+
+	if (sortField != NULL) {
+		needSort = true;
+	} else if (needSort) {
+		/* need a default sorting here */
+		sortField     = needScore ? "_score" : "zdb_ctid";
+		if (direction == SORTBY_DEFAULT)
+			direction = needScore ? SORTBY_DESC : SORTBY_ASC;
+	}
+
+	if (needSort)
+		appendStringInfo(sort, "{\"%s\":\"%s\"}", sortField,
+						 direction == SORTBY_DEFAULT || direction == SORTBY_ASC ? "asc" : "desc");
+	else
+		appendStringInfo(sort, "\"%s\"", needScore ? "_score" : "_doc");
+
+	if (highlights != NULL) {
+		ListCell *lc;
+		int      cnt = 0;
+
+		appendStringInfo(highlightClause, ",\"highlight\":{\"fields\":{");
+		foreach (lc, highlights) {
+			ZDBHighlightInfo *info = lfirst(lc);
+
+			if (cnt > 0) appendStringInfoCharMacro(highlightClause, ',');
+			appendStringInfo(highlightClause, "\"%s\":%s", info->name, info->json);
+			cnt++;
+		}
+		appendStringInfo(highlightClause, "}}");
+	}
+
+	appendStringInfo(docvalueFields, "zdb_ctid");
+	for (i = 0; i < nextraFields; i++) {
+		appendStringInfo(docvalueFields, ",%s", extraFields[i]);
+	}
+
+	appendStringInfo(request,
+					 "%s%s/%s/_search?_source=false&filter_path=%s&stored_fields=%s&docvalue_fields=%s",
+					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
+					 ZDBIndexOptionsGetTypeName(indexRel),
+					 ES_SEARCH_RESPONSE_FILTER,
+					 highlights ? "type" : use_id ? "_id" : "_none_",
+					 docvalueFields->data);
+
+	/* create a memory context in which to allocate json data */
+	context->jsonMemoryContext = AllocSetContextCreate(CurTransactionContext, "scroll", ALLOCSET_DEFAULT_MINSIZE,
+													   4 * 1024 * 1024, ALLOCSET_DEFAULT_MAXSIZE);
+
 	context->url              = ZDBIndexOptionsGetUrl(indexRel);
 	context->compressionLevel = ZDBIndexOptionsGetCompressionLevel(indexRel);
 
 	context->usingId       = use_id;
-	context->scrollId      = get_json_object_string(jsonResponse, "_scroll_id");
 	context->hasHighlights = highlights != NULL;
 	context->cnt           = 0;
 	context->currpos       = 0;
-	context->total         = get_json_object_uint64(hitsObject, "total");
 	context->limit         = limit;
 	context->extraFields   = extraFields;
 	context->nextraFields  = nextraFields;
 
-	if (context->total > 0) {
-		context->hits  = get_json_object_array(hitsObject, "hits", false);
-		context->nhits = context->hits == NULL ? 0 : get_json_array_length(context->hits);
+	/*
+	 * A scroll holds a search context open on every shard until we clear it, so if the first page
+	 * has all the hits we need, we don't ask for one
+	 */
+	if (nslices == 1 && limit > 0 && limit <= MAX_DOCS_PER_REQUEST) {
+		/*
+		 * With a limit that fits in a page it will, unless too many of them turn out not to be
+		 * visible to us, and then we scroll through them all again, skipping those we've read
+		 */
+		StringInfo search = makeStringInfo();
+
+		appendStringInfo(search, "%s&size=%lu", request->data, limit);
+		append_search_body(postData, 0, 1, needScore, sort->data, queryDSL, highlightClause->data);
+		load_page(context, search, postData);
+		freeStringInfo(search);
+
+		context->searchRequest  = request;
+		context->searchPostData = postData;
+		context->searched       = palloc(sizeof(uint64) * limit);
+	} else if (nslices == 1 && limit == 0 && !needSort && !use_id) {
+		/*
+		 * Without a limit, when the order doesn't matter, we ask for the hits in ctid order, so if
+		 * the first page doesn't have them all, a scroll can pick up after the last one it has.
+		 * Everything a scan uses has a ctid, unlike what we find by _id
+		 */
+		StringInfo search = makeStringInfo();
+
+		appendStringInfo(search, "%s&size=%d", request->data, MAX_DOCS_PER_REQUEST);
+		append_search_body(postData, 0, 1, needScore, "{\"zdb_ctid\":\"asc\"}", queryDSL, highlightClause->data);
+		load_page(context, search, postData);
+		freeStringInfo(search);
+
+		if (context->nhits < context->total)
+			scroll_past_first_page(context, indexRel, request, needScore, sort->data, queryDSL, highlightClause->data);
+
+		freeStringInfo(request);
+		freeStringInfo(postData);
+	} else {
+		/*
+		 * Otherwise the first page comes from the scroll itself, and if it has all the hits, the
+		 * scroll is cleared along with the next one we're done with
+		 */
+		append_search_body(postData, slice, nslices, needScore, sort->data, queryDSL, highlightClause->data);
+		appendStringInfo(request, "&size=%lu&scroll=10m", limit == 0 ? MAX_DOCS_PER_REQUEST : limit);
+
+		if (limit == 0) {
+			scroll_open_slices(context, request, postData, 1);
+		} else {
+			/* we probably won't need more than the one page, so we don't ask for the next before we know we do */
+			context->openIds = track_scroll_ids(context->url, 1);
+			load_page(context, request, postData);
+
+			if (context->nhits >= context->total)
+				release_scroll_ids(context);
+		}
+
+		freeStringInfo(request);
+		freeStringInfo(postData);
 	}
 
 	pfree(queryDSL);
-	freeStringInfo(request);
-	freeStringInfo(postData);
-	freeStringInfo(response);
+	freeStringInfo(sort);
+	freeStringInfo(highlightClause);
+	freeStringInfo(docvalueFields);
 	return context;
 }
 
+ElasticsearchScrollContext *ElasticsearchOpenScroll(Relation indexRel, ZDBQueryType *userQuery, bool use_id, bool needSort, bool needScore, uint64 limit, char *sortField, SortByDir direction, List *highlights, char **extraFields, int nextraFields) {
+	return open_scroll(indexRel, userQuery, use_id, needSort, needScore, limit, sortField, direction, highlights,
+					   extraFields, nextraFields, 0, 1);
+}
+
+/*
+ * Like ElasticsearchOpenScroll(), but only for slice 'slice' of 'nslices' of the hits.  Every hit
+ * is in exactly one slice, so this is how the participants in a parallel index scan divide them up
+ */
+ElasticsearchScrollContext *ElasticsearchOpenScrollSlice(Relation indexRel, ZDBQueryType *userQuery, bool needSort, bool needScore, uint64 limit, char *sortField, SortByDir direction, List *highlights, int slice, int nslices) {
+	return open_scroll(indexRel, userQuery, false, needSort, needScore, limit, sortField, direction, highlights,
+					   NULL, 0, slice, nslices);
+}
+
 void ElasticsearchGetNextItemPointer(ElasticsearchScrollContext *context, ItemPointer ctid, char **_id, float4 *score, zdb_json_object *highlights) {
-	char *es_id = NULL;
+	MemoryContext hitContext;
+	char          *es_id = NULL;
 
 	if (context->cnt >= context->total)
 		ereport(ERROR,
 				(errcode(ERRCODE_INTERNAL_ERROR),
 						errmsg("Attempt to read past total number of hits of %lu", context->total)));
 
-	if (context->currpos == context->nhits) {
+	context->skip = false;
+
+	if (context->currpos == context->nhits && context->nslices > 0) {
+		/* on to whichever page of the slices has arrived next */
+		scroll_next_sliced_page(context);
+	} else if (context->currpos == context->nhits && context->searchRequest != NULL) {
+		/* we thought we wouldn't need a scroll, but we need more hits */
+		scroll_past_search_page(context);
+		if (context->nhits == 0) {
+			/* what we read were the only hits, and they're gone now, so there's nothing to return */
+			context->skip = true;
+			return;
+		}
+	} else if (context->currpos == context->nhits) {
 		/* we exhausted the current set of hits, so go get more */
-		StringInfo request  = makeStringInfo();
-		StringInfo postData = makeStringInfo();
-		StringInfo response;
-		void       *jsonResponse, *hitsObject;
-		char       *error;
-
-		appendStringInfo(postData, "{\"scroll\":\"10m\",\"scroll_id\":\"%s\"}", context->scrollId);
-		appendStringInfo(request, "%s_search/scroll?filter_path=%s", context->url, ES_SEARCH_RESPONSE_FILTER);
-		response = rest_call("POST", request, postData, context->compressionLevel);
-
-		/* make sure we don't leak the hits json from the previous request */
-		if (context->hits != NULL)
-			MemoryContextReset(context->jsonMemoryContext);
-
-		jsonResponse = parse_json_object(response, context->jsonMemoryContext);
-		error        = get_json_object_object(jsonResponse, "error", true);
-		if (error != NULL)
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-							errmsg("%s", response->data)));
-
-		hitsObject = get_json_object_object(jsonResponse, "hits", false);
-
-		context->scrollId = get_json_object_string(jsonResponse, "_scroll_id");
-		context->currpos  = 0;
-		context->hits     = get_json_object_array(hitsObject, "hits", false);
-		context->nhits    = context->hits == NULL ? 0 : get_json_array_length(context->hits);
-
-		freeStringInfo(request);
-		freeStringInfo(response);
-		freeStringInfo(postData);
+		load_next_scroll_page(context);
 	}
 
 	if (context->hits == NULL)
@@ -792,7 +2384,9 @@ void ElasticsearchGetNextItemPointer(ElasticsearchScrollContext *context, ItemPo
 				(errcode(ERRCODE_INTERNAL_ERROR),
 						errmsg("No results found when loading next scroll context")));
 
-	context->hitEntry = get_json_array_element_object(context->hits, context->currpos, context->jsonMemoryContext);
+	/* a sliced scroll doesn't reset its json memory context between pages, but each page has its own */
+	hitContext        = context->page != NULL ? context->page->memoryContext : context->jsonMemoryContext;
+	context->hitEntry = get_json_array_element_object(context->hits, context->currpos, hitContext);
 	context->fields   = get_json_object_object(context->hitEntry, "fields", true);
 
 	if (context->usingId) {
@@ -802,15 +2396,23 @@ void ElasticsearchGetNextItemPointer(ElasticsearchScrollContext *context, ItemPo
 		uint64 ctidAs64bits;
 
 		zdb_ctid     = get_json_object_array(context->fields, "zdb_ctid", false);
-		ctidAs64bits = get_json_array_element_uint64(zdb_ctid, 0, context->jsonMemoryContext);
+		ctidAs64bits = get_json_array_element_uint64(zdb_ctid, 0, hitContext);
 
 		/* set ctid out parameter */
 		ItemPointerSet(ctid, (BlockNumber) (ctidAs64bits >> 32), (OffsetNumber) ctidAs64bits);
+
+		if (context->searchRequest != NULL)
+			context->searched[context->nsearched++] = ctidAs64bits;
+		else if (context->searched != NULL)
+			context->skip = bsearch(&ctidAs64bits, context->searched, context->nsearched, sizeof(uint64), ctid64_cmp) != NULL;
 	}
 
 	context->currpos++;
 	context->cnt++;
 
+	if (context->rest != NULL && context->currpos % SCROLL_POLL_HITS == 0)
+		rest_multi_perform(context->rest);
+
 	/* set our out parameters */
 	if (_id != NULL) {
 		*_id = es_id;
@@ -826,62 +2428,205 @@ void ElasticsearchGetNextItemPointer(ElasticsearchScrollContext *context, ItemPo
 }
 
 void ElasticsearchCloseScroll(ElasticsearchScrollContext *scrollContext) {
+	if (scrollContext->rest != NULL) {
+		StringInfo *pool = scrollContext->rest->pool;
+		int        i;
+
+		/* nobody is going to read the pages we haven't yet */
+		rest_multi_cancel(scrollContext->rest);
+
+		/* after this call, scrollContext->rest is no longer usable */
+		rest_multi_partial_cleanup(scrollContext->rest, true, false);
+
+		for (i = 0; i < scrollContext->nslices; i++)
+			freeStringInfo(pool[i]);
+		pfree(pool);
+		pfree(scrollContext->slices);
+	}
+
+	if (scrollContext->searchRequest != NULL) {
+		freeStringInfo(scrollContext->searchRequest);
+		freeStringInfo(scrollContext->searchPostData);
+	}
+	if (scrollContext->searched != NULL)
+		pfree(scrollContext->searched);
+
+	/* rather than leave Elasticsearch holding its search contexts until the scroll expires */
+	release_scroll_ids(scrollContext);
+
 	MemoryContextDelete(scrollContext->jsonMemoryContext);
 	pfree(scrollContext);
 }
 
-void ElasticsearchCommitCurrentTransaction(Relation indexRel) {
-	StringInfo request  = makeStringInfo();
-	StringInfo postData = makeStringInfo();
-	StringInfo response;
-	uint64     xid      = convert_xid(GetCurrentTransactionId());
+/*
+ * Hand a request to 'rest', with a body of 'body' if it isn't NULL.  Its buffer comes from, and
+ * goes back to, the MultiRestState's pool
+ */
+static void finish_transaction_call(MultiRestState *rest, int pool_idx, char *method, StringInfo url, char *body, int compressionLevel) {
+	PostDataEntry *entry = palloc0(sizeof(PostDataEntry));
 
-	appendStringInfo(postData, ""
-							   "{"
-							   "\"script\":{"
-							   "\"source\":\"ctx._source.zdb_aborted_xids.remove(ctx._source.zdb_aborted_xids.indexOf(params.XID));\","
-							   "\"params\":{\"XID\":%lu},"
-							   "\"lang\":\"painless\""
-							   "}"
-							   "}", xid);
+	entry->buff          = rest->pool[pool_idx];
+	entry->pool_idx      = pool_idx;
+	entry->separator     = '\n';
+	rest->pool[pool_idx] = NULL;
 
-	appendStringInfo(request, "%s%s/%s/zdb_aborted_xids/_update?retry_on_conflict=128",
-					 ZDBIndexOptionsGetUrl(indexRel),
-					 ZDBIndexOptionsGetIndexName(indexRel),
-					 ZDBIndexOptionsGetTypeName(indexRel));
-	if (strcmp("-1", ZDBIndexOptionsGetRefreshInterval(indexRel)) == 0)
-		appendStringInfo(request, "&refresh=true");
+	if (body != NULL)
+		appendStringInfoString(entry->buff, body);
+	rest_multi_post_data_add_chunk(entry, true);
 
-	response = rest_call("POST", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
+	rest_multi_call(rest, method, url, entry, compressionLevel);
+}
 
-	freeStringInfo(response);
+/*
+ * Tell Elasticsearch what's left to tell it as our transaction commits.  That is, mark our
+ * transaction as committed in each index of 'committed', refresh each index of 'refresh' that
+ * still needs it, and delete each Elasticsearch index whose URL is in 'dropped'.  The requests
+ * all go out at once, on one MultiRestState, rather than waiting for each in turn
+ */
+void ElasticsearchFinishTransaction(List *committed, List *refresh, List *dropped) {
+	int            nrequests  = list_length(committed) + list_length(refresh) + list_length(dropped);
+	StringInfo     request    = makeStringInfo();
+	StringInfo     postData   = makeStringInfo();
+	uint64         *generations;
+	bool           *refreshing;
+	MultiRestState *rest;
+	ListCell       *lc;
+	int            i, j;
+
+	if (nrequests == 0)
+		return;
+
+	rest       = rest_multi_init(NULL, Min(nrequests, MAX_CURL_HANDLES), false);
+	rest->pool = palloc(sizeof(StringInfo) * nrequests);
+	for (i = 0; i < nrequests; i++)
+		rest->pool[i] = makeStringInfo();
+
+	generations = palloc0(sizeof(uint64) * (list_length(refresh) + 1));
+	refreshing  = palloc0(sizeof(bool) * (list_length(refresh) + 1));
+
+	PG_TRY();
+	{
+		i = 0;
+		foreach (lc, committed) {
+			Relation indexRel = lfirst(lc);
+
+			resetStringInfo(postData);
+			appendStringInfo(postData, ""
+									   "{"
+									   "\"script\":{"
+									   "\"source\":\"ctx._source.zdb_aborted_xids.remove(ctx._source.zdb_aborted_xids.indexOf(params.XID));\","
+									   "\"params\":{\"XID\":%lu},"
+									   "\"lang\":\"painless\""
+									   "}"
+									   "}", convert_xid(GetCurrentTransactionId()));
+
+			resetStringInfo(request);
+			appendStringInfo(request, "%s%s/%s/zdb_aborted_xids/_update?retry_on_conflict=128",
+							 ZDBIndexOptionsGetUrl(indexRel),
+							 ZDBIndexOptionsGetIndexName(indexRel),
+							 ZDBIndexOptionsGetTypeName(indexRel));
+			if (strcmp("-1", ZDBIndexOptionsGetRefreshInterval(indexRel)) == 0)
+				appendStringInfo(request, "&refresh=true");
+
+			finish_transaction_call(rest, i++, "POST", request, postData->data, ZDBIndexOptionsGetCompressionLevel(indexRel));
+		}
+
+		j = 0;
+		foreach (lc, refresh) {
+			Relation indexRel = lfirst(lc);
+
+			refreshing[j] = refresh_coordinator_begin(RelationGetRelid(indexRel), &generations[j]);
+			if (refreshing[j]) {
+				resetStringInfo(request);
+				appendStringInfo(request, "%s%s/_refresh", ZDBIndexOptionsGetUrl(indexRel),
+								 ZDBIndexOptionsGetIndexName(indexRel));
+
+				finish_transaction_call(rest, i++, "POST", request, NULL, 0);
+			}
+			j++;
+		}
+
+		foreach (lc, dropped) {
+			char *index_url = lfirst(lc);
+
+			elog(LOG, "[ZomboDB] DELETING remote index %s", index_url);
+			resetStringInfo(request);
+			appendStringInfoString(request, index_url);
+
+			finish_transaction_call(rest, i++, "DELETE", request, NULL, 0);
+		}
+
+		rest_multi_wait_all(rest);
+	}
+	PG_CATCH();
+	{
+		j = 0;
+		foreach (lc, refresh) {
+			if (refreshing[j])
+				refresh_coordinator_end(RelationGetRelid((Relation) lfirst(lc)), generations[j], false);
+			j++;
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* after this call, 'rest' is no longer usable */
+	rest_multi_partial_cleanup(rest, true, false);
+
+	j = 0;
+	foreach (lc, refresh) {
+		if (refreshing[j])
+			refresh_coordinator_end(RelationGetRelid((Relation) lfirst(lc)), generations[j], true);
+		j++;
+	}
+
+	pfree(generations);
+	pfree(refreshing);
 	freeStringInfo(request);
 	freeStringInfo(postData);
 }
 
-void ElasticsearchRemoveAbortedTransactions(Relation indexRel, List/*uint64*/ *xids) {
-	if (list_length(xids) > 0) {
-		StringInfo xidsArray  = makeStringInfo();
-		StringInfo request    = makeStringInfo();
-		StringInfo postData   = makeStringInfo();
-		StringInfo response;
-		ListCell   *lc;
+static void append_xid_ranges(StringInfo buf, uint64 *ranges, int nranges) {
+	int i;
 
-		foreach (lc, xids) {
-			uint64 xid = *((uint64 *) lfirst(lc));
+	for (i = 0; i < nranges * 2; i++) {
+		if (i > 0) appendStringInfoCharMacro(buf, ',');
+		appendStringInfo(buf, "%lu", ranges[i]);
+	}
+}
 
-			if (xidsArray->len > 0) appendStringInfoCharMacro(xidsArray, ',');
-			appendStringInfo(xidsArray, "%lu", xid);
-		}
+/*
+ * Remove the given [lo, hi] ranges of aborted xids from the index, along with any individual
+ * aborted xids and smaller ranges that fall within them
+ */
+void ElasticsearchRemoveAbortedTransactions(Relation indexRel, uint64 *ranges, int nranges) {
+	if (nranges > 0) {
+		StringInfo rangesArray = makeStringInfo();
+		StringInfo request     = makeStringInfo();
+		StringInfo postData    = makeStringInfo();
+		StringInfo response;
+
+		append_xid_ranges(rangesArray, ranges, nranges);
 
 		appendStringInfo(postData, ""
 								   "{"
 								   "\"script\":{"
-								   "\"source\":\"ctx._source.zdb_aborted_xids.removeAll(params.XIDS);\","
-								   "\"params\":{\"XIDS\":[%s]},"
+								   "\"source\":\""
+								   "boolean covered(def p, def lo, def hi) { for (int i = 0; i + 1 < p.size(); i += 2) { if (lo >= p[i] && hi <= p[i + 1]) { return true; } } return false; } "
+								   "if (ctx._source.zdb_aborted_xids != null) { "
+								   "List kept = new ArrayList(); "
+								   "for (def x : ctx._source.zdb_aborted_xids) { if (!covered(params.RANGES, x, x)) { kept.add(x); } } "
+								   "ctx._source.zdb_aborted_xids = kept; "
+								   "} "
+								   "if (ctx._source.zdb_aborted_ranges != null) { "
+								   "List kept = new ArrayList(); def r = ctx._source.zdb_aborted_ranges; "
+								   "for (int i = 0; i + 1 < r.size(); i += 2) { if (!covered(params.RANGES, r[i], r[i + 1])) { kept.add(r[i]); kept.add(r[i + 1]); } } "
+								   "ctx._source.zdb_aborted_ranges = kept; "
+								   "}\","
+								   "\"params\":{\"RANGES\":[%s]},"
 								   "\"lang\":\"painless\""
 								   "}"
-								   "}", xidsArray->data);
+								   "}", rangesArray->data);
 
 		appendStringInfo(request, "%s%s/%s/zdb_aborted_xids/_update?retry_on_conflict=128&refresh=true",
 						 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
@@ -889,18 +2634,139 @@ void ElasticsearchRemoveAbortedTransactions(Relation indexRel, List/*uint64*/ *x
 
 		response = rest_call("POST", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
 
-		freeStringInfo(xidsArray);
+		freeStringInfo(rangesArray);
 		freeStringInfo(response);
 		freeStringInfo(request);
 		freeStringInfo(postData);
 	}
 }
 
+/*
+ * Add sorted, non-overlapping [lo, hi] ranges of xids we know didn't commit to the index's
+ * aborted xid ranges, merging them with the ranges it already has, and move its xid horizon
+ * up to 'horizon', if that's further along.  Either can be empty/zero
+ */
+void ElasticsearchRecordAbortedTransactions(Relation indexRel, uint64 *ranges, int nranges, uint64 horizon) {
+	StringInfo rangesArray = makeStringInfo();
+	StringInfo request     = makeStringInfo();
+	StringInfo postData    = makeStringInfo();
+	StringInfo response;
+
+	append_xid_ranges(rangesArray, ranges, nranges);
+
+	appendStringInfo(postData, ""
+							   "{"
+							   "\"script\":{"
+							   "\"source\":\""
+							   "List pairs = new ArrayList(); "
+							   "for (def r : [ctx._source.zdb_aborted_ranges, params.RANGES]) { if (r != null) { for (int i = 0; i + 1 < r.size(); i += 2) { pairs.add([((Number) r[i]).longValue(), ((Number) r[i + 1]).longValue()]); } } } "
+							   "pairs.sort((a, b) -> Long.compare(a[0], b[0])); "
+							   "List merged = new ArrayList(); "
+							   "for (def p : pairs) { int n = merged.size(); if (n > 0 && p[0] <= merged[n - 1] + 1) { if (p[1] > merged[n - 1]) { merged[n - 1] = p[1]; } } else { merged.add(p[0]); merged.add(p[1]); } } "
+							   "ctx._source.zdb_aborted_ranges = merged; "
+							   "if (ctx._source.zdb_aborted_xids == null) { ctx._source.zdb_aborted_xids = new ArrayList(); } "
+							   "if (ctx._source.zdb_xid_horizon == null || ctx._source.zdb_xid_horizon < params.HORIZON) { ctx._source.zdb_xid_horizon = params.HORIZON; }\","
+							   "\"params\":{\"RANGES\":[%s],\"HORIZON\":%lu},"
+							   "\"lang\":\"painless\""
+							   "},"
+							   "\"upsert\":{\"zdb_aborted_xids\":[],\"zdb_aborted_ranges\":[%s],\"zdb_xid_horizon\":%lu}"
+							   "}", rangesArray->data, horizon, rangesArray->data, horizon);
+
+	appendStringInfo(request, "%s%s/%s/zdb_aborted_xids/_update?retry_on_conflict=128",
+					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
+					 ZDBIndexOptionsGetTypeName(indexRel));
+
+	response = rest_call("POST", request, postData, ZDBIndexOptionsGetCompressionLevel(indexRel));
+
+	freeStringInfo(rangesArray);
+	freeStringInfo(response);
+	freeStringInfo(request);
+	freeStringInfo(postData);
+}
+
+static int xid_range_cmp(const void *a, const void *b) {
+	uint64 lo_a = *((const uint64 *) a);
+	uint64 lo_b = *((const uint64 *) b);
+
+	return lo_a < lo_b ? -1 : lo_a > lo_b ? 1 : 0;
+}
+
+/*
+ * The xid below which VACUUM has told the index about every transaction that didn't commit,
+ * or zero if it never has.
+ *
+ * If 'ranges' isn't NULL, it's set to the index's aborted xids as a palloc'd array of sorted,
+ * non-overlapping [lo, hi] pairs, and 'nranges' to how many pairs there are.  This includes the
+ * individual xids of transactions that wrote to the index without our xact tracker, which are
+ * there from when they started writing until they commit
+ */
+uint64 ElasticsearchGetXidHorizon(Relation indexRel, uint64 **ranges, int *nranges) {
+	StringInfo request = makeStringInfo();
+	StringInfo response;
+	void       *json, *source;
+	uint64     horizon = 0;
+
+	appendStringInfo(request, "%s%s/%s/zdb_aborted_xids?_source=%s",
+					 ZDBIndexOptionsGetUrl(indexRel), ZDBIndexOptionsGetIndexName(indexRel),
+					 ZDBIndexOptionsGetTypeName(indexRel),
+					 ranges == NULL ? "zdb_xid_horizon" : "zdb_xid_horizon,zdb_aborted_xids,zdb_aborted_ranges");
+
+	response = rest_call("GET", request, NULL, ZDBIndexOptionsGetCompressionLevel(indexRel));
+	json     = parse_json_object(response, CurrentMemoryContext);
+	source   = get_json_object_object(json, "_source", true);
+	if (source != NULL && get_json_object_object(source, "zdb_xid_horizon", true) != NULL)
+		horizon = get_json_object_uint64(source, "zdb_xid_horizon");
+
+	if (ranges != NULL) {
+		void   *xids     = source == NULL ? NULL : get_json_object_array(source, "zdb_aborted_xids", true);
+		void   *stored   = source == NULL ? NULL : get_json_object_array(source, "zdb_aborted_ranges", true);
+		int    nxids     = xids == NULL ? 0 : get_json_array_length(xids);
+		int    nstored   = stored == NULL ? 0 : get_json_array_length(stored) / 2;
+		uint64 *pairs    = palloc(sizeof(uint64) * 2 * (nxids + nstored + 1));
+		int    npairs    = 0;
+		int    i, merged = 0;
+
+		for (i = 0; i < nxids; i++) {
+			pairs[npairs * 2]     = get_json_array_element_uint64(xids, i, CurrentMemoryContext);
+			pairs[npairs * 2 + 1] = pairs[npairs * 2];
+			npairs++;
+		}
+		for (i = 0; i < nstored; i++) {
+			pairs[npairs * 2]     = get_json_array_element_uint64(stored, i * 2, CurrentMemoryContext);
+			pairs[npairs * 2 + 1] = get_json_array_element_uint64(stored, i * 2 + 1, CurrentMemoryContext);
+			npairs++;
+		}
+
+		qsort(pairs, npairs, sizeof(uint64) * 2, xid_range_cmp);
+
+		/* merge ranges that overlap, or that touch */
+		for (i = 0; i < npairs; i++) {
+			if (merged > 0 && pairs[i * 2] <= pairs[merged * 2 - 1] + 1) {
+				pairs[merged * 2 - 1] = Max(pairs[merged * 2 - 1], pairs[i * 2 + 1]);
+			} else {
+				pairs[merged * 2]     = pairs[i * 2];
+				pairs[merged * 2 + 1] = pairs[i * 2 + 1];
+				merged++;
+			}
+		}
+
+		*ranges  = pairs;
+		*nranges = merged;
+	}
+
+	freeStringInfo(response);
+	freeStringInfo(request);
+
+	return horizon;
+}
+
 char *ElasticsearchProfileQuery(Relation indexRel, ZDBQueryType *query) {
 	StringInfo request    = makeStringInfo();
 	StringInfo postData   = makeStringInfo();
 	StringInfo response;
 
+	ElasticsearchRefreshIfNeeded(indexRel);
+
 	appendStringInfo(postData, "{\"profile\":true, \"query\":%s}", convert_to_query_dsl(indexRel, query));
 
 	appendStringInfo(request, "%s%s/_search?size=0&filter_path=profile&pretty", ZDBIndexOptionsGetUrl(indexRel),
@@ -921,6 +2787,7 @@ uint64 ElasticsearchCount(Relation indexRel, ZDBQueryType *query) {
 	uint64     count;
 
 	validate_alias(indexRel);
+	ElasticsearchRefreshIfNeeded(indexRel);
 
 	appendStringInfo(postData, "{\"query\":%s}", convert_to_query_dsl(indexRel, query));
 
@@ -944,6 +2811,7 @@ static char *makeAggRequest(Relation indexRel, ZDBQueryType *query, char *agg, b
 	StringInfo response;
 
 	validate_alias(indexRel);
+	ElasticsearchRefreshIfNeeded(indexRel);
 
 	appendStringInfoCharMacro(postData, '{');
 	if (query != NULL)
@@ -1010,6 +2878,8 @@ static StringInfo terms_agg_only_keys(Relation indexRel, char *field, ZDBQueryTy
 	StringInfo postData     = makeStringInfo();
 	StringInfo response;
 
+	ElasticsearchRefreshIfNeeded(indexRel);
+
 	if (size == 0)
 		size = INT32_MAX;
 
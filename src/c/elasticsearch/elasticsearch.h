@@ -19,27 +19,56 @@
 
 #include "zombodb.h"
 #include "json/json_support.h"
+#include "json/row_serializer.h"
+#include "rest/bulk_thread.h"
 #include "rest/curl_support.h"
+#include "portability/instr_time.h"
+#include "utils/hsearch.h"
 #include "utils/jsonb.h"
 
 /* this needs to match curl_support.h:MAX_CURL_HANDLES */
 #define MAX_BULK_CONCURRENCY 1024
 
-typedef struct ElasticsearchBulkContext {
+/* the most slices we'll split a scroll into */
+#define MAX_SCROLL_SLICES 16
+
+/*
+ * The batches a bulk process sends to Elasticsearch.  Usually they're for a single index, but
+ * the indexes a transaction changes on the same cluster share one.  See ElasticsearchStartSharedBulkProcess()
+ */
+typedef struct ElasticsearchBulkStream {
 	char           *url;
-	char           *pgIndexName;
-	char           *esIndexName;
-	char           *typeName;
+	char           *name;             /* what we call it in log messages */
+	char           *path;             /* the "index/type/" we post to, or NULL if each action names its own */
 	int            batchSize;
 	int            bulkConcurrency;
 	int            compressionLevel;
 	bool           waitForActiveShards;
-	bool           containsJson;
-	bool           containsJsonIsSet;
-	bool           shouldRefresh;
+	bool           streamWaitForActiveShards;    /* what waitForActiveShards was when 'current' was handed to curl */
+	bool           ignoreVersionConflicts;
 	MultiRestState *rest;
 	PostDataEntry  *current;
+	bool           smile;            /* are we sending Smile rather than json?  See the 'bulk_format' index option */
+	StringInfo     line;             /* when we are, the json we're about to convert */
+	int            ncontexts;        /* how many bulk contexts are sending through us */
+	List           *written;         /* the indexes to count as written to once we're finished */
+
+	/*
+	 * When coalescing, the "index" actions we can still take back because curl hasn't seen their
+	 * batch yet, by index and ctid, and the bytes of those we took back, which we cut out before it does
+	 */
+	MemoryContext  coalesceContext;
+	HTAB           *pendingIndex;
+	List           *deadSpans;
+	int            ncoalesced;
+
+	/* when zdb.bulk_io_thread is on, completed batches go here instead of to 'rest' */
+	BulkIOThread   *io;
+	int            ioOutstanding;    /* batches given to 'io' that we haven't collected yet */
+	int            nstalls;          /* how many times we had to wait for 'io' to catch up */
+	instr_time     stallTime;
 	int            nrequests;
+	bool           finalSent;        /* has the last batch been handed to curl? */
 	int            nrows;
 	int            ntotal;
 	int            nindex;
@@ -47,9 +76,62 @@ typedef struct ElasticsearchBulkContext {
 	int            ndelete;
 	int            nvacuum;
 	int            nxid;
-	StringInfo     pool[MAX_CURL_HANDLES];
+
+	/* bulkConcurrency+1 buffers to build batches in, allocated, with their chunks, in 'bufferContext' */
+	MemoryContext  bufferContext;
+	StringInfo     *pool;
+
+	/* how often, and for how long, we had to wait for our batches to finish to stay under zdb.max_bulk_memory */
+	int            nthrottles;
+	instr_time     throttleTime;
+
+	/* I/O pacing:  when did we last let curl do some work, and how big was the current batch then? */
+	instr_time     lastPoll;
+	int            lastPollLen;
+
+	/* where are we spending our time? */
+	int            npolls;
+	instr_time     pollTime;
+	instr_time     serializeTime;
+	instr_time     rowStart;
+} ElasticsearchBulkStream;
+
+typedef struct ElasticsearchBulkContext {
+	ElasticsearchBulkStream *stream;
+	char                    *pgIndexName;
+	char                    *esIndexName;
+	char                    *typeName;
+	char                    *target;    /* the "_index" and "_type" our action lines need when the stream is shared, otherwise "" */
+	int                     targetLen;
+	bool                    containsJson;
+	bool                    containsJsonIsSet;
+	bool                    shouldRefresh;    /* does ZomboDB refresh the index, rather than its refresh_interval? */
+	Oid                     indexRelid;
+	RowSerializer           *serializer;      /* writes the rows given to ElasticsearchBulkInsertRecord() */
+	bool                    tombstones;       /* are UPDATEs/DELETEs tombstone documents?  See the 'tombstones' index option */
 } ElasticsearchBulkContext;
 
+/*
+ * One slice of a scroll.  When the order of a scroll's hits doesn't matter, it's split into
+ * slices that we fetch pages of concurrently, otherwise it's read as a single slice.  Either way,
+ * the next page of a slice is fetched while we read through the current one.  See ElasticsearchOpenScroll()
+ */
+typedef struct ElasticsearchScrollSlice {
+	struct ElasticsearchScrollContext *scroll;
+	int                               id;
+	char                              *scrollId;
+	bool                              started;      /* has its first page arrived? */
+	uint64                            remaining;    /* its hits we haven't been sent yet */
+} ElasticsearchScrollSlice;
+
+/* a page of a slice's hits that has arrived, and the memory context its json lives in */
+typedef struct ElasticsearchScrollPage {
+	MemoryContext            memoryContext;
+	ElasticsearchScrollSlice *slice;
+	void                     *hits;
+	int                      nhits;
+} ElasticsearchScrollPage;
+
 typedef struct ElasticsearchScrollContext {
 	MemoryContext jsonMemoryContext;      /* where are json objects allocated? */
 	char          *url;
@@ -68,6 +150,25 @@ typedef struct ElasticsearchScrollContext {
 	void          *fields;
 	char          **extraFields;
 	int           nextraFields;
+
+	/* unless there's a limit, the slices we're reading, the pages of them that have arrived, and the one we're reading */
+	int                      nslices;
+	ElasticsearchScrollSlice *slices;
+	MultiRestState           *rest;
+	List                     *pages;
+	ElasticsearchScrollPage  *page;
+
+	/* if we haven't needed a scroll yet, the search we start one from if we do */
+	StringInfo               searchRequest;
+	StringInfo               searchPostData;
+
+	/* the ctids of the search's hits we've read, which the scroll will have too, and are sorted once it does */
+	uint64                   *searched;
+	int                      nsearched;
+	bool                     skip;         /* is the hit just read, if there was one, one of them? */
+
+	/* otherwise, the search contexts the scroll is holding open in Elasticsearch */
+	struct ElasticsearchScrollIds *openIds;
 } ElasticsearchScrollContext;
 
 /* defined in zdbam.c */
@@ -79,31 +180,42 @@ char *ElasticsearchArbitraryRequest(Relation indexRel, char *method, char *endpo
 
 char *ElasticsearchCreateIndex(Relation heapRel, Relation indexRel, TupleDesc tupdesc, char *aliasName);
 void ElasticsearchDeleteIndex(Relation indexRel);
-void ElasticsearchDeleteIndexDirect(char *index_url);
 void ElasticsearchFinalizeIndexCreation(Relation indexRel);
 
 void ElasticsearchUpdateSettings(Relation indexRel, char *oldAlias, char *newAlias);
 void ElasticsearchPutMapping(Relation heapRel, Relation indexRel, TupleDesc tupdesc);
 
 ElasticsearchBulkContext *ElasticsearchStartBulkProcess(Relation indexRel, char *indexName, TupleDesc tupdesc, bool ignore_version_conflicts);
+ElasticsearchBulkContext *ElasticsearchStartSharedBulkProcess(Relation indexRel, TupleDesc tupdesc, List **streams);
 void ElasticsearchBulkInsertRow(ElasticsearchBulkContext *context, ItemPointerData *ctid, text *json, CommandId cmin, CommandId cmax, uint64 xmin, uint64 xmax);
+void ElasticsearchBulkInsertRecord(ElasticsearchBulkContext *context, ItemPointerData *ctid, Datum record, MemoryContext scratch, CommandId cmin, CommandId cmax, uint64 xmin, uint64 xmax);
 void ElasticsearchBulkUpdateTuple(ElasticsearchBulkContext *context, ItemPointer ctid, char *llapi_id, CommandId cmax, uint64 xmax);
+void ElasticsearchBulkUpdateTuples(ElasticsearchBulkContext *context, ItemPointerData *ctids, int nctids, CommandId cmax, uint64 xmax);
 void ElasticsearchBulkVacuumXmax(ElasticsearchBulkContext *context, char *_id, uint64 expected_xmax);
 void ElasticsearchBulkDeleteRowByXmin(ElasticsearchBulkContext *context, char *_id, uint64 xmin);
 void ElasticsearchBulkDeleteRowByXmax(ElasticsearchBulkContext *context, char *_id, uint64 xmax);
+void ElasticsearchBulkDeleteRowByTombstone(ElasticsearchBulkContext *context, char *tombstone_id);
+void ElasticsearchBulkDeleteTombstone(ElasticsearchBulkContext *context, char *tombstone_id);
 void ElasticsearchBulkMarkTransactionInProgress(ElasticsearchBulkContext *context);
 void ElasticsearchBulkMarkTransactionCommitted(ElasticsearchBulkContext *context);
+void ElasticsearchBulkEnableCoalescing(ElasticsearchBulkContext *context);
+void ElasticsearchBulkSendFinal(ElasticsearchBulkContext *context);
 void ElasticsearchFinishBulkProcess(ElasticsearchBulkContext *context);
+void ElasticsearchRefreshIfNeeded(Relation indexRel);
 
 uint64 ElasticsearchCountAllDocs(Relation indexRel);
 uint64 ElasticsearchEstimateSelectivity(Relation indexRel, ZDBQueryType *query);
 
 ElasticsearchScrollContext *ElasticsearchOpenScroll(Relation indexRel, ZDBQueryType *userQuery, bool use_id, bool needSort, bool needScore, uint64 limit, char *sortField, SortByDir direction, List *highlights, char **extraFields, int nextraFields);
+ElasticsearchScrollContext *ElasticsearchOpenScrollSlice(Relation indexRel, ZDBQueryType *userQuery, bool needSort, bool needScore, uint64 limit, char *sortField, SortByDir direction, List *highlights, int slice, int nslices);
 void ElasticsearchGetNextItemPointer(ElasticsearchScrollContext *context, ItemPointer ctid, char **_id, float4 *score, zdb_json_object *highlights);
 void ElasticsearchCloseScroll(ElasticsearchScrollContext *scrollContext);
+void ElasticsearchAbandonOpenScrolls(void);
 
-void ElasticsearchCommitCurrentTransaction(Relation indexRel);
-void ElasticsearchRemoveAbortedTransactions(Relation indexRel, List/*uint64*/ *xids);
+void ElasticsearchFinishTransaction(List *committed, List *refresh, List *dropped);
+void ElasticsearchRemoveAbortedTransactions(Relation indexRel, uint64 *ranges, int nranges);
+void ElasticsearchRecordAbortedTransactions(Relation indexRel, uint64 *ranges, int nranges, uint64 horizon);
+uint64 ElasticsearchGetXidHorizon(Relation indexRel, uint64 **ranges, int *nranges);
 
 char *ElasticsearchProfileQuery(Relation indexRel, ZDBQueryType *query);
 
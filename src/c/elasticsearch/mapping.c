@@ -167,7 +167,7 @@ static List *lookup_es_only_fields(MemoryContext cxt, Oid tableOid) {
 }
 
 
-StringInfo generate_mapping(Relation heapRel, TupleDesc tupdesc) {
+StringInfo generate_mapping(Relation heapRel, TupleDesc tupdesc, bool tombstones) {
 	StringInfo mapping = makeStringInfo();
 	int        i;
 	ListCell   *lc;
@@ -179,6 +179,12 @@ StringInfo generate_mapping(Relation heapRel, TupleDesc tupdesc) {
 	appendStringInfo(mapping, ",\"zdb_xmin\": { \"type\":\"long\" }");
 	appendStringInfo(mapping, ",\"zdb_xmax\": { \"type\":\"long\" }");
 	appendStringInfo(mapping, ",\"zdb_aborted_xids\": { \"type\":\"long\" }");
+	appendStringInfo(mapping, ",\"zdb_xid_horizon\": { \"type\":\"long\" }");
+	appendStringInfo(mapping, ",\"zdb_aborted_ranges\": { \"type\":\"long\" }");
+
+	/* row documents are the parents of the tombstones that say who deleted them */
+	if (tombstones)
+		appendStringInfo(mapping, ",\"zdb_join\": { \"type\":\"join\", \"relations\": { \"zdb_row\":\"zdb_tombstone\" } }");
 
 	foreach (lc, lookup_es_only_fields(CurrentMemoryContext, RelationGetRelid(heapRel))) {
 		char *json = lfirst(lc);
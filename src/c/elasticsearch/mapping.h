@@ -19,7 +19,7 @@
 
 #include "zombodb.h"
 
-StringInfo generate_mapping(Relation heapRel, TupleDesc tupdesc);
+StringInfo generate_mapping(Relation heapRel, TupleDesc tupdesc, bool tombstones);
 char *lookup_analysis_thing(MemoryContext cxt, char *thing);
 
 #endif /* __ZDB_MAPPING_H__ */
@@ -16,15 +16,53 @@
 
 #include "querygen.h"
 
+#include "elasticsearch/elasticsearch.h"
+#include "indexam/xact_tracker.h"
+#include "indexam/zdbam.h"
 #include "json/json_support.h"
 
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "storage/proc.h"
+#include "utils/hsearch.h"
 #include "utils/json.h"
-
-/* from zdbfuncs.c */
-extern Datum zdb_internal_visibility_clause(PG_FUNCTION_ARGS);
+#include "utils/snapmgr.h"
 
 extern bool zdb_ignore_visibility_guc;
 
+/*
+ * The visibility clause we last built for an index, which is good for as long as we're in the
+ * same transaction, at the same command, with the same snapshot.  Nothing that changes in the
+ * meantime can change which xids are visible to that snapshot
+ */
+typedef struct VisibilityClauseCacheEntry {
+	Oid                indexRelid;    /* hash key */
+	LocalTransactionId lxid;
+	TransactionId      xid;
+	CommandId          commandId;
+	TransactionId      xmin;
+	TransactionId      xmax;
+	uint32             xcnt;
+	TransactionId      *xip;
+	char               *clause;
+} VisibilityClauseCacheEntry;
+
+/*
+ * Every xid in an index that didn't commit before Postgres started, from its xid horizon on, for when
+ * the xact tracker can't remember them.  It doesn't change until VACUUM moves the horizon
+ */
+typedef struct UncommittedRangesCacheEntry {
+	Oid           indexRelid;    /* hash key */
+	uint64        horizon;
+	TransactionId until;
+	int           nranges;
+	uint64        *ranges;
+} UncommittedRangesCacheEntry;
+
+static HTAB          *visibilityClauseCache  = NULL;
+static HTAB          *uncommittedRangesCache = NULL;
+static MemoryContext visibilityClauseContext = NULL;
+
 static char *wrap_with_visibility_query(Relation indexRel, char *query);
 
 char *convert_to_query_dsl_not_wrapped(char *input) {
@@ -176,14 +214,224 @@ ZDBQueryType *scan_keys_to_query_dsl(ScanKey keys, int nkeys) {
 	}
 }
 
+/*
+ * A query for docs whose xid 'field' is committed as far as our snapshot is concerned, like
+ * zdb.xid_is_committed().  Below the horizon, every xid that didn't commit is in 'ranges', so
+ * we only need to look at our active xids above it
+ */
+static void append_xid_is_committed(StringInfo buf, char *field, uint64 myXmax, uint64 *active, int nactive,
+									uint64 *ranges, int nranges, uint64 horizon) {
+	int i;
+
+	appendStringInfo(buf, "{\"bool\":{\"should\":["
+						  "{\"range\":{\"%s\":{\"lt\":%lu}}},"
+						  "{\"bool\":{\"must\":[{\"range\":{\"%s\":{\"lt\":%lu}}}]", field, horizon, field, myXmax);
+	if (nactive > 0) {
+		appendStringInfo(buf, ",\"must_not\":[{\"terms\":{\"%s\":[", field);
+		for (i = 0; i < nactive; i++) {
+			if (i > 0) appendStringInfoCharMacro(buf, ',');
+			appendStringInfo(buf, "%lu", active[i]);
+		}
+		appendStringInfoString(buf, "]}}]");
+	}
+	appendStringInfoString(buf, "}}],\"minimum_should_match\":1");
+
+	if (nranges > 0) {
+		appendStringInfoString(buf, ",\"must_not\":[");
+		for (i = 0; i < nranges; i++) {
+			if (i > 0) appendStringInfoCharMacro(buf, ',');
+			appendStringInfo(buf, "{\"range\":{\"%s\":{\"gte\":%lu,\"lte\":%lu}}}", field, ranges[i * 2],
+							 ranges[i * 2 + 1]);
+		}
+		appendStringInfoCharMacro(buf, ']');
+	}
+	appendStringInfoString(buf, "}}");
+}
+
+/*
+ * Add every xid in the index between 'horizon' and 'until' that didn't commit to its aborted xid ranges
+ */
+static int append_uncommitted_ranges(Relation indexRel, uint64 horizon, TransactionId until, uint64 **ranges, int nranges) {
+	Oid                         indexRelid = RelationGetRelid(indexRel);
+	UncommittedRangesCacheEntry *entry;
+	bool                        found;
+
+	if (uncommittedRangesCache == NULL) {
+		HASHCTL ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize   = sizeof(Oid);
+		ctl.entrysize = sizeof(UncommittedRangesCacheEntry);
+		ctl.hcxt      = visibilityClauseContext;
+		uncommittedRangesCache = hash_create("uncommitted xid ranges cache", 32, &ctl,
+											 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = hash_search(uncommittedRangesCache, &indexRelid, HASH_FIND, &found);
+	if (!found || entry->horizon != horizon || entry->until != until) {
+		uint64 *uncommitted;
+		int    nuncommitted;
+
+		/* this asks Elasticsearch, so it might fail, and then we'll have cached nothing */
+		uncommitted = uncommitted_xid_ranges(indexRel, horizon, until, &nuncommitted);
+
+		entry = hash_search(uncommittedRangesCache, &indexRelid, HASH_ENTER, &found);
+		if (found)
+			pfree(entry->ranges);
+		entry->ranges = MemoryContextAlloc(visibilityClauseContext, sizeof(uint64) * 2 * (nuncommitted + 1));
+		memcpy(entry->ranges, uncommitted, sizeof(uint64) * 2 * nuncommitted);
+		entry->nranges = nuncommitted;
+		entry->horizon = horizon;
+		entry->until   = until;
+		pfree(uncommitted);
+	}
+
+	*ranges = repalloc(*ranges, sizeof(uint64) * 2 * (nranges + entry->nranges + 1));
+	memcpy(*ranges + nranges * 2, entry->ranges, sizeof(uint64) * 2 * entry->nranges);
+
+	return nranges + entry->nranges;
+}
+
+/*
+ * The same query as zdb.visibility_clause() or zdb.visibility_clause_tombstones(), depending on how
+ * the index records xmax, for the current snapshot
+ */
+static char *build_visibility_clause(Relation indexRel, Snapshot snapshot, CommandId commandId, TransactionId myXid) {
+	Oid                 indexRelid = RelationGetRelid(indexRel);
+	StringInfo          buf        = makeStringInfo();
+	uint64              xid        = convert_xid(myXid);
+	uint64              xmax       = convert_xid(snapshot->xmax);
+	uint64              *active, *ranges, horizon;
+	TransactionId       *unresolved, until = InvalidTransactionId;
+	XactTrackerRecovery recovery   = XACT_TRACKER_RECOVERED;
+	int                 nactive    = 0, nunresolved, nranges, i;
+
+	/*
+	 * If this is the first we've seen of the index since Postgres started, find out which of the
+	 * transactions that wrote to it didn't get to commit before then.  If the xact tracker can't
+	 * remember them, we have to assume the worst of every xid from back then that didn't commit
+	 */
+	if (!RecoveryInProgress()) {
+		recovery = xact_tracker_begin_recovery(indexRelid, &until);
+		if (recovery == XACT_TRACKER_RECOVER && !recover_unresolved_xids(indexRel, until))
+			recovery = XACT_TRACKER_UNRECOVERABLE;
+	}
+
+	/* our active transaction ids, along with those that wrote to the index and haven't committed */
+	nunresolved = xact_tracker_unresolved(indexRelid, &unresolved);
+	active      = palloc(sizeof(uint64) * (snapshot->xcnt + nunresolved + 1));
+	for (i = 0; i < snapshot->xcnt; i++)
+		active[nactive++] = convert_xid(snapshot->xip[i]);
+	for (i = 0; i < nunresolved; i++)
+		active[nactive++] = convert_xid(unresolved[i]);
+
+	/* the xids Elasticsearch knows didn't commit, and the horizon below which that's all of them */
+	horizon = ElasticsearchGetXidHorizon(indexRel, &ranges, &nranges);
+	if (recovery == XACT_TRACKER_UNRECOVERABLE)
+		nranges = append_uncommitted_ranges(indexRel, horizon, until, &ranges, nranges);
+
+	appendStringInfoString(buf, "{\"bool\":{\"must_not\":[{\"ids\":{\"values\":[\"zdb_aborted_xids\"]}}");
+	if (ZDBIndexOptionsGetTombstones(indexRel)) {
+		/* rows are visible unless one of their tombstones hides them */
+		appendStringInfo(buf, ",{\"has_child\":{\"type\":\"zdb_tombstone\",\"query\":{\"bool\":{\"should\":["
+							  "{\"bool\":{\"must\":[{\"term\":{\"zdb_xmax\":%lu}},{\"range\":{\"zdb_cmax\":{\"lt\":%u}}}]}},"
+							  "{\"bool\":{\"must_not\":[{\"term\":{\"zdb_xmax\":%lu}}],\"must\":[", xid, commandId, xid);
+		append_xid_is_committed(buf, "zdb_xmax", xmax, active, nactive, ranges, nranges, horizon);
+		appendStringInfo(buf, "]}}],\"minimum_should_match\":1}}}}],\"should\":["
+							  "{\"bool\":{\"must\":[{\"term\":{\"zdb_xmin\":%lu}},{\"range\":{\"zdb_cmin\":{\"lt\":%u}}}]}},",
+						 xid, commandId);
+		append_xid_is_committed(buf, "zdb_xmin", xmax, active, nactive, ranges, nranges, horizon);
+		appendStringInfoString(buf, "],\"minimum_should_match\":1}}");
+	} else {
+		char *xmaxIsOk = psprintf("{\"bool\":{\"must_not\":[{\"exists\":{\"field\":\"zdb_xmax\"}}]}},"
+								  "{\"bool\":{\"must\":[{\"term\":{\"zdb_xmax\":%lu}},{\"range\":{\"zdb_cmax\":{\"gte\":%u}}}]}}",
+								  xid, commandId);
+
+		appendStringInfo(buf, "],\"should\":["
+							  "{\"bool\":{\"must\":[{\"term\":{\"zdb_xmin\":%lu}},{\"range\":{\"zdb_cmin\":{\"lt\":%u}}}],"
+							  "\"should\":[%s],\"minimum_should_match\":1}},"
+							  "{\"bool\":{\"must\":[", xid, commandId, xmaxIsOk);
+		append_xid_is_committed(buf, "zdb_xmin", xmax, active, nactive, ranges, nranges, horizon);
+		appendStringInfo(buf, "],\"should\":[%s,{\"bool\":{\"must_not\":[{\"term\":{\"zdb_xmax\":%lu}},", xmaxIsOk, xid);
+		append_xid_is_committed(buf, "zdb_xmax", xmax, active, nactive, ranges, nranges, horizon);
+		appendStringInfoString(buf, "]}}],\"minimum_should_match\":1}}],\"minimum_should_match\":1}}");
+
+		pfree(xmaxIsOk);
+	}
+
+	pfree(active);
+	pfree(ranges);
+
+	return buf->data;
+}
+
+/*
+ * The visibility clause for our current snapshot against the index.  It's built once for each
+ * snapshot and command, so every scroll page, count and aggregate of a query shares it
+ */
+char *make_visibility_clause(Relation indexRel) {
+	Oid                        indexRelid = RelationGetRelid(indexRel);
+	Snapshot                   snapshot   = GetTransactionSnapshot();
+	CommandId                  commandId  = GetCurrentCommandId(false);
+	TransactionId              xid        = GetCurrentTransactionIdIfAny();
+	VisibilityClauseCacheEntry *entry;
+	MemoryContext              oldContext;
+	char                       *clause;
+	bool                       found;
+
+	if (visibilityClauseCache == NULL) {
+		HASHCTL ctl;
+
+		visibilityClauseContext = AllocSetContextCreate(TopMemoryContext, "visibility clause cache",
+														ALLOCSET_SMALL_SIZES);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize   = sizeof(Oid);
+		ctl.entrysize = sizeof(VisibilityClauseCacheEntry);
+		ctl.hcxt      = visibilityClauseContext;
+		visibilityClauseCache = hash_create("visibility clause cache", 32, &ctl,
+											HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = hash_search(visibilityClauseCache, &indexRelid, HASH_ENTER, &found);
+	if (found && entry->lxid == MyProc->lxid && entry->xid == xid && entry->commandId == commandId &&
+		entry->xmin == snapshot->xmin && entry->xmax == snapshot->xmax && entry->xcnt == snapshot->xcnt &&
+		memcmp(entry->xip, snapshot->xip, sizeof(TransactionId) * snapshot->xcnt) == 0)
+		return entry->clause;
+
+	if (found && entry->xip != NULL)
+		pfree(entry->xip);
+	if (found && entry->clause != NULL)
+		pfree(entry->clause);
+	entry->xip    = NULL;
+	entry->clause = NULL;
+	entry->lxid   = InvalidLocalTransactionId;
+
+	clause = build_visibility_clause(indexRel, snapshot, commandId, xid);
+
+	oldContext = MemoryContextSwitchTo(visibilityClauseContext);
+	entry->xip = palloc(sizeof(TransactionId) * (snapshot->xcnt + 1));
+	memcpy(entry->xip, snapshot->xip, sizeof(TransactionId) * snapshot->xcnt);
+	entry->clause = pstrdup(clause);
+	MemoryContextSwitchTo(oldContext);
+
+	entry->lxid      = MyProc->lxid;
+	entry->xid       = xid;
+	entry->commandId = commandId;
+	entry->xmin      = snapshot->xmin;
+	entry->xmax      = snapshot->xmax;
+	entry->xcnt      = snapshot->xcnt;
+
+	pfree(clause);
+
+	return entry->clause;
+}
+
 static char *wrap_with_visibility_query(Relation indexRel, char *query) {
 	if (zdb_ignore_visibility_guc) {
 		return query;
 	} else {
-		ZDBQueryType *vis = (ZDBQueryType *) DatumGetPointer(
-				DirectFunctionCall1(zdb_internal_visibility_clause, ObjectIdGetDatum(RelationGetRelid(indexRel))));
-
 		/* wrap the input query with the visibility query */
-		return psprintf("{\"bool\":{\"must\":[%s],\"filter\":%s}}", query, vis->query_string);
+		return psprintf("{\"bool\":{\"must\":[%s],\"filter\":%s}}", query, make_visibility_clause(indexRel));
 	}
 }
@@ -25,5 +25,6 @@ ZDBQueryType *array_to_should_query_dsl(ArrayType *array);
 ZDBQueryType *array_to_must_query_dsl(ArrayType *array);
 ZDBQueryType *array_to_not_query_dsl(ArrayType *array);
 ZDBQueryType *scan_keys_to_query_dsl(ScanKey keys, int nkeys);
+char *make_visibility_clause(Relation indexRel);
 
 #endif /* __ZDB_QUERYGEN_H__ */
@@ -0,0 +1,282 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * When ZomboDB indexes are refreshed.
+ *
+ * A refresh makes what we've sent to an index searchable, but it's also what makes Elasticsearch
+ * write a new segment, so we don't do one at the end of every statement that writes to an index.
+ * Instead, writing to an index only counts as a change here, and a refresh happens the next time
+ * anyone searches the index, if it has changed since the last one.
+ *
+ * When ZomboDB is in shared_preload_libraries, those counts live in shared memory, so a backend
+ * knows when another one has changed an index, and only one backend refreshes an index at a time.
+ * Everyone else who needs that refresh waits for it rather than doing one of their own.
+ *
+ * When ZomboDB isn't preloaded, or we can't track an index in shared memory, other backends can't
+ * know we changed it, so we refresh it ourselves before we commit, once per transaction rather
+ * than once per statement
+ */
+#include "refresh_coordinator.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+
+typedef struct RefreshIndex {
+	Oid    dbOid;
+	Oid    indexRelid;
+	uint64 written;       /* bumped each time a backend finishes writing to the index */
+	uint64 refreshed;     /* what 'written' was when the last refresh to finish started */
+	uint64 refreshing;    /* what 'written' was when the running refresh started, or zero */
+	int    refresher;     /* the pid of the backend running it */
+} RefreshIndex;
+
+typedef struct RefreshCoordinatorShmem {
+	LWLock            *lock;
+	ConditionVariable cv;    /* broadcast whenever a refresh finishes */
+	int               nindexes;
+	RefreshIndex      indexes[MAX_REFRESH_INDEXES];
+} RefreshCoordinatorShmem;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static RefreshCoordinatorShmem *coordinator            = NULL;
+static bool                    exitCallbackRegistered  = false;
+
+/* indexes our transaction wrote to that aren't tracked in shared memory, and we haven't refreshed since */
+static List                    *unshared               = NIL;
+
+static void refresh_coordinator_shmem_startup(void) {
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	coordinator = ShmemInitStruct("zombodb refresh coordinator", sizeof(RefreshCoordinatorShmem), &found);
+	if (!found) {
+		memset(coordinator, 0, sizeof(RefreshCoordinatorShmem));
+		coordinator->lock = &(GetNamedLWLockTranche("zombodb refresh coordinator"))->lock;
+		ConditionVariableInit(&coordinator->cv);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * The index's entry, or NULL if it doesn't have one.  Caller must hold the lock
+ */
+static RefreshIndex *find_index(Oid indexRelid) {
+	int i;
+
+	for (i = 0; i < coordinator->nindexes; i++) {
+		RefreshIndex *entry = &coordinator->indexes[i];
+
+		if (entry->indexRelid == indexRelid && entry->dbOid == MyDatabaseId)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Give the index an entry, reusing that of one that doesn't need a refresh if we're out of room.
+ * Returns NULL if we can't.  Caller must hold the lock exclusively
+ */
+static RefreshIndex *add_index(Oid indexRelid) {
+	RefreshIndex *entry = NULL;
+	int          i;
+
+	if (coordinator->nindexes < MAX_REFRESH_INDEXES) {
+		entry = &coordinator->indexes[coordinator->nindexes++];
+	} else {
+		for (i = 0; i < coordinator->nindexes; i++) {
+			if (coordinator->indexes[i].refreshed == coordinator->indexes[i].written &&
+				coordinator->indexes[i].refreshing == 0) {
+				entry = &coordinator->indexes[i];
+				break;
+			}
+		}
+	}
+
+	if (entry != NULL) {
+		memset(entry, 0, sizeof(RefreshIndex));
+		entry->dbOid      = MyDatabaseId;
+		entry->indexRelid = indexRelid;
+	}
+
+	return entry;
+}
+
+/*
+ * Stop any refreshes we're running, without counting them, so whoever is waiting for one can
+ * run it instead
+ */
+static void abandon_refreshes(void) {
+	bool abandoned = false;
+	int  i;
+
+	LWLockAcquire(coordinator->lock, LW_EXCLUSIVE);
+	for (i = 0; i < coordinator->nindexes; i++) {
+		RefreshIndex *entry = &coordinator->indexes[i];
+
+		if (entry->refreshing != 0 && entry->refresher == MyProcPid) {
+			entry->refreshing = 0;
+			abandoned = true;
+		}
+	}
+	LWLockRelease(coordinator->lock);
+
+	if (abandoned)
+		ConditionVariableBroadcast(&coordinator->cv);
+}
+
+/*lint -esym 715,code,arg ignore unused param */
+static void refresh_coordinator_exit_callback(int code, Datum arg) {
+	abandon_refreshes();
+}
+
+/*
+ * Ask for our shared memory.  Only possible when we're being loaded via shared_preload_libraries
+ */
+void refresh_coordinator_init(void) {
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(sizeof(RefreshCoordinatorShmem));
+	RequestNamedLWLockTranche("zombodb refresh coordinator", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook      = refresh_coordinator_shmem_startup;
+}
+
+/*
+ * We've finished sending changes to an index, and they won't be searchable until it's refreshed
+ */
+void refresh_coordinator_wrote(Oid indexRelid) {
+	MemoryContext oldContext;
+
+	if (coordinator != NULL) {
+		RefreshIndex *entry;
+
+		LWLockAcquire(coordinator->lock, LW_EXCLUSIVE);
+		entry = find_index(indexRelid);
+		if (entry == NULL)
+			entry = add_index(indexRelid);
+		if (entry != NULL)
+			entry->written++;
+		LWLockRelease(coordinator->lock);
+
+		if (entry != NULL)
+			return;
+	}
+
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	unshared   = list_append_unique_oid(unshared, indexRelid);
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * Does the index need a refresh before we search it?  If so, the caller has to do it and then call
+ * refresh_coordinator_end() with the 'generation' we set.  If another backend is already refreshing
+ * it, we wait for that refresh instead, and only return true if it started too soon to include
+ * everything we need to see
+ */
+bool refresh_coordinator_begin(Oid indexRelid, uint64 *generation) {
+	bool mine = false;
+
+	*generation = 0;
+	if (list_member_oid(unshared, indexRelid))
+		return true;
+
+	if (coordinator == NULL)
+		return false;
+
+	if (!exitCallbackRegistered) {
+		before_shmem_exit(refresh_coordinator_exit_callback, (Datum) 0);
+		exitCallbackRegistered = true;
+	}
+
+	for (;;) {
+		RefreshIndex *entry;
+		bool         wait = false;
+
+		LWLockAcquire(coordinator->lock, LW_EXCLUSIVE);
+		entry = find_index(indexRelid);
+		if (entry != NULL && entry->refreshed < entry->written) {
+			if (entry->refreshing != 0) {
+				wait = true;
+			} else {
+				entry->refreshing = entry->written;
+				entry->refresher  = MyProcPid;
+				*generation       = entry->written;
+				mine = true;
+			}
+		}
+		LWLockRelease(coordinator->lock);
+
+		if (!wait)
+			break;
+
+		ConditionVariableSleep(&coordinator->cv, PG_WAIT_EXTENSION);
+	}
+	ConditionVariableCancelSleep();
+
+	return mine;
+}
+
+/*
+ * The refresh refresh_coordinator_begin() asked us to do is over.  If it didn't work, whoever
+ * needs it next will try again
+ */
+void refresh_coordinator_end(Oid indexRelid, uint64 generation, bool refreshed) {
+	if (refreshed)
+		unshared = list_delete_oid(unshared, indexRelid);
+
+	if (coordinator != NULL && generation != 0) {
+		RefreshIndex *entry;
+
+		LWLockAcquire(coordinator->lock, LW_EXCLUSIVE);
+		entry = find_index(indexRelid);
+		if (entry != NULL && entry->refresher == MyProcPid) {
+			if (refreshed)
+				entry->refreshed = Max(entry->refreshed, generation);
+			entry->refreshing = 0;
+		}
+		LWLockRelease(coordinator->lock);
+
+		ConditionVariableBroadcast(&coordinator->cv);
+	}
+}
+
+/*
+ * The indexes our transaction wrote to that only we know need a refresh, and so we have to refresh
+ * before we commit
+ */
+List *refresh_coordinator_unshared(void) {
+	return list_copy(unshared);
+}
+
+/*
+ * Our transaction is over.  Whatever of it didn't commit doesn't need to be seen
+ */
+void refresh_coordinator_end_xact(void) {
+	list_free(unshared);
+	unshared = NIL;
+}
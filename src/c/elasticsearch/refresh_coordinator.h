@@ -0,0 +1,33 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZDB_REFRESH_COORDINATOR_H__
+#define __ZDB_REFRESH_COORDINATOR_H__
+
+#include "postgres.h"
+#include "nodes/pg_list.h"
+
+/* the most indexes we can coordinate refreshes for in shared memory */
+#define MAX_REFRESH_INDEXES 1024
+
+void refresh_coordinator_init(void);
+void refresh_coordinator_wrote(Oid indexRelid);
+bool refresh_coordinator_begin(Oid indexRelid, uint64 *generation);
+void refresh_coordinator_end(Oid indexRelid, uint64 generation, bool refreshed);
+List *refresh_coordinator_unshared(void);
+void refresh_coordinator_end_xact(void);
+
+#endif /* __ZDB_REFRESH_COORDINATOR_H__ */
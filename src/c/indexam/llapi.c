@@ -39,6 +39,7 @@ Datum llapi_direct_insert(PG_FUNCTION_ARGS) {
 	}
 
 	context = checkout_insert_context(indexRel, PointerGetDatum(NULL), true);
+	track_xid(context, GetCurrentTransactionId());
 	ElasticsearchBulkInsertRow(context->esContext, NULL, json, GetCurrentCommandId(true), InvalidCommandId,
 							   convert_xid(GetCurrentTransactionId()), InvalidTransactionId);
 
@@ -64,6 +65,7 @@ Datum llapi_direct_delete(PG_FUNCTION_ARGS) {
 	}
 
 	context = checkout_insert_context(indexRel, PointerGetDatum(NULL), true);
+	track_xid(context, GetCurrentTransactionId());
 	ElasticsearchBulkUpdateTuple(context->esContext, NULL, id, GetCurrentCommandId(true),
 								 convert_xid(GetCurrentTransactionId()));
 
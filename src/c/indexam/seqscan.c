@@ -19,20 +19,48 @@
 #include "highlighting/highlighting.h"
 #include "scoring/scoring.h"
 
+#include "access/hash.h"
+#include "access/htup_details.h"
 #include "parser/parsetree.h"
 #include "utils/lsyscache.h"
 
-#define CMP_FUNC_ENTRY_KEYSIZE 8192
+/* the bytes of a CtidSet's bitmap for each heap page */
+#define CTID_SET_PAGE_BYTES ((MaxHeapTuplesPerPage + 7) / 8)
 
-typedef struct CmpFuncKey {
-	char key[CMP_FUNC_ENTRY_KEYSIZE];
-} CmpFuncKey;
+/*
+ * The ctids a query matched, as a bitmap of the line pointers of each heap page it matched any
+ * on, in block order.  A sequential scan visits the heap in block order too, so we remember the
+ * last page we looked for, and testing a row is usually just testing a bit
+ */
+typedef struct CtidSet {
+	int         npages;
+	BlockNumber *blocks;       /* sorted */
+	bits8       *bits;         /* CTID_SET_PAGE_BYTES for each of 'blocks' */
+	BlockNumber lastBlock;
+	int         lastPage;      /* the index of 'lastBlock' in 'blocks', or -1 if it isn't there */
+} CtidSet;
+
+/* the ctids of a query we've run for an expression */
+typedef struct CmpFuncQuery {
+	uint32  fingerprint;       /* of the index and the query */
+	char    *queryString;
+	CtidSet *ctids;
+} CmpFuncQuery;
+
+/*
+ * What a ZomboDB comparison expression keeps in its fn_extra, so that evaluating it for a row
+ * doesn't need to do much more than look up the row's ctid
+ */
+typedef struct CmpFuncState {
+	Oid            heapRelId;
+	Oid            indexRelId;
+	bool           stableQuery;    /* is our rhs the same for every row? */
+	TupleTableSlot *slot;          /* where we found the row being evaluated last time */
+	CmpFuncQuery   *lastQuery;
+	List           *queries;
+} CmpFuncState;
 
-typedef struct CmpFuncEntry {
-	/*lint -e754 ignore unused member */
-	char key[CMP_FUNC_ENTRY_KEYSIZE];
-	HTAB *hash;
-} CmpFuncEntry;
+typedef ZDBQueryType *(*CmpFuncQueryBuilder)(FunctionCallInfo fcinfo);
 
 PG_FUNCTION_INFO_V1(zdb_anyelement_cmpfunc_array_should);
 PG_FUNCTION_INFO_V1(zdb_anyelement_cmpfunc_array_must);
@@ -78,115 +106,245 @@ static List *highlight_cb(ItemPointer ctid, Name field, void *arg) {
 	return NULL;
 }
 
-static HTAB *create_ctid_map(Relation heapRel, Relation indexRel, ZDBQueryType *query, MemoryContext memoryContext) {
+static int ctid_cmp(const void *a, const void *b) {
+	return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+static CtidSet *make_ctid_set(ItemPointerData *ctids, uint64 nctids) {
+	CtidSet     *set = palloc0(sizeof(CtidSet));
+	BlockNumber block;
+	uint64      i;
+	int         page;
+
+	qsort(ctids, nctids, sizeof(ItemPointerData), ctid_cmp);
+
+	for (i = 0; i < nctids; i++) {
+		if (i == 0 || ItemPointerGetBlockNumber(&ctids[i]) != ItemPointerGetBlockNumber(&ctids[i - 1]))
+			set->npages++;
+	}
+
+	set->blocks    = palloc_extended(Max(1, set->npages) * sizeof(BlockNumber), MCXT_ALLOC_HUGE);
+	set->bits      = palloc_extended(Max(1, set->npages) * CTID_SET_PAGE_BYTES, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	set->lastBlock = InvalidBlockNumber;
+	set->lastPage  = -1;
+
+	page = -1;
+	for (i = 0; i < nctids; i++) {
+		OffsetNumber offset = ItemPointerGetOffsetNumber(&ctids[i]);
+
+		block = ItemPointerGetBlockNumber(&ctids[i]);
+		if (page < 0 || set->blocks[page] != block)
+			set->blocks[++page] = block;
+
+		if (offset >= FirstOffsetNumber && offset <= MaxHeapTuplesPerPage)
+			set->bits[page * CTID_SET_PAGE_BYTES + (offset - 1) / 8] |= (bits8) (1 << ((offset - 1) % 8));
+	}
+
+	return set;
+}
+
+static bool ctid_set_contains(CtidSet *set, ItemPointer ctid) {
+	BlockNumber  block  = ItemPointerGetBlockNumber(ctid);
+	OffsetNumber offset = ItemPointerGetOffsetNumber(ctid);
+
+	if (offset < FirstOffsetNumber || offset > MaxHeapTuplesPerPage)
+		return false;
+
+	if (block != set->lastBlock) {
+		int lo = 0, hi = set->npages - 1;
+
+		set->lastBlock = block;
+		set->lastPage  = -1;
+		while (lo <= hi) {
+			int mid = lo + (hi - lo) / 2;
+
+			if (set->blocks[mid] < block) {
+				lo = mid + 1;
+			} else if (set->blocks[mid] > block) {
+				hi = mid - 1;
+			} else {
+				set->lastPage = mid;
+				break;
+			}
+		}
+	}
+
+	if (set->lastPage < 0)
+		return false;
+
+	return (set->bits[set->lastPage * CTID_SET_PAGE_BYTES + (offset - 1) / 8] & (1 << ((offset - 1) % 8))) != 0;
+}
+
+/*
+ * Run the query, and remember the scores and highlights of what it matches for whoever asks for
+ * them while our query runs
+ */
+static CtidSet *create_ctid_set(Relation heapRel, Relation indexRel, ZDBQueryType *query, MemoryContext memoryContext) {
+	MemoryContext              oldContext     = MemoryContextSwitchTo(memoryContext);
+	bool                       wantScores     = current_scan_wants_scores(NULL, heapRel);
+	List                       *highlights    = extract_highlight_info(NULL, RelationGetRelid(heapRel));
+	HTAB                       *scoreHash     = NULL;
+	HTAB                       *highlightHash = NULL;
 	ElasticsearchScrollContext *scroll;
-	HTAB                       *scoreHash     = scoring_create_lookup_table(memoryContext, "scores from seqscan");
-	HTAB                       *highlightHash = highlight_create_lookup_table(memoryContext, "highlights from seqscan");
+	ItemPointerData            *ctids;
+	CtidSet                    *set;
+	uint64                     nctids         = 0;
 
-	scroll = ElasticsearchOpenScroll(indexRel, query, false, false, current_scan_wants_scores(NULL, heapRel), 0, NULL,
-									 SORTBY_DEFAULT, extract_highlight_info(NULL, RelationGetRelid(heapRel)), NULL, 0);
-	scoring_register_callback(RelationGetRelid(heapRel), scoring_cb, scoreHash, memoryContext);
-	highlight_register_callback(RelationGetRelid(heapRel), highlight_cb, highlightHash, memoryContext);
+	if (wantScores) {
+		scoreHash = scoring_create_lookup_table(memoryContext, "scores from seqscan");
+		scoring_register_callback(RelationGetRelid(heapRel), scoring_cb, scoreHash, memoryContext);
+	}
+
+	if (highlights != NULL) {
+		highlightHash = highlight_create_lookup_table(memoryContext, "highlights from seqscan");
+		highlight_register_callback(RelationGetRelid(heapRel), highlight_cb, highlightHash, memoryContext);
+	}
+
+	scroll = ElasticsearchOpenScroll(indexRel, query, false, false, wantScores, 0, NULL, SORTBY_DEFAULT, highlights,
+									 NULL, 0);
+	ctids  = palloc_extended(Max(1, scroll->total) * sizeof(ItemPointerData), MCXT_ALLOC_HUGE);
 
 	while (scroll->cnt < scroll->total) {
-		ZDBScoreKey     key;
-		ZDBScoreEntry   *entry;
-		bool            found;
+		ItemPointer     ctid = &ctids[nctids++];
 		float4          score;
-		zdb_json_object highlights;
+		zdb_json_object hitHighlights;
+
+		ElasticsearchGetNextItemPointer(scroll, ctid, NULL, &score, &hitHighlights);
 
-		ElasticsearchGetNextItemPointer(scroll, &key.ctid, NULL, &score, &highlights);
+		if (scoreHash != NULL) {
+			ZDBScoreKey   key;
+			ZDBScoreEntry *entry;
+			bool          found;
 
-		entry = hash_search(scoreHash, &key, HASH_ENTER, &found);
-		entry->score = score;
+			ItemPointerCopy(ctid, &key.ctid);
+			entry = hash_search(scoreHash, &key, HASH_ENTER, &found);
+			entry->score = score;
+		}
 
-		save_highlights(highlightHash, &key.ctid, highlights);
+		if (highlightHash != NULL)
+			save_highlights(highlightHash, ctid, hitHighlights);
 	}
 
 	ElasticsearchCloseScroll(scroll);
 
-	return scoreHash;
+	set = make_ctid_set(ctids, nctids);
+	pfree(ctids);
+
+	MemoryContextSwitchTo(oldContext);
+	return set;
 }
 
-static Datum do_cmpfunc(ZDBQueryType *userQuery, HTAB *cmpFuncHash, Oid typeoid, FunctionCallInfo fcinfo) {
-	QueryDesc      *currentQuery;
-	TupleTableSlot *slot = NULL;
-	Oid            heapRelId;
-	Relation       heapRel;
-	ListCell       *lc;
-	bool           found;
+static CmpFuncState *get_cmpfunc_state(FunctionCallInfo fcinfo, Oid heapRelId, Oid typeoid) {
+	CmpFuncState *state = (CmpFuncState *) fcinfo->flinfo->fn_extra;
 
-	if (currentQueryStack == NULL) {
-		goto invalid_context_error;
-	}
+	if (state == NULL) {
+		Relation heapRel = RelationIdGetRelation(heapRelId);
+		Relation indexRel;
 
-	currentQuery = linitial(currentQueryStack);
+		indexRel = find_index_relation(heapRel, typeoid, AccessShareLock);
 
-	heapRelId = get_typ_typrelid(typeoid);
-	if (heapRelId == InvalidOid) {
-		goto invalid_context_error;
-	}
+		state = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(CmpFuncState));
+		state->heapRelId   = heapRelId;
+		state->indexRelId  = RelationGetRelid(indexRel);
+		state->stableQuery = get_fn_expr_arg_stable(fcinfo->flinfo, 1);
 
-	/* find the TupleTableSlot that represents the row being evaluated in this scan */
-	heapRel = RelationIdGetRelation(heapRelId);
-	foreach(lc, currentQuery->estate->es_tupleTable) {
-		TupleTableSlot *tmp = lfirst(lc);
-		if (tmp->tts_tuple != NULL && tmp->tts_tuple->t_tableOid == RelationGetRelid(heapRel)) {
-			slot = tmp;
-			break;
-		}
+		relation_close(indexRel, AccessShareLock);
+		RelationClose(heapRel);
+
+		fcinfo->flinfo->fn_extra = state;
 	}
 
-	if (slot != NULL) {
-		CmpFuncKey    key;
-		CmpFuncEntry  *entry     = NULL;
-		MemoryContext oldContext = MemoryContextSwitchTo(currentQuery->estate->es_query_cxt);
-
-		memset(&key, 0, sizeof(CmpFuncKey));
-		snprintf(key.key, CMP_FUNC_ENTRY_KEYSIZE, "%s", userQuery->query_string);
-
-		if (cmpFuncHash == NULL) {
-			HASHCTL ctl;
-
-			memset(&ctl, 0, sizeof(HASHCTL));
-			ctl.hash      = string_hash;
-			ctl.keysize   = sizeof(CmpFuncKey);
-			ctl.entrysize = sizeof(CmpFuncEntry);
-			ctl.hcxt      = currentQuery->estate->es_query_cxt;    /* once this query is done, we don't care */
-
-			cmpFuncHash = hash_create("seqscan", 64, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
-			entry       = hash_search(cmpFuncHash, &key, HASH_ENTER, &found);
-			entry->hash = NULL;
-
-			fcinfo->flinfo->fn_extra = cmpFuncHash;
-		} else {
-			entry = hash_search(cmpFuncHash, &key, HASH_FIND, &found);
-			if (!found) {
-				entry = hash_search(cmpFuncHash, &key, HASH_ENTER, &found);
-				entry->hash = NULL;
-			}
-		}
+	return state;
+}
+
+/*
+ * The ctids of the query in our rhs.  If it's the same for every row, that's whatever we found the
+ * first time.  Otherwise we find the one we ran for the same query before, if any, by its fingerprint
+ */
+static CtidSet *get_query_ctids(FunctionCallInfo fcinfo, CmpFuncState *state, CmpFuncQueryBuilder builder) {
+	ZDBQueryType *query;
+	CmpFuncQuery *prepared;
+	uint32       fingerprint;
+	ListCell     *lc;
 
-		if (entry->hash == NULL) {
-			/*
-			 * execute query using our rhs argument and turn it into a hash
-			 * and store that hash with this function for future evaluations
-			 */
-			Relation indexRel;
+	if (state->stableQuery && state->lastQuery != NULL)
+		return state->lastQuery->ctids;
 
-			indexRel = find_index_relation(heapRel, typeoid, AccessShareLock);
-			entry->hash = create_ctid_map(heapRel, indexRel, userQuery, currentQuery->estate->es_query_cxt);
-			relation_close(indexRel, AccessShareLock);
+	query       = builder(fcinfo);
+	fingerprint = DatumGetUInt32(hash_any((unsigned char *) query->query_string, (int) strlen(query->query_string))) ^
+				  DatumGetUInt32(hash_uint32(state->indexRelId));
+
+	foreach (lc, state->queries) {
+		prepared = lfirst(lc);
+
+		if (prepared->fingerprint == fingerprint && strcmp(prepared->queryString, query->query_string) == 0) {
+			state->lastQuery = prepared;
+			return prepared->ctids;
 		}
+	}
+
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+		Relation      heapRel    = RelationIdGetRelation(state->heapRelId);
+		Relation      indexRel   = relation_open(state->indexRelId, AccessShareLock);
+
+		prepared = palloc0(sizeof(CmpFuncQuery));
+		prepared->fingerprint = fingerprint;
+		prepared->queryString = pstrdup(query->query_string);
+		prepared->ctids       = create_ctid_set(heapRel, indexRel, query, fcinfo->flinfo->fn_mcxt);
 
-		/* does our hash match the tuple currently being evaluated? */
-		/*lint -e534 ignore return value */
-		hash_search(entry->hash, &slot->tts_tuple->t_self, HASH_FIND, &found);
+		state->queries   = lappend(state->queries, prepared);
+		state->lastQuery = prepared;
 
+		relation_close(indexRel, AccessShareLock);
 		RelationClose(heapRel);
 		MemoryContextSwitchTo(oldContext);
+	}
+
+	return prepared->ctids;
+}
+
+static Datum do_cmpfunc(FunctionCallInfo fcinfo, CmpFuncQueryBuilder builder) {
+	CmpFuncState   *state = (CmpFuncState *) fcinfo->flinfo->fn_extra;
+	TupleTableSlot *slot;
+
+	if (currentQueryStack == NULL) {
+		goto invalid_context_error;
+	}
+
+	if (state == NULL) {
+		Oid typeoid   = get_fn_expr_argtype(fcinfo->flinfo, 0);
+		Oid heapRelId = get_typ_typrelid(typeoid);
+
+		if (heapRelId == InvalidOid) {
+			goto invalid_context_error;
+		}
 
-		PG_RETURN_BOOL(found);
+		state = get_cmpfunc_state(fcinfo, heapRelId, typeoid);
+	}
+
+	/* find the TupleTableSlot that represents the row being evaluated in this scan, usually the same one as last time */
+	slot = state->slot;
+	if (slot == NULL || slot->tts_tuple == NULL || slot->tts_tuple->t_tableOid != state->heapRelId) {
+		QueryDesc *currentQuery = linitial(currentQueryStack);
+		ListCell  *lc;
+
+		slot = NULL;
+		foreach(lc, currentQuery->estate->es_tupleTable) {
+			TupleTableSlot *tmp = lfirst(lc);
+			if (tmp->tts_tuple != NULL && tmp->tts_tuple->t_tableOid == state->heapRelId) {
+				slot = tmp;
+				break;
+			}
+		}
+		state->slot = slot;
+	}
+
+	if (slot != NULL) {
+		CtidSet *ctids = get_query_ctids(fcinfo, state, builder);
+
+		/* does the query match the tuple currently being evaluated? */
+		PG_RETURN_BOOL(ctid_set_contains(ctids, &slot->tts_tuple->t_self));
 	}
 
 	invalid_context_error:
@@ -196,68 +354,57 @@ static Datum do_cmpfunc(ZDBQueryType *userQuery, HTAB *cmpFuncHash, Oid typeoid,
 	/*lint -e533 we either return a bool or elog(ERROR)*/
 }
 
+static ZDBQueryType *query_arg(FunctionCallInfo fcinfo) {
+	return (ZDBQueryType *) PG_GETARG_VARLENA_P(1);
+}
+
+static ZDBQueryType *should_query_arg(FunctionCallInfo fcinfo) {
+	return array_to_should_query_dsl(PG_GETARG_ARRAYTYPE_P(1));
+}
+
+static ZDBQueryType *must_query_arg(FunctionCallInfo fcinfo) {
+	return array_to_must_query_dsl(PG_GETARG_ARRAYTYPE_P(1));
+}
+
+static ZDBQueryType *not_query_arg(FunctionCallInfo fcinfo) {
+	return array_to_not_query_dsl(PG_GETARG_ARRAYTYPE_P(1));
+}
+
 Datum zdb_anyelement_cmpfunc_array_should(PG_FUNCTION_ARGS) {
-	ZDBQueryType *query = array_to_should_query_dsl(DatumGetArrayTypeP(PG_GETARG_ARRAYTYPE_P(1)));
-	return do_cmpfunc(query, (HTAB *) fcinfo->flinfo->fn_extra, get_fn_expr_argtype(fcinfo->flinfo, 0), fcinfo);
+	return do_cmpfunc(fcinfo, should_query_arg);
 }
 
 Datum zdb_anyelement_cmpfunc_array_must(PG_FUNCTION_ARGS) {
-	ZDBQueryType *query = array_to_must_query_dsl(DatumGetArrayTypeP(PG_GETARG_ARRAYTYPE_P(1)));
-	return do_cmpfunc(query, (HTAB *) fcinfo->flinfo->fn_extra, get_fn_expr_argtype(fcinfo->flinfo, 0), fcinfo);
+	return do_cmpfunc(fcinfo, must_query_arg);
 }
 
 Datum zdb_anyelement_cmpfunc_array_not(PG_FUNCTION_ARGS) {
-	ZDBQueryType *query = array_to_not_query_dsl(DatumGetArrayTypeP(PG_GETARG_ARRAYTYPE_P(1)));
-	return do_cmpfunc(query, (HTAB *) fcinfo->flinfo->fn_extra, get_fn_expr_argtype(fcinfo->flinfo, 0), fcinfo);
+	return do_cmpfunc(fcinfo, not_query_arg);
 }
 
 Datum zdb_anyelement_cmpfunc(PG_FUNCTION_ARGS) {
-	ZDBQueryType *query = (ZDBQueryType *) PG_GETARG_VARLENA_P(1);
-	return do_cmpfunc(query, (HTAB *) fcinfo->flinfo->fn_extra, get_fn_expr_argtype(fcinfo->flinfo, 0), fcinfo);
+	return do_cmpfunc(fcinfo, query_arg);
 }
 
 Datum zdb_tid_cmpfunc(PG_FUNCTION_ARGS) {
-	ItemPointer  ctid   = (ItemPointer) PG_GETARG_POINTER(0);
-	ZDBQueryType *query = (ZDBQueryType *) PG_GETARG_VARLENA_P(1);
-	Node         *left  = linitial(((OpExpr *) fcinfo->flinfo->fn_expr)->args);
+	ItemPointer ctid  = (ItemPointer) PG_GETARG_POINTER(0);
+	Node        *left = linitial(((OpExpr *) fcinfo->flinfo->fn_expr)->args);
 
 	if (IsA(left, Var)) {
-		Var           *var          = (Var *) left;
-		QueryDesc     *currentQuery = linitial(currentQueryStack);
-		RangeTblEntry *rentry       = rt_fetch(var->varnoold, currentQuery->plannedstmt->rtable);
-		HTAB          *hash         = (HTAB *) fcinfo->flinfo->fn_extra;
-		Oid           heapRelId;
-		Relation      heapRel;
-		bool          found;
-
-		heapRelId = rentry->relid;
-
-		heapRel = RelationIdGetRelation(heapRelId);
-		if (hash == NULL) {
-			/*
-			 * execute query using our rhs argument and turn it into a hash
-			 * and store that hash with this function for future evaluations
-			 */
-			MemoryContext oldContext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
-			Relation      indexRel;
-
-			indexRel = find_index_relation(heapRel, get_rel_type_id(heapRelId), AccessShareLock);
-			hash     = create_ctid_map(heapRel, indexRel, query, fcinfo->flinfo->fn_mcxt);
-			relation_close(indexRel, AccessShareLock);
-
-			MemoryContextSwitchTo(oldContext);
-
-			fcinfo->flinfo->fn_extra = hash;
-		}
-		RelationClose(heapRel);
+		CmpFuncState *state = (CmpFuncState *) fcinfo->flinfo->fn_extra;
 
-		/* does our hash match the tuple currently being evaluated? */
-		hash_search(hash, ctid, HASH_FIND, &found);
+		if (state == NULL) {
+			Var           *var          = (Var *) left;
+			QueryDesc     *currentQuery = linitial(currentQueryStack);
+			RangeTblEntry *rentry       = rt_fetch(var->varnoold, currentQuery->plannedstmt->rtable);
 
-		PG_RETURN_BOOL(found);
+			state = get_cmpfunc_state(fcinfo, rentry->relid, get_rel_type_id(rentry->relid));
+		}
+
+		/* does the query match the tuple currently being evaluated? */
+		PG_RETURN_BOOL(ctid_set_contains(get_query_ctids(fcinfo, state, query_arg), ctid));
 	} else {
 		elog(ERROR, "zombodb tid comparision function lhs is not a direct ctid column reference");
 	}
 	/*lint -e533 we either return a bool or elog(ERROR)*/
 }
-
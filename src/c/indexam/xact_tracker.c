@@ -0,0 +1,435 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Which transactions have written to which ZomboDB indexes, and haven't committed.
+ *
+ * Elasticsearch only learns that a transaction aborted when VACUUM reconciles the xids in an
+ * index against the commit log and adds the aborted ones to its "zdb_aborted_xids" doc.  Until
+ * then, a transaction that wrote to an index, and might not commit, lives here in shared memory
+ * so that every backend's visibility clause can treat it as uncommitted.  Transactions that
+ * commit simply forget themselves, without telling Elasticsearch anything.
+ *
+ * Shared memory doesn't survive a restart, so the first time an index is queried afterwards, one
+ * backend finds the xids of everything written to it since it was last vacuumed, up to the first
+ * xid handed out since the restart, and puts those that didn't commit back here.  Everyone else
+ * who queries the index meanwhile waits for that.  Only VACUUM tells Elasticsearch about them.
+ * If there's no room for them, queries instead treat every xid in that range that didn't commit
+ * as unresolved, until VACUUM has moved the index's horizon past it.
+ *
+ * When ZomboDB isn't preloaded there's no shared memory for this, and every writing transaction
+ * records itself in "zdb_aborted_xids" until it commits, the way it always has
+ */
+#include "xact_tracker.h"
+
+#include "access/transam.h"
+#include "access/twophase.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/autovacuum.h"
+#include "storage/backendid.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+typedef struct TrackedXid {
+	Oid           dbOid;
+	Oid           indexRelid;
+	TransactionId xid;
+	BackendId     owner;    /* InvalidBackendId once its transaction is over */
+} TrackedXid;
+
+typedef struct RecoveredIndex {
+	Oid  dbOid;
+	Oid  indexRelid;
+	int  recoverer;     /* the pid of the backend recovering it, or zero once that's done */
+	bool overflowed;    /* its unresolved xids didn't all fit in 'tracked' */
+} RecoveredIndex;
+
+typedef struct XactTrackerShmem {
+	LWLock            *lock;
+	ConditionVariable cv;            /* broadcast whenever a recovery finishes */
+	TransactionId     startupXid;    /* the first xid handed out since Postgres started */
+	int               nrecovered;
+	RecoveredIndex    recovered[XACT_TRACKER_MAX_RECOVERED];
+	int               ntracked;
+	int               maxtracked;
+	TrackedXid        tracked[FLEXIBLE_ARRAY_MEMBER];
+} XactTrackerShmem;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static XactTrackerShmem        *tracker                = NULL;
+static int                     trackerEntries          = 0;
+static bool                    exitCallbackRegistered  = false;
+
+/* so we don't need the lock at the end of every transaction just to find out we tracked nothing */
+static int                     localTracked            = 0;
+
+static Size xact_tracker_shmem_size(void) {
+	return add_size(offsetof(XactTrackerShmem, tracked), mul_size(trackerEntries, sizeof(TrackedXid)));
+}
+
+static void xact_tracker_shmem_startup(void) {
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	tracker = ShmemInitStruct("zombodb xact tracker", xact_tracker_shmem_size(), &found);
+	if (!found) {
+		memset(tracker, 0, xact_tracker_shmem_size());
+		tracker->lock       = &(GetNamedLWLockTranche("zombodb xact tracker"))->lock;
+		tracker->startupXid = InvalidTransactionId;
+		tracker->maxtracked = trackerEntries;
+		ConditionVariableInit(&tracker->cv);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Remember the first xid handed out since Postgres started, if we haven't yet.  Anything
+ * before it that wrote to an index and didn't commit must've been running when Postgres
+ * went away.  Caller must hold the lock exclusively
+ */
+static void note_startup_xid(void) {
+	if (!TransactionIdIsValid(tracker->startupXid))
+		tracker->startupXid = ReadNewTransactionId();
+}
+
+/*
+ * Returns false if we're out of room.  Caller must hold the lock exclusively
+ */
+static bool track_locked(Oid indexRelid, TransactionId xid, BackendId owner) {
+	int i;
+
+	for (i = 0; i < tracker->ntracked; i++) {
+		TrackedXid *entry = &tracker->tracked[i];
+
+		if (entry->xid == xid && entry->indexRelid == indexRelid && entry->dbOid == MyDatabaseId)
+			return true;
+	}
+
+	if (tracker->ntracked < tracker->maxtracked) {
+		TrackedXid *entry = &tracker->tracked[tracker->ntracked++];
+
+		entry->dbOid      = MyDatabaseId;
+		entry->indexRelid = indexRelid;
+		entry->xid        = xid;
+		entry->owner      = owner;
+
+		if (owner != InvalidBackendId)
+			localTracked++;
+		return true;
+	}
+
+	return false;
+}
+
+static bool track(Oid indexRelid, TransactionId xid, BackendId owner) {
+	bool tracked;
+
+	LWLockAcquire(tracker->lock, LW_EXCLUSIVE);
+	note_startup_xid();
+	tracked = track_locked(indexRelid, xid, owner);
+	LWLockRelease(tracker->lock);
+
+	return tracked;
+}
+
+/*
+ * Forget an entry by moving the last one into its place.  Caller must hold the lock exclusively
+ */
+static void untrack(int i) {
+	tracker->tracked[i] = tracker->tracked[--tracker->ntracked];
+}
+
+/*
+ * The index's recovery, or NULL if no one has started one.  Caller must hold the lock
+ */
+static RecoveredIndex *find_recovered(Oid indexRelid) {
+	int i;
+
+	for (i = 0; i < tracker->nrecovered; i++) {
+		RecoveredIndex *entry = &tracker->recovered[i];
+
+		if (entry->indexRelid == indexRelid && entry->dbOid == MyDatabaseId)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Forget a recovery by moving the last one into its place.  Caller must hold the lock exclusively
+ */
+static void unrecover(RecoveredIndex *entry) {
+	*entry = tracker->recovered[--tracker->nrecovered];
+}
+
+/*
+ * Give up on any recoveries we're running, so whoever is waiting for one can run it instead
+ */
+static void abandon_recoveries(void) {
+	bool abandoned = false;
+	int  i;
+
+	LWLockAcquire(tracker->lock, LW_EXCLUSIVE);
+	for (i = tracker->nrecovered - 1; i >= 0; i--) {
+		if (tracker->recovered[i].recoverer == MyProcPid) {
+			unrecover(&tracker->recovered[i]);
+			abandoned = true;
+		}
+	}
+	LWLockRelease(tracker->lock);
+
+	if (abandoned)
+		ConditionVariableBroadcast(&tracker->cv);
+}
+
+/*lint -esym 715,code,arg ignore unused param */
+static void xact_tracker_exit_callback(int code, Datum arg) {
+	abandon_recoveries();
+}
+
+/*
+ * Ask for our shared memory.  Only possible when we're being loaded via shared_preload_libraries
+ */
+void xact_tracker_init(void) {
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	/* MaxBackends isn't computed yet, so do what it will */
+	trackerEntries = (MaxConnections + autovacuum_max_workers + 1 + max_worker_processes +
+					  max_prepared_xacts) * XACT_TRACKER_XIDS_PER_BACKEND;
+
+	RequestAddinShmemSpace(xact_tracker_shmem_size());
+	RequestNamedLWLockTranche("zombodb xact tracker", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook      = xact_tracker_shmem_startup;
+}
+
+bool xact_tracker_enabled(void) {
+	return tracker != NULL;
+}
+
+/*
+ * Remember that our transaction, or one of its subtransactions, is writing to an index.  Returns
+ * false if we can't, in which case the caller needs to tell Elasticsearch itself
+ */
+bool xact_tracker_track(Oid indexRelid, TransactionId xid) {
+	if (tracker == NULL || MyBackendId == InvalidBackendId)
+		return false;
+
+	return track(indexRelid, xid, MyBackendId);
+}
+
+/*
+ * Remember a prepared transaction we found in an index, which no backend owns
+ */
+void xact_tracker_track_prepared(Oid indexRelid, TransactionId xid) {
+	if (tracker == NULL)
+		return;
+
+	if (!track(indexRelid, xid, InvalidBackendId))
+		elog(ERROR, "[zombodb] too many transactions are writing to ZomboDB indexes to track prepared transaction %u", xid);
+}
+
+/*
+ * Our transaction is over.  Whatever of it committed can be forgotten.  Whatever didn't, or
+ * is just prepared, stays until VACUUM has told Elasticsearch about it
+ */
+void xact_tracker_end_xact(void) {
+	int i;
+
+	if (tracker == NULL || localTracked == 0)
+		return;
+
+	LWLockAcquire(tracker->lock, LW_EXCLUSIVE);
+	for (i = tracker->ntracked - 1; i >= 0; i--) {
+		TrackedXid *entry = &tracker->tracked[i];
+
+		if (entry->owner != MyBackendId)
+			continue;
+
+		if (TransactionIdDidCommit(entry->xid))
+			untrack(i);
+		else
+			entry->owner = InvalidBackendId;
+	}
+	LWLockRelease(tracker->lock);
+
+	localTracked = 0;
+}
+
+/*
+ * The transactions, other than our own, that wrote to an index and haven't committed (yet),
+ * and that Elasticsearch doesn't know about
+ */
+int xact_tracker_unresolved(Oid indexRelid, TransactionId **xids) {
+	int many = 0;
+	int cnt  = 0;
+	int i;
+
+	*xids = NULL;
+	if (tracker == NULL)
+		return 0;
+
+	LWLockAcquire(tracker->lock, LW_SHARED);
+	for (i = 0; i < tracker->ntracked; i++) {
+		TrackedXid *entry = &tracker->tracked[i];
+
+		if (entry->indexRelid == indexRelid && entry->dbOid == MyDatabaseId) {
+			if (*xids == NULL)
+				*xids = palloc(sizeof(TransactionId) * tracker->ntracked);
+			(*xids)[many++] = entry->xid;
+		}
+	}
+	LWLockRelease(tracker->lock);
+
+	/* no need to hold the lock while we look at the commit log */
+	for (i = 0; i < many; i++) {
+		TransactionId xid = (*xids)[i];
+
+		if (TransactionIdIsCurrentTransactionId(xid) || TransactionIdDidCommit(xid))
+			continue;
+
+		(*xids)[cnt++] = xid;
+	}
+
+	return cnt;
+}
+
+/*
+ * VACUUM has told Elasticsearch about every transaction before 'horizon' that didn't commit,
+ * so we don't need to remember them anymore
+ */
+void xact_tracker_forget(Oid indexRelid, TransactionId horizon) {
+	int i;
+
+	if (tracker == NULL)
+		return;
+
+	LWLockAcquire(tracker->lock, LW_EXCLUSIVE);
+	for (i = tracker->ntracked - 1; i >= 0; i--) {
+		TrackedXid *entry = &tracker->tracked[i];
+
+		if (entry->owner == InvalidBackendId && entry->indexRelid == indexRelid && entry->dbOid == MyDatabaseId &&
+			TransactionIdPrecedes(entry->xid, horizon))
+			untrack(i);
+	}
+	LWLockRelease(tracker->lock);
+}
+
+/*
+ * Do we know which transactions that wrote to the index didn't commit before Postgres started?
+ * 'until' is set to the first xid handed out since.
+ *
+ * If no one has found them yet, it's up to the caller, who must then call xact_tracker_end_recovery().
+ * If another backend is already at it, we wait for it to finish.  If we can't remember them all,
+ * the caller has to assume every xid before 'until' that didn't commit might be in the index
+ */
+XactTrackerRecovery xact_tracker_begin_recovery(Oid indexRelid, TransactionId *until) {
+	XactTrackerRecovery recovery = XACT_TRACKER_RECOVERED;
+
+	*until = InvalidTransactionId;
+	if (tracker == NULL)
+		return XACT_TRACKER_RECOVERED;
+
+	if (!exitCallbackRegistered) {
+		before_shmem_exit(xact_tracker_exit_callback, (Datum) 0);
+		exitCallbackRegistered = true;
+	}
+
+	for (;;) {
+		RecoveredIndex *entry;
+		bool           wait = false;
+
+		LWLockAcquire(tracker->lock, LW_EXCLUSIVE);
+		note_startup_xid();
+		*until = tracker->startupXid;
+
+		entry = find_recovered(indexRelid);
+		if (entry == NULL) {
+			if (tracker->nrecovered < XACT_TRACKER_MAX_RECOVERED) {
+				entry = &tracker->recovered[tracker->nrecovered++];
+				entry->dbOid      = MyDatabaseId;
+				entry->indexRelid = indexRelid;
+				entry->recoverer  = MyProcPid;
+				entry->overflowed = false;
+				recovery = XACT_TRACKER_RECOVER;
+			} else {
+				recovery = XACT_TRACKER_UNRECOVERABLE;
+			}
+		} else if (entry->recoverer != 0) {
+			wait = true;
+		} else {
+			recovery = entry->overflowed ? XACT_TRACKER_UNRECOVERABLE : XACT_TRACKER_RECOVERED;
+		}
+		LWLockRelease(tracker->lock);
+
+		if (!wait)
+			break;
+
+		ConditionVariableSleep(&tracker->cv, PG_WAIT_EXTENSION);
+	}
+	ConditionVariableCancelSleep();
+
+	return recovery;
+}
+
+/*
+ * The recovery xact_tracker_begin_recovery() asked us to do is over, and these are the xids that
+ * wrote to the index and didn't commit.  If it didn't work, whoever queries the index next will
+ * try again.  Returns false if we can't remember them all
+ */
+bool xact_tracker_end_recovery(Oid indexRelid, TransactionId *xids, int nxids, bool recovered) {
+	RecoveredIndex *entry;
+	bool           overflowed = false;
+	int            i;
+
+	if (tracker == NULL)
+		return true;
+
+	LWLockAcquire(tracker->lock, LW_EXCLUSIVE);
+	entry = find_recovered(indexRelid);
+	if (entry != NULL && entry->recoverer == MyProcPid) {
+		if (recovered) {
+			for (i = 0; i < nxids; i++) {
+				if (!track_locked(indexRelid, xids[i], InvalidBackendId)) {
+					overflowed = true;
+					break;
+				}
+			}
+			entry->overflowed = overflowed;
+			entry->recoverer  = 0;
+		} else {
+			unrecover(entry);
+		}
+	}
+	LWLockRelease(tracker->lock);
+
+	ConditionVariableBroadcast(&tracker->cv);
+
+	if (overflowed)
+		elog(LOG, "[zombodb] too many transactions that didn't commit before Postgres started to track for index %u",
+			 indexRelid);
+
+	return !overflowed;
+}
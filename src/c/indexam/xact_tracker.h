@@ -0,0 +1,44 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZDB_XACT_TRACKER_H__
+#define __ZDB_XACT_TRACKER_H__
+
+#include "postgres.h"
+
+/* how many transactions, per backend, we can remember wrote to an index */
+#define XACT_TRACKER_XIDS_PER_BACKEND 32
+
+/* the most indexes we can remember recovering since Postgres started */
+#define XACT_TRACKER_MAX_RECOVERED 1024
+
+typedef enum XactTrackerRecovery {
+	XACT_TRACKER_RECOVERED,        /* the tracker knows about everything before Postgres started */
+	XACT_TRACKER_RECOVER,          /* the caller needs to find out, and tell xact_tracker_end_recovery() */
+	XACT_TRACKER_UNRECOVERABLE     /* the tracker can't remember it, so assume the worst */
+} XactTrackerRecovery;
+
+void xact_tracker_init(void);
+bool xact_tracker_enabled(void);
+bool xact_tracker_track(Oid indexRelid, TransactionId xid);
+void xact_tracker_track_prepared(Oid indexRelid, TransactionId xid);
+void xact_tracker_end_xact(void);
+int xact_tracker_unresolved(Oid indexRelid, TransactionId **xids);
+void xact_tracker_forget(Oid indexRelid, TransactionId horizon);
+XactTrackerRecovery xact_tracker_begin_recovery(Oid indexRelid, TransactionId *until);
+bool xact_tracker_end_recovery(Oid indexRelid, TransactionId *xids, int nxids, bool recovered);
+
+#endif /* __ZDB_XACT_TRACKER_H__ */
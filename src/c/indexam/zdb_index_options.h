@@ -40,6 +40,8 @@ typedef struct {
 	int   uuidOffset;
 	int   optimizeAfter;
 	bool  llapi;
+	int   bulkFormatOffset;
+	bool  tombstones;
 } ZDBIndexOptions;
 
 #define ZDBIndexOptionsGetUrlMacro(relation) \
@@ -97,6 +99,13 @@ static inline char *ZDBIndexOptionsGetUrl(Relation rel) {
 #define ZDBIndexOptionsGetLLAPI(relation) \
     ((bool) ((relation)->rd_options ? ((ZDBIndexOptions *) (relation)->rd_options)->llapi : false))
 
+#define ZDBIndexOptionsGetBulkFormat(relation) \
+    ((relation)->rd_options && ((ZDBIndexOptions *) (relation)->rd_options)->bulkFormatOffset > 0 ? \
+      (char *) ((ZDBIndexOptions *) (relation)->rd_options) + ((ZDBIndexOptions *) (relation)->rd_options)->bulkFormatOffset : ("json"))
+
+#define ZDBIndexOptionsGetTombstones(relation) \
+    ((bool) ((relation)->rd_options ? ((ZDBIndexOptions *) (relation)->rd_options)->tombstones : false))
+
 #define ZDBIndexOptionsGetOptimizeAfter(relation) \
     ((uint64) ((relation)->rd_options ? ((ZDBIndexOptions *) (relation)->rd_options)->optimizeAfter : 0))
 
@@ -15,27 +15,39 @@
  */
 
 #include "zdbam.h"
+#include "xact_tracker.h"
 
 #include "elasticsearch/querygen.h"
+#include "elasticsearch/refresh_coordinator.h"
 #include "highlighting/highlighting.h"
 #include "scoring/scoring.h"
 
 #include "access/amapi.h"
+#include "access/parallel.h"
 #include "access/reloptions.h"
 #include "access/relscan.h"
+#include "access/transam.h"
 #include "access/xact.h"
 #include "catalog/index.h"
 #include "catalog/pg_trigger.h"
 #include "commands/tablecmds.h"
 #include "executor/spi.h"
+#include "mb/pg_wchar.h"
 #include "optimizer/cost.h"
 #include "parser/parse_func.h"
+#include "port/atomics.h"
+#include "postmaster/postmaster.h"
 #include "tcop/utility.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
 #include "storage/procarray.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/snapmgr.h"
 #include "utils/lsyscache.h"
 
+#include <math.h>
+
 static const struct config_enum_entry zdb_log_level_options[] = {
 		{"debug",   DEBUG2,  true},
 		{"debug5",  DEBUG5,  false},
@@ -56,6 +68,29 @@ typedef struct ZDBBuildStateData {
 	MemoryContext            memoryContext;
 }                                     ZDBBuildStateData;
 
+/* the shm_toc key for our ZDBParallelBuildShared */
+#define PARALLEL_KEY_ZDB_BUILD UINT64CONST(0xA000000000000001)
+
+/* how many heap blocks a parallel CREATE INDEX participant claims at a time */
+#define PARALLEL_BUILD_CHUNK_BLOCKS 1024
+
+/*
+ * What the participants in a parallel CREATE INDEX share.  Each claims the next range of heap blocks
+ * until there are none left, and adds its tuple counts here once its batches are all in Elasticsearch
+ */
+typedef struct ZDBParallelBuildShared {
+	Oid              heapRelid;
+	Oid              indexRelid;
+	BlockNumber      nblocks;
+	pg_atomic_uint64 nextBlock;
+
+	slock_t          mutex;              /* protects the counts */
+	double           reltuples;
+	double           indtuples;
+
+	char             indexName[FLEXIBLE_ARRAY_MEMBER];
+}                                     ZDBParallelBuildShared;
+
 typedef struct ZDBScanContext {
 	bool                       needsInit;
 	ElasticsearchScrollContext *scrollContext;
@@ -66,8 +101,25 @@ typedef struct ZDBScanContext {
 	bool                       wantScores;
 	bool                       wantHighlights;
 	ZDBQueryType               *query;
+
+	/* what we opened the scroll with, so a parallel scan can open the next slice the same way */
+	bool                       needSort;
+	char                       *sortField;
+	SortByDir                  sortdir;
+	uint64                     limit;
+	List                       *highlights;
 }                                     ZDBScanContext;
 
+/*
+ * What the participants in a parallel index scan share.  Each claims a slice of the query's
+ * Elasticsearch scroll at a time, until there are none left
+ */
+typedef struct ZDBParallelScanShared {
+	slock_t mutex;
+	int     nslices;      /* how many slices the scroll is split into, or zero until someone decides */
+	int     nextSlice;    /* the next one nobody has claimed */
+}                                     ZDBParallelScanShared;
+
 PG_FUNCTION_INFO_V1(zdb_delete_trigger);
 PG_FUNCTION_INFO_V1(zdb_update_trigger);
 
@@ -86,8 +138,15 @@ static void amrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
 static bool amgettuple(IndexScanDesc scan, ScanDirection direction);
 static void amendscan(IndexScanDesc scan);
 static int64 amgetbitmap(IndexScanDesc scan, TIDBitmap *tbm);
+static Size amestimateparallelscan(void);
+static void aminitparallelscan(void *target);
+static void amparallelrescan(IndexScanDesc scan);
 
 static void zdbbuildCallback(Relation indexRel, HeapTuple htup, Datum *values, bool *isnull, bool tupleIsAlive, void *state);
+static int plan_parallel_build(Relation heapRelation);
+static double parallel_build(Relation heapRelation, Relation indexRelation, IndexInfo *indexInfo, char *indexName, int nworkers, ZDBBuildStateData *buildstate);
+static double build_block_ranges(Relation heapRelation, Relation indexRelation, IndexInfo *indexInfo, ZDBParallelBuildShared *shared, ZDBBuildStateData *buildstate);
+PGDLLEXPORT void zdb_parallel_build_main(dsm_segment *seg, shm_toc *toc);
 static void index_record(ElasticsearchBulkContext *esContext, MemoryContext scratchContext, ItemPointer ctid, Datum record, HeapTuple htup);
 
 static void apply_alter_statement(PlannedStmt *parsetree, char *url, uint32 shards, char *typeName, char *oldAlias, char *oldUUID);
@@ -130,10 +189,25 @@ static void validate_uuid(char *str) {
 	/* noop */
 }
 
+static void validate_bulk_format(char *str) {
+	if (str == NULL || strcmp("json", str) == 0)
+		return;
+
+	if (strcmp("smile", str) == 0) {
+		/* Smile strings must be UTF8, and that's also what guarantees they never contain its 0xFF document separator */
+		if (GetDatabaseEncoding() != PG_UTF8)
+			elog(ERROR, "'bulk_format' index option 'smile' requires a UTF8 database");
+		return;
+	}
+
+	elog(ERROR, "'bulk_format' index option must be 'json' or 'smile'");
+}
+
 
 PG_FUNCTION_INFO_V1(zdb_amhandler);
 
-static List                     *insert_contexts        = NULL;
+static HTAB                     *insert_contexts        = NULL;    /* ZDBIndexChangeContexts, by index relid */
+static List                     *bulk_streams           = NULL;    /* the ElasticsearchBulkStreams they share */
 static List                     *touched_indexes        = NULL;
 static List                     *to_drop                = NULL;
 static ExecutorStart_hook_type  prev_ExecutorStartHook  = NULL;
@@ -144,11 +218,34 @@ static ProcessUtility_hook_type prev_ProcessUtilityHook = NULL;
 static int                      executor_depth          = 0;
 static MemoryContext            TopQueryContext         = NULL;
 
+/* how many ctids our UPDATE/DELETE triggers collect for an index before we send them along */
+#define PENDING_XMAX_CTIDS 8192
+
+/*
+ * The rows our UPDATE/DELETE triggers have seen for an index that we haven't yet added to
+ * its bulk context.  They're all from the same command, so they all get the same cmax/xmax
+ */
+typedef struct ZDBPendingXmax {
+	Oid             triggerOid;
+	Oid             indexRelid;
+	CommandId       cmax;
+	uint64          xmax;
+	int             nctids;
+	ItemPointerData ctids[PENDING_XMAX_CTIDS];
+} ZDBPendingXmax;
+
+static List           *pending_xmax      = NULL;
+static ZDBPendingXmax *last_pending_xmax = NULL;
+
 bool zdb_batch_mode_guc;
 int  ZDB_LOG_LEVEL;
 char *zdb_default_elasticsearch_url_guc;
 int  zdb_default_row_estimation_guc;
 bool zdb_curl_verbose_guc;
+bool zdb_bulk_io_thread_guc;
+int  zdb_max_concurrent_bulk_requests_guc;
+int  zdb_max_bulk_memory_guc;
+int  zdb_max_parallel_build_workers_guc;
 bool zdb_ignore_visibility_guc;
 int  zdb_default_replicas_guc;
 
@@ -156,23 +253,71 @@ relopt_kind RELOPT_KIND_ZDB;
 
 List *currentQueryStack = NULL;
 
-static void finish_inserts() {
+/*
+ * Hand the rows our triggers have collected for an index to its bulk context, opening
+ * the index just the once
+ */
+static void flush_pending_xmax(ZDBPendingXmax *pending) {
+	MemoryContext         oldContext;
+	ZDBIndexChangeContext *context;
+	Relation              indexRel;
+
+	if (pending->nctids == 0)
+		return;
+
+	oldContext = MemoryContextSwitchTo(IsBatchMode() || TopQueryContext == NULL ? TopTransactionContext : TopQueryContext);
+	indexRel   = zdb_open_index(pending->indexRelid, AccessShareLock);
+
+	context = checkout_insert_context(indexRel, PointerGetDatum(NULL), true);
+	track_xid(context, (TransactionId) pending->xmax);
+	ElasticsearchBulkUpdateTuples(context->esContext, pending->ctids, pending->nctids, pending->cmax, pending->xmax);
+	pending->nctids = 0;
+
+	relation_close(indexRel, AccessShareLock);
+	MemoryContextSwitchTo(oldContext);
+}
+
+static void flush_all_pending_xmax(void) {
 	ListCell *lc;
 
-	foreach (lc, insert_contexts) {
-		ZDBIndexChangeContext *context = lfirst(lc);
+	foreach (lc, pending_xmax) {
+		flush_pending_xmax(lfirst(lc));
+	}
+}
 
-		if (IsBatchMode() && context->esContext->nrequests == 0) {
-			ElasticsearchBulkMarkTransactionCommitted(context->esContext);
+static void finish_inserts() {
+	HASH_SEQ_STATUS       seq;
+	ZDBIndexChangeContext *context;
+
+	if (IsBatchMode()) {
+		hash_seq_init(&seq, insert_contexts);
+		while ((context = hash_seq_search(&seq)) != NULL) {
+			if (context->esContext->stream->nrequests == 0 && list_member_oid(touched_indexes, context->indexRelid)) {
+				ElasticsearchBulkMarkTransactionCommitted(context->esContext);
 
-			/* no ned to remember this index anymore as we're able to mark it as committed in the only batch */
-			touched_indexes = list_delete_oid(touched_indexes, context->indexRelid);
+				/* no ned to remember this index anymore as we're able to mark it as committed in the only batch */
+				touched_indexes = list_delete_oid(touched_indexes, context->indexRelid);
+			}
 		}
+	}
+
+	/*
+	 * get every stream's last batch going before we wait for any of them.  Indexes share streams,
+	 * so we can't do this until nothing else is going to be added to any of them
+	 */
+	hash_seq_init(&seq, insert_contexts);
+	while ((context = hash_seq_search(&seq)) != NULL) {
+		ElasticsearchBulkSendFinal(context->esContext);
+	}
 
+	hash_seq_init(&seq, insert_contexts);
+	while ((context = hash_seq_search(&seq)) != NULL) {
 		ElasticsearchFinishBulkProcess(context->esContext);
 	}
 
+	hash_destroy(insert_contexts);
 	insert_contexts = NULL;
+	bulk_streams    = NULL;
 }
 
 /*lint -esym 715,arg ignore unused param */
@@ -182,10 +327,15 @@ static void xact_commit_callback(XactEvent event, void *arg) {
 		case XACT_EVENT_PRE_COMMIT:
 		case XACT_EVENT_PARALLEL_PRE_COMMIT:
 		case XACT_EVENT_PRE_PREPARE: {
+			List     *committed = NIL;
+			List     *refresh   = NIL;
 			ListCell *lc;
 
 			HOLD_INTERRUPTS();
 
+			/* our triggers only collect rows during a statement, so this is just in case */
+			flush_all_pending_xmax();
+
 			if (IsBatchMode() && insert_contexts != NULL) {
 				/*
 				 * this might remove entries from 'touched_indexes' if they mark-as-committed doc
@@ -195,20 +345,29 @@ static void xact_commit_callback(XactEvent event, void *arg) {
 			}
 
 			/*
-			 * For any indexes we touched that need to have this transaction id marked as committed,
-			 * do that now
+			 * For any indexes we touched that we couldn't track in shared memory, and so need to have
+			 * this transaction id marked as committed, do that now
 			 */
 			foreach(lc, touched_indexes) {
-				Oid      relid    = lfirst_oid(lc);
-				Relation indexRel = RelationIdGetRelation(relid);
+				committed = lappend(committed, RelationIdGetRelation(lfirst_oid(lc)));
+			}
 
-				ElasticsearchCommitCurrentTransaction(indexRel);
-				RelationClose(indexRel);
+			/* other backends can't know to refresh these indexes before searching them, so we do it now */
+			foreach(lc, refresh_coordinator_unshared()) {
+				Relation indexRel = RelationIdGetRelation(lfirst_oid(lc));
+
+				if (RelationIsValid(indexRel))
+					refresh = lappend(refresh, indexRel);
 			}
 
-			foreach(lc, to_drop) {
-				char *index_url = lfirst(lc);
-				ElasticsearchDeleteIndexDirect(index_url);
+			/* all at once, along with deleting the Elasticsearch indexes of those we dropped */
+			ElasticsearchFinishTransaction(committed, refresh, to_drop);
+
+			foreach(lc, committed) {
+				RelationClose(lfirst(lc));
+			}
+			foreach(lc, refresh) {
+				RelationClose(lfirst(lc));
 			}
 
 			RESUME_INTERRUPTS();
@@ -218,6 +377,17 @@ static void xact_commit_callback(XactEvent event, void *arg) {
 			break;
 	}
 
+	/* whatever of our transaction committed no longer needs tracking */
+	switch (event) {
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PREPARE:
+			xact_tracker_end_xact();
+			break;
+		default:
+			break;
+	}
+
 	/* reset per-transaction state in any of the xact completion states */
 	switch (event) {
 		case XACT_EVENT_ABORT:
@@ -227,10 +397,15 @@ static void xact_commit_callback(XactEvent event, void *arg) {
 		case XACT_EVENT_PREPARE:
 			executor_depth    = 0;
 			insert_contexts   = NULL;
+			bulk_streams      = NULL;
 			touched_indexes   = NULL;
 			to_drop           = NULL;
+			pending_xmax      = NULL;
+			last_pending_xmax = NULL;
 			currentQueryStack = NULL;
 			TopQueryContext   = NULL;
+			refresh_coordinator_end_xact();
+			ElasticsearchAbandonOpenScrolls();
 			break;
 		default:
 			break;
@@ -299,6 +474,9 @@ static void zdb_executor_end_hook(QueryDesc *queryDesc) {
 	 */
 	if (executor_depth == 0) {
 
+		/* the rows our UPDATE/DELETE triggers saw need to be in their indexes' bulk contexts */
+		flush_all_pending_xmax();
+
 		/* if we've inserted into some indexes and we're not in batch mode, then process the inserts */
 		if (insert_contexts != NULL && !IsBatchMode()) {
 			finish_inserts();
@@ -515,6 +693,8 @@ static void zdb_process_utility_hook(PlannedStmt *parsetree, const char *querySt
 	PG_END_TRY();
 
 	if (executor_depth == 0) {
+		flush_all_pending_xmax();
+
 		/*
 		 * If the statement has finished and we've inserted into some indexes and we're not
 		 * in batch mode, then process the inserts
@@ -532,56 +712,67 @@ static void zdb_process_utility_hook(PlannedStmt *parsetree, const char *querySt
 	}
 }
 
-static void touch_index(Relation indexRelation, ElasticsearchBulkContext *context) {
-	MemoryContext oldContext;
+/*
+ * Make sure everyone will know that 'xid' wrote to the index and hasn't committed, until it
+ * does.  If it aborts, they'll keep knowing that until VACUUM tells Elasticsearch.
+ *
+ * Normally that's what our shared memory xact tracker is for.  If we can't use it, we mark the
+ * transaction as in-progress within Elasticsearch, and as committed during xact commit
+ */
+void track_xid(ZDBIndexChangeContext *context, TransactionId xid) {
+	if (context->trackedXid == xid)
+		return;
+	context->trackedXid = xid;
 
-	/*
-	 * remember that we're touching this index so we can mark our transaction as committed upon COMMIT
-	 *
-	 * That's also why we switch to TopTransactionContext -- we need this to survive until xact commit
-	 */
+	if (xact_tracker_track(context->indexRelid, xid))
+		return;
 
-	oldContext = MemoryContextSwitchTo(TopTransactionContext);
+	if (!list_member_oid(touched_indexes, context->indexRelid)) {
+		MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
 
-	if (!list_member_oid(touched_indexes, RelationGetRelid(indexRelation))) {
-		/*
-		 * this is the first time we've touched this index during this transaction
-		 * so we need to remember it and also mark the transaction as in-progress
-		 * within Elasticsearch
-		 */
-		touched_indexes = lappend_oid(touched_indexes, RelationGetRelid(indexRelation));
-		ElasticsearchBulkMarkTransactionInProgress(context);
-	}
+		/* remember that we're touching this index so we can mark our transaction as committed upon COMMIT */
+		touched_indexes = lappend_oid(touched_indexes, context->indexRelid);
+		ElasticsearchBulkMarkTransactionInProgress(context->esContext);
 
-	MemoryContextSwitchTo(oldContext);
+		MemoryContextSwitchTo(oldContext);
+	}
 }
 
 ZDBIndexChangeContext *checkout_insert_context(Relation indexRelation, Datum row, bool isnull) {
-	ListCell              *lc;
-	ZDBIndexChangeContext *context;
-	TupleDesc             tupdesc = NULL;
+	Oid                      indexRelid = RelationGetRelid(indexRelation);
+	ZDBIndexChangeContext    *context;
+	ElasticsearchBulkContext *esContext;
+	TupleDesc                tupdesc    = NULL;
 
-	/* see if we already have an IndexChangeContext for this index */
-	foreach (lc, insert_contexts) {
-		context = lfirst(lc);
-		if (context->indexRelid == RelationGetRelid(indexRelation)) {
+	if (insert_contexts == NULL) {
+		HASHCTL ctl;
 
-			/*
-			 * we need to check to see if the TupleDesc that describes
-			 * what we're indexing contains a column of type ::json
-			 *
-			 * ElasticsearchStartBulkProcess() does this too, but we could
-			 * have called it with a NULL TupleDesc from our BEFORE UPDATE or DELETE
-			 * triggers, and then got here again via an INSERT (or UPDATE) when
-			 * we actually know the Datum being indexed
-			 */
-			if (!isnull && !context->esContext->containsJsonIsSet) {
-				context->esContext->containsJson      = datum_contains_json(row);
-				context->esContext->containsJsonIsSet = true;
-			}
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize   = sizeof(Oid);
+		ctl.entrysize = sizeof(ZDBIndexChangeContext);
+		ctl.hcxt      = CurrentMemoryContext;
+		insert_contexts = hash_create("zombodb insert contexts", 32, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
 
-			return context;
+	/* see if we already have an IndexChangeContext for this index */
+	context = hash_search(insert_contexts, &indexRelid, HASH_FIND, NULL);
+	if (context != NULL) {
+
+		/*
+		 * we need to check to see if the TupleDesc that describes
+		 * what we're indexing contains a column of type ::json
+		 *
+		 * ElasticsearchStartSharedBulkProcess() does this too, but we could
+		 * have called it with a NULL TupleDesc from our BEFORE UPDATE or DELETE
+		 * triggers, and then got here again via an INSERT (or UPDATE) when
+		 * we actually know the Datum being indexed
+		 */
+		if (!isnull && !context->esContext->containsJsonIsSet) {
+			context->esContext->containsJson      = datum_contains_json(row);
+			context->esContext->containsJsonIsSet = true;
 		}
+
+		return context;
 	}
 
 	/*
@@ -591,17 +782,19 @@ ZDBIndexChangeContext *checkout_insert_context(Relation indexRelation, Datum row
 	if (!isnull)
 		tupdesc = lookup_composite_tupdesc(row);
 
-	context = palloc(sizeof(ZDBIndexChangeContext));
-	context->indexRelid = RelationGetRelid(indexRelation);
+	/* the index's changes go out in the same batches as those of the other indexes we're changing on its cluster */
+	esContext = ElasticsearchStartSharedBulkProcess(indexRelation, tupdesc, &bulk_streams);
+
+	context = hash_search(insert_contexts, &indexRelid, HASH_ENTER, NULL);
+	context->trackedXid = InvalidTransactionId;
 	context->scratch    = AllocSetContextCreate(TopTransactionContext, "aminsert scratch context",
 												ALLOCSET_DEFAULT_MINSIZE,
 												ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
-	context->esContext  = ElasticsearchStartBulkProcess(indexRelation, NULL, tupdesc, false);
+	context->esContext  = esContext;
 
-	insert_contexts = lappend(insert_contexts, context);
-
-	/* note that we're touching this index for cleanup during xact commit */
-	touch_index(indexRelation, context->esContext);
+	/* in batch mode, rows can be indexed and then updated or deleted before their batch goes out */
+	if (IsBatchMode())
+		ElasticsearchBulkEnableCoalescing(context->esContext);
 
 	if (tupdesc != NULL)
 		ReleaseTupleDesc(tupdesc);
@@ -662,12 +855,26 @@ void zdb_aminit(void) {
 							 &zdb_batch_mode_guc, false, PGC_USERSET, 0, NULL, NULL, NULL);
 	DefineCustomBoolVariable("zdb.curl_verbose", "Put libcurl into verbose mode", NULL,
 							 &zdb_curl_verbose_guc, false, PGC_USERSET, 0, NULL, NULL, NULL);
+	DefineCustomBoolVariable("zdb.bulk_io_thread",
+							 "Compress and send bulk indexing requests from a helper thread", NULL,
+							 &zdb_bulk_io_thread_guc, false, PGC_USERSET, 0, NULL, NULL, NULL);
+	DefineCustomIntVariable("zdb.max_concurrent_bulk_requests",
+							"The most bulk indexing requests all backends may have in flight to one Elasticsearch URL",
+							NULL, &zdb_max_concurrent_bulk_requests_guc, 0, 0, INT_MAX, PGC_SIGHUP, 0, NULL, NULL,
+							NULL);
+	DefineCustomIntVariable("zdb.max_bulk_memory",
+							"The most memory a backend may use for the bulk indexing requests it's building and sending",
+							NULL, &zdb_max_bulk_memory_guc, 1024 * 1024, 0, INT_MAX, PGC_USERSET, GUC_UNIT_KB, NULL,
+							NULL, NULL);
 	DefineCustomEnumVariable("zdb.log_level", "ZomboDB's logging level", NULL, &ZDB_LOG_LEVEL, DEBUG1,
 							 zdb_log_level_options, PGC_USERSET, 0, NULL, NULL, NULL);
 	DefineCustomStringVariable("zdb.default_elasticsearch_url",
 							   "The default Elasticsearch URL ZomboDB should use if not specified on the index", NULL,
 							   &zdb_default_elasticsearch_url_guc, NULL, PGC_SIGHUP, 0,
 							   validate_default_elasticsearch_url, NULL, NULL);
+	DefineCustomIntVariable("zdb.max_parallel_build_workers",
+							"The most background workers CREATE INDEX may use to help scan the table", NULL,
+							&zdb_max_parallel_build_workers_guc, 0, 0, MAX_BACKENDS, PGC_USERSET, 0, NULL, NULL, NULL);
 	DefineCustomIntVariable("zdb.default_row_estimate",
 							"The default row estimate ZDB should use", NULL,
 							&zdb_default_row_estimation_guc, 2500, -1, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
@@ -701,6 +908,11 @@ void zdb_aminit(void) {
 	add_int_reloption(RELOPT_KIND_ZDB, "optimize_after",
 					  "After how many deleted docs should ZDB _optimize the ES index during VACUUM?", 0, 0, INT32_MAX);
 	add_bool_reloption(RELOPT_KIND_ZDB, "llapi", "Will this index be used by ZomboDB's low-level API?", false);
+	add_string_reloption(RELOPT_KIND_ZDB, "bulk_format", "The encoding of documents sent to the _bulk API: json or smile",
+						 "json", validate_bulk_format);
+	add_bool_reloption(RELOPT_KIND_ZDB, "tombstones",
+					   "Record UPDATEs and DELETEs as small tombstone documents rather than by updating the row's document",
+					   false);
 
 	/* register xact callbacks and planner hooks */
 	RegisterXactCallback(xact_commit_callback, NULL);
@@ -734,7 +946,7 @@ Datum zdb_amhandler(PG_FUNCTION_ARGS) {
 	amroutine->amstorage      = false;
 	amroutine->amclusterable  = false;
 	amroutine->ampredlocks    = false;
-	amroutine->amcanparallel  = false;
+	amroutine->amcanparallel  = true;
 
 	amroutine->amkeytype              = InvalidOid;
 	amroutine->amvalidate             = zdbamvalidate;
@@ -754,9 +966,9 @@ Datum zdb_amhandler(PG_FUNCTION_ARGS) {
 	amroutine->amendscan              = amendscan;
 	amroutine->ammarkpos              = NULL;
 	amroutine->amrestrpos             = NULL;
-	amroutine->amestimateparallelscan = NULL;
-	amroutine->aminitparallelscan     = NULL;
-	amroutine->amparallelrescan       = NULL;
+	amroutine->amestimateparallelscan = amestimateparallelscan;
+	amroutine->aminitparallelscan     = aminitparallelscan;
+	amroutine->amparallelrescan       = amparallelrescan;
 
 	PG_RETURN_POINTER(amroutine);
 }
@@ -774,6 +986,8 @@ static IndexBuildResult *ambuild(Relation heapRelation, Relation indexRelation,
 	TupleDesc         tupdesc;
 	char              *aliasName = ZDBIndexOptionsGetAlias(indexRelation);
 	char              *indexName;
+	int               nworkers;
+	TransactionId     horizon;
 
 	if (ZDBIndexOptionsGetIndexName(indexRelation) != NULL && ZDBIndexOptionsGetLLAPI(indexRelation) == true) {
 		/*
@@ -813,12 +1027,22 @@ static IndexBuildResult *ambuild(Relation heapRelation, Relation indexRelation,
 													 ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
 	buildstate.esContext     = ElasticsearchStartBulkProcess(indexRelation, indexName, tupdesc, false);
 
+	/* every transaction before this one has committed or aborted, and we only index the rows of those that committed */
+	horizon = GetOldestXmin(heapRelation, PROCARRAY_FLAGS_VACUUM);
+
 	/*
-	 * Now we insert data into our index
+	 * Now we insert data into our index, with help from some background workers if we can
 	 */
-	reltuples = IndexBuildHeapScan(heapRelation, indexRelation, indexInfo, true, zdbbuildCallback, &buildstate);
+	nworkers = plan_parallel_build(heapRelation);
+	if (nworkers > 0)
+		reltuples = parallel_build(heapRelation, indexRelation, indexInfo, indexName, nworkers, &buildstate);
+	else
+		reltuples = IndexBuildHeapScan(heapRelation, indexRelation, indexInfo, true, zdbbuildCallback, &buildstate);
 	ElasticsearchFinishBulkProcess(buildstate.esContext);
 
+	/* so VACUUM knows where to start reconciling xids */
+	ElasticsearchRecordAbortedTransactions(indexRelation, NULL, 0, convert_xid(horizon));
+
 	/* Finish up with elasticsearch index creation */
 	ElasticsearchFinalizeIndexCreation(indexRelation);
 
@@ -850,6 +1074,142 @@ static IndexBuildResult *ambuild(Relation heapRelation, Relation indexRelation,
 
 }
 
+/*
+ * How many background workers should help build this index?  Zero if we shouldn't use any
+ */
+static int plan_parallel_build(Relation heapRelation) {
+	BlockNumber nblocks;
+	BlockNumber nranges;
+
+	if (zdb_max_parallel_build_workers_guc <= 0 || !IsUnderPostmaster || IsInParallelMode())
+		return 0;
+
+	/* workers can't see a temp table's buffers */
+	if (RelationUsesLocalBuffers(heapRelation))
+		return 0;
+
+	/* workers need the leader's snapshot, and VACUUM FULL, for one, doesn't have one */
+	if (!ActiveSnapshotSet())
+		return 0;
+
+	nblocks = RelationGetNumberOfBlocks(heapRelation);
+	nranges = (nblocks + PARALLEL_BUILD_CHUNK_BLOCKS - 1) / PARALLEL_BUILD_CHUNK_BLOCKS;
+
+	/* the leader scans ranges too, so there's no point in more workers than the ranges it won't get */
+	return (int) Min((BlockNumber) zdb_max_parallel_build_workers_guc, nranges > 0 ? nranges - 1 : 0);
+}
+
+/*
+ * Scan the heap with the help of some background workers.  Each one sends the rows it finds to
+ * Elasticsearch with its own bulk context, and so does the leader, with the one in buildstate.
+ *
+ * The workers share our transaction, so they see the heap exactly as we do, and they've all
+ * finished (and their rows are in Elasticsearch) when we return
+ */
+static double parallel_build(Relation heapRelation, Relation indexRelation, IndexInfo *indexInfo, char *indexName, int nworkers, ZDBBuildStateData *buildstate) {
+	ParallelContext        *pcxt;
+	ZDBParallelBuildShared *shared;
+	Size                   size = add_size(offsetof(ZDBParallelBuildShared, indexName), strlen(indexName) + 1);
+	double                 reltuples;
+
+	/* so the workers see the options we've set on the index */
+	CommandCounterIncrement();
+
+	EnterParallelMode();
+	pcxt = CreateParallelContextForExternalFunction("zombodb", "zdb_parallel_build_main", nworkers);
+	shm_toc_estimate_chunk(&pcxt->estimator, size);
+	shm_toc_estimate_keys(&pcxt->estimator, 1);
+	InitializeParallelDSM(pcxt);
+
+	shared = shm_toc_allocate(pcxt->toc, size);
+	shared->heapRelid  = RelationGetRelid(heapRelation);
+	shared->indexRelid = RelationGetRelid(indexRelation);
+	shared->nblocks    = RelationGetNumberOfBlocks(heapRelation);
+	pg_atomic_init_u64(&shared->nextBlock, 0);
+	SpinLockInit(&shared->mutex);
+	shared->reltuples = 0;
+	shared->indtuples = 0;
+	strcpy(shared->indexName, indexName);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_ZDB_BUILD, shared);
+
+	LaunchParallelWorkers(pcxt);
+	elog(ZDB_LOG_LEVEL, "[zombodb] building %s with %d of %d requested workers", RelationGetRelationName(indexRelation),
+		 pcxt->nworkers_launched, nworkers);
+
+	/* we do our share too, and if no workers could be launched, we do it all */
+	reltuples = build_block_ranges(heapRelation, indexRelation, indexInfo, shared, buildstate);
+
+	/* any error a worker raised is raised here too */
+	WaitForParallelWorkersToFinish(pcxt);
+
+	reltuples += shared->reltuples;
+	buildstate->indtuples += shared->indtuples;
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	return reltuples;
+}
+
+/*
+ * Claim ranges of heap blocks and index them until there are none left
+ */
+static double build_block_ranges(Relation heapRelation, Relation indexRelation, IndexInfo *indexInfo, ZDBParallelBuildShared *shared, ZDBBuildStateData *buildstate) {
+	double reltuples = 0;
+
+	for (;;) {
+		uint64 start = pg_atomic_fetch_add_u64(&shared->nextBlock, PARALLEL_BUILD_CHUNK_BLOCKS);
+
+		if (start >= shared->nblocks)
+			break;
+
+		/* no synchronized scans, they'd start somewhere other than where we asked */
+		reltuples += IndexBuildHeapRangeScan(heapRelation, indexRelation, indexInfo, false, false,
+											 (BlockNumber) start,
+											 Min(PARALLEL_BUILD_CHUNK_BLOCKS, shared->nblocks - (BlockNumber) start),
+											 zdbbuildCallback, buildstate);
+	}
+
+	return reltuples;
+}
+
+/*
+ * Entry point for the background workers that help with a parallel CREATE INDEX
+ */
+void zdb_parallel_build_main(dsm_segment *seg, shm_toc *toc) {
+	ZDBParallelBuildShared *shared = shm_toc_lookup(toc, PARALLEL_KEY_ZDB_BUILD, false);
+	ZDBBuildStateData      buildstate;
+	Relation               heapRelation;
+	Relation               indexRelation;
+	IndexInfo              *indexInfo;
+	TupleDesc              tupdesc;
+	double                 reltuples;
+
+	/* these are the locks the leader already holds, and we're in its lock group */
+	heapRelation  = heap_open(shared->heapRelid, ShareLock);
+	indexRelation = index_open(shared->indexRelid, RowExclusiveLock);
+	indexInfo     = BuildIndexInfo(indexRelation);
+	tupdesc       = extract_tuple_desc_from_index_expressions(indexInfo->ii_Expressions);
+
+	buildstate.indtuples     = 0;
+	buildstate.memoryContext = AllocSetContextCreate(CurrentMemoryContext, "zdbBuildCallback",
+													 ALLOCSET_DEFAULT_MINSIZE,
+													 ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+	buildstate.esContext     = ElasticsearchStartBulkProcess(indexRelation, shared->indexName, tupdesc, false);
+	ReleaseTupleDesc(tupdesc);
+
+	reltuples = build_block_ranges(heapRelation, indexRelation, indexInfo, shared, &buildstate);
+	ElasticsearchFinishBulkProcess(buildstate.esContext);
+
+	SpinLockAcquire(&shared->mutex);
+	shared->reltuples += reltuples;
+	shared->indtuples += buildstate.indtuples;
+	SpinLockRelease(&shared->mutex);
+
+	index_close(indexRelation, RowExclusiveLock);
+	heap_close(heapRelation, ShareLock);
+}
+
 static void ambuildempty(Relation indexRelation) {
 	Relation heapRelation = RelationIdGetRelation(IndexGetRelation(RelationGetRelid(indexRelation), false));
 
@@ -917,6 +1277,7 @@ static bool aminsert(Relation indexRelation, Datum *values, bool *isnull, ItemPo
 	oldContext = MemoryContextSwitchTo(IsBatchMode() ? TopTransactionContext : TopQueryContext);
 
 	insertContext = checkout_insert_context(indexRelation, values[0], isnull[0]);
+	track_xid(insertContext, GetCurrentTransactionId());
 
 	index_record(insertContext->esContext, insertContext->scratch, heap_tid, values[0], NULL);
 	MemoryContextSwitchTo(oldContext);
@@ -925,20 +1286,10 @@ static bool aminsert(Relation indexRelation, Datum *values, bool *isnull, ItemPo
 }
 
 static void index_record(ElasticsearchBulkContext *esContext, MemoryContext scratchContext, ItemPointer ctid, Datum record, HeapTuple htup) {
-	MemoryContext oldContext;
-	text          *json;
-	CommandId     cmin;
-	CommandId     cmax;
-	uint64        xmin;
-	uint64        xmax;
-
-	/*
-	 * create the json form of the input record in the specified MemoryContext
-	 * and then switch back to whatever the current context is
-	 */
-	oldContext = MemoryContextSwitchTo(scratchContext);
-	json       = DatumGetTextP(DirectFunctionCall1(row_to_json, record));
-	MemoryContextSwitchTo(oldContext);
+	CommandId cmin;
+	CommandId cmax;
+	uint64    xmin;
+	uint64    xmax;
 
 	if (htup == NULL) {
 		/* it's from an INSERT or UPDATE statement */
@@ -956,22 +1307,291 @@ static void index_record(ElasticsearchBulkContext *esContext, MemoryContext scra
 		xmax = InvalidTransactionId;
 	}
 
-	/* add the row to Elasticsearch */
-	ElasticsearchBulkInsertRow(esContext, ctid, json, cmin, cmax, xmin, xmax);
+	/* add the row to Elasticsearch, writing its json form straight into the current batch */
+	ElasticsearchBulkInsertRecord(esContext, ctid, record, scratchContext, cmin, cmax, xmin, xmax);
 
 	/*
-	 * and now that we've used the json value, free the MemoryContext in which it was allocated.
+	 * and free whatever we had to allocate to do that, such as detoasted copies of the row's values.
 	 *
-	 * if we don't do this, we'll leak the json string version of every row being indexed
-	 * until the transaction ends!
+	 * if we don't do this, we'll leak them for every row being indexed until the transaction ends!
 	 */
 	MemoryContextResetAndDeleteChildren(scratchContext);
 }
 
+/*
+ * The flattened [lo, hi] pairs of aborted xid ranges as a bigint[], for our SQL functions
+ */
+Datum make_xid_ranges_array(uint64 *ranges, int nranges) {
+	Datum *elems = palloc(sizeof(Datum) * 2 * (nranges + 1));
+	int   i;
+
+	for (i = 0; i < nranges * 2; i++)
+		elems[i] = UInt64GetDatum(ranges[i]);
+
+	return PointerGetDatum(construct_array(elems, nranges * 2, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
+
+static int xid_cmp(const void *a, const void *b) {
+	uint64 xid_a = *((const uint64 *) a);
+	uint64 xid_b = *((const uint64 *) b);
+
+	return xid_a < xid_b ? -1 : xid_a > xid_b ? 1 : 0;
+}
+
+static void note_xid(HTAB *xids, ElasticsearchScrollContext *scroll, char *name) {
+	void   *array = get_json_object_array(scroll->fields, name, true);
+	uint64 xid64;
+
+	if (array == NULL || get_json_array_length(array) == 0)
+		return;
+
+	xid64 = get_json_array_element_uint64(array, 0, scroll->jsonMemoryContext);
+	hash_search(xids, &xid64, HASH_ENTER, NULL);
+}
+
+/*
+ * Where to start looking for xids in the index: its xid horizon, or the oldest xid the commit log
+ * still knows about, whichever is later
+ */
+static uint64 xid_horizon_floor(uint64 horizon) {
+	uint64 oldest;
+
+	LWLockAcquire(XidGenLock, LW_SHARED);
+	oldest = convert_xid(ShmemVariableCache->oldestXid);
+	LWLockRelease(XidGenLock);
+
+	return Max(oldest, horizon);
+}
+
+/*
+ * The distinct xmins and xmaxes in the index that are in [from, to), sorted
+ */
+static uint64 *find_index_xids(Relation indexRel, uint64 from, uint64 to, int *nfound) {
+	static char     *zdb_x_fields[]       = {"zdb_xmin", "zdb_xmax"};
+	bool            savedIgnoreVisibility = zdb_ignore_visibility_guc;
+	HASHCTL         ctl;
+	HTAB            *xids;
+	HASH_SEQ_STATUS seq;
+	uint64          *xid64;
+	uint64          *found;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize   = sizeof(uint64);
+	ctl.entrysize = sizeof(uint64);
+	ctl.hcxt      = CurrentMemoryContext;
+	xids = hash_create("index xids", 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	PG_TRY();
+			{
+				ElasticsearchScrollContext *scroll;
+				char                       *tmp;
+
+				zdb_ignore_visibility_guc = true;
+
+				/* the rows of transactions that aborted, or never finished, might not have been refreshed */
+				tmp = ElasticsearchArbitraryRequest(indexRel, "POST", "_refresh", NULL);
+				pfree(tmp);
+
+				scroll = ElasticsearchOpenScroll(indexRel, MakeZDBQuery(psprintf(
+						"{\"bool\":{\"should\":["
+						"{\"range\":{\"zdb_xmin\":{\"gte\":%lu,\"lt\":%lu}}},"
+						"{\"range\":{\"zdb_xmax\":{\"gte\":%lu,\"lt\":%lu}}}"
+						"]}}", from, to, from, to)),
+												 false, false, false, 0, NULL, SORTBY_DEFAULT, NULL, zdb_x_fields, 2);
+				while (scroll->cnt < scroll->total) {
+					ElasticsearchGetNextItemPointer(scroll, NULL, NULL, NULL, NULL);
+					if (scroll->fields == NULL)
+						continue;
+
+					note_xid(xids, scroll, "zdb_xmin");
+					note_xid(xids, scroll, "zdb_xmax");
+				}
+				ElasticsearchCloseScroll(scroll);
+
+				zdb_ignore_visibility_guc = savedIgnoreVisibility;
+			}
+		PG_CATCH();
+			{
+				zdb_ignore_visibility_guc = savedIgnoreVisibility;
+				PG_RE_THROW();
+			}
+	PG_END_TRY();
+
+	*nfound = 0;
+	found = palloc(sizeof(uint64) * (hash_get_num_entries(xids) + 1));
+	hash_seq_init(&seq, xids);
+	while ((xid64 = hash_seq_search(&seq)) != NULL) {
+		if (*xid64 < from || *xid64 >= to)
+			continue;    /* only one of the row's xids is in our range */
+
+		found[(*nfound)++] = *xid64;
+	}
+	qsort(found, *nfound, sizeof(uint64), xid_cmp);
+
+	hash_destroy(xids);
+	return found;
+}
+
+/*
+ * Tell Elasticsearch about every transaction between the index's xid horizon and 'until', VACUUM's
+ * oldest xmin, that wrote to it and didn't commit, as ranges of aborted xids, and then move the
+ * horizon up to 'until'.  Any that are merely prepared go back into the xact tracker
+ */
+void reconcile_aborted_xids(Relation indexRel, TransactionId until) {
+	uint64        from = xid_horizon_floor(ElasticsearchGetXidHorizon(indexRel, NULL, NULL));
+	uint64        to   = convert_xid(until);
+	uint64        *found, *ranges;
+	TransactionId *tracked;
+	int           nfound, ntracked, nranges = 0, naborted = 0, i, j;
+	bool          extending = false;
+
+	found = find_index_xids(indexRel, from, to, &nfound);
+
+	/*
+	 * A transaction that aborted might have had _bulk requests in flight that Elasticsearch will
+	 * apply after we looked, so the xids the xact tracker is holding for the index count too,
+	 * whether or not any of their rows are there yet.  We're about to make it forget them
+	 */
+	ntracked = xact_tracker_unresolved(RelationGetRelid(indexRel), &tracked);
+	if (ntracked > 0) {
+		found = repalloc(found, sizeof(uint64) * (nfound + ntracked + 1));
+		for (i = 0; i < ntracked; i++) {
+			uint64 xid64 = convert_xid(tracked[i]);
+
+			if (xid64 >= from && xid64 < to)
+				found[nfound++] = xid64;
+		}
+		pfree(tracked);
+
+		qsort(found, nfound, sizeof(uint64), xid_cmp);
+		for (i = 0, j = 0; i < nfound; i++) {
+			if (j == 0 || found[j - 1] != found[i])
+				found[j++] = found[i];
+		}
+		nfound = j;
+	}
+
+	/*
+	 * Every transaction before 'to' has finished, so no xid in our range that isn't in the index yet
+	 * ever will be.  That lets a run of aborted xids, with no other xid from the index between them,
+	 * become a single [lo, hi] range no matter what happened to the xids in the gaps
+	 */
+	ranges = palloc(sizeof(uint64) * 2 * (nfound + 1));
+	for (i = 0; i < nfound; i++) {
+		TransactionId xid = (TransactionId) found[i];
+
+		if (TransactionIdIsInProgress(xid)) {
+			xact_tracker_track_prepared(RelationGetRelid(indexRel), xid);
+			extending = false;
+		} else if (TransactionIdDidCommit(xid)) {
+			extending = false;
+		} else {
+			if (extending) {
+				ranges[nranges * 2 - 1] = found[i];
+			} else {
+				ranges[nranges * 2]     = found[i];
+				ranges[nranges * 2 + 1] = found[i];
+				nranges++;
+			}
+			extending = true;
+			naborted++;
+		}
+	}
+
+	ElasticsearchRecordAbortedTransactions(indexRel, ranges, nranges, to);
+
+	if (naborted > 0)
+		elog(LOG, "[zombodb] recorded %d aborted xids as %d ranges for %s", naborted, nranges,
+			 RelationGetRelationName(indexRel));
+
+	/* Elasticsearch knows about everything before 'until' now */
+	xact_tracker_forget(RelationGetRelid(indexRel), until);
+
+	pfree(found);
+	pfree(ranges);
+}
+
+/*
+ * After Postgres restarts, find the transactions between the index's xid horizon and 'until', the
+ * first xid handed out since, that wrote to it and didn't commit, and hand them to the xact tracker.
+ * They were lost from it without having committed when Postgres went away.  This only reads from
+ * Elasticsearch: telling it about them is up to VACUUM.
+ *
+ * Returns false if the tracker can't remember them all
+ */
+bool recover_unresolved_xids(Relation indexRel, TransactionId until) {
+	Oid           indexRelid = RelationGetRelid(indexRel);
+	TransactionId *xids      = NULL;
+	int           nxids      = 0;
+
+	PG_TRY();
+			{
+				uint64 from = xid_horizon_floor(ElasticsearchGetXidHorizon(indexRel, NULL, NULL));
+				uint64 *found;
+				int    nfound, i;
+
+				found = find_index_xids(indexRel, from, convert_xid(until), &nfound);
+				xids  = palloc(sizeof(TransactionId) * (nfound + 1));
+				for (i = 0; i < nfound; i++) {
+					TransactionId xid = (TransactionId) found[i];
+
+					if (!TransactionIdDidCommit(xid))
+						xids[nxids++] = xid;
+				}
+				pfree(found);
+			}
+		PG_CATCH();
+			{
+				xact_tracker_end_recovery(indexRelid, NULL, 0, false);
+				PG_RE_THROW();
+			}
+	PG_END_TRY();
+
+	return xact_tracker_end_recovery(indexRelid, xids, nxids, true);
+}
+
+/*
+ * Every xid in the index between its xid 'horizon' and 'until' that didn't commit, as [lo, hi]
+ * ranges, for when the xact tracker can't remember which of them they were.  Everything before
+ * 'until' has finished, unless it's prepared, and to a query either is as good as aborted.
+ *
+ * Like VACUUM, we only look up the xids that are in the index, rather than every one since the
+ * horizon, which after a long enough gap could be most of the commit log.  And like VACUUM, a run
+ * of them that didn't commit, with no other xid from the index between them, is a single range.
+ * VACUUM moves the horizon past 'until', after which there's nothing to do
+ */
+uint64 *uncommitted_xid_ranges(Relation indexRel, uint64 horizon, TransactionId until, int *nranges) {
+	uint64 *found, *ranges;
+	int    nfound, i;
+	bool   extending = false;
+
+	found  = find_index_xids(indexRel, xid_horizon_floor(horizon), convert_xid(until), &nfound);
+	ranges = palloc(sizeof(uint64) * 2 * (nfound + 1));
+
+	*nranges = 0;
+	for (i = 0; i < nfound; i++) {
+		if (TransactionIdDidCommit((TransactionId) found[i])) {
+			extending = false;
+			continue;
+		}
+
+		if (extending) {
+			ranges[*nranges * 2 - 1] = found[i];
+		} else {
+			ranges[*nranges * 2]     = found[i];
+			ranges[*nranges * 2 + 1] = found[i];
+			(*nranges)++;
+		}
+		extending = true;
+	}
+
+	pfree(found);
+	return ranges;
+}
+
 static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats, bool via_cleanup) {
 	static char      *zdb_x_fields[]       = {"zdb_xmin", "zdb_xmax"};
-	static char      *zdb_aborted_fields[] = {"zdb_aborted_xids"};
-	static const Oid args[]                = {REGCLASSOID, TEXTOID, INT8OID};
+	static const Oid args[]                = {INT8OID, INT8ARRAYOID};
 	Oid              byXmin;
 	Oid              byXmax;
 	Oid              byAbtXmax;
@@ -981,9 +1601,9 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 	TransactionId         oldestXmin;
 	ZDBQueryType          *query;
 
-	byXmin    = LookupFuncName(lappend(lappend(NIL, makeString("zdb")), makeString("vac_by_xmin")), 3, args, false);
-	byXmax    = LookupFuncName(lappend(lappend(NIL, makeString("zdb")), makeString("vac_by_xmax")), 3, args, false);
-	byAbtXmax = LookupFuncName(lappend(lappend(NIL, makeString("zdb")), makeString("vac_aborted_xmax")), 3, args,
+	byXmin    = LookupFuncName(lappend(lappend(NIL, makeString("zdb")), makeString("vac_by_xmin")), 2, args, false);
+	byXmax    = LookupFuncName(lappend(lappend(NIL, makeString("zdb")), makeString("vac_by_xmax")), 2, args, false);
+	byAbtXmax = LookupFuncName(lappend(lappend(NIL, makeString("zdb")), makeString("vac_aborted_xmax")), 2, args,
 							   false);
 
 	if (stats == NULL)
@@ -996,19 +1616,20 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 				ElasticsearchScrollContext *scroll;
 				ElasticsearchBulkContext   *bulk;
 				int                        deleted = 0, xmaxes_reset = 0;
+				uint64                     *ranges, *unreferenced;
+				int                        nranges, nunreferenced = 0, i;
+				Datum                      abortedRanges;
 
 				zdb_ignore_visibility_guc = true;
 
-				if (strcmp(ZDBIndexOptionsGetRefreshInterval(info->index), "-1") != 0) {
-					/*
-					 * The index has a custom refresh interval, but VACUUM needs a refreshed index
-					 * so we'll force one now
-					 */
-					char *tmp;
-
-					tmp = ElasticsearchArbitraryRequest(info->index, "POST", "_refresh", NULL);
-					pfree(tmp);
-				}
+				/*
+				 * Make sure Elasticsearch knows about every transaction before our oldest xmin that didn't
+				 * commit, as we're about to rely on its list of aborted xids.  This also refreshes the index,
+				 * which VACUUM needs even if it has a custom refresh interval
+				 */
+				reconcile_aborted_xids(info->index, oldestXmin);
+				ElasticsearchGetXidHorizon(info->index, &ranges, &nranges);
+				abortedRanges = make_xid_ranges_array(ranges, nranges);
 
 				bulk = ElasticsearchStartBulkProcess(info->index, NULL, NULL, true);
 
@@ -1018,10 +1639,7 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 				 * These rows can be deleted
 				 */
 				query  = (ZDBQueryType *) DatumGetPointer(
-						OidFunctionCall3(byXmin,
-										 ObjectIdGetDatum(RelationGetRelid(info->index)),
-										 CStringGetTextDatum(ZDBIndexOptionsGetTypeName(info->index)),
-										 Int64GetDatum(convert_xid(oldestXmin))));
+						OidFunctionCall2(byXmin, Int64GetDatum(convert_xid(oldestXmin)), abortedRanges));
 				scroll = ElasticsearchOpenScroll(info->index, query, true, false, false, 0, NULL, SORTBY_DEFAULT, NULL,
 												 zdb_x_fields, 2);
 				while (scroll->cnt < scroll->total) {
@@ -1031,8 +1649,8 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 					ElasticsearchGetNextItemPointer(scroll, NULL, &_id, NULL, NULL);
 					xmin = (TransactionId) get_json_first_array_uint64(scroll->fields, "zdb_xmin");
 
-					if (TransactionIdPrecedes(xmin, oldestXmin) && TransactionIdDidAbort(xmin) &&
-						!TransactionIdDidCommit(xmin) && !TransactionIdIsInProgress(xmin)) {
+					if (TransactionIdPrecedes(xmin, oldestXmin) && !TransactionIdDidCommit(xmin) &&
+						!TransactionIdIsInProgress(xmin)) {
 						ElasticsearchBulkDeleteRowByXmin(bulk, _id, convert_xid(xmin));
 						deleted++;
 					}
@@ -1042,13 +1660,11 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 				/*
 				 * Find all rows with what we think is a *committed* xmax
 				 *
-				 * These rows can be deleted
+				 * These rows can be deleted.  If the index uses tombstones, what we find are the tombstones,
+				 * and we delete both them and their rows
 				 */
 				query  = (ZDBQueryType *) DatumGetPointer(
-						OidFunctionCall3(byXmax,
-										 ObjectIdGetDatum(RelationGetRelid(info->index)),
-										 CStringGetTextDatum(ZDBIndexOptionsGetTypeName(info->index)),
-										 Int64GetDatum(convert_xid(oldestXmin))));
+						OidFunctionCall2(byXmax, Int64GetDatum(convert_xid(oldestXmin)), abortedRanges));
 				scroll = ElasticsearchOpenScroll(info->index, query, true, false, false, 0, NULL, SORTBY_DEFAULT, NULL,
 												 zdb_x_fields, 2);
 				while (scroll->cnt < scroll->total) {
@@ -1060,7 +1676,10 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 
 					if (TransactionIdPrecedes(xmax, oldestXmin) && TransactionIdDidCommit(xmax) &&
 						!TransactionIdDidAbort(xmax) && !TransactionIdIsInProgress(xmax)) {
-						ElasticsearchBulkDeleteRowByXmax(bulk, _id, convert_xid(xmax));
+						if (bulk->tombstones)
+							ElasticsearchBulkDeleteRowByTombstone(bulk, _id);
+						else
+							ElasticsearchBulkDeleteRowByXmax(bulk, _id, convert_xid(xmax));
 						deleted++;
 					}
 				}
@@ -1069,13 +1688,11 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 				/*
 				 * Find all rows with what we think is an *aborted* xmax
 				 *
-				 * These rows can have their xmax reset to null because they're still live
+				 * These rows can have their xmax reset to null because they're still live, or
+				 * if the index uses tombstones, these are tombstones we can delete
 				 */
 				query  = (ZDBQueryType *) DatumGetPointer(
-						OidFunctionCall3(byAbtXmax,
-										 ObjectIdGetDatum(RelationGetRelid(info->index)),
-										 CStringGetTextDatum(ZDBIndexOptionsGetTypeName(info->index)),
-										 Int64GetDatum(convert_xid(oldestXmin))));
+						OidFunctionCall2(byAbtXmax, Int64GetDatum(convert_xid(oldestXmin)), abortedRanges));
 				scroll = ElasticsearchOpenScroll(info->index, query, true, false, false, 0, NULL, SORTBY_DEFAULT, NULL,
 												 zdb_x_fields, 2);
 				while (scroll->cnt < scroll->total) {
@@ -1087,9 +1704,12 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 					xmax64 = get_json_first_array_uint64(scroll->fields, "zdb_xmax");
 					xmax   = (TransactionId) xmax64;
 
-					if (TransactionIdPrecedes(xmax, oldestXmin) && TransactionIdDidAbort(xmax) &&
-						!TransactionIdDidCommit(xmax) && !TransactionIdIsInProgress(xmax)) {
-						ElasticsearchBulkVacuumXmax(bulk, _id, xmax64);
+					if (TransactionIdPrecedes(xmax, oldestXmin) && !TransactionIdDidCommit(xmax) &&
+						!TransactionIdIsInProgress(xmax)) {
+						if (bulk->tombstones)
+							ElasticsearchBulkDeleteTombstone(bulk, _id);
+						else
+							ElasticsearchBulkVacuumXmax(bulk, _id, xmax64);
 						xmaxes_reset++;
 					}
 				}
@@ -1099,52 +1719,31 @@ static IndexBulkDeleteResult *zdb_vacuum_internal(IndexVacuumInfo *info, IndexBu
 				ElasticsearchFinishBulkProcess(bulk);
 
 				/*
-				 * Finally, any "zdb_aborted_xid" value we have can be removed if it's
-				 * known to be aborted and no longer referenced anywhere in the index
+				 * Finally, any range of aborted xids that's entirely behind our oldest xmin can be removed
+				 * once nothing in the index refers to any xid in it
 				 */
-				scroll = ElasticsearchOpenScroll(info->index, MakeZDBQuery("_id:zdb_aborted_xids"), true, false, false,
-												 0, NULL, SORTBY_DEFAULT, NULL, zdb_aborted_fields, 1);
-				while (scroll->cnt < scroll->total) {
-					void *array;
+				unreferenced = palloc(sizeof(uint64) * 2 * (nranges + 1));
+				for (i = 0; i < nranges; i++) {
+					uint64 lo = ranges[i * 2];
+					uint64 hi = ranges[i * 2 + 1];
 
-					ElasticsearchGetNextItemPointer(scroll, NULL, NULL, NULL, NULL);
-					if (scroll->fields == NULL)
+					if (hi >= convert_xid(oldestXmin))
 						continue;
 
-					array = get_json_object_array(scroll->fields, "zdb_aborted_xids", true);
-
-					if (array != NULL) {
-						List *to_remove = NIL;
-						int  i, len     = get_json_array_length(array);
-
-						for (i = 0; i < len; i++) {
-							uint64        xid64 = get_json_array_element_uint64(array, i, scroll->jsonMemoryContext);
-							TransactionId xid   = (TransactionId) xid64;
-
-							if (TransactionIdPrecedes(xid, oldestXmin) && TransactionIdDidAbort(xid) &&
-								!TransactionIdDidCommit(xid) && !TransactionIdIsInProgress(xid)) {
-								uint64 xmin_cnt = ElasticsearchCount(info->index,
-																	 MakeZDBQuery(psprintf("zdb_xmin:%lu", xid64)));
-								uint64 xmax_cnt = ElasticsearchCount(info->index,
-																	 MakeZDBQuery(psprintf("zdb_xmax:%lu", xid64)));
-
-								/* if it's not referenced anywhere, so we can remove it */
-								if (xmin_cnt == 0 && xmax_cnt == 0) {
-									uint64 *tmp = palloc(sizeof(uint64));
-									memcpy(tmp, &xid64, sizeof(uint64));
-
-									to_remove = lappend(to_remove, tmp);
-								}
-							}
-						}
-						ElasticsearchRemoveAbortedTransactions(info->index, to_remove);
-
-						if (list_length(to_remove) > 0)
-							elog(LOG, "[zombodb-vacuum] removed %d aborted xids", list_length(to_remove));
+					if (ElasticsearchCount(info->index, MakeZDBQuery(psprintf(
+							"{\"bool\":{\"should\":["
+							"{\"range\":{\"zdb_xmin\":{\"gte\":%lu,\"lte\":%lu}}},"
+							"{\"range\":{\"zdb_xmax\":{\"gte\":%lu,\"lte\":%lu}}}"
+							"]}}", lo, hi, lo, hi))) == 0) {
+						unreferenced[nunreferenced * 2]     = lo;
+						unreferenced[nunreferenced * 2 + 1] = hi;
+						nunreferenced++;
 					}
 				}
-				ElasticsearchCloseScroll(scroll);
+				ElasticsearchRemoveAbortedTransactions(info->index, unreferenced, nunreferenced);
 
+				if (nunreferenced > 0)
+					elog(LOG, "[zombodb-vacuum] removed %d aborted xid ranges", nunreferenced);
 
 				stats->tuples_removed   = deleted;
 				stats->num_index_tuples = ElasticsearchCount(info->index, MakeZDBQuery(""));
@@ -1218,7 +1817,12 @@ static void amcostestimate(struct PlannerInfo *root, struct IndexPath *path, dou
 
 	*indexStartupCost = 0;
 	*indexCorrelation = 1;    /* because an IndexScan will sort by zdb_ctid in ES, which will give us heap order */
-	*indexPages       = 0;
+
+	/*
+	 * we have no pages on disk either, but Postgres decides how many workers a parallel index scan
+	 * gets from how many pages it reads, so say how many heap pages we expect to match
+	 */
+	*indexPages       = ceil(*indexSelectivity * heapRel->rd_rel->relpages);
 
 	*indexTotalCost += (*indexSelectivity * Max(1, heapRel->rd_rel->reltuples)) * (cpu_index_tuple_cost);
 
@@ -1244,6 +1848,8 @@ static bytea *amoptions(Datum reloptions, bool validate) {
 			{"optimize_after",    RELOPT_TYPE_INT,    offsetof(ZDBIndexOptions, optimizeAfter)},
 			{"llapi",             RELOPT_TYPE_BOOL,   offsetof(ZDBIndexOptions, llapi)},
 			{"uuid",              RELOPT_TYPE_STRING, offsetof(ZDBIndexOptions, uuidOffset)},
+			{"bulk_format",       RELOPT_TYPE_STRING, offsetof(ZDBIndexOptions, bulkFormatOffset)},
+			{"tombstones",        RELOPT_TYPE_BOOL,   offsetof(ZDBIndexOptions, tombstones)},
 	};
 
 	options = parseRelOptions(reloptions, validate, RELOPT_KIND_ZDB, &numoptions);
@@ -1323,7 +1929,48 @@ static IndexScanDesc ambeginscan(Relation indexRelation, int nkeys, int norderby
 	return scan;
 }
 
-static inline void do_search_for_scan(IndexScanDesc scan) {
+/*
+ * Claim the next slice of a parallel index scan's Elasticsearch scroll, and start reading it.
+ * Returns false if every slice has already been claimed
+ */
+static bool open_next_slice(IndexScanDesc scan) {
+	ZDBScanContext        *context = (ZDBScanContext *) scan->opaque;
+	ZDBParallelScanShared *shared  = (ZDBParallelScanShared *) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+	int                   nslices  = 1;
+	int                   slice    = -1;
+
+	/* hits in a particular order, or only so many of them, can only be read by one of us */
+	if (context->sortField == NULL && context->limit == 0)
+		nslices = Max(1, Min(ZDBIndexOptionsGetNumberOfShards(scan->indexRelation), MAX_SCROLL_SLICES));
+
+	SpinLockAcquire(&shared->mutex);
+	if (shared->nslices == 0)
+		shared->nslices = nslices;
+	nslices = shared->nslices;
+	if (shared->nextSlice < nslices)
+		slice = shared->nextSlice++;
+	SpinLockRelease(&shared->mutex);
+
+	if (context->scrollContext != NULL) {
+		ElasticsearchCloseScroll(context->scrollContext);
+		context->scrollContext = NULL;
+	}
+
+	if (slice < 0)
+		return false;
+
+	context->scrollContext = ElasticsearchOpenScrollSlice(scan->indexRelation, context->query, context->needSort,
+														  context->wantScores, context->limit, context->sortField,
+														  context->sortdir, context->highlights, slice, nslices);
+	return true;
+}
+
+/*
+ * Start the scan's Elasticsearch query, if we haven't yet.  'needSort' is false when the caller
+ * doesn't care about the order of the results.  A parallel scan only starts on the first slice
+ * it can claim, if any
+ */
+static inline void do_search_for_scan(IndexScanDesc scan, bool needSort) {
 	ZDBScanContext *context = (ZDBScanContext *) scan->opaque;
 
 	if (context->needsInit) {
@@ -1344,15 +1991,26 @@ static inline void do_search_for_scan(IndexScanDesc scan) {
 		if (limit == 0)
 			limit = find_limit_for_scan(scan);
 
-		if (context->scrollContext != NULL) {
-			ElasticsearchCloseScroll(context->scrollContext);
-		}
-
-		context->scrollContext  = ElasticsearchOpenScroll(scan->indexRelation, context->query, false, true, wantScores,
-														  limit,
-														  sortField, sortdir, highlights, NULL, 0);
+		context->needSort       = needSort;
+		context->sortField      = sortField;
+		context->sortdir        = sortdir;
+		context->limit          = limit;
+		context->highlights     = highlights;
 		context->wantHighlights = highlights != NULL;
 		context->wantScores     = wantScores;
+
+		if (scan->parallel_scan != NULL) {
+			open_next_slice(scan);
+		} else {
+			if (context->scrollContext != NULL) {
+				ElasticsearchCloseScroll(context->scrollContext);
+			}
+
+			context->scrollContext = ElasticsearchOpenScroll(scan->indexRelation, context->query, false, needSort,
+															 wantScores, limit,
+															 sortField, sortdir, highlights, NULL, 0);
+		}
+
 		if (context->wantScores) {
 			context->scoreLookup = scoring_create_lookup_table(TopTransactionContext, "bitmap scores");
 			scoring_register_callback(RelationGetRelid(heapRel), scoring_cb, context, CurrentMemoryContext);
@@ -1383,18 +2041,29 @@ static bool amgettuple(IndexScanDesc scan, ScanDirection direction) {
 	ZDBScanContext  *context = (ZDBScanContext *) scan->opaque;
 	zdb_json_object highlights;
 
-	do_search_for_scan(scan);
+	do_search_for_scan(scan, true);
 
 	/* zdb indexes are never lossy */
 	scan->xs_recheck = false;
 
-	if (context->scrollContext->limit > 0 && context->scrollContext->limitcnt >= context->scrollContext->limit)
-		return false; /* we've reached our limit of live tuples */
-	else if (context->scrollContext->cnt >= context->scrollContext->total)
-		return false; /* we have no more tuples to return */
+	do {
+		for (;;) {
+			ElasticsearchScrollContext *scroll = context->scrollContext;
+
+			if (scroll != NULL && scroll->limit > 0 && scroll->limitcnt >= scroll->limit)
+				return false; /* we've reached our limit of live tuples */
+			else if (scroll != NULL && scroll->cnt < scroll->total)
+				break;
+
+			/* we have no more tuples to return, unless we're part of a parallel scan with another slice for us */
+			if (scan->parallel_scan == NULL || !open_next_slice(scan))
+				return false;
+		}
+
+		/* get the next tuple from Elasticsearch, other than one we've returned already */
+		ElasticsearchGetNextItemPointer(context->scrollContext, &context->lastCtid, NULL, &context->lastScore, &highlights);
+	} while (context->scrollContext->skip);
 
-	/* get the next tuple from Elasticsearch */
-	ElasticsearchGetNextItemPointer(context->scrollContext, &context->lastCtid, NULL, &context->lastScore, &highlights);
 	if (!ItemPointerIsValid(&context->lastCtid))
 		ereport(ERROR,
 				(errcode(ERRCODE_INTERNAL_ERROR),
@@ -1453,7 +2122,8 @@ static int64 amgetbitmap(IndexScanDesc scan, TIDBitmap *tbm) {
 	ZDBScanContext *context = (ZDBScanContext *) scan->opaque;
 	int64          ntuples  = 0;
 
-	do_search_for_scan(scan);
+	/* a bitmap is in ctid order no matter what order we add to it */
+	do_search_for_scan(scan, false);
 
 	while (context->scrollContext->cnt < context->scrollContext->total) {
 		ItemPointerData ctid;
@@ -1463,6 +2133,8 @@ static int64 amgetbitmap(IndexScanDesc scan, TIDBitmap *tbm) {
 		bool            found;
 
 		ElasticsearchGetNextItemPointer(context->scrollContext, &ctid, NULL, &score, NULL);
+		if (context->scrollContext->skip)
+			continue;
 
 		ItemPointerCopy(&ctid, &key.ctid);
 
@@ -1497,26 +2169,96 @@ static void amendscan(IndexScanDesc scan) {
 	pfree(scan->opaque);
 }
 
-static void handle_trigger(Oid indexRelId, ItemPointer targetCtid) {
-	MemoryContext         oldContext;
-	ZDBIndexChangeContext *context;
-	Relation              indexRel;
+static Size amestimateparallelscan(void) {
+	return sizeof(ZDBParallelScanShared);
+}
 
-	oldContext = MemoryContextSwitchTo(IsBatchMode() ? TopTransactionContext : TopQueryContext);
-	indexRel   = zdb_open_index(indexRelId, AccessShareLock);
+/*
+ * Called by the leader of a parallel index scan, before its workers start
+ */
+static void aminitparallelscan(void *target) {
+	ZDBParallelScanShared *shared   = (ZDBParallelScanShared *) target;
+	List                  *unshared = refresh_coordinator_unshared();
+	ListCell              *lc;
 
-	context = checkout_insert_context(indexRel, PointerGetDatum(NULL), true);
+	SpinLockInit(&shared->mutex);
+	shared->nslices   = 0;
+	shared->nextSlice = 0;
 
-	ElasticsearchBulkUpdateTuple(context->esContext, targetCtid, NULL, GetCurrentCommandId(true),
-								 convert_xid(GetCurrentTransactionId()));
+	/*
+	 * our workers can't know about the changes our transaction made that only we know need a
+	 * refresh, so make sure those are searchable before they start
+	 */
+	foreach (lc, unshared) {
+		Relation indexRel = RelationIdGetRelation(lfirst_oid(lc));
 
-	relation_close(indexRel, AccessShareLock);
-	MemoryContextSwitchTo(oldContext);
+		if (indexRel != NULL) {
+			ElasticsearchRefreshIfNeeded(indexRel);
+			RelationClose(indexRel);
+		}
+	}
+	list_free(unshared);
+}
+
+static void amparallelrescan(IndexScanDesc scan) {
+	ZDBParallelScanShared *shared = (ZDBParallelScanShared *) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+
+	SpinLockAcquire(&shared->mutex);
+	shared->nslices   = 0;
+	shared->nextSlice = 0;
+	SpinLockRelease(&shared->mutex);
+}
+
+/*
+ * Rather than open the index and add an update action to its bulk context for every row,
+ * we collect the ctids an UPDATE or DELETE touches and add them all at once when the
+ * statement finishes (or we've collected a lot of them)
+ */
+static void handle_trigger(Trigger *trigger, ItemPointer targetCtid) {
+	ZDBPendingXmax *pending = last_pending_xmax;
+	CommandId      cmax     = GetCurrentCommandId(true);
+	uint64         xmax     = convert_xid(GetCurrentTransactionId());
+
+	if (pending == NULL || pending->triggerOid != trigger->tgoid) {
+		Oid      indexRelId = DatumGetObjectId(DirectFunctionCall1(oidin, CStringGetDatum(trigger->tgargs[0])));
+		ListCell *lc;
+
+		pending = NULL;
+		foreach (lc, pending_xmax) {
+			ZDBPendingXmax *candidate = lfirst(lc);
+
+			if (candidate->indexRelid == indexRelId) {
+				pending = candidate;
+				break;
+			}
+		}
+
+		if (pending == NULL) {
+			MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+			pending = palloc(sizeof(ZDBPendingXmax));
+			pending->indexRelid = indexRelId;
+			pending->nctids     = 0;
+			pending_xmax = lappend(pending_xmax, pending);
+			MemoryContextSwitchTo(oldContext);
+		}
+
+		/* the UPDATE and DELETE triggers for an index are different triggers */
+		pending->triggerOid = trigger->tgoid;
+		last_pending_xmax   = pending;
+	}
+
+	if (pending->nctids == PENDING_XMAX_CTIDS ||
+		(pending->nctids > 0 && (pending->cmax != cmax || pending->xmax != xmax)))
+		flush_pending_xmax(pending);
+
+	pending->cmax = cmax;
+	pending->xmax = xmax;
+	pending->ctids[pending->nctids++] = *targetCtid;
 }
 
 Datum zdb_delete_trigger(PG_FUNCTION_ARGS) {
 	TriggerData *trigdata = (TriggerData *) fcinfo->context;
-	Oid         indexRelId;
 
 	/* make sure it's called as a trigger at all */
 	if (!CALLED_AS_TRIGGER(fcinfo))
@@ -1531,15 +2273,13 @@ Datum zdb_delete_trigger(PG_FUNCTION_ARGS) {
 	if (trigdata->tg_trigger->tgnargs != 1)
 		elog(ERROR, "zdb_delete_trigger: called with incorrect number of arguments");
 
-	indexRelId = DatumGetObjectId(DirectFunctionCall1(oidin, CStringGetDatum(trigdata->tg_trigger->tgargs[0])));
-	handle_trigger(indexRelId, &trigdata->tg_trigtuple->t_self);
+	handle_trigger(trigdata->tg_trigger, &trigdata->tg_trigtuple->t_self);
 
 	return PointerGetDatum(trigdata->tg_trigtuple);
 }
 
 Datum zdb_update_trigger(PG_FUNCTION_ARGS) {
 	TriggerData *trigdata = (TriggerData *) fcinfo->context;
-	Oid         indexRelId;
 
 	/* make sure it's called as a trigger at all */
 	if (!CALLED_AS_TRIGGER(fcinfo))
@@ -1554,8 +2294,7 @@ Datum zdb_update_trigger(PG_FUNCTION_ARGS) {
 	if (trigdata->tg_trigger->tgnargs != 1)
 		elog(ERROR, "zdb_update_trigger: called with incorrect number of arguments");
 
-	indexRelId = DatumGetObjectId(DirectFunctionCall1(oidin, CStringGetDatum(trigdata->tg_trigger->tgargs[0])));
-	handle_trigger(indexRelId, &trigdata->tg_trigtuple->t_self);
+	handle_trigger(trigdata->tg_trigger, &trigdata->tg_trigtuple->t_self);
 
 	return PointerGetDatum(trigdata->tg_newtuple);
 }
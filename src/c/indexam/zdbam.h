@@ -23,12 +23,18 @@
 #include "utils/guc.h"
 
 typedef struct ZDBIndexChangeContext {
-	Oid                      indexRelid;
+	Oid                      indexRelid;    /* hash key */
 	ElasticsearchBulkContext *esContext;
 	MemoryContext            scratch;
+	TransactionId            trackedXid;    /* the last xid we know is tracked for this index */
 } ZDBIndexChangeContext;
 
 
 ZDBIndexChangeContext *checkout_insert_context(Relation indexRelation, Datum row, bool isnull);
+void track_xid(ZDBIndexChangeContext *context, TransactionId xid);
+void reconcile_aborted_xids(Relation indexRel, TransactionId until);
+bool recover_unresolved_xids(Relation indexRel, TransactionId until);
+uint64 *uncommitted_xid_ranges(Relation indexRel, uint64 horizon, TransactionId until, int *nranges);
+Datum make_xid_ranges_array(uint64 *ranges, int nranges);
 
 #endif /* __ZDB_ZDBAM_H__ */
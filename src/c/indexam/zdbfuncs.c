@@ -94,6 +94,7 @@ Datum zdb_request(PG_FUNCTION_ARGS) {
 	}
 
 	indexRel = zdb_open_index(indexRelId, AccessShareLock);
+	ElasticsearchRefreshIfNeeded(indexRel);
 	response = ElasticsearchArbitraryRequest(indexRel, method, endpoint, postData);
 	if (is_json(response)) {
 		Datum jb     = DirectFunctionCall1(jsonb_in, CStringGetDatum(response));
@@ -269,7 +270,8 @@ Datum zdb_query_tids(PG_FUNCTION_ARGS) {
 
 	indexRel = zdb_open_index(indexRelOid, AccessShareLock);
 
-	scrollContext = ElasticsearchOpenScroll(indexRel, userJsonQuery, false, true, false, 0, NULL, SORTBY_DEFAULT, NULL,
+	/* the tids can come back in any order */
+	scrollContext = ElasticsearchOpenScroll(indexRel, userJsonQuery, false, false, false, 0, NULL, SORTBY_DEFAULT, NULL,
 											NULL, 0);
 
 	relation_close(indexRel, AccessShareLock);
@@ -318,59 +320,13 @@ Datum zdb_json_build_object_wrapper(PG_FUNCTION_ARGS) {
 }
 
 Datum zdb_internal_visibility_clause(PG_FUNCTION_ARGS) {
-	MemoryContext tmpContext = AllocSetContextCreate(CurrentMemoryContext, "visibility_clause", ALLOCSET_DEFAULT_SIZES);
-	MemoryContext oldContext = MemoryContextSwitchTo(tmpContext);
-	ZDBQueryType  *output;
-
-	{
-		Oid             indexRelOid = PG_GETARG_OID(0);
-		Snapshot        snapshot    = GetTransactionSnapshot();
-		CommandId       commandId   = GetCurrentCommandId(false);
-		uint64          xid         = convert_xid(GetCurrentTransactionIdIfAny());
-		uint64          xmax        = convert_xid(snapshot->xmax);
-		ArrayBuildState *astate     = initArrayResult(INT8OID, tmpContext, false);
-		Relation        indexRel;
-		Oid             zdb_visibility_clause;
-		ZDBQueryType    *vis;
-		size_t          len;
-
-		indexRel = zdb_open_index(indexRelOid, AccessShareLock);
-
-		/* build up an array of active transaction ids */
-		if (snapshot->xcnt > 0) {
-			uint32 i;
-
-			for (i = 0; i < snapshot->xcnt; i++) {
-				astate = accumArrayResult(astate, UInt64GetDatum(convert_xid(snapshot->xip[i])), false, INT8OID,
-										  tmpContext);
-			}
-		}
-
-		/* find our visibility query SQL function */
-		zdb_visibility_clause = DatumGetObjectId(DirectFunctionCall1(regprocedurein, CStringGetDatum(
-				"zdb.visibility_clause(bigint, bigint, int, bigint[], regclass, text)")));
-
-		/* ... and call it */
-		vis = (ZDBQueryType *) DatumGetTextP(
-				OidFunctionCall6(zdb_visibility_clause, UInt64GetDatum(xid), UInt64GetDatum(xmax),
-								 CommandIdGetDatum(commandId),
-								 makeArrayResult(astate, tmpContext),
-								 ObjectIdGetDatum(RelationGetRelid(indexRel)),
-								 CStringGetTextDatum(ZDBIndexOptionsGetTypeName(indexRel))));
-
-		relation_close(indexRel, AccessShareLock);
-
-		/* switch back to the original memory context */
-		MemoryContextSwitchTo(oldContext);
+	Oid          indexRelOid = PG_GETARG_OID(0);
+	Relation     indexRel;
+	ZDBQueryType *output;
 
-		/* and copy the 'vis'ibility query into this context so we can return it */
-		len    = strlen(vis->query_string);
-		output = palloc0(sizeof(ZDBQueryType) + len + 1);
-		output->vl_len_          = vis->vl_len_;
-		output->count_estimation = vis->count_estimation;
-		memcpy(output->query_string, vis->query_string, len);
-	}
-	MemoryContextDelete(tmpContext);
+	indexRel = zdb_open_index(indexRelOid, AccessShareLock);
+	output   = MakeZDBQuery(make_visibility_clause(indexRel));
+	relation_close(indexRel, AccessShareLock);
 
 	PG_RETURN_POINTER(output);
 }
@@ -0,0 +1,608 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Writes rows as the json documents we send to Elasticsearch, straight into a _bulk request.
+ *
+ * The output is what row_to_json() would produce, minus the closing brace so the caller can
+ * add our zdb_* properties, and with any line breaks inside ::json values turned into spaces
+ * because a _bulk document must be on a single line.  But rather than go through every column's
+ * output function and build a text datum we'd have to copy again, we work out once per row type
+ * how to write each column, and the common types are written directly.
+ *
+ * If a row has a column of any other type, we just use row_to_json() for the whole row.
+ *
+ * A serializer can also write Smile instead, for indexes whose bulk_format is "smile".  The
+ * document is then a Smile header and the object's fields, again without its end marker
+ */
+#include "row_serializer.h"
+#include "smile.h"
+#include "zombodb.h"
+
+#include "access/htup_details.h"
+#include "utils/array.h"
+#include "utils/date.h"
+#include "utils/datetime.h"
+#include "utils/jsonapi.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
+
+#include <float.h>
+#include <math.h>
+
+typedef enum RowSerializerKind {
+	RS_INT2,
+	RS_INT4,
+	RS_INT8,
+	RS_FLOAT4,
+	RS_FLOAT8,
+	RS_NUMBER,         /* via its output function, quoted if it isn't a valid json number (ie, NaN) */
+	RS_BOOL,
+	RS_TEXT,
+	RS_DATE,
+	RS_TIMESTAMP,
+	RS_TIMESTAMPTZ,
+	RS_JSON,
+	RS_RAW,            /* via its output function, as-is */
+	RS_ARRAY
+} RowSerializerKind;
+
+typedef struct RowSerializerColumn {
+	char              *key;       /* the escaped "name": , with a leading comma for all but the first, or NULL if dropped.
+	                               * For Smile, the encoded key */
+	int               keylen;
+	RowSerializerKind kind;
+
+	/* for arrays, how to write, and find, their elements */
+	RowSerializerKind elemKind;
+	Oid               elemType;
+	int16             elemLen;
+	bool              elemByVal;
+	char              elemAlign;
+
+	/* for RS_NUMBER and RS_RAW, or arrays of them */
+	FmgrInfo          output;
+} RowSerializerColumn;
+
+struct RowSerializer {
+	MemoryContext       memcxt;
+	Oid                 typid;
+	int32               typmod;
+	TupleDesc           tupdesc;
+	bool                smile;
+	bool                generic;         /* some column isn't a type we know how to write */
+	RowSerializerColumn *columns;
+	Datum               *values;
+	bool                *nulls;
+};
+
+/*
+ * The same escaping as Postgres' escape_json(), but for a string that isn't NULL-terminated
+ */
+static void append_escaped(StringInfo buf, const char *str, int len) {
+	int start = 0;
+	int i;
+
+	enlargeStringInfo(buf, len + 2);
+	appendStringInfoCharMacro(buf, '"');
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) str[i];
+
+		if (c >= ' ' && c != '"' && c != '\\')
+			continue;
+
+		appendBinaryStringInfo(buf, str + start, i - start);
+		switch (c) {
+			case '\b':
+				appendStringInfoString(buf, "\\b");
+				break;
+			case '\f':
+				appendStringInfoString(buf, "\\f");
+				break;
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			case '\r':
+				appendStringInfoString(buf, "\\r");
+				break;
+			case '\t':
+				appendStringInfoString(buf, "\\t");
+				break;
+			case '"':
+				appendStringInfoString(buf, "\\\"");
+				break;
+			case '\\':
+				appendStringInfoString(buf, "\\\\");
+				break;
+			default:
+				appendStringInfo(buf, "\\u%04x", c);
+				break;
+		}
+		start = i + 1;
+	}
+	appendBinaryStringInfo(buf, str + start, len - start);
+	appendStringInfoCharMacro(buf, '"');
+}
+
+/*
+ * Append some json we didn't write ourselves, which might have line breaks between its tokens.
+ * Any json or jsonb value in it, however deeply nested, is there as-is
+ */
+static void append_single_line(StringInfo buf, char *json, int len) {
+	char *dest;
+
+	enlargeStringInfo(buf, len);
+	dest = buf->data + buf->len;
+	memcpy(dest, json, len);
+	replace_line_breaks(dest, len, ' ');
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+}
+
+void json_append_uint64(StringInfo buf, uint64 value) {
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = (char) ('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	appendBinaryStringInfo(buf, p, (int) (tmp + sizeof(tmp) - p));
+}
+
+void json_append_int32(StringInfo buf, int32 value) {
+	if (value < 0) {
+		appendStringInfoCharMacro(buf, '-');
+		json_append_uint64(buf, (uint64) (-(int64) value));
+	} else {
+		json_append_uint64(buf, (uint64) value);
+	}
+}
+
+/*
+ * What float4out() and float8out() do, but NaN and Infinity are quoted, as row_to_json() would
+ */
+static void append_float(StringInfo buf, double num, int digits, bool smile) {
+	if (isnan(num) || isinf(num)) {
+		const char *str = isnan(num) ? "NaN" : num > 0 ? "Infinity" : "-Infinity";
+
+		if (smile)
+			smile_append_string(buf, str, (int) strlen(str));
+		else
+			appendStringInfo(buf, "\"%s\"", str);
+	} else if (smile) {
+		if (digits == FLT_DIG)
+			smile_append_float(buf, (float) num);
+		else
+			smile_append_double(buf, num);
+	} else {
+		int ndig = digits + extra_float_digits;
+
+		appendStringInfo(buf, "%.*g", ndig < 1 ? 1 : ndig, num);
+	}
+}
+
+/*
+ * Dates and timestamps are always in ISO 8601 format, regardless of DateStyle, like row_to_json()
+ */
+static const char *format_date(DateADT date, char *tmp) {
+	struct pg_tm tm;
+
+	if (DATE_NOT_FINITE(date))
+		return DATE_IS_NOBEGIN(date) ? "-infinity" : "infinity";
+
+	j2date(date + POSTGRES_EPOCH_JDATE, &(tm.tm_year), &(tm.tm_mon), &(tm.tm_mday));
+	EncodeDateOnly(&tm, USE_XSD_DATES, tmp);
+	return tmp;
+}
+
+static const char *format_timestamp(Timestamp timestamp, bool withTimezone, char *tmp) {
+	struct pg_tm tm;
+	fsec_t       fsec;
+	int          tz;
+	const char   *tzn = NULL;
+
+	if (TIMESTAMP_NOT_FINITE(timestamp))
+		return TIMESTAMP_IS_NOBEGIN(timestamp) ? "-infinity" : "infinity";
+
+	if (withTimezone ? timestamp2tm(timestamp, &tz, &tm, &fsec, &tzn, NULL) != 0
+					 : timestamp2tm(timestamp, NULL, &tm, &fsec, NULL, NULL) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+						errmsg("timestamp out of range")));
+
+	EncodeDateTime(&tm, fsec, withTimezone, withTimezone ? tz : 0, tzn, USE_XSD_DATES, tmp);
+	return tmp;
+}
+
+static void append_string(StringInfo buf, const char *str, int len, bool smile) {
+	if (smile)
+		smile_append_string(buf, str, len);
+	else
+		append_escaped(buf, str, len);
+}
+
+/*
+ * Append some json, as Smile if that's what we're writing
+ */
+static void append_json(StringInfo buf, char *json, int len, bool smile) {
+	if (smile)
+		smile_append_json(buf, json, len);
+	else
+		append_single_line(buf, json, len);
+}
+
+static void append_scalar(StringInfo buf, RowSerializerKind kind, FmgrInfo *output, Datum value, bool smile) {
+	char tmp[MAXDATELEN + 1];
+
+	switch (kind) {
+		case RS_INT2:
+			if (smile)
+				smile_append_int64(buf, DatumGetInt16(value));
+			else
+				json_append_int32(buf, DatumGetInt16(value));
+			break;
+
+		case RS_INT4:
+			if (smile)
+				smile_append_int64(buf, DatumGetInt32(value));
+			else
+				json_append_int32(buf, DatumGetInt32(value));
+			break;
+
+		case RS_INT8: {
+			int64 i = DatumGetInt64(value);
+
+			if (smile) {
+				smile_append_int64(buf, i);
+			} else if (i < 0) {
+				appendStringInfoCharMacro(buf, '-');
+				json_append_uint64(buf, i == PG_INT64_MIN ? (uint64) PG_INT64_MAX + 1 : (uint64) -i);
+			} else {
+				json_append_uint64(buf, (uint64) i);
+			}
+		}
+			break;
+
+		case RS_FLOAT4:
+			append_float(buf, DatumGetFloat4(value), FLT_DIG, smile);
+			break;
+
+		case RS_FLOAT8:
+			append_float(buf, DatumGetFloat8(value), DBL_DIG, smile);
+			break;
+
+		case RS_NUMBER: {
+			char *str = OutputFunctionCall(output, value);
+			int  len  = (int) strlen(str);
+
+			if (!IsValidJsonNumber(str, len))
+				append_string(buf, str, len, smile);
+			else if (smile)
+				smile_append_number(buf, str, len);
+			else
+				appendBinaryStringInfo(buf, str, len);
+		}
+			break;
+
+		case RS_BOOL:
+			if (smile)
+				smile_append_bool(buf, DatumGetBool(value));
+			else
+				appendStringInfoString(buf, DatumGetBool(value) ? "true" : "false");
+			break;
+
+		case RS_TEXT: {
+			text *t = DatumGetTextPP(value);
+
+			append_string(buf, VARDATA_ANY(t), (int) VARSIZE_ANY_EXHDR(t), smile);
+		}
+			break;
+
+		case RS_DATE:
+		case RS_TIMESTAMP:
+		case RS_TIMESTAMPTZ: {
+			const char *str;
+
+			if (kind == RS_DATE)
+				str = format_date(DatumGetDateADT(value), tmp);
+			else
+				str = format_timestamp(DatumGetTimestamp(value), kind == RS_TIMESTAMPTZ, tmp);
+
+			append_string(buf, str, (int) strlen(str), smile);
+		}
+			break;
+
+		case RS_JSON: {
+			text *t = DatumGetTextPP(value);
+
+			append_json(buf, VARDATA_ANY(t), (int) VARSIZE_ANY_EXHDR(t), smile);
+		}
+			break;
+
+		case RS_RAW: {
+			char *str = OutputFunctionCall(output, value);
+
+			if (smile)
+				smile_append_json(buf, str, (int) strlen(str));
+			else
+				appendStringInfoString(buf, str);
+		}
+			break;
+
+		default:
+			elog(ERROR, "unexpected row serializer kind: %d", kind);
+	}
+}
+
+static void append_array(StringInfo buf, RowSerializerColumn *column, Datum value, bool smile) {
+	ArrayType *array = DatumGetArrayTypeP(value);
+	Datum     *elems;
+	bool      *nulls;
+	int       nelems;
+	int       i;
+
+	if (ARR_NDIM(array) > 1) {
+		/* leave nesting the dimensions to Postgres */
+		text *json = DatumGetTextPP(DirectFunctionCall1(array_to_json, PointerGetDatum(array)));
+
+		append_json(buf, VARDATA_ANY(json), (int) VARSIZE_ANY_EXHDR(json), smile);
+		return;
+	}
+
+	deconstruct_array(array, column->elemType, column->elemLen, column->elemByVal, column->elemAlign,
+					  &elems, &nulls, &nelems);
+
+	if (smile)
+		smile_append_start_array(buf);
+	else
+		appendStringInfoCharMacro(buf, '[');
+	for (i = 0; i < nelems; i++) {
+		if (i > 0 && !smile)
+			appendStringInfoCharMacro(buf, ',');
+
+		if (!nulls[i])
+			append_scalar(buf, column->elemKind, &column->output, elems[i], smile);
+		else if (smile)
+			smile_append_null(buf);
+		else
+			appendStringInfoString(buf, "null");
+	}
+	if (smile)
+		smile_append_end_array(buf);
+	else
+		appendStringInfoCharMacro(buf, ']');
+}
+
+/*
+ * Which of the types we write ourselves is this?
+ */
+static bool classify_type(Oid typid, RowSerializerKind *kind) {
+	switch (getBaseType(typid)) {
+		case INT2OID:
+			*kind = RS_INT2;
+			return true;
+		case INT4OID:
+			*kind = RS_INT4;
+			return true;
+		case INT8OID:
+			*kind = RS_INT8;
+			return true;
+		case FLOAT4OID:
+			*kind = RS_FLOAT4;
+			return true;
+		case FLOAT8OID:
+			*kind = RS_FLOAT8;
+			return true;
+		case NUMERICOID:
+			*kind = RS_NUMBER;
+			return true;
+		case BOOLOID:
+			*kind = RS_BOOL;
+			return true;
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			*kind = RS_TEXT;
+			return true;
+		case DATEOID:
+			*kind = RS_DATE;
+			return true;
+		case TIMESTAMPOID:
+			*kind = RS_TIMESTAMP;
+			return true;
+		case TIMESTAMPTZOID:
+			*kind = RS_TIMESTAMPTZ;
+			return true;
+		case JSONOID:
+			*kind = RS_JSON;
+			return true;
+		case JSONBOID:
+			*kind = RS_RAW;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void compile(RowSerializer *serializer, TupleDesc tupdesc) {
+	MemoryContext oldContext;
+	bool          first = true;
+	int           i;
+
+	MemoryContextReset(serializer->memcxt);
+	oldContext = MemoryContextSwitchTo(serializer->memcxt);
+
+	serializer->typid        = tupdesc->tdtypeid;
+	serializer->typmod       = tupdesc->tdtypmod;
+	serializer->tupdesc      = CreateTupleDescCopy(tupdesc);
+	serializer->generic      = false;
+	serializer->columns      = palloc0(sizeof(RowSerializerColumn) * Max(tupdesc->natts, 1));
+	serializer->values       = palloc(sizeof(Datum) * Max(tupdesc->natts, 1));
+	serializer->nulls        = palloc(sizeof(bool) * Max(tupdesc->natts, 1));
+
+	for (i = 0; i < tupdesc->natts; i++) {
+		Form_pg_attribute   attr    = tupdesc->attrs[i];
+		RowSerializerColumn *column = &serializer->columns[i];
+		StringInfoData      key;
+		Oid                 elemType;
+		Oid                 outputType = InvalidOid;
+
+		if (attr->attisdropped)
+			continue;
+
+		initStringInfo(&key);
+		if (serializer->smile) {
+			smile_append_key(&key, NameStr(attr->attname), (int) strlen(NameStr(attr->attname)));
+		} else {
+			if (!first)
+				appendStringInfoCharMacro(&key, ',');
+			append_escaped(&key, NameStr(attr->attname), (int) strlen(NameStr(attr->attname)));
+			appendStringInfoCharMacro(&key, ':');
+		}
+		column->key    = key.data;
+		column->keylen = key.len;
+		first = false;
+
+		if (classify_type(attr->atttypid, &column->kind)) {
+			outputType = attr->atttypid;
+		} else if ((elemType = get_element_type(getBaseType(attr->atttypid))) != InvalidOid &&
+				   classify_type(elemType, &column->elemKind)) {
+			column->kind     = RS_ARRAY;
+			column->elemType = elemType;
+			get_typlenbyvalalign(elemType, &column->elemLen, &column->elemByVal, &column->elemAlign);
+			outputType = elemType;
+		} else {
+			serializer->generic = true;
+		}
+
+		if (column->kind == RS_NUMBER || column->kind == RS_RAW ||
+			(column->kind == RS_ARRAY && (column->elemKind == RS_NUMBER || column->elemKind == RS_RAW))) {
+			Oid  outfunc;
+			bool isvarlena;
+
+			getTypeOutputInfo(outputType, &outfunc, &isvarlena);
+			fmgr_info_cxt(outfunc, &column->output, serializer->memcxt);
+		}
+	}
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * Make a serializer for rows of the specified type.  If we don't know the type yet, tupdesc can be NULL
+ * and we'll figure it out from the first row.  If smile is true, we write Smile rather than json
+ */
+RowSerializer *row_serializer_create(TupleDesc tupdesc, bool smile) {
+	RowSerializer *serializer = palloc0(sizeof(RowSerializer));
+
+	serializer->memcxt = AllocSetContextCreate(CurrentMemoryContext, "RowSerializer",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE, ALLOCSET_SMALL_MAXSIZE);
+	serializer->typid  = InvalidOid;
+	serializer->typmod = -1;
+	serializer->smile  = smile;
+
+	if (tupdesc != NULL)
+		compile(serializer, tupdesc);
+
+	return serializer;
+}
+
+void row_serializer_free(RowSerializer *serializer) {
+	MemoryContextDelete(serializer->memcxt);
+	pfree(serializer);
+}
+
+/*
+ * Append the row's document to buf, without its closing brace (or Smile end-object marker).  Anything we need to allocate
+ * along the way, such as detoasted values, goes in the scratch context, which the caller should reset
+ */
+void row_serializer_append(RowSerializer *serializer, StringInfo buf, Datum record, MemoryContext scratch) {
+	MemoryContext   oldContext = MemoryContextSwitchTo(scratch);
+	HeapTupleHeader td         = DatumGetHeapTupleHeader(record);
+	HeapTupleData   tuple;
+	int             i;
+
+	if (HeapTupleHeaderGetTypeId(td) != serializer->typid || HeapTupleHeaderGetTypMod(td) != serializer->typmod) {
+		TupleDesc tupdesc = lookup_rowtype_tupdesc(HeapTupleHeaderGetTypeId(td), HeapTupleHeaderGetTypMod(td));
+
+		compile(serializer, tupdesc);
+		ReleaseTupleDesc(tupdesc);
+	}
+
+	if (serializer->smile)
+		smile_append_header(buf);
+
+	if (serializer->generic) {
+		text *json = DatumGetTextPP(DirectFunctionCall1(row_to_json, PointerGetDatum(td)));
+		char *data = VARDATA_ANY(json);
+		int  len   = (int) VARSIZE_ANY_EXHDR(json);
+
+		if (serializer->smile) {
+			/* the object's end marker is its last byte */
+			smile_append_json(buf, data, len);
+			buf->len--;
+			buf->data[buf->len] = '\0';
+			MemoryContextSwitchTo(oldContext);
+			return;
+		}
+
+		/* drop the closing brace */
+		while (len > 0 && data[len - 1] != '}')
+			len--;
+		if (len == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+							errmsg("improper JSON format")));
+
+		/* row_to_json() writes a json value in a composite column, or in an array of them, as-is */
+		append_single_line(buf, data, len - 1);
+		MemoryContextSwitchTo(oldContext);
+		return;
+	}
+
+	tuple.t_len  = HeapTupleHeaderGetDatumLength(td);
+	ItemPointerSetInvalid(&(tuple.t_self));
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = td;
+	heap_deform_tuple(&tuple, serializer->tupdesc, serializer->values, serializer->nulls);
+
+	if (serializer->smile)
+		smile_append_start_object(buf);
+	else
+		appendStringInfoCharMacro(buf, '{');
+	for (i = 0; i < serializer->tupdesc->natts; i++) {
+		RowSerializerColumn *column = &serializer->columns[i];
+
+		if (column->key == NULL)
+			continue;    /* dropped */
+
+		appendBinaryStringInfo(buf, column->key, column->keylen);
+		if (!serializer->nulls[i] && column->kind == RS_ARRAY)
+			append_array(buf, column, serializer->values[i], serializer->smile);
+		else if (!serializer->nulls[i])
+			append_scalar(buf, column->kind, &column->output, serializer->values[i], serializer->smile);
+		else if (serializer->smile)
+			smile_append_null(buf);
+		else
+			appendStringInfoString(buf, "null");
+	}
+
+	MemoryContextSwitchTo(oldContext);
+}
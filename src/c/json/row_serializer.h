@@ -0,0 +1,33 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZDB_ROW_SERIALIZER_H__
+#define __ZDB_ROW_SERIALIZER_H__
+
+#include "postgres.h"
+#include "access/tupdesc.h"
+#include "lib/stringinfo.h"
+
+typedef struct RowSerializer RowSerializer;
+
+RowSerializer *row_serializer_create(TupleDesc tupdesc, bool smile);
+void row_serializer_free(RowSerializer *serializer);
+void row_serializer_append(RowSerializer *serializer, StringInfo buf, Datum record, MemoryContext scratch);
+
+void json_append_uint64(StringInfo buf, uint64 value);
+void json_append_int32(StringInfo buf, int32 value);
+
+#endif /* __ZDB_ROW_SERIALIZER_H__ */
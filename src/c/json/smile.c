@@ -0,0 +1,501 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A writer for Smile, the binary json format Elasticsearch accepts as application/smile.
+ * See https://github.com/FasterXML/smile-format-specification
+ *
+ * We never use Smile's shared (back-referenced) names or values, or raw binary, so that every
+ * document stands alone and can never contain the 0xFF byte that separates _bulk documents.
+ * Strings must be UTF8, which is why the "smile" bulk_format requires a UTF8 database
+ */
+#include "smile.h"
+
+#include "miscadmin.h"
+
+#include <math.h>
+
+#define SMILE_TOKEN_EMPTY_STRING      0x20
+#define SMILE_TOKEN_NULL              0x21
+#define SMILE_TOKEN_FALSE             0x22
+#define SMILE_TOKEN_TRUE              0x23
+#define SMILE_TOKEN_INT32             0x24
+#define SMILE_TOKEN_INT64             0x25
+#define SMILE_TOKEN_FLOAT32           0x28
+#define SMILE_TOKEN_FLOAT64           0x29
+#define SMILE_TOKEN_TINY_ASCII        0x40    /* 1-32 bytes */
+#define SMILE_TOKEN_SHORT_ASCII       0x60    /* 33-64 bytes */
+#define SMILE_TOKEN_TINY_UNICODE      0x80    /* 2-33 bytes */
+#define SMILE_TOKEN_SHORT_UNICODE     0xA0    /* 34-65 bytes */
+#define SMILE_TOKEN_SMALL_INT         0xC0    /* -16 to 15 */
+#define SMILE_TOKEN_LONG_ASCII        0xE0
+#define SMILE_TOKEN_LONG_UNICODE      0xE4
+#define SMILE_TOKEN_START_ARRAY       0xF8
+#define SMILE_TOKEN_END_ARRAY         0xF9
+#define SMILE_TOKEN_START_OBJECT      0xFA
+#define SMILE_TOKEN_END_OBJECT        0xFB
+#define SMILE_END_OF_STRING           0xFC
+
+#define SMILE_KEY_EMPTY_STRING        0x20
+#define SMILE_KEY_LONG_NAME           0x34
+#define SMILE_KEY_SHORT_ASCII         0x80    /* 1-64 bytes */
+#define SMILE_KEY_SHORT_UNICODE       0xC0    /* 2-57 bytes */
+
+static inline void append_byte(StringInfo buf, int b) {
+	appendStringInfoCharMacro(buf, (char) b);
+}
+
+static inline bool is_ascii(const char *str, int len) {
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((unsigned char) str[i] >= 0x80)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Smile's variable length integers are big-endian groups of 7 bits, except the last byte,
+ * which has 6 bits and its high bit set
+ */
+static void append_vint(StringInfo buf, uint64 value) {
+	char tmp[11];
+	int  n = sizeof(tmp);
+
+	tmp[--n] = (char) (0x80 | (value & 0x3F));
+	value >>= 6;
+	while (value != 0) {
+		tmp[--n] = (char) (value & 0x7F);
+		value >>= 7;
+	}
+
+	appendBinaryStringInfo(buf, tmp + n, (int) sizeof(tmp) - n);
+}
+
+void smile_append_header(StringInfo buf) {
+	/* ":)\n" and then version 0, without shared names or values, and without raw binary */
+	appendBinaryStringInfo(buf, ":)\n\0", 4);
+}
+
+void smile_append_start_object(StringInfo buf) {
+	append_byte(buf, SMILE_TOKEN_START_OBJECT);
+}
+
+void smile_append_end_object(StringInfo buf) {
+	append_byte(buf, SMILE_TOKEN_END_OBJECT);
+}
+
+void smile_append_start_array(StringInfo buf) {
+	append_byte(buf, SMILE_TOKEN_START_ARRAY);
+}
+
+void smile_append_end_array(StringInfo buf) {
+	append_byte(buf, SMILE_TOKEN_END_ARRAY);
+}
+
+void smile_append_key(StringInfo buf, const char *key, int len) {
+	bool ascii = is_ascii(key, len);
+
+	if (len == 0) {
+		append_byte(buf, SMILE_KEY_EMPTY_STRING);
+		return;
+	} else if (ascii && len <= 64) {
+		append_byte(buf, SMILE_KEY_SHORT_ASCII + (len - 1));
+	} else if (!ascii && len <= 57) {
+		append_byte(buf, SMILE_KEY_SHORT_UNICODE + (len - 2));
+	} else {
+		append_byte(buf, SMILE_KEY_LONG_NAME);
+		appendBinaryStringInfo(buf, key, len);
+		append_byte(buf, SMILE_END_OF_STRING);
+		return;
+	}
+
+	appendBinaryStringInfo(buf, key, len);
+}
+
+void smile_append_string(StringInfo buf, const char *str, int len) {
+	bool ascii = is_ascii(str, len);
+
+	if (len == 0) {
+		append_byte(buf, SMILE_TOKEN_EMPTY_STRING);
+		return;
+	} else if (ascii && len <= 32) {
+		append_byte(buf, SMILE_TOKEN_TINY_ASCII + (len - 1));
+	} else if (ascii && len <= 64) {
+		append_byte(buf, SMILE_TOKEN_SHORT_ASCII + (len - 33));
+	} else if (!ascii && len <= 33) {
+		append_byte(buf, SMILE_TOKEN_TINY_UNICODE + (len - 2));
+	} else if (!ascii && len <= 65) {
+		append_byte(buf, SMILE_TOKEN_SHORT_UNICODE + (len - 34));
+	} else {
+		append_byte(buf, ascii ? SMILE_TOKEN_LONG_ASCII : SMILE_TOKEN_LONG_UNICODE);
+		appendBinaryStringInfo(buf, str, len);
+		append_byte(buf, SMILE_END_OF_STRING);
+		return;
+	}
+
+	appendBinaryStringInfo(buf, str, len);
+}
+
+void smile_append_int64(StringInfo buf, int64 value) {
+	/* zigzag encoding, so small negative numbers are small too */
+	uint64 zigzag = ((uint64) value << 1) ^ (uint64) (value >> 63);
+
+	if (value >= -16 && value <= 15) {
+		append_byte(buf, SMILE_TOKEN_SMALL_INT + (int) zigzag);
+		return;
+	}
+
+	append_byte(buf, value >= PG_INT32_MIN && value <= PG_INT32_MAX ? SMILE_TOKEN_INT32 : SMILE_TOKEN_INT64);
+	append_vint(buf, zigzag);
+}
+
+/*
+ * Floating point numbers are their IEEE 754 bits, in big-endian groups of 7
+ */
+void smile_append_double(StringInfo buf, double value) {
+	uint64 bits;
+	char   tmp[10];
+	int    i;
+
+	memcpy(&bits, &value, sizeof(bits));
+	for (i = 0; i < 10; i++)
+		tmp[i] = (char) ((bits >> (7 * (9 - i))) & 0x7F);
+
+	append_byte(buf, SMILE_TOKEN_FLOAT64);
+	appendBinaryStringInfo(buf, tmp, sizeof(tmp));
+}
+
+void smile_append_float(StringInfo buf, float value) {
+	uint32 bits;
+	char   tmp[5];
+	int    i;
+
+	memcpy(&bits, &value, sizeof(bits));
+	for (i = 0; i < 5; i++)
+		tmp[i] = (char) ((bits >> (7 * (4 - i))) & 0x7F);
+
+	append_byte(buf, SMILE_TOKEN_FLOAT32);
+	appendBinaryStringInfo(buf, tmp, sizeof(tmp));
+}
+
+void smile_append_bool(StringInfo buf, bool value) {
+	append_byte(buf, value ? SMILE_TOKEN_TRUE : SMILE_TOKEN_FALSE);
+}
+
+void smile_append_null(StringInfo buf) {
+	append_byte(buf, SMILE_TOKEN_NULL);
+}
+
+/*
+ * Append a number that's in json's format.  Integers that fit in 64 bits are sent as such, and
+ * anything else as a double, which is what Elasticsearch would have parsed the json into anyway
+ */
+void smile_append_number(StringInfo buf, const char *str, int len) {
+	char   tmp[64];
+	char   *copy;
+	uint64 magnitude = 0;
+	bool   negative  = len > 0 && str[0] == '-';
+	bool   integral  = len > (negative ? 1 : 0);
+	int    i;
+
+	for (i = negative ? 1 : 0; i < len && integral; i++) {
+		if (str[i] < '0' || str[i] > '9' || magnitude > (PG_UINT64_MAX - 9) / 10)
+			integral = false;
+		else
+			magnitude = magnitude * 10 + (str[i] - '0');
+	}
+
+	if (integral && magnitude <= (uint64) PG_INT64_MAX + (negative ? 1 : 0)) {
+		smile_append_int64(buf, negative ? (int64) (0 - magnitude) : (int64) magnitude);
+		return;
+	}
+
+	/* strtod() needs it NULL-terminated */
+	copy = len < (int) sizeof(tmp) ? tmp : palloc(len + 1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	smile_append_double(buf, strtod(copy, NULL));
+	if (copy != tmp)
+		pfree(copy);
+}
+
+/*
+ * Convert json into Smile
+ */
+typedef struct JsonTranscoder {
+	const char     *pos;
+	const char     *end;
+	StringInfoData decoded;    /* a string value or key with its escapes decoded */
+} JsonTranscoder;
+
+static void transcode_value(StringInfo buf, JsonTranscoder *t);
+
+static void invalid_json(void) {
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					errmsg("improper JSON format")));
+}
+
+static inline void skip_whitespace(JsonTranscoder *t) {
+	while (t->pos < t->end && (*t->pos == ' ' || *t->pos == '\t' || *t->pos == '\n' || *t->pos == '\r' || *t->pos == '\f'))
+		t->pos++;
+}
+
+static inline void expect(JsonTranscoder *t, char c) {
+	skip_whitespace(t);
+	if (t->pos >= t->end || *t->pos != c)
+		invalid_json();
+	t->pos++;
+}
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	invalid_json();
+	return 0;    /* keep compiler quiet */
+}
+
+static unsigned int read_hex4(JsonTranscoder *t) {
+	unsigned int value = 0;
+	int          i;
+
+	if (t->end - t->pos < 4)
+		invalid_json();
+	for (i = 0; i < 4; i++)
+		value = (value << 4) | (unsigned int) hex_digit(*t->pos++);
+	return value;
+}
+
+static void append_utf8(StringInfo buf, unsigned int cp) {
+	if (cp < 0x80) {
+		append_byte(buf, (int) cp);
+	} else if (cp < 0x800) {
+		append_byte(buf, (int) (0xC0 | (cp >> 6)));
+		append_byte(buf, (int) (0x80 | (cp & 0x3F)));
+	} else if (cp < 0x10000) {
+		append_byte(buf, (int) (0xE0 | (cp >> 12)));
+		append_byte(buf, (int) (0x80 | ((cp >> 6) & 0x3F)));
+		append_byte(buf, (int) (0x80 | (cp & 0x3F)));
+	} else {
+		append_byte(buf, (int) (0xF0 | (cp >> 18)));
+		append_byte(buf, (int) (0x80 | ((cp >> 12) & 0x3F)));
+		append_byte(buf, (int) (0x80 | ((cp >> 6) & 0x3F)));
+		append_byte(buf, (int) (0x80 | (cp & 0x3F)));
+	}
+}
+
+/*
+ * Read the string at the current position.  If it has no escapes, we point right at it in the
+ * json, otherwise at our decoded copy
+ */
+static void read_string(JsonTranscoder *t, const char **str, int *len) {
+	const char *start;
+
+	expect(t, '"');
+	start = t->pos;
+	while (t->pos < t->end && *t->pos != '"' && *t->pos != '\\')
+		t->pos++;
+	if (t->pos >= t->end)
+		invalid_json();
+
+	if (*t->pos == '"') {
+		*str = start;
+		*len = (int) (t->pos - start);
+		t->pos++;
+		return;
+	}
+
+	resetStringInfo(&t->decoded);
+	appendBinaryStringInfo(&t->decoded, start, (int) (t->pos - start));
+	while (t->pos < t->end && *t->pos != '"') {
+		char c = *t->pos++;
+
+		if (c != '\\') {
+			appendStringInfoCharMacro(&t->decoded, c);
+			continue;
+		}
+
+		if (t->pos >= t->end)
+			invalid_json();
+
+		switch (c = *t->pos++) {
+			case 'b':
+				appendStringInfoCharMacro(&t->decoded, '\b');
+				break;
+			case 'f':
+				appendStringInfoCharMacro(&t->decoded, '\f');
+				break;
+			case 'n':
+				appendStringInfoCharMacro(&t->decoded, '\n');
+				break;
+			case 'r':
+				appendStringInfoCharMacro(&t->decoded, '\r');
+				break;
+			case 't':
+				appendStringInfoCharMacro(&t->decoded, '\t');
+				break;
+			case 'u': {
+				unsigned int cp = read_hex4(t);
+
+				/* a surrogate pair */
+				if (cp >= 0xD800 && cp <= 0xDBFF && t->end - t->pos >= 6 && t->pos[0] == '\\' && t->pos[1] == 'u') {
+					unsigned int low;
+
+					t->pos += 2;
+					low = read_hex4(t);
+					if (low < 0xDC00 || low > 0xDFFF)
+						invalid_json();
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				append_utf8(&t->decoded, cp);
+			}
+				break;
+			default:
+				/* \", \\, and \/ */
+				appendStringInfoCharMacro(&t->decoded, c);
+				break;
+		}
+	}
+	if (t->pos >= t->end)
+		invalid_json();
+	t->pos++;
+
+	*str = t->decoded.data;
+	*len = t->decoded.len;
+}
+
+static void transcode_value(StringInfo buf, JsonTranscoder *t) {
+	const char *str;
+	int        len;
+
+	check_stack_depth();
+
+	skip_whitespace(t);
+	if (t->pos >= t->end)
+		invalid_json();
+
+	switch (*t->pos) {
+		case '{':
+			t->pos++;
+			append_byte(buf, SMILE_TOKEN_START_OBJECT);
+			skip_whitespace(t);
+			if (t->pos < t->end && *t->pos == '}') {
+				t->pos++;
+			} else {
+				for (;;) {
+					read_string(t, &str, &len);
+					smile_append_key(buf, str, len);
+					expect(t, ':');
+					transcode_value(buf, t);
+
+					skip_whitespace(t);
+					if (t->pos < t->end && *t->pos == ',') {
+						t->pos++;
+						continue;
+					}
+					expect(t, '}');
+					break;
+				}
+			}
+			append_byte(buf, SMILE_TOKEN_END_OBJECT);
+			break;
+
+		case '[':
+			t->pos++;
+			append_byte(buf, SMILE_TOKEN_START_ARRAY);
+			skip_whitespace(t);
+			if (t->pos < t->end && *t->pos == ']') {
+				t->pos++;
+			} else {
+				for (;;) {
+					transcode_value(buf, t);
+
+					skip_whitespace(t);
+					if (t->pos < t->end && *t->pos == ',') {
+						t->pos++;
+						continue;
+					}
+					expect(t, ']');
+					break;
+				}
+			}
+			append_byte(buf, SMILE_TOKEN_END_ARRAY);
+			break;
+
+		case '"':
+			read_string(t, &str, &len);
+			smile_append_string(buf, str, len);
+			break;
+
+		case 't':
+			if (t->end - t->pos < 4 || strncmp(t->pos, "true", 4) != 0)
+				invalid_json();
+			t->pos += 4;
+			append_byte(buf, SMILE_TOKEN_TRUE);
+			break;
+
+		case 'f':
+			if (t->end - t->pos < 5 || strncmp(t->pos, "false", 5) != 0)
+				invalid_json();
+			t->pos += 5;
+			append_byte(buf, SMILE_TOKEN_FALSE);
+			break;
+
+		case 'n':
+			if (t->end - t->pos < 4 || strncmp(t->pos, "null", 4) != 0)
+				invalid_json();
+			t->pos += 4;
+			append_byte(buf, SMILE_TOKEN_NULL);
+			break;
+
+		default: {
+			const char *start = t->pos;
+
+			while (t->pos < t->end && (isdigit((unsigned char) *t->pos) || *t->pos == '-' || *t->pos == '+' ||
+									   *t->pos == '.' || *t->pos == 'e' || *t->pos == 'E'))
+				t->pos++;
+			if (t->pos == start)
+				invalid_json();
+
+			smile_append_number(buf, start, (int) (t->pos - start));
+		}
+			break;
+	}
+}
+
+/*
+ * Append a json value as Smile.  The json must be UTF8, and be just one value
+ */
+void smile_append_json(StringInfo buf, const char *json, int len) {
+	JsonTranscoder t;
+
+	t.pos = json;
+	t.end = json + len;
+	initStringInfo(&t.decoded);
+
+	transcode_value(buf, &t);
+	skip_whitespace(&t);
+	if (t.pos != t.end)
+		invalid_json();
+
+	pfree(t.decoded.data);
+}
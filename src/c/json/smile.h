@@ -0,0 +1,43 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZDB_SMILE_H__
+#define __ZDB_SMILE_H__
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+/* what separates the documents of a _bulk request in Smile, and never appears inside one */
+#define SMILE_STREAM_SEPARATOR ((char) 0xFF)
+
+#define SMILE_CONTENT_TYPE "application/smile"
+
+void smile_append_header(StringInfo buf);
+void smile_append_start_object(StringInfo buf);
+void smile_append_end_object(StringInfo buf);
+void smile_append_start_array(StringInfo buf);
+void smile_append_end_array(StringInfo buf);
+void smile_append_key(StringInfo buf, const char *key, int len);
+void smile_append_string(StringInfo buf, const char *str, int len);
+void smile_append_int64(StringInfo buf, int64 value);
+void smile_append_double(StringInfo buf, double value);
+void smile_append_float(StringInfo buf, float value);
+void smile_append_bool(StringInfo buf, bool value);
+void smile_append_null(StringInfo buf);
+void smile_append_number(StringInfo buf, const char *str, int len);
+void smile_append_json(StringInfo buf, const char *json, int len);
+
+#endif /* __ZDB_SMILE_H__ */
@@ -0,0 +1,304 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Cluster-wide admission control for _bulk requests.
+ *
+ * Every backend would otherwise open up to an index's bulk_concurrency requests on its own,
+ * so many concurrent writers can swamp Elasticsearch.  When ZomboDB is in
+ * shared_preload_libraries, we keep a count of in-flight _bulk requests per Elasticsearch URL
+ * in shared memory, and a backend must take one of the zdb.max_concurrent_bulk_requests
+ * tokens for that URL before it sends a request.
+ *
+ * When ZomboDB isn't preloaded there's no shared memory for this, and every request is admitted
+ */
+#include "admission.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "postmaster/autovacuum.h"
+#include "storage/backendid.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+PG_FUNCTION_INFO_V1(zdb_bulk_admission);
+
+typedef struct AdmissionUrl {
+	char url[MAX_ADMISSION_URL_LEN];
+	int  inflight;
+} AdmissionUrl;
+
+typedef struct AdmissionBackend {
+	int         pid;
+	int         holding[MAX_ADMISSION_URLS];    /* tokens we hold, per URL */
+	int         waiting;                        /* the URL we're waiting for a token for, or -1 */
+	TimestampTz waitingSince;
+} AdmissionBackend;
+
+typedef struct AdmissionShmem {
+	LWLock           *lock;
+	int              nurls;
+	int              nbackends;
+	AdmissionUrl     urls[MAX_ADMISSION_URLS];
+	AdmissionBackend backends[FLEXIBLE_ARRAY_MEMBER];    /* indexed by MyBackendId - 1 */
+} AdmissionShmem;
+
+/* defined in zdbam.c */
+extern int zdb_max_concurrent_bulk_requests_guc;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static AdmissionShmem          *admission              = NULL;
+static int                     admissionBackends       = 0;
+static bool                    exitCallbackRegistered  = false;
+
+/* so we don't need the lock at the end of every transaction just to find out we hold nothing */
+static int                     localHeld               = 0;
+static bool                    localWaiting            = false;
+
+static Size admission_shmem_size(void) {
+	return add_size(offsetof(AdmissionShmem, backends), mul_size(admissionBackends, sizeof(AdmissionBackend)));
+}
+
+static void admission_shmem_startup(void) {
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	admission = ShmemInitStruct("zombodb bulk admission", admission_shmem_size(), &found);
+	if (!found) {
+		int i;
+
+		memset(admission, 0, admission_shmem_size());
+		admission->lock      = &(GetNamedLWLockTranche("zombodb"))->lock;
+		admission->nbackends = admissionBackends;
+		for (i = 0; i < admission->nbackends; i++)
+			admission->backends[i].waiting = -1;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Our slot in shared memory, or NULL if we don't have one
+ */
+static AdmissionBackend *my_slot(void) {
+	if (admission == NULL || MyBackendId == InvalidBackendId || MyBackendId > admission->nbackends)
+		return NULL;
+	return &admission->backends[MyBackendId - 1];
+}
+
+/*lint -esym 715,code,arg ignore unused param */
+static void admission_exit_callback(int code, Datum arg) {
+	admission_release_all();
+}
+
+/*
+ * Ask for our shared memory.  Only possible when we're being loaded via shared_preload_libraries
+ */
+void admission_init(void) {
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	/* MaxBackends isn't computed yet, so do what it will */
+	admissionBackends = MaxConnections + autovacuum_max_workers + 1 + max_worker_processes;
+
+	RequestAddinShmemSpace(admission_shmem_size());
+	RequestNamedLWLockTranche("zombodb", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook      = admission_shmem_startup;
+}
+
+/*
+ * Find (or start tracking) the admission slot for an Elasticsearch URL.  Returns
+ * ADMISSION_UNLIMITED if there's no cluster-wide limit for it
+ */
+int admission_lookup(char *url) {
+	char key[MAX_ADMISSION_URL_LEN];
+	int  idx = ADMISSION_UNLIMITED;
+	int  i;
+
+	if (admission == NULL || zdb_max_concurrent_bulk_requests_guc <= 0)
+		return ADMISSION_UNLIMITED;
+
+	strlcpy(key, url, sizeof(key));
+
+	LWLockAcquire(admission->lock, LW_EXCLUSIVE);
+	for (i = 0; i < admission->nurls; i++) {
+		if (strcmp(admission->urls[i].url, key) == 0) {
+			idx = i;
+			break;
+		}
+	}
+
+	if (idx == ADMISSION_UNLIMITED && admission->nurls < MAX_ADMISSION_URLS) {
+		idx = admission->nurls++;
+		strlcpy(admission->urls[idx].url, key, MAX_ADMISSION_URL_LEN);
+		admission->urls[idx].inflight = 0;
+	}
+	LWLockRelease(admission->lock);
+
+	if (idx == ADMISSION_UNLIMITED)
+		elog(WARNING, "[zombodb] too many Elasticsearch URLs to limit bulk requests to %s", url);
+
+	return idx;
+}
+
+/*
+ * Take a token to send a request to the URL, if one is free.  If not, we're noted as
+ * waiting for one until we get it
+ */
+bool admission_try_acquire(int url_idx) {
+	AdmissionBackend *slot = my_slot();
+	bool             acquired;
+
+	if (url_idx == ADMISSION_UNLIMITED || slot == NULL)
+		return true;
+
+	if (!exitCallbackRegistered) {
+		before_shmem_exit(admission_exit_callback, (Datum) 0);
+		exitCallbackRegistered = true;
+	}
+
+	LWLockAcquire(admission->lock, LW_EXCLUSIVE);
+	slot->pid = MyProcPid;
+	if (admission->urls[url_idx].inflight < zdb_max_concurrent_bulk_requests_guc) {
+		admission->urls[url_idx].inflight++;
+		slot->holding[url_idx]++;
+		slot->waiting = -1;
+		acquired = true;
+	} else {
+		if (slot->waiting != url_idx) {
+			slot->waiting      = url_idx;
+			slot->waitingSince = GetCurrentTimestamp();
+		}
+		acquired = false;
+	}
+	LWLockRelease(admission->lock);
+
+	if (acquired)
+		localHeld++;
+	localWaiting = !acquired;
+
+	return acquired;
+}
+
+/*
+ * Give back a token we took for the URL
+ */
+void admission_release(int url_idx) {
+	AdmissionBackend *slot = my_slot();
+
+	if (url_idx == ADMISSION_UNLIMITED || slot == NULL)
+		return;
+
+	LWLockAcquire(admission->lock, LW_EXCLUSIVE);
+	if (slot->holding[url_idx] > 0) {
+		slot->holding[url_idx]--;
+		admission->urls[url_idx].inflight--;
+		localHeld--;
+	}
+	LWLockRelease(admission->lock);
+}
+
+/*
+ * Give back every token we hold and stop waiting.  Called when the transaction ends and when
+ * the backend exits, by which time we can't have any requests in flight
+ */
+void admission_release_all(void) {
+	AdmissionBackend *slot = my_slot();
+	int              i;
+
+	if (slot == NULL || (localHeld == 0 && !localWaiting))
+		return;
+
+	LWLockAcquire(admission->lock, LW_EXCLUSIVE);
+	for (i = 0; i < MAX_ADMISSION_URLS; i++) {
+		admission->urls[i].inflight -= slot->holding[i];
+		slot->holding[i] = 0;
+	}
+	slot->waiting = -1;
+	LWLockRelease(admission->lock);
+
+	localHeld    = 0;
+	localWaiting = false;
+}
+
+/*
+ * Who's holding, and who's waiting for, _bulk request tokens
+ */
+Datum zdb_bulk_admission(PG_FUNCTION_ARGS) {
+	ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc       tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext   oldcontext;
+	int             b;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult  = tupstore;
+	rsinfo->setDesc    = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	if (admission == NULL)
+		return (Datum) 0;    /* not preloaded, so there's nothing to show */
+
+	LWLockAcquire(admission->lock, LW_SHARED);
+	for (b = 0; b < admission->nbackends; b++) {
+		AdmissionBackend *slot = &admission->backends[b];
+		int              u;
+
+		for (u = 0; u < admission->nurls; u++) {
+			Datum values[7];
+			bool  nulls[7];
+
+			if (slot->holding[u] == 0 && slot->waiting != u)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+			values[0] = Int32GetDatum(slot->pid);
+			values[1] = CStringGetTextDatum(admission->urls[u].url);
+			values[2] = Int32GetDatum(zdb_max_concurrent_bulk_requests_guc);
+			values[3] = Int32GetDatum(admission->urls[u].inflight);
+			values[4] = Int32GetDatum(slot->holding[u]);
+			values[5] = BoolGetDatum(slot->waiting == u);
+			if (slot->waiting == u)
+				values[6] = TimestampTzGetDatum(slot->waitingSince);
+			else
+				nulls[6] = true;
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+	LWLockRelease(admission->lock);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
@@ -0,0 +1,37 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZDB_ADMISSION_H__
+#define __ZDB_ADMISSION_H__
+
+#include "postgres.h"
+
+/* the most distinct Elasticsearch URLs we can track in shared memory */
+#define MAX_ADMISSION_URLS 32
+
+/* URLs longer than this are truncated when we look them up, and displayed */
+#define MAX_ADMISSION_URL_LEN 256
+
+/* returned by admission_lookup() when there's no cluster-wide limit for a URL */
+#define ADMISSION_UNLIMITED (-1)
+
+void admission_init(void);
+int admission_lookup(char *url);
+bool admission_try_acquire(int url_idx);
+void admission_release(int url_idx);
+void admission_release_all(void);
+
+#endif /* __ZDB_ADMISSION_H__ */
@@ -0,0 +1,555 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * An optional helper thread that compresses and sends _bulk requests so that the
+ * backend can keep formatting tuples while that happens.
+ *
+ * The thread only ever touches libcurl, zlib, and the malloc()'d memory in this file.  It
+ * must never call into Postgres (no palloc, no elog, no latches), and it has every signal
+ * blocked so that Postgres' signal handlers always run on the backend's own thread.
+ *
+ * The backend hands it batches through one single-producer/single-consumer ring and gets
+ * them back, with their responses, through another.  The backend decides if a response is
+ * an error, so any ereport() happens on the backend's thread.  It also decides if Elasticsearch
+ * rejected a batch, and keeps it here until it's time to hand it to the thread again
+ */
+#include "bulk_thread.h"
+
+#include "port/atomics.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <zlib.h>
+
+typedef struct BulkJobRing {
+	pg_atomic_uint32 head;    /* next slot the producer fills */
+	pg_atomic_uint32 tail;    /* next slot the consumer empties */
+	uint32           mask;    /* size - 1, where size is a power of two */
+	BulkIOJob        **slots;
+} BulkJobRing;
+
+struct BulkIOThread {
+	pthread_t        thread;
+	int              concurrency;
+	int              compressionLevel;
+	bool             verbose;
+	int              capacity;    /* the most jobs the backend may have outstanding */
+
+	BulkJobRing      submitted;   /* backend -> thread */
+	BulkJobRing      completed;   /* thread -> backend */
+
+	/* the thread sleeps on this when it has nothing to do */
+	pthread_mutex_t  mutex;
+	pthread_cond_t   cond;
+	pg_atomic_uint32 finishing;   /* no more jobs are coming, so exit once idle */
+	pg_atomic_uint32 cancelled;   /* exit now */
+	pg_atomic_uint32 exited;      /* the thread has returned */
+
+	/* only the backend looks at these:  rejected jobs it'll submit again, oldest first */
+	BulkIOJob        *deferred;
+	BulkIOJob        *lastDeferred;
+	int              ndeferred;
+
+	BulkIOThread     *next;       /* in our list of running threads */
+};
+
+/* every thread we've started and not yet stopped, so they can be cancelled if the transaction aborts */
+static BulkIOThread *runningThreads = NULL;
+
+static bool ring_init(BulkJobRing *ring, uint32 size) {
+	pg_atomic_init_u32(&ring->head, 0);
+	pg_atomic_init_u32(&ring->tail, 0);
+	ring->mask  = size - 1;
+	ring->slots = calloc(size, sizeof(BulkIOJob *));
+	return ring->slots != NULL;
+}
+
+static bool ring_push(BulkJobRing *ring, BulkIOJob *job) {
+	uint32 head = pg_atomic_read_u32(&ring->head);
+	uint32 tail = pg_atomic_read_u32(&ring->tail);
+
+	if (head - tail > ring->mask)
+		return false;    /* full */
+
+	ring->slots[head & ring->mask] = job;
+	pg_write_barrier();    /* the job must be visible before the new head is */
+	pg_atomic_write_u32(&ring->head, head + 1);
+	return true;
+}
+
+static BulkIOJob *ring_pop(BulkJobRing *ring) {
+	uint32    tail = pg_atomic_read_u32(&ring->tail);
+	uint32    head = pg_atomic_read_u32(&ring->head);
+	BulkIOJob *job;
+
+	if (tail == head)
+		return NULL;    /* empty */
+
+	pg_read_barrier();     /* don't read the slot until we've seen the head that covers it */
+	job = ring->slots[tail & ring->mask];
+	pg_memory_barrier();   /* and finish reading it before the producer can reuse it */
+	pg_atomic_write_u32(&ring->tail, tail + 1);
+	return job;
+}
+
+static bool ring_is_empty(BulkJobRing *ring) {
+	return pg_atomic_read_u32(&ring->tail) == pg_atomic_read_u32(&ring->head);
+}
+
+static void wake_thread(BulkIOThread *thread) {
+	pthread_mutex_lock(&thread->mutex);
+	pthread_cond_signal(&thread->cond);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+static size_t thread_write_func(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	BulkIOJob *job = (BulkIOJob *) userdata;
+	size_t    len  = size * nmemb;
+	char      *response;
+
+	response = realloc(job->response, job->response_len + len + 1);
+	if (response == NULL)
+		return 0;    /* curl treats this as an error */
+
+	memcpy(response + job->response_len, ptr, len);
+	job->response = response;
+	job->response_len += len;
+	job->response[job->response_len] = '\0';
+	return len;
+}
+
+/*
+ * Compress a job's body (if we're supposed to) and add it to the multi handle.  Returns
+ * false if it couldn't be compressed, in which case the caller hands it straight back
+ */
+static bool start_job(BulkIOThread *thread, CURLM *multi, CURL *curl, BulkIOJob *job, struct curl_slist **headers, char **compressed) {
+	char   *body = job->data;
+	uLongf len   = (uLongf) job->len;
+
+	if (job->contentType != NULL) {
+		char header[128];
+
+		snprintf(header, sizeof(header), "Content-Type: %s", job->contentType);
+		*headers = curl_slist_append(NULL, header);
+		*headers = curl_slist_append(*headers, "Accept: application/json");
+	} else {
+		*headers = curl_slist_append(NULL, "Content-Type: application/json");
+	}
+	*compressed = NULL;
+
+	if (thread->compressionLevel > 0) {
+		len = compressBound((uLong) job->len);
+		*compressed = malloc(len);
+		if (*compressed == NULL) {
+			job->zlib_rc = Z_MEM_ERROR;
+			return false;
+		}
+
+		job->zlib_rc = compress2((Bytef *) *compressed, &len, (Bytef *) job->data, (uLong) job->len,
+								 thread->compressionLevel);
+		if (job->zlib_rc != Z_OK)
+			return false;
+
+		body = *compressed;
+		*headers = curl_slist_append(*headers, "Content-Encoding: deflate");
+	}
+
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "zdb");
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 0);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, thread_write_func);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, job);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 0);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60 * 60L);  /* timeout of 60 minutes */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, job->errorbuff);
+	curl_easy_setopt(curl, CURLOPT_URL, job->url);
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, thread->compressionLevel > 0 ? "" : NULL);
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, thread->verbose ? 1L : 0L);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) len);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+	job->sent = (size_t) len;
+
+	curl_multi_add_handle(multi, curl);
+	return true;
+}
+
+static void *bulk_thread_main(void *arg) {
+	BulkIOThread      *thread     = (BulkIOThread *) arg;
+	int               concurrency = thread->concurrency;
+	CURLM             *multi      = curl_multi_init();
+	CURL              **handles   = calloc(concurrency, sizeof(CURL *));
+	BulkIOJob         **jobs      = calloc(concurrency, sizeof(BulkIOJob *));
+	struct curl_slist **headers   = calloc(concurrency, sizeof(struct curl_slist *));
+	char              **bodies    = calloc(concurrency, sizeof(char *));
+	int               inflight    = 0;
+	int               i;
+
+	if (multi == NULL || handles == NULL || jobs == NULL || headers == NULL || bodies == NULL)
+		pg_atomic_write_u32(&thread->cancelled, 1);    /* the backend will see jobs never complete */
+
+	while (pg_atomic_read_u32(&thread->cancelled) == 0) {
+		CURLMsg *msg;
+		int     running;
+		int     msgs_left;
+
+		/* start as many of the submitted batches as we have free handles for */
+		for (i = 0; i < concurrency; i++) {
+			BulkIOJob *job;
+
+			if (jobs[i] != NULL)
+				continue;
+			if ((job = ring_pop(&thread->submitted)) == NULL)
+				break;
+
+			if (handles[i] == NULL)
+				handles[i] = curl_easy_init();
+			else
+				curl_easy_reset(handles[i]);
+
+			if (handles[i] == NULL) {
+				job->curl_rc = CURLE_FAILED_INIT;
+				ring_push(&thread->completed, job);
+			} else if (!start_job(thread, multi, handles[i], job, &headers[i], &bodies[i])) {
+				curl_slist_free_all(headers[i]);
+				headers[i] = NULL;
+				free(bodies[i]);
+				bodies[i] = NULL;
+				ring_push(&thread->completed, job);
+			} else {
+				jobs[i] = job;
+				inflight++;
+			}
+		}
+
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			for (i = 0; i < concurrency; i++) {
+				if (handles[i] == msg->easy_handle && jobs[i] != NULL) {
+					BulkIOJob *job = jobs[i];
+
+					job->curl_rc = msg->data.result;
+					curl_easy_getinfo(handles[i], CURLINFO_RESPONSE_CODE, &job->response_code);
+					curl_multi_remove_handle(multi, handles[i]);
+
+					curl_slist_free_all(headers[i]);
+					headers[i] = NULL;
+					free(bodies[i]);
+					bodies[i] = NULL;
+
+					/* the backend never has more jobs outstanding than this ring holds, so it can't be full */
+					ring_push(&thread->completed, job);
+					jobs[i] = NULL;
+					inflight--;
+					break;
+				}
+			}
+		}
+
+		if (inflight > 0) {
+			curl_multi_wait(multi, NULL, 0, 100, NULL);
+		} else if (ring_is_empty(&thread->submitted)) {
+			if (pg_atomic_read_u32(&thread->finishing) != 0)
+				break;
+
+			/* sleep until the backend gives us something to do */
+			pthread_mutex_lock(&thread->mutex);
+			while (ring_is_empty(&thread->submitted) &&
+				   pg_atomic_read_u32(&thread->finishing) == 0 &&
+				   pg_atomic_read_u32(&thread->cancelled) == 0)
+				pthread_cond_wait(&thread->cond, &thread->mutex);
+			pthread_mutex_unlock(&thread->mutex);
+		}
+	}
+
+	/* if we were cancelled there may still be jobs in flight, and they're ours to free */
+	for (i = 0; i < concurrency; i++) {
+		if (handles != NULL && handles[i] != NULL) {
+			if (jobs != NULL && jobs[i] != NULL)
+				curl_multi_remove_handle(multi, handles[i]);
+			curl_easy_cleanup(handles[i]);
+		}
+		if (jobs != NULL && jobs[i] != NULL)
+			bulk_thread_free_job(jobs[i]);
+		if (headers != NULL)
+			curl_slist_free_all(headers[i]);
+		if (bodies != NULL)
+			free(bodies[i]);
+	}
+
+	if (multi != NULL)
+		curl_multi_cleanup(multi);
+	free(handles);
+	free(jobs);
+	free(headers);
+	free(bodies);
+
+	pg_atomic_write_u32(&thread->exited, 1);
+	return NULL;
+}
+
+/*
+ * Start an I/O thread that sends the batches it's given, at most 'concurrency' at a time
+ */
+BulkIOThread *bulk_thread_start(int concurrency, int compressionLevel, bool verbose) {
+	BulkIOThread *thread = calloc(1, sizeof(BulkIOThread));
+	uint32       size    = 2;
+	sigset_t     allsigs;
+	sigset_t     oldsigs;
+	int          rc;
+
+	if (thread == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+						errmsg("out of memory")));
+
+	/* like our in-backend batch pool, one more than can be in flight at once */
+	thread->capacity = concurrency + 1;
+	while (size < (uint32) thread->capacity)
+		size <<= 1;
+
+	thread->concurrency      = concurrency;
+	thread->compressionLevel = compressionLevel;
+	thread->verbose          = verbose;
+	pg_atomic_init_u32(&thread->finishing, 0);
+	pg_atomic_init_u32(&thread->cancelled, 0);
+	pg_atomic_init_u32(&thread->exited, 0);
+
+	if (!ring_init(&thread->submitted, size) || !ring_init(&thread->completed, size)) {
+		free(thread->submitted.slots);
+		free(thread->completed.slots);
+		free(thread);
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+						errmsg("out of memory")));
+	}
+
+	pthread_mutex_init(&thread->mutex, NULL);
+	pthread_cond_init(&thread->cond, NULL);
+
+	/* the new thread inherits our signal mask, and it must never handle any signals */
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+	rc = pthread_create(&thread->thread, NULL, bulk_thread_main, thread);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	if (rc != 0) {
+		pthread_mutex_destroy(&thread->mutex);
+		pthread_cond_destroy(&thread->cond);
+		free(thread->submitted.slots);
+		free(thread->completed.slots);
+		free(thread);
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+						errmsg("unable to start bulk I/O thread: %s", strerror(rc))));
+	}
+
+	thread->next   = runningThreads;
+	runningThreads = thread;
+
+	return thread;
+}
+
+/*
+ * How many jobs the backend can have submitted and not yet collected
+ */
+int bulk_thread_capacity(BulkIOThread *thread) {
+	return thread->capacity;
+}
+
+/*
+ * A job to POST a 'len' byte body, which the caller copies into job->data, to 'url'
+ */
+BulkIOJob *bulk_thread_make_job(char *url, size_t len, const char *contentType) {
+	BulkIOJob *job = calloc(1, sizeof(BulkIOJob));
+
+	if (job != NULL && ((job->url = strdup(url)) == NULL || (job->data = malloc(Max(len, 1))) == NULL)) {
+		free(job->url);
+		free(job);
+		job = NULL;
+	}
+
+	if (job == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+						errmsg("out of memory")));
+
+	job->len         = len;
+	job->contentType = contentType;
+	job->zlib_rc     = Z_OK;
+	job->curl_rc = CURLE_OK;
+	return job;
+}
+
+/*
+ * Give a job to the thread.  Returns false, and the job is still the caller's, if the
+ * thread is backed up
+ */
+bool bulk_thread_submit(BulkIOThread *thread, BulkIOJob *job) {
+	if (!ring_push(&thread->submitted, job))
+		return false;
+
+	wake_thread(thread);
+	return true;
+}
+
+/*
+ * The next job the thread has finished with, or NULL if there isn't one yet
+ */
+BulkIOJob *bulk_thread_next_completed(BulkIOThread *thread) {
+	return ring_pop(&thread->completed);
+}
+
+/*
+ * Has the thread gone away on its own?  It only does that if it couldn't allocate what it
+ * needed to run, and then nothing submitted to it will ever complete
+ */
+bool bulk_thread_has_exited(BulkIOThread *thread) {
+	return pg_atomic_read_u32(&thread->exited) != 0 && pg_atomic_read_u32(&thread->finishing) == 0;
+}
+
+/*
+ * Hold on to a job the thread has finished with, which the backend will submit again once
+ * job->notBefore has passed.  It's freed with the thread if that never happens
+ */
+void bulk_thread_defer(BulkIOThread *thread, BulkIOJob *job) {
+	job->next = NULL;
+	if (thread->lastDeferred != NULL)
+		thread->lastDeferred->next = job;
+	else
+		thread->deferred = job;
+	thread->lastDeferred = job;
+	thread->ndeferred++;
+}
+
+/*
+ * The job that's been deferred the longest, or NULL if there aren't any
+ */
+BulkIOJob *bulk_thread_first_deferred(BulkIOThread *thread) {
+	return thread->deferred;
+}
+
+/*
+ * Stop holding on to the first deferred job, because the backend is submitting it again
+ */
+void bulk_thread_undefer(BulkIOThread *thread) {
+	BulkIOJob *job = thread->deferred;
+
+	if (job == NULL)
+		return;
+
+	thread->deferred = job->next;
+	if (thread->deferred == NULL)
+		thread->lastDeferred = NULL;
+	thread->ndeferred--;
+	job->next = NULL;
+}
+
+int bulk_thread_deferred(BulkIOThread *thread) {
+	return thread->ndeferred;
+}
+
+/*
+ * Forget what became of a job the thread has finished with, so it can be submitted again
+ */
+void bulk_thread_reset_job(BulkIOJob *job) {
+	free(job->response);
+	job->response      = NULL;
+	job->response_len  = 0;
+	job->response_code = 0;
+	job->zlib_rc       = Z_OK;
+	job->curl_rc       = CURLE_OK;
+	job->sent          = 0;
+	job->errorbuff[0]  = '\0';
+}
+
+void bulk_thread_free_job(BulkIOJob *job) {
+	if (job == NULL)
+		return;
+
+	free(job->url);
+	free(job->data);
+	free(job->response);
+	free(job);
+}
+
+static void unlink_thread(BulkIOThread *thread) {
+	BulkIOThread **prev = &runningThreads;
+
+	while (*prev != NULL) {
+		if (*prev == thread) {
+			*prev = thread->next;
+			break;
+		}
+		prev = &(*prev)->next;
+	}
+}
+
+static void join_and_free_thread(BulkIOThread *thread) {
+	BulkIOJob *job;
+
+	wake_thread(thread);
+	pthread_join(thread->thread, NULL);
+
+	/* anything left in the rings is ours now */
+	while ((job = ring_pop(&thread->submitted)) != NULL)
+		bulk_thread_free_job(job);
+	while ((job = ring_pop(&thread->completed)) != NULL)
+		bulk_thread_free_job(job);
+	while ((job = thread->deferred) != NULL) {
+		thread->deferred = job->next;
+		bulk_thread_free_job(job);
+	}
+
+	pthread_mutex_destroy(&thread->mutex);
+	pthread_cond_destroy(&thread->cond);
+	free(thread->submitted.slots);
+	free(thread->completed.slots);
+	free(thread);
+}
+
+/*
+ * Tell the thread no more jobs are coming and wait for it to exit.  The caller should have
+ * already collected every job it submitted, so the thread is idle and this doesn't block
+ */
+void bulk_thread_stop(BulkIOThread *thread) {
+	unlink_thread(thread);
+	pg_atomic_write_u32(&thread->finishing, 1);
+	join_and_free_thread(thread);
+}
+
+/*
+ * Abandon whatever every running thread is doing and wait for them to exit.  Called when
+ * the transaction ends, which, for a thread that wasn't stopped normally, means it aborted
+ */
+void bulk_thread_cancel_all(void) {
+	while (runningThreads != NULL) {
+		BulkIOThread *thread = runningThreads;
+
+		runningThreads = thread->next;
+		pg_atomic_write_u32(&thread->cancelled, 1);
+		join_and_free_thread(thread);
+	}
+}
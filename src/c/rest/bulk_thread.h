@@ -0,0 +1,70 @@
+/**
+ * Copyright 2018 ZomboDB, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZDB_BULK_THREAD_H__
+#define __ZDB_BULK_THREAD_H__
+
+#include "postgres.h"
+#include "datatype/timestamp.h"
+
+#include <curl/curl.h>
+
+/*
+ * A finished _bulk request body handed to a BulkIOThread, and what became of it.
+ *
+ * Everything here is malloc()'d, never palloc()'d, because the I/O thread owns it
+ * while it's in flight and must never touch Postgres' memory contexts
+ */
+typedef struct BulkIOJob {
+	char   *url;
+	char   *data;             /* the uncompressed request body, which we keep in case it's rejected */
+	size_t len;
+	const char *contentType;  /* a string constant, or NULL for application/json */
+
+	/* the backend's own bookkeeping, which the I/O thread doesn't look at */
+	int         attempt;      /* how many times Elasticsearch has rejected it */
+	TimestampTz started;      /* when it was last submitted */
+	TimestampTz notBefore;    /* if it was rejected, when to submit it again */
+	struct BulkIOJob *next;   /* in the list of those waiting to be */
+
+	/* filled in by the I/O thread */
+	int    zlib_rc;           /* Z_OK unless compressing the body failed */
+	size_t sent;              /* how big the body was on the wire, once compressed */
+	int    curl_rc;
+	long   response_code;
+	char   *response;         /* NUL-terminated, or NULL if Elasticsearch didn't send anything */
+	size_t response_len;
+	char   errorbuff[CURL_ERROR_SIZE];
+} BulkIOJob;
+
+typedef struct BulkIOThread BulkIOThread;
+
+BulkIOThread *bulk_thread_start(int concurrency, int compressionLevel, bool verbose);
+int bulk_thread_capacity(BulkIOThread *thread);
+BulkIOJob *bulk_thread_make_job(char *url, size_t len, const char *contentType);
+bool bulk_thread_submit(BulkIOThread *thread, BulkIOJob *job);
+BulkIOJob *bulk_thread_next_completed(BulkIOThread *thread);
+bool bulk_thread_has_exited(BulkIOThread *thread);
+void bulk_thread_defer(BulkIOThread *thread, BulkIOJob *job);
+BulkIOJob *bulk_thread_first_deferred(BulkIOThread *thread);
+void bulk_thread_undefer(BulkIOThread *thread);
+int bulk_thread_deferred(BulkIOThread *thread);
+void bulk_thread_reset_job(BulkIOJob *job);
+void bulk_thread_free_job(BulkIOJob *job);
+void bulk_thread_stop(BulkIOThread *thread);
+void bulk_thread_cancel_all(void);
+
+#endif /* __ZDB_BULK_THREAD_H__ */
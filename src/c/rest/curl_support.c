@@ -15,13 +15,33 @@
  */
 
 #include "curl_support.h"
+#include "bulk_thread.h"
+#include "admission.h"
+#include "rest.h"
 
 #include "access/xact.h"
 #include "utils/memutils.h"
 
 
+/* the most number of idle easy handles we'll keep around for reuse */
+#define MAX_POOLED_CURL_HANDLES MAX_CURL_HANDLES
+
 static List *curlMultiHandles = NULL;
 
+static void free_multi_wait_state(MultiRestState *state);
+static void free_multi_zstreams(MultiRestState *state);
+
+/*
+ * Every easy handle we create is attached to this share so that they all
+ * use the same connection, DNS, and SSL session caches.  This lets
+ * keep-alive connections to Elasticsearch live for the life of the backend
+ */
+static CURLSH *curlShare = NULL;
+
+/* idle easy handles, ready to be checked out */
+static CURL *curlPool[MAX_POOLED_CURL_HANDLES];
+static int  curlPoolSize = 0;
+
 CURL *GLOBAL_CURL_INSTANCE;
 char GLOBAL_CURL_ERRBUF[CURL_ERROR_SIZE];
 
@@ -45,7 +65,7 @@ static void curl_cleanup_callback(XactEvent event, void *arg) {
 					for (i = 0; i < state->nhandles; i++) {
 						if (state->handles[i] != NULL) {
 							curl_multi_remove_handle(state->multi_handle, state->handles[i]);
-							curl_easy_cleanup(state->handles[i]);
+							curl_pool_checkin(state->handles[i]);
 						}
 						if (state->headers[i] != NULL) {
 							curl_slist_free_all(state->headers[i]);
@@ -53,6 +73,11 @@ static void curl_cleanup_callback(XactEvent event, void *arg) {
 					}
 					curl_multi_cleanup(state->multi_handle);
 				}
+
+				if (state != NULL) {
+					free_multi_wait_state(state);
+					free_multi_zstreams(state);
+				}
 			}
 		}
 			break;
@@ -69,6 +94,15 @@ static void curl_cleanup_callback(XactEvent event, void *arg) {
 		case XACT_EVENT_PREPARE:
 			list_free_deep(curlMultiHandles);
 			curlMultiHandles = NULL;
+
+			/* the request bodies they were sending are gone too */
+			rest_post_data_memory_end_xact();
+
+			/* any bulk I/O thread that's still running was abandoned by an error */
+			bulk_thread_cancel_all();
+
+			/* and so were any cluster-wide bulk request tokens we still hold */
+			admission_release_all();
 			break;
 
 		default:
@@ -92,18 +126,66 @@ void curl_support_init(void) {
 						errmsg("Problem initializing libcurl:  rc=%d", rc)));
 	}
 
-	GLOBAL_CURL_INSTANCE = curl_easy_init();
-	if (GLOBAL_CURL_INSTANCE == NULL) {
+	curlShare = curl_share_init();
+	if (curlShare == NULL) {
 		ereport(ERROR,
 				(errcode(ERRCODE_IO_ERROR),
-						errmsg("Error initializing our GLOBAL_CURL_INSTANCE")));
+						errmsg("Error initializing libcurl share handle")));
 	}
+
+	/* we're single-threaded, so no lock functions are necessary */
+	curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	GLOBAL_CURL_INSTANCE = curl_pool_checkout();
 	memset(GLOBAL_CURL_ERRBUF, 0, CURL_ERROR_SIZE);
 
 	/* A callback for freeing libcurl-allocated objects when the transaction completes */
 	RegisterXactCallback(curl_cleanup_callback, NULL);
 }
 
+/*
+ * Get an easy handle from our pool, creating a new one if the pool is empty.
+ *
+ * The returned handle is attached to our share handle, so any connection it opens
+ * to Elasticsearch is kept alive and can be used by the next handle that's checked out
+ */
+CURL *curl_pool_checkout(void) {
+	CURL *handle;
+
+	if (curlPoolSize > 0)
+		return curlPool[--curlPoolSize];
+
+	handle = curl_easy_init();
+	if (handle == NULL) {
+		ereport(ERROR,
+				(errcode(ERRCODE_IO_ERROR),
+						errmsg("unable to initialize curl handle")));
+	}
+
+	curl_easy_setopt(handle, CURLOPT_SHARE, curlShare);
+	return handle;
+}
+
+/*
+ * Return an easy handle to our pool.  Its options are reset, but it stays
+ * attached to the share handle so its connections are not closed
+ */
+void curl_pool_checkin(CURL *handle) {
+	if (handle == NULL)
+		return;
+
+	if (curlPoolSize == MAX_POOLED_CURL_HANDLES) {
+		curl_easy_cleanup(handle);
+		return;
+	}
+
+	curl_easy_reset(handle);
+	curl_easy_setopt(handle, CURLOPT_SHARE, curlShare);
+	curlPool[curlPoolSize++] = handle;
+}
+
 void curl_record_multi_handle(MultiRestState *state) {
 	MemoryContext oldContext;
 
@@ -114,6 +196,40 @@ void curl_record_multi_handle(MultiRestState *state) {
 
 void curl_forget_multi_handle(MultiRestState *state) {
 	curlMultiHandles = list_delete(curlMultiHandles, state);
+	free_multi_wait_state(state);
+	free_multi_zstreams(state);
 	pfree(state);
 }
 
+/*
+ * Release the WaitEventSet (and its kernel resources) and socket tracking
+ * array of a MultiRestState
+ */
+static void free_multi_wait_state(MultiRestState *state) {
+	if (state->waitset != NULL) {
+		FreeWaitEventSet(state->waitset);
+		state->waitset = NULL;
+	}
+
+	if (state->sockets != NULL) {
+		pfree(state->sockets);
+		state->sockets = NULL;
+	}
+	state->nsockets = 0;
+}
+
+/*
+ * Release the deflate streams of a MultiRestState.  zlib malloc()s these, so
+ * they'd leak if we didn't
+ */
+static void free_multi_zstreams(MultiRestState *state) {
+	int i;
+
+	for (i = 0; i < state->nhandles; i++) {
+		if (state->zstreams[i] != NULL) {
+			deflateEnd(state->zstreams[i]);
+			free(state->zstreams[i]);
+			state->zstreams[i] = NULL;
+		}
+	}
+}
@@ -18,31 +18,120 @@
 #define __ZDB_CURL_SUPPORT_H__
 
 #include "postgres.h"
+#include "datatype/timestamp.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
+#include "storage/latch.h"
 
 #include <curl/curl.h>
+#include <zlib.h>
 
 /* this needs to match elasticsearch.h:MAX_BULK_CONCURRENCY */
 #define MAX_CURL_HANDLES 1024
 
+/* once the chunk we're appending to is this big, it's handed off to curl and a new one is started */
+#define POST_DATA_CHUNK_SIZE (64 * 1024)
+
+/* given the response to a request that succeeded, which it then owns */
+typedef void (*RestResponseCallback)(void *arg, StringInfo response);
+
+/*
+ * A request body built as a list of chunks that curl reads through a CURLOPT_READFUNCTION,
+ * deflating them as it goes if compression is enabled.  Curl can start sending the chunks
+ * we've finished while we're still appending to 'buff'.
+ *
+ * Chunks curl has read are kept until the request completes so that curl can rewind the
+ * body if it has to resend it on a fresh connection
+ */
 typedef struct PostDataEntry {
 	int        pool_idx;
-	StringInfo buff;
-	char       *compressed_data;
+	StringInfo buff;          /* the chunk we're currently appending to */
+	List       *chunks;       /* finished chunks, in order */
+	uint64     nchunked;      /* total bytes in 'chunks' */
+	bool       finished;      /* no more chunks will be added */
+	const char *contentType;  /* the body's Content-Type, or NULL for application/json */
+	char       separator;     /* what ends each line, or document, of the body */
+
+	/* if set, who wants the response once the request is done, rather than it being thrown away */
+	RestResponseCallback on_response;
+	void                 *on_response_arg;
+
+	/* curl's read position */
+	CURL       *handle;       /* the handle sending this entry, once it's been handed to curl */
+	ListCell   *readcell;
+	int        readpos;
+	bool       paused;        /* curl is waiting for us to add another chunk */
+	z_stream   *zstream;      /* if compressing, the deflate stream of the curl slot we're in */
+	bool       zdone;
 } PostDataEntry;
 
+#define PostDataEntryLength(entry) ((entry)->nchunked + (uint64) (entry)->buff->len)
+
+/* a request Elasticsearch rejected, waiting for its backoff to expire before we send it again */
+typedef struct RestRetry {
+	PostDataEntry *entry;
+	char          *method;
+	char          *url;
+	int           compressionLevel;
+	int           attempt;
+	TimestampTz   notBefore;
+} RestRetry;
+
+typedef struct RestSocket {
+	curl_socket_t fd;
+	int           events;     /* WL_SOCKET_READABLE and/or WL_SOCKET_WRITEABLE */
+	int           pos;        /* position in the WaitEventSet, or -1 if not yet added */
+} RestSocket;
+
 typedef struct MultiRestState {
 	int               nhandles;
-	CURL              *handles[MAX_CURL_HANDLES];
-	struct curl_slist *headers[MAX_CURL_HANDLES];
-	char              *errorbuffs[MAX_CURL_HANDLES];
-	PostDataEntry     *postDatas[MAX_CURL_HANDLES];
-	StringInfo        responses[MAX_CURL_HANDLES];
-	bool              vconflicts[MAX_CURL_HANDLES];    /* should we ignore version conflicts for this request? */
+
+	/* per-handle state, 'nhandles' long.  See rest_multi_init() */
+	CURL              **handles;
+	struct curl_slist **headers;
+	char              **errorbuffs;
+	PostDataEntry     **postDatas;
+	StringInfo        *responses;
+	bool              *vconflicts;          /* should we ignore version conflicts for this request? */
+	z_stream          **zstreams;           /* deflate streams, created on first use and then reused */
+	char              **methods;
+	char              **urls;
+	int               *compressionLevels;
+	int               *attempts;            /* how many times this request has been rejected */
+	TimestampTz       *started;
+	bool              *admitted;            /* does this request hold a cluster-wide admission token? */
 
 	CURLM *multi_handle;
 	int   available;
+	int   running;            /* number of handles curl says are still running */
+
+	/*
+	 * Adaptive (AIMD) flow control:  when Elasticsearch rejects requests we halve how many we
+	 * allow in flight and how big we ask callers to make them, and grow both back additively
+	 * as requests succeed without their latency spiking.  Never more than 'nhandles' at once
+	 */
+	int    limit;
+	double batch_scale;       /* the fraction of its configured batch size the caller should use */
+	int    credit;            /* successes since we last increased 'limit' */
+	double latency_avg;       /* smoothed request latency, in milliseconds */
+	int    nrejected;
+	uint64 nbytesSent;        /* of the request bodies curl has finished sending, as they went over the wire */
+	List   *retries;          /* RestRetry's, in the order they were rejected */
+
+	/* cluster-wide admission control (see admission.c) for the Elasticsearch URL we talk to */
+	int    admission;
+	int    reserved;          /* tokens we've taken but not yet used for a request */
+
+	/* the sockets libcurl has asked us to watch, and the WaitEventSet that watches them */
+	RestSocket   *sockets;
+	int          nsockets;
+	int          maxsockets;
+	WaitEventSet *waitset;
+	bool         waitset_dirty;
+
+	/* when libcurl next wants to be told about a timeout */
+	bool        timer_set;
+	TimestampTz timer_deadline;
 
 	StringInfo *pool;
 } MultiRestState;
@@ -51,6 +140,8 @@ extern CURL *GLOBAL_CURL_INSTANCE;
 extern char GLOBAL_CURL_ERRBUF[CURL_ERROR_SIZE];
 
 void curl_support_init(void);
+CURL *curl_pool_checkout(void);
+void curl_pool_checkin(CURL *handle);
 void curl_record_multi_handle(MultiRestState *state);
 void curl_forget_multi_handle(MultiRestState *state);
 
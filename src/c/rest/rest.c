@@ -16,18 +16,58 @@
  */
 
 #include "rest.h"
+#include "admission.h"
 #include "zombodb.h"
 #include "json/json_support.h"
 
 #include "access/xact.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 
 #include <zlib.h>
 
+/* the longest we'll sleep waiting on Elasticsearch before looking around again */
+#define MAX_MULTI_WAIT_MS 1000
+
+/* how long we wait before resending a request Elasticsearch rejected.  See MAX_REQUEST_RETRIES */
+#define RETRY_BACKOFF_MIN_MS 100
+#define RETRY_BACKOFF_MAX_MS 10000
+
+/* the smallest fraction of their configured batch size we'll ask callers to use, and how fast it grows back */
+#define MIN_BATCH_SCALE 0.0625
+
+/* a request that takes this many times longer than usual means Elasticsearch is getting busy */
+#define LATENCY_SPIKE_FACTOR 2.0
+
+/* how often we look again for a retry we couldn't send, or an admission token we couldn't get */
+#define MIN_MULTI_WAIT_MS 10
+
 static size_t curl_write_func(char *ptr, size_t size, size_t nmemb, void *userdata);
 static int curl_progress_func(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
-static bool contains_version_conflict_error(const MultiRestState *state, int i);
+static int curl_socket_func(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp);
+static int curl_timer_func(CURLM *multi, long timeout_ms, void *userp);
+static size_t curl_read_func(char *buffer, size_t size, size_t nitems, void *userdata);
+static int curl_seek_func(void *userp, curl_off_t offset, int origin);
+static void dispatch_retries(MultiRestState *state);
+
+PG_FUNCTION_INFO_V1(zdb_bulk_memory);
 
 extern bool zdb_curl_verbose_guc;
+extern int  zdb_max_bulk_memory_guc;
+extern int  ZDB_LOG_LEVEL;
+
+/*
+ * How many bytes of request bodies this backend is holding on to:  the finished chunks of every
+ * PostDataEntry that hasn't been reset, plus whatever callers tell us about through
+ * rest_post_data_memory_add().  The most it's ever been this session too
+ */
+static uint64 postDataMemory     = 0;
+static uint64 postDataMemoryPeak = 0;
 
 static size_t curl_write_func(char *ptr, size_t size, size_t nmemb, void *userdata) {
 	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
@@ -63,6 +103,282 @@ static int curl_progress_func(void *clientp, curl_off_t dltotal, curl_off_t dlno
 	return 0;
 }
 
+/*
+ * libcurl tells us here which sockets it wants watched, and for what.  We keep
+ * our own list and (re)build a WaitEventSet from it before we next wait
+ */
+/*lint -esym 715,easy,socketp ignore unused param */
+static int curl_socket_func(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp) {
+	MultiRestState *state  = (MultiRestState *) userp;
+	int            events  = 0;
+	int            i;
+
+	switch (what) {
+		case CURL_POLL_IN:
+			events = WL_SOCKET_READABLE;
+			break;
+		case CURL_POLL_OUT:
+			events = WL_SOCKET_WRITEABLE;
+			break;
+		case CURL_POLL_INOUT:
+			events = WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE;
+			break;
+		default:
+			break;
+	}
+
+	for (i = 0; i < state->nsockets; i++) {
+		if (state->sockets[i].fd == fd)
+			break;
+	}
+
+	if (events == 0) {
+		/* curl is done with this socket.  WaitEventSets can't remove events, so it'll be rebuilt */
+		if (i < state->nsockets) {
+			state->sockets[i] = state->sockets[--state->nsockets];
+			state->waitset_dirty = true;
+		}
+	} else if (i < state->nsockets) {
+		/* a socket we already know about is waiting for something different now */
+		if (state->sockets[i].events != events) {
+			state->sockets[i].events = events;
+
+			if (state->waitset != NULL && !state->waitset_dirty && state->sockets[i].pos >= 0)
+				ModifyWaitEvent(state->waitset, state->sockets[i].pos, (uint32) events, NULL);
+			else
+				state->waitset_dirty = true;
+		}
+	} else {
+		/* a new socket */
+		if (state->nsockets == state->maxsockets) {
+			state->maxsockets *= 2;
+			state->sockets = repalloc(state->sockets, sizeof(RestSocket) * state->maxsockets);
+		}
+
+		state->sockets[state->nsockets].fd     = fd;
+		state->sockets[state->nsockets].events = events;
+		state->sockets[state->nsockets].pos    = -1;
+		state->nsockets++;
+		state->waitset_dirty = true;
+	}
+
+	return 0;
+}
+
+/*
+ * libcurl tells us here when it next wants curl_multi_socket_action(CURL_SOCKET_TIMEOUT)
+ */
+/*lint -esym 715,multi ignore unused param */
+static int curl_timer_func(CURLM *multi, long timeout_ms, void *userp) {
+	MultiRestState *state = (MultiRestState *) userp;
+
+	if (timeout_ms < 0) {
+		state->timer_set = false;
+	} else {
+		state->timer_set      = true;
+		state->timer_deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout_ms);
+	}
+
+	return 0;
+}
+
+static void rebuild_wait_event_set(MultiRestState *state) {
+	int i;
+
+	if (state->waitset != NULL)
+		FreeWaitEventSet(state->waitset);
+
+	state->waitset = CreateWaitEventSet(TopMemoryContext, state->nsockets + 2);
+	AddWaitEventToSet(state->waitset, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(state->waitset, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+
+	for (i = 0; i < state->nsockets; i++) {
+		state->sockets[i].pos = AddWaitEventToSet(state->waitset, (uint32) state->sockets[i].events,
+												  state->sockets[i].fd, NULL, NULL);
+	}
+
+	state->waitset_dirty = false;
+}
+
+/*
+ * Sleep for up to timeout_ms until one of curl's sockets is ready, curl's timer expires,
+ * or our latch is set, and then let curl do whatever work is ready.
+ *
+ * A timeout of zero doesn't sleep at all and is how we drive curl without blocking.
+ *
+ * Returns the number of handles that are still running
+ */
+int rest_multi_wait(MultiRestState *state, long timeout_ms) {
+	WaitEvent events[16];
+	int       nevents;
+	int       i;
+
+	if (state->timer_set) {
+		long secs;
+		int  usecs;
+
+		TimestampDifference(GetCurrentTimestamp(), state->timer_deadline, &secs, &usecs);
+		timeout_ms = Min(timeout_ms, secs * 1000 + usecs / 1000);
+	}
+
+	if (state->retries != NIL) {
+		RestRetry *retry = linitial(state->retries);
+		long      secs;
+		int       usecs;
+
+		/* retries all have the same backoff for the same attempt, so the first one is usually next */
+		TimestampDifference(GetCurrentTimestamp(), retry->notBefore, &secs, &usecs);
+		timeout_ms = Min(timeout_ms, Max(MIN_MULTI_WAIT_MS, secs * 1000 + usecs / 1000));
+	}
+
+	if (state->waitset == NULL || state->waitset_dirty)
+		rebuild_wait_event_set(state);
+
+	nevents = WaitEventSetWait(state->waitset, timeout_ms, events, lengthof(events), PG_WAIT_EXTENSION);
+
+	for (i = 0; i < nevents; i++) {
+		WaitEvent *event = &events[i];
+
+		if (event->events & WL_POSTMASTER_DEATH) {
+			proc_exit(1);
+		} else if (event->events & WL_LATCH_SET) {
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		} else {
+			int flags = 0;
+
+			if (event->events & WL_SOCKET_READABLE)
+				flags |= CURL_CSELECT_IN;
+			if (event->events & WL_SOCKET_WRITEABLE)
+				flags |= CURL_CSELECT_OUT;
+
+			curl_multi_socket_action(state->multi_handle, event->fd, flags, &state->running);
+		}
+	}
+
+	if (state->timer_set && GetCurrentTimestamp() >= state->timer_deadline) {
+		/* curl will set a new timer, if it needs one, while we call it */
+		state->timer_set = false;
+		curl_multi_socket_action(state->multi_handle, CURL_SOCKET_TIMEOUT, 0, &state->running);
+	}
+
+	dispatch_retries(state);
+
+	return state->running;
+}
+
+/*
+ * The next chunk of a PostDataEntry that curl hasn't finished reading, or NULL if
+ * it has read everything we've given it so far
+ */
+static StringInfo next_unread_chunk(PostDataEntry *entry) {
+	if (entry->readcell == NULL) {
+		if (entry->chunks == NIL)
+			return NULL;
+		entry->readcell = list_head(entry->chunks);
+		entry->readpos  = 0;
+	} else if (entry->readpos >= ((StringInfo) lfirst(entry->readcell))->len) {
+		if (lnext(entry->readcell) == NULL)
+			return NULL;
+		entry->readcell = lnext(entry->readcell);
+		entry->readpos  = 0;
+	}
+
+	return (StringInfo) lfirst(entry->readcell);
+}
+
+/*
+ * curl asks us here for more of a request body.  We copy (or deflate) directly from
+ * the entry's chunks into curl's buffer, and if we've run out of chunks before the
+ * entry is finished, we pause the transfer until rest_multi_post_data_add_chunk() adds more
+ */
+static size_t curl_read_func(char *buffer, size_t size, size_t nitems, void *userdata) {
+	PostDataEntry *entry = (PostDataEntry *) userdata;
+	size_t        max    = size * nitems;
+	size_t        nread;
+
+	if (entry->zstream != NULL) {
+		z_stream *zstream = entry->zstream;
+
+		zstream->next_out  = (Bytef *) buffer;
+		zstream->avail_out = (uInt) max;
+
+		while (zstream->avail_out > 0 && !entry->zdone) {
+			int flush = Z_NO_FLUSH;
+			int rc;
+
+			if (zstream->avail_in == 0) {
+				StringInfo chunk = next_unread_chunk(entry);
+
+				if (chunk != NULL) {
+					/* zlib reads it directly from the chunk, which we keep until the request is done */
+					zstream->next_in  = (Bytef *) chunk->data + entry->readpos;
+					zstream->avail_in = (uInt) (chunk->len - entry->readpos);
+					entry->readpos    = chunk->len;
+				} else if (entry->finished) {
+					flush = Z_FINISH;
+				} else {
+					break;
+				}
+			}
+
+			rc = deflate(zstream, flush);
+			if (rc == Z_STREAM_END)
+				entry->zdone = true;
+			else if (rc != Z_OK && rc != Z_BUF_ERROR)
+				return CURL_READFUNC_ABORT;
+		}
+
+		nread = max - zstream->avail_out;
+		if (nread == 0 && entry->zdone)
+			return 0;
+	} else {
+		StringInfo chunk;
+
+		nread = 0;
+		while (nread < max && (chunk = next_unread_chunk(entry)) != NULL) {
+			size_t n = Min(max - nread, (size_t) (chunk->len - entry->readpos));
+
+			memcpy(buffer + nread, chunk->data + entry->readpos, n);
+			entry->readpos += n;
+			nread += n;
+		}
+
+		if (nread == 0 && entry->finished)
+			return 0;
+	}
+
+	if (nread == 0) {
+		entry->paused = true;
+		return CURL_READFUNC_PAUSE;
+	}
+
+	return nread;
+}
+
+/*
+ * curl only seeks a request body to rewind it, which it does if it needs to resend the
+ * request on a new connection
+ */
+static int curl_seek_func(void *userp, curl_off_t offset, int origin) {
+	PostDataEntry *entry = (PostDataEntry *) userp;
+
+	if (offset != 0 || origin != SEEK_SET)
+		return CURL_SEEKFUNC_CANTSEEK;
+
+	entry->readcell = NULL;
+	entry->readpos  = 0;
+	entry->zdone    = false;
+
+	if (entry->zstream != NULL) {
+		entry->zstream->avail_in = 0;
+		if (deflateReset(entry->zstream) != Z_OK)
+			return CURL_SEEKFUNC_FAIL;
+	}
+
+	return CURL_SEEKFUNC_OK;
+}
+
 static char *do_compression(StringInfo input, int level, uint64 *len) {
 	Bytef *compressed = NULL;
 	if (input != NULL) {
@@ -80,9 +396,41 @@ static char *do_compression(StringInfo input, int level, uint64 *len) {
 	return (char *) compressed;
 }
 
-MultiRestState *rest_multi_init(int nhandles, bool ignore_version_conflicts) {
-	MultiRestState *state = MemoryContextAlloc(TopMemoryContext,  /* because that's where curl is allocated too */
-											   sizeof(MultiRestState));
+/*
+ * Point the state's per-handle arrays at 'space', and return how much of it they take.  With a
+ * NULL 'space', just returns how much they'd need
+ */
+static Size multi_state_arrays(MultiRestState *state, char *space, int nhandles) {
+	Size used = 0;
+
+#define CARVE_ARRAY(field) \
+	do { \
+		if (space != NULL) \
+			state->field = (void *) (space + used); \
+		used += MAXALIGN(sizeof(*state->field) * nhandles); \
+	} while (0)
+
+	CARVE_ARRAY(handles);
+	CARVE_ARRAY(headers);
+	CARVE_ARRAY(errorbuffs);
+	CARVE_ARRAY(postDatas);
+	CARVE_ARRAY(responses);
+	CARVE_ARRAY(vconflicts);
+	CARVE_ARRAY(zstreams);
+	CARVE_ARRAY(methods);
+	CARVE_ARRAY(urls);
+	CARVE_ARRAY(compressionLevels);
+	CARVE_ARRAY(attempts);
+	CARVE_ARRAY(started);
+	CARVE_ARRAY(admitted);
+
+#undef CARVE_ARRAY
+
+	return used;
+}
+
+MultiRestState *rest_multi_init(char *url, int nhandles, bool ignore_version_conflicts) {
+	MultiRestState *state;
 	int            i;
 
 	if (nhandles > MAX_CURL_HANDLES) {
@@ -91,9 +439,34 @@ MultiRestState *rest_multi_init(int nhandles, bool ignore_version_conflicts) {
 						errmsg("Number of curl handles (%d) is larger than max (%d)", nhandles, MAX_CURL_HANDLES)));
 	}
 
-	state->nhandles     = nhandles;
-	state->multi_handle = curl_multi_init();
-	state->available    = nhandles;
+	/*
+	 * The per-handle arrays live right after the state, sized for the handles we'll actually use,
+	 * so that freeing the state frees them too.  In TopMemoryContext because that's where curl is
+	 * allocated too
+	 */
+	state = MemoryContextAlloc(TopMemoryContext,
+							   MAXALIGN(sizeof(MultiRestState)) + multi_state_arrays(NULL, NULL, nhandles));
+	multi_state_arrays(state, (char *) state + MAXALIGN(sizeof(MultiRestState)), nhandles);
+
+	state->nhandles       = nhandles;
+	state->multi_handle   = curl_multi_init();
+	state->available      = nhandles;
+	state->running        = 0;
+	state->maxsockets     = nhandles * 2;
+	state->nsockets       = 0;
+	state->sockets        = MemoryContextAlloc(TopMemoryContext, sizeof(RestSocket) * state->maxsockets);
+	state->waitset        = NULL;
+	state->waitset_dirty  = true;
+	state->timer_set      = false;
+	state->timer_deadline = 0;
+	state->limit          = nhandles;
+	state->batch_scale    = 1.0;
+	state->credit         = 0;
+	state->latency_avg    = 0;
+	state->nrejected      = 0;
+	state->retries        = NIL;
+	state->admission      = url != NULL ? admission_lookup(url) : ADMISSION_UNLIMITED;
+	state->reserved       = 0;
 	for (i = 0; i < nhandles; i++) {
 		state->handles[i]    = NULL;
 		state->headers[i]    = NULL;
@@ -101,62 +474,66 @@ MultiRestState *rest_multi_init(int nhandles, bool ignore_version_conflicts) {
 		state->postDatas[i]  = NULL;
 		state->responses[i]  = NULL;
 		state->vconflicts[i] = ignore_version_conflicts;
+		state->zstreams[i]   = NULL;
+		state->methods[i]    = NULL;
+		state->urls[i]       = NULL;
+		state->admitted[i]   = false;
 	}
 
+	/* we drive curl with its socket interface so that we can sleep while it's busy */
+	curl_multi_setopt(state->multi_handle, CURLMOPT_SOCKETFUNCTION, curl_socket_func);
+	curl_multi_setopt(state->multi_handle, CURLMOPT_SOCKETDATA, state);
+	curl_multi_setopt(state->multi_handle, CURLMOPT_TIMERFUNCTION, curl_timer_func);
+	curl_multi_setopt(state->multi_handle, CURLMOPT_TIMERDATA, state);
+
 	curl_record_multi_handle(state);
 
 	return state;
 }
 
 int rest_multi_perform(MultiRestState *state) {
-	int       still_running;
-	CURLMcode rc;
-
-	do {
-		rc = curl_multi_perform(state->multi_handle, &still_running);
-		CHECK_FOR_INTERRUPTS();
-	} while (rc == CURLM_CALL_MULTI_PERFORM);
-
-	return still_running;
+	CHECK_FOR_INTERRUPTS();
+	return rest_multi_wait(state, 0);
 }
 
-void rest_multi_call(MultiRestState *state, char *method, StringInfo url, PostDataEntry *postData, int compressionLevel) {
+/*
+ * Hand a request to curl in a free slot.  The slot takes ownership of 'method' and 'url'.
+ * The caller must have already made sure we have the capacity for it
+ */
+static void start_request(MultiRestState *state, char *method, char *url, PostDataEntry *postData, int compressionLevel, int attempt) {
 	int i;
 
-	if (state->available == 0) {
-		int still_running;
-
-		do {
-			CHECK_FOR_INTERRUPTS();
-
-			still_running = rest_multi_perform(state);
-		} while (still_running == state->nhandles);
-
-		rest_multi_partial_cleanup(state, false, true);
-		if (state->available == 0) {
-			ereport(ERROR,
-					(errcode(ERRCODE_IO_ERROR),
-							errmsg("unable to cleanup an available rest_multi slot")));
-		}
-	}
-
 	for (i = 0; i < state->nhandles; i++) {
 		if (state->handles[i] == NULL) {
 			CURL       *curl;
 			char       *errorbuff;
 			StringInfo response;
 
-			curl = state->handles[i] = curl_easy_init();
-			if (!state->handles[i]) {
-				ereport(ERROR,
-						(errcode(ERRCODE_IO_ERROR),
-								errmsg("unable to initialize curl handle")));
-			}
+			/* reuse a pooled handle so we can also reuse its keep-alive connection */
+			curl = state->handles[i] = curl_pool_checkout();
+
+			if (postData != NULL && postData->contentType != NULL) {
+				char header[128];
+
+				snprintf(header, sizeof(header), "Content-Type: %s", postData->contentType);
+				state->headers[i] = curl_slist_append(state->headers[i], header);
 
-			state->headers[i] = curl_slist_append(state->headers[i], "Content-Type: application/json");
+				/* but we always want json back */
+				state->headers[i] = curl_slist_append(state->headers[i], "Accept: application/json");
+			} else {
+				state->headers[i] = curl_slist_append(state->headers[i], "Content-Type: application/json");
+			}
 			errorbuff = state->errorbuffs[i] = palloc0(CURL_ERROR_SIZE);
 			state->postDatas[i] = postData;
 			response = state->responses[i] = makeStringInfo();
+			state->methods[i]           = method;
+			state->urls[i]              = url;
+			state->compressionLevels[i] = compressionLevel;
+			state->attempts[i]          = attempt;
+			state->started[i]           = GetCurrentTimestamp();
+			state->admitted[i]          = state->reserved > 0;
+			if (state->reserved > 0)
+				state->reserved--;
 
 			curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);      /* we want progress ... */
 			curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION,
@@ -171,68 +548,516 @@ void rest_multi_call(MultiRestState *state, char *method, StringInfo url, PostDa
 			curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 			curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuff);
 
-			curl_easy_setopt(curl, CURLOPT_URL, url->data);
+			curl_easy_setopt(curl, CURLOPT_URL, url);
 			curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
 			curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
 			curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, compressionLevel > 0 ? "" : NULL);
 			curl_easy_setopt(curl, CURLOPT_VERBOSE, zdb_curl_verbose_guc);
 
-			if (postData != NULL && compressionLevel > 0) {
-				char   *data;
-				uint64 len;
+			if (postData != NULL && postData->finished && compressionLevel <= 0 && list_length(postData->chunks) <= 1) {
+				/* the whole body is (at most) one chunk, so curl can just send it */
+				StringInfo chunk = postData->chunks != NIL ? linitial(postData->chunks) : postData->buff;
 
-				postData->compressed_data = data = do_compression(postData->buff, compressionLevel, &len);
-
-				state->headers[i] = curl_slist_append(state->headers[i], "Content-Encoding: deflate");
-				curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
-				curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+				curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, chunk->len);
+				curl_easy_setopt(curl, CURLOPT_POSTFIELDS, chunk->data);
 			} else if (postData != NULL) {
-				postData->compressed_data = NULL;
-				curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, postData->buff->len);
-				curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData->buff->data);
+				postData->handle   = curl;
+				postData->readcell = NULL;
+				postData->readpos  = 0;
+				postData->paused   = false;
+				postData->zdone    = false;
+				postData->zstream  = NULL;
+
+				if (compressionLevel > 0) {
+					z_stream *zstream = state->zstreams[i];
+
+					if (zstream == NULL) {
+						zstream = malloc(sizeof(z_stream));
+						if (zstream == NULL)
+							ereport(ERROR,
+									(errcode(ERRCODE_OUT_OF_MEMORY),
+											errmsg("out of memory")));
+						memset(zstream, 0, sizeof(z_stream));
+
+						if (deflateInit(zstream, compressionLevel) != Z_OK) {
+							free(zstream);
+							ereport(ERROR,
+									(errcode(ERRCODE_INTERNAL_ERROR),
+											errmsg("unable to initialize deflate stream")));
+						}
+						state->zstreams[i] = zstream;
+					} else if (deflateReset(zstream) != Z_OK) {
+						ereport(ERROR,
+								(errcode(ERRCODE_INTERNAL_ERROR),
+										errmsg("unable to reset deflate stream")));
+					}
+					zstream->avail_in = 0;
+
+					postData->zstream = zstream;
+					state->headers[i] = curl_slist_append(state->headers[i], "Content-Encoding: deflate");
+				}
+
+				/* if we don't know how long the body will be, curl uses chunked transfer encoding */
+				curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+								 postData->finished && compressionLevel <= 0 ? (curl_off_t) postData->nchunked
+																			 : (curl_off_t) -1);
+				curl_easy_setopt(curl, CURLOPT_READFUNCTION, curl_read_func);
+				curl_easy_setopt(curl, CURLOPT_READDATA, postData);
+				curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curl_seek_func);
+				curl_easy_setopt(curl, CURLOPT_SEEKDATA, postData);
 			} else {
 				curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0);
 				curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
 			}
 
 			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, state->headers[i]);
-			curl_easy_setopt(curl, CURLOPT_POST,
-							 strcmp(method, "GET") != 0 && postData && postData->buff->data ? 1 : 0);
-			curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+			curl_easy_setopt(curl, CURLOPT_POST, strcmp(method, "GET") != 0 && postData ? 1 : 0);
 			curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
 
 			curl_multi_add_handle(state->multi_handle, curl);
 			state->available--;
-
-			rest_multi_perform(state);
 			return;
 		}
 	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_IO_ERROR),
+					errmsg("no available rest_multi slot")));
+}
+
+void rest_multi_call(MultiRestState *state, char *method, StringInfo url, PostDataEntry *postData, int compressionLevel) {
+	/*
+	 * sleep until we're allowed another request in flight.  Rejected requests waiting to be retried go first,
+	 * and then we need a cluster-wide admission token, which other backends might be holding
+	 */
+	for (;;) {
+		bool has_capacity = rest_multi_has_capacity(state);
+
+		if (has_capacity && (state->reserved > 0 || rest_multi_try_reserve(state)))
+			break;
+
+		rest_multi_wait(state, has_capacity ? MIN_MULTI_WAIT_MS : MAX_MULTI_WAIT_MS);
+		rest_multi_partial_cleanup(state, false, true);
+	}
+
+	start_request(state, pstrdup(method), pstrdup(url->data), postData, compressionLevel, 0);
+	rest_multi_perform(state);
+}
+
+/*
+ * Move whatever is in the entry's current chunk onto its list of finished chunks and, if
+ * 'finished', note that nothing more will be added.  If curl was waiting on us for more
+ * of this entry, it's told to carry on
+ */
+void rest_multi_post_data_add_chunk(PostDataEntry *entry, bool finished) {
+	if (entry->buff->len > 0) {
+		/* the next chunk goes wherever the caller put the entry's buffer */
+		MemoryContext oldContext = MemoryContextSwitchTo(GetMemoryChunkContext(entry->buff));
+
+		entry->chunks   = lappend(entry->chunks, entry->buff);
+		entry->nchunked += entry->buff->len;
+		rest_post_data_memory_add(entry->buff->maxlen);
+
+		entry->buff = makeStringInfo();
+		if (!finished) {
+			/* with room for the row that takes it past POST_DATA_CHUNK_SIZE */
+			enlargeStringInfo(entry->buff, POST_DATA_CHUNK_SIZE * 2 - 1);
+		}
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	if (finished)
+		entry->finished = true;
+
+	if (entry->handle != NULL && entry->paused) {
+		entry->paused = false;
+		curl_easy_pause(entry->handle, CURLPAUSE_CONT);
+	}
+}
+
+/*
+ * Throw away everything in the entry so it can be used to build another request body
+ */
+void rest_multi_post_data_reset(PostDataEntry *entry) {
+	ListCell *lc;
+
+	foreach (lc, entry->chunks) {
+		StringInfo chunk = lfirst(lc);
+
+		rest_post_data_memory_add(-(int64) chunk->maxlen);
+		freeStringInfo(chunk);
+	}
+	list_free(entry->chunks);
+
+	resetStringInfo(entry->buff);
+	entry->chunks   = NIL;
+	entry->nchunked = 0;
+	entry->finished = false;
+	entry->handle   = NULL;
+	entry->readcell = NULL;
+	entry->readpos  = 0;
+	entry->paused   = false;
+	entry->zstream  = NULL;
+	entry->zdone    = false;
 }
 
 bool rest_multi_is_available(MultiRestState *state) {
-	CURLM *multi_handle         = state->multi_handle;
-	int   still_running, numfds = 0;
+	int still_running;
 
 	/* Has something finished? */
 	still_running = rest_multi_perform(state);
-	if (still_running < state->nhandles)
+	if (still_running < state->limit)
 		return true;
 
-	/* Not yet, so wait for some action to be performed by curl */
-	curl_multi_wait(multi_handle, NULL, 0, 1000, &numfds);
-	if (numfds == 0)    /* no action, so get out now */
+	/* Not yet, so wait for some action to be performed by curl and see if something has finished */
+	still_running = rest_multi_wait(state, MAX_MULTI_WAIT_MS);
+	return still_running < state->limit;
+}
+
+/*
+ * Can we start another request right now without going over our flow control limit?
+ */
+bool rest_multi_has_capacity(MultiRestState *state) {
+	return state->retries == NIL && state->nhandles - state->available < state->limit;
+}
+
+/*
+ * Take a cluster-wide admission token for our next request, if one is free
+ */
+bool rest_multi_try_reserve(MultiRestState *state) {
+	if (!admission_try_acquire(state->admission))
 		return false;
 
-	/* see if something has finished */
-	still_running = rest_multi_perform(state);
-	return still_running < state->nhandles;
+	state->reserved++;
+	return true;
 }
 
 bool rest_multi_all_done(MultiRestState *state) {
 	int still_running;
 	still_running = rest_multi_perform(state);
-	return still_running == 0;
+
+	/* a request that just finished might have been rejected and need to be sent again */
+	rest_multi_partial_cleanup(state, false, false);
+	return still_running == 0 && state->retries == NIL;
+}
+
+void rest_multi_wait_all(MultiRestState *state) {
+	while (!rest_multi_all_done(state))
+		rest_multi_wait(state, MAX_MULTI_WAIT_MS);
+}
+
+/*
+ * A request, started at 'started', finished without Elasticsearch rejecting it.  If it wasn't
+ * unusually slow, we earn credit towards allowing another request in flight and larger batches
+ */
+void rest_multi_note_success(MultiRestState *state, TimestampTz started) {
+	long   secs;
+	int    usecs;
+	double latency;
+
+	TimestampDifference(started, GetCurrentTimestamp(), &secs, &usecs);
+	latency = secs * 1000.0 + usecs / 1000.0;
+
+	if (state->latency_avg > 0 && latency > state->latency_avg * LATENCY_SPIKE_FACTOR) {
+		/* Elasticsearch is slowing down, so hold steady */
+		state->credit = 0;
+	} else if (++state->credit >= state->limit) {
+		/* a full window of requests went well */
+		state->credit      = 0;
+		state->limit       = Min(state->nhandles, state->limit + 1);
+		state->batch_scale = Min(1.0, state->batch_scale + MIN_BATCH_SCALE);
+	}
+
+	state->latency_avg = state->latency_avg == 0 ? latency : state->latency_avg * 0.8 + latency * 0.2;
+}
+
+/*
+ * Elasticsearch rejected a request, so we back off:  half as many requests in flight, and half
+ * the batch size
+ */
+void rest_multi_note_rejection(MultiRestState *state) {
+	state->limit       = Max(1, state->limit / 2);
+	state->batch_scale = Max(MIN_BATCH_SCALE, state->batch_scale / 2);
+	state->credit      = 0;
+	state->nrejected++;
+}
+
+/*
+ * How long to wait before the 'attempt'th resend of a rejected request
+ */
+int rest_retry_backoff(int attempt) {
+	int backoff = Min(RETRY_BACKOFF_MAX_MS, RETRY_BACKOFF_MIN_MS << Min(attempt, 16));
+
+	/* so the backends that got rejected together don't all come back together */
+	return backoff + (int) (random() % (backoff / 2 + 1));
+}
+
+/*
+ * Did Elasticsearch reject (with a 429 status) some of the items in this _bulk 'response', and
+ * were those the only errors we can't ignore?  If so, 'rejected' is the list of their positions
+ */
+bool rest_find_rejected_items(char *response, bool ignore_version_conflicts, List **rejected) {
+	char *json = parse_json_object_from_string(response, CurrentMemoryContext);
+	char *items;
+	int  len;
+	int  a_itr;
+
+	*rejected = NIL;
+	if (json == NULL || (items = get_json_object_array(json, "items", true)) == NULL)
+		return false;
+
+	len = get_json_array_length(items);
+	for (a_itr = 0; a_itr < len; a_itr++) {
+		void *elem   = get_json_array_element_object(items, a_itr, CurrentMemoryContext);
+		void *action = get_json_object_object(elem, "update", true);
+		void *error;
+
+		if (action == NULL)
+			action = get_json_object_object(elem, "index", true);
+		if (action == NULL || (error = get_json_object_object(action, "error", true)) == NULL)
+			continue;
+
+		if (get_json_object_uint64(action, "status") == 429) {
+			*rejected = lappend_int(*rejected, a_itr);
+		} else {
+			const char *type = get_json_object_string(error, "type");
+
+			if (!ignore_version_conflicts || type == NULL || strcmp("version_conflict_engine_exception", type) != 0) {
+				list_free(*rejected);
+				*rejected = NIL;
+				return false;
+			}
+		}
+	}
+
+	return *rejected != NIL;
+}
+
+/*
+ * Copy, to 'dest', the lines of the 'len' bytes at 'src' that belong to the actions at the
+ * (ascending) positions 'next' points into, and return how many bytes that was.  Every action
+ * we generate is two lines:  the action itself and its document or script.  Smile bodies end
+ * each document with 'separator' rather than a line break, but it's the same idea.
+ *
+ * 'line' is how many lines came before 'src'.  'dest' can be 'src', as it's never ahead of it
+ */
+static size_t keep_action_lines(char *dest, char *src, size_t len, char separator, int *line, ListCell **next) {
+	size_t pos  = 0;
+	size_t kept = 0;
+
+	while (pos < len) {
+		char   *nl = memchr(src + pos, separator, len - pos);
+		size_t end = nl != NULL ? (size_t) (nl - src) + 1 : len;
+
+		while (*next != NULL && lfirst_int(*next) < *line / 2)
+			*next = lnext(*next);
+		if (*next != NULL && lfirst_int(*next) == *line / 2) {
+			memmove(dest + kept, src + pos, end - pos);
+			kept += end - pos;
+		}
+
+		if (nl != NULL)
+			(*line)++;
+		pos = end;
+	}
+
+	return kept;
+}
+
+/*
+ * Rebuild the 'len' byte _bulk request body at 'data', in place, so that it only contains the
+ * actions at the (ascending) positions in 'keep', and return its new length
+ */
+size_t rest_keep_only_actions(char *data, size_t len, char separator, List *keep) {
+	ListCell *next = list_head(keep);
+	int      line  = 0;
+
+	return keep_action_lines(data, data, len, separator, &line, &next);
+}
+
+/*
+ * Like rest_keep_only_actions(), but for a finished request body that's in chunks
+ */
+static void keep_only_actions(PostDataEntry *entry, List *keep) {
+	MemoryContext oldContext = MemoryContextSwitchTo(GetMemoryChunkContext(entry->buff));
+	StringInfo    body       = makeStringInfo();
+	ListCell      *next      = list_head(keep);
+	int           line       = 0;
+	ListCell      *lc;
+
+	MemoryContextSwitchTo(oldContext);
+
+	foreach (lc, entry->chunks) {
+		StringInfo chunk = lfirst(lc);
+
+		enlargeStringInfo(body, chunk->len);
+		body->len += (int) keep_action_lines(body->data + body->len, chunk->data, chunk->len, entry->separator,
+											 &line, &next);
+		body->data[body->len] = '\0';
+	}
+
+	rest_multi_post_data_reset(entry);
+	entry->chunks   = list_make1(body);
+	entry->nchunked = body->len;
+	entry->finished = true;
+	rest_post_data_memory_add(body->maxlen);
+}
+
+/*
+ * Take the request in slot 'i' out of its slot and queue it to be sent again after a backoff.
+ * If only some of its items were rejected, only those are sent again
+ */
+static void schedule_retry(MultiRestState *state, int i, List *rejected) {
+	PostDataEntry *entry = state->postDatas[i];
+	MemoryContext oldContext;
+	RestRetry     *retry;
+	int           backoff;
+
+	if (rejected != NIL) {
+		keep_only_actions(entry, rejected);
+	} else {
+		/* resend the whole thing from the beginning */
+		entry->handle   = NULL;
+		entry->readcell = NULL;
+		entry->readpos  = 0;
+		entry->paused   = false;
+		entry->zstream  = NULL;
+		entry->zdone    = false;
+	}
+
+	backoff = rest_retry_backoff(state->attempts[i]);
+
+	oldContext = MemoryContextSwitchTo(TopTransactionContext);
+	retry                   = palloc(sizeof(RestRetry));
+	retry->entry            = entry;
+	retry->method           = state->methods[i];
+	retry->url              = state->urls[i];
+	retry->compressionLevel = state->compressionLevels[i];
+	retry->attempt          = state->attempts[i] + 1;
+	retry->notBefore        = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), backoff);
+	state->retries          = lappend(state->retries, retry);
+	MemoryContextSwitchTo(oldContext);
+
+	/* the retry owns these now */
+	state->postDatas[i] = NULL;
+	state->methods[i]   = NULL;
+	state->urls[i]      = NULL;
+
+	rest_multi_note_rejection(state);
+
+	elog(ZDB_LOG_LEVEL, "[zombodb] Elasticsearch rejected %s, retrying in %dms (attempt %d, now allowing %d concurrent requests)",
+		 rejected != NIL ? psprintf("%d items of a request", list_length(rejected)) : "a request",
+		 backoff, retry->attempt, state->limit);
+	list_free(rejected);
+}
+
+/*
+ * Send any rejected requests whose backoff has expired, as long as we have the capacity
+ */
+static void dispatch_retries(MultiRestState *state) {
+	TimestampTz now;
+	ListCell    *lc;
+	ListCell    *prev = NULL;
+	ListCell    *next;
+
+	if (state->retries == NIL)
+		return;
+
+	now = GetCurrentTimestamp();
+	for (lc = list_head(state->retries); lc != NULL; lc = next) {
+		RestRetry *retry = lfirst(lc);
+
+		next = lnext(lc);
+		if (state->nhandles - state->available >= state->limit)
+			break;
+
+		if (retry->notBefore > now) {
+			prev = lc;
+			continue;
+		}
+
+		if (state->reserved == 0 && !rest_multi_try_reserve(state))
+			break;
+
+		state->retries = list_delete_cell(state->retries, lc, prev);
+		start_request(state, retry->method, retry->url, retry->entry, retry->compressionLevel, retry->attempt);
+		pfree(retry);
+	}
+}
+
+/*
+ * Free everything the request in slot 'i' was using, so the slot can be used for another.  Its
+ * request body's buffer goes back to the pool
+ */
+static void release_slot(MultiRestState *state, int i) {
+	if (state->errorbuffs[i] != NULL) {
+		pfree(state->errorbuffs[i]);
+		state->errorbuffs[i] = NULL;
+	}
+	if (state->postDatas[i] != NULL) {
+		PostDataEntry *entry = state->postDatas[i];
+
+		rest_multi_post_data_reset(entry);
+		state->pool[entry->pool_idx] = entry->buff;
+		state->postDatas[i]          = NULL;
+		pfree(entry);
+	}
+	if (state->responses[i] != NULL) {
+		pfree(state->responses[i]->data);
+		pfree(state->responses[i]);
+		state->responses[i] = NULL;
+	}
+	if (state->headers[i] != NULL) {
+		curl_slist_free_all(state->headers[i]);
+		state->headers[i] = NULL;
+	}
+	if (state->methods[i] != NULL) {
+		pfree(state->methods[i]);
+		state->methods[i] = NULL;
+	}
+	if (state->urls[i] != NULL) {
+		pfree(state->urls[i]);
+		state->urls[i] = NULL;
+	}
+	if (state->admitted[i]) {
+		admission_release(state->admission);
+		state->admitted[i] = false;
+	}
+	state->handles[i] = NULL;
+	state->available++;
+}
+
+/*
+ * Abandon the requests that are still in flight, and those waiting to be retried, without waiting
+ * for them to finish.  Nobody hears about their responses
+ */
+void rest_multi_cancel(MultiRestState *state) {
+	int i;
+
+	for (i = 0; i < state->nhandles; i++) {
+		CURL *handle = state->handles[i];
+
+		if (handle == NULL)
+			continue;
+
+		release_slot(state, i);
+		curl_multi_remove_handle(state->multi_handle, handle);
+		curl_pool_checkin(handle);
+	}
+
+	while (state->retries != NIL) {
+		RestRetry *retry = linitial(state->retries);
+
+		state->retries = list_delete_first(state->retries);
+		rest_multi_post_data_reset(retry->entry);
+		state->pool[retry->entry->pool_idx] = retry->entry->buff;
+		pfree(retry->entry);
+		pfree(retry->method);
+		pfree(retry->url);
+		pfree(retry);
+	}
+
+	state->running = 0;
 }
 
 void rest_multi_partial_cleanup(MultiRestState *state, bool finalize, bool fast) {
@@ -258,9 +1083,23 @@ void rest_multi_partial_cleanup(MultiRestState *state, bool finalize, bool fast)
 										errmsg("problem getting response code: rc=%d", rc)));
 					}
 
-					if (msg->data.result != CURLE_OK || response_code != 200 ||
+					/* like rest_call(), deleting something that's already gone isn't an error */
+					if (msg->data.result != CURLE_OK ||
+						(response_code != 200 && !(response_code == 404 && strcmp(state->methods[i], "DELETE") == 0)) ||
 						strstr(state->responses[i]->data, "\"errors\":true")) {
-						bool ignoreError = state->vconflicts[i] && contains_version_conflict_error(state, i);
+						bool ignoreError = false;
+						List *rejected   = NIL;
+
+						if (msg->data.result == CURLE_OK && state->postDatas[i] != NULL &&
+							state->attempts[i] < MAX_REQUEST_RETRIES &&
+							(response_code == 429 ||
+							 (response_code == 200 && rest_find_rejected_items(state->responses[i]->data, state->vconflicts[i], &rejected)))) {
+							/* Elasticsearch is too busy for (some of) this request, so we'll send it again shortly */
+							schedule_retry(state, i, rejected);
+							ignoreError = true;
+						} else {
+							ignoreError = state->vconflicts[i] && rest_contains_version_conflict_error(state->responses[i]->data);
+						}
 
 						if (!ignoreError) {
 							/* REST endpoint messed up */
@@ -270,34 +1109,25 @@ void rest_multi_partial_cleanup(MultiRestState *state, bool finalize, bool fast)
 												   i, handle, state->errorbuffs[i], state->responses[i]->data,
 												   response_code, msg->data.result)));
 						}
+					} else {
+						rest_multi_note_success(state, state->started[i]);
 					}
 
-					if (state->errorbuffs[i] != NULL) {
-						pfree(state->errorbuffs[i]);
-						state->errorbuffs[i] = NULL;
-					}
 					if (state->postDatas[i] != NULL) {
-						PostDataEntry *entry = state->postDatas[i];
+						double uploaded;
 
-						resetStringInfo(entry->buff);
-						if (state->postDatas[i]->compressed_data != NULL) {
-							pfree(state->postDatas[i]->compressed_data);
-							state->postDatas[i]->compressed_data = NULL;
-						}
-						state->pool[entry->pool_idx] = entry->buff;
-						state->postDatas[i]          = NULL;
+						if (curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD, &uploaded) == CURLE_OK)
+							state->nbytesSent += (uint64) uploaded;
 					}
-					if (state->responses[i] != NULL) {
-						pfree(state->responses[i]->data);
-						pfree(state->responses[i]);
+
+					if (state->postDatas[i] != NULL && state->postDatas[i]->on_response != NULL) {
+						/* the caller wants the response, and it's theirs now */
+						StringInfo response = state->responses[i];
+
 						state->responses[i] = NULL;
+						state->postDatas[i]->on_response(state->postDatas[i]->on_response_arg, response);
 					}
-					if (state->headers[i] != NULL) {
-						curl_slist_free_all(state->headers[i]);
-						state->headers[i] = NULL;
-					}
-					state->handles[i] = NULL;
-					state->available++;
+					release_slot(state, i);
 
 					found = true;
 					break;
@@ -306,7 +1136,7 @@ void rest_multi_partial_cleanup(MultiRestState *state, bool finalize, bool fast)
 
 			if (found) {
 				curl_multi_remove_handle(state->multi_handle, handle);
-				curl_easy_cleanup(handle);
+				curl_pool_checkin(handle);
 				if (fast)
 					return;
 			} else {
@@ -318,14 +1148,82 @@ void rest_multi_partial_cleanup(MultiRestState *state, bool finalize, bool fast)
 	}
 
 	if (finalize) {
+		for (; state->reserved > 0; state->reserved--)
+			admission_release(state->admission);
+
 		curl_multi_cleanup(state->multi_handle);
 		curl_forget_multi_handle(state);
 	}
 }
 
-static bool contains_version_conflict_error(const MultiRestState *state, int i) {
+/*
+ * Count 'delta' more (or, if negative, fewer) bytes of request bodies against this backend
+ */
+void rest_post_data_memory_add(int64 delta) {
+	if (delta < 0 && (uint64) -delta > postDataMemory)
+		postDataMemory = 0;
+	else
+		postDataMemory += delta;
+
+	postDataMemoryPeak = Max(postDataMemoryPeak, postDataMemory);
+}
+
+/*
+ * How many bytes of request bodies this backend is holding on to right now
+ */
+uint64 rest_post_data_memory(void) {
+	return postDataMemory;
+}
+
+/*
+ * Our transaction is over, and with it, every request body it built
+ */
+void rest_post_data_memory_end_xact(void) {
+	postDataMemory = 0;
+}
+
+/*
+ * How much memory this backend's _bulk requests are using, and have used, against zdb.max_bulk_memory
+ */
+Datum zdb_bulk_memory(PG_FUNCTION_ARGS) {
+	ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc       tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext   oldcontext;
+	Datum           values[3];
+	bool            nulls[3];
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult  = tupstore;
+	rsinfo->setDesc    = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) postDataMemory);
+	values[1] = Int64GetDatum((int64) postDataMemoryPeak);
+	values[2] = Int64GetDatum((int64) zdb_max_bulk_memory_guc * 1024);
+	nulls[2]  = zdb_max_bulk_memory_guc == 0;
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/*
+ * Is one of the errors in this _bulk response a version conflict?
+ */
+bool rest_contains_version_conflict_error(char *response) {
 	bool ignoreError = false;
-	char *json       = parse_json_object(state->responses[i], CurrentMemoryContext);
+	char *json       = parse_json_object_from_string(response, CurrentMemoryContext);
 
 	if (json) {
 		char *items = get_json_object_array(json, "items", true);
@@ -19,13 +19,34 @@
 
 #include "curl_support.h"
 
+/* how many times we'll resend a request Elasticsearch rejected */
+#define MAX_REQUEST_RETRIES 8
+
 StringInfo rest_call(char *method, StringInfo url, StringInfo postData, int compressionLevel);
 
-MultiRestState *rest_multi_init(int nhandles, bool ignore_version_conflicts);
+MultiRestState *rest_multi_init(char *url, int nhandles, bool ignore_version_conflicts);
 int rest_multi_perform(MultiRestState *state);
+int rest_multi_wait(MultiRestState *state, long timeout_ms);
 void rest_multi_call(MultiRestState *state, char *method, StringInfo url, PostDataEntry *postData, int compressionLevel);
+void rest_multi_post_data_add_chunk(PostDataEntry *entry, bool finished);
+void rest_multi_post_data_reset(PostDataEntry *entry);
 bool rest_multi_is_available(MultiRestState *state);
+bool rest_multi_has_capacity(MultiRestState *state);
+bool rest_multi_try_reserve(MultiRestState *state);
 bool rest_multi_all_done(MultiRestState *state);
+void rest_multi_wait_all(MultiRestState *state);
 void rest_multi_partial_cleanup(MultiRestState *state, bool finalize, bool fast);
+void rest_multi_cancel(MultiRestState *state);
+bool rest_contains_version_conflict_error(char *response);
+
+void rest_multi_note_success(MultiRestState *state, TimestampTz started);
+void rest_multi_note_rejection(MultiRestState *state);
+int rest_retry_backoff(int attempt);
+bool rest_find_rejected_items(char *response, bool ignore_version_conflicts, List **rejected);
+size_t rest_keep_only_actions(char *data, size_t len, char separator, List *keep);
+
+void rest_post_data_memory_add(int64 delta);
+uint64 rest_post_data_memory(void);
+void rest_post_data_memory_end_xact(void);
 
 #endif /* __ZDB_REST_H__ */
@@ -15,6 +15,9 @@
  */
 #include "zombodb.h"
 #include "highlighting/highlighting.h"
+#include "elasticsearch/refresh_coordinator.h"
+#include "indexam/xact_tracker.h"
+#include "rest/admission.h"
 #include "rest/curl_support.h"
 #include "scoring/scoring.h"
 
@@ -39,6 +42,9 @@ void _PG_init(void) {
 	json_support_init();
 	scoring_support_init();
 	highlight_support_init();
+	admission_init();
+	xact_tracker_init();
+	refresh_coordinator_init();
 
 	/* callbacks registered here should always be the first to run, so it's the last one we initialize */
 	zdb_aminit();
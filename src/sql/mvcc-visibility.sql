@@ -1,35 +1,63 @@
-CREATE OR REPLACE FUNCTION vac_by_xmin(index regclass, type text, xmin bigint) RETURNS zdbquery PARALLEL SAFE STABLE STRICT LANGUAGE sql AS $$
+CREATE OR REPLACE FUNCTION xid_ranges(field name, ranges bigint[]) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
+/*
+ * docs whose xid 'field' is in one of the flattened [lo, hi] pairs of 'ranges'
+ */
+    SELECT CASE WHEN coalesce(array_length(ranges, 1), 0) < 2 THEN dsl.match_none()
+                ELSE dsl.should(VARIADIC ARRAY(SELECT dsl.range(field => field, gte => ranges[i], lte => ranges[i + 1])
+                                                 FROM generate_series(1, array_length(ranges, 1) - 1, 2) i
+                                                ORDER BY i))
+           END;
+$$;
+
+CREATE OR REPLACE FUNCTION xid_is_committed(field name, myXmax bigint, active_xids bigint[], aborted_ranges bigint[], xid_horizon bigint) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
+/*
+ * docs whose xid 'field' is committed as far as our snapshot is concerned.  Below the horizon, every
+ * xid that didn't commit is in 'aborted_ranges', so we only need to look at our active xids above it
+ */
+    SELECT dsl.must(
+        dsl.noteq(zdb.xid_ranges(field, aborted_ranges)),
+        dsl.should(
+            dsl.range(field => field, lt => xid_horizon),
+            dsl.must(
+                dsl.noteq(dsl.terms(field, VARIADIC active_xids)),
+                dsl.range(field => field, lt => myXmax)
+            )
+        )
+    );
+$$;
+
+CREATE OR REPLACE FUNCTION vac_by_xmin(xmin bigint, aborted_ranges bigint[]) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
 /*
  * docs with aborted xmins
  */
     SELECT dsl.must(
         dsl.range(field=>'zdb_xmin', lt=>xmin),
-        dsl.filter(dsl.terms_lookup('zdb_xmin', zdb.index_name(index), type, 'zdb_aborted_xids', 'zdb_aborted_xids'))
+        dsl.filter(zdb.xid_ranges('zdb_xmin', aborted_ranges))
     );
 $$;
 
-CREATE OR REPLACE FUNCTION vac_by_xmax(index regclass, type text, xmax bigint) RETURNS zdbquery PARALLEL SAFE STABLE STRICT LANGUAGE sql AS $$
+CREATE OR REPLACE FUNCTION vac_by_xmax(xmax bigint, aborted_ranges bigint[]) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
 /*
  * docs with committed xmax
  */
     SELECT dsl.must(
         dsl.range(field=>'zdb_xmax', lt=>xmax),
-        dsl.filter(dsl.noteq(dsl.terms_lookup('zdb_xmax', zdb.index_name(index), type, 'zdb_aborted_xids', 'zdb_aborted_xids')))
+        dsl.filter(dsl.noteq(zdb.xid_ranges('zdb_xmax', aborted_ranges)))
     );
 $$;
 
-CREATE OR REPLACE FUNCTION vac_aborted_xmax(index regclass, type text, xmax bigint) RETURNS zdbquery PARALLEL SAFE STABLE STRICT LANGUAGE sql AS $$
+CREATE OR REPLACE FUNCTION vac_aborted_xmax(xmax bigint, aborted_ranges bigint[]) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
 /*
  * docs with aborted xmax
  */
     SELECT dsl.must(
         dsl.range(field=>'zdb_xmax', lt=>xmax),
-        dsl.filter(dsl.terms_lookup('zdb_xmax', zdb.index_name(index), type, 'zdb_aborted_xids', 'zdb_aborted_xids'))
+        dsl.filter(zdb.xid_ranges('zdb_xmax', aborted_ranges))
     );
 $$;
 
 CREATE OR REPLACE FUNCTION internal_visibility_clause(index regclass) RETURNS zdbquery PARALLEL SAFE STABLE STRICT LANGUAGE c AS 'MODULE_PATHNAME', 'zdb_internal_visibility_clause';
-CREATE OR REPLACE FUNCTION visibility_clause(myXid bigint, myXmax bigint, myCid int, active_xids bigint[], index regclass, type text) RETURNS zdbquery PARALLEL SAFE STABLE STRICT LANGUAGE sql AS $$
+CREATE OR REPLACE FUNCTION visibility_clause(myXid bigint, myXmax bigint, myCid int, active_xids bigint[], aborted_ranges bigint[], xid_horizon bigint) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
 /*
 * ((Xmin == my-transaction &&				inserted by the current transaction
 *	 Cmin < my-command &&					before this command, and
@@ -53,11 +81,11 @@ CREATE OR REPLACE FUNCTION visibility_clause(myXid bigint, myXmax bigint, myCid
         )
     OR
         (
-            (NOT ({"terms":{"xmin":{"index":"$INDEX","path":"aborted_xids","type":"$TYPE","id":"aborted_xids"}}}) AND NOT xmin = [active_xids] AND NOT xmin >= "myXmax")
+            (NOT xmin = [aborted_ranges] AND (xmin < "xid_horizon" OR (NOT xmin = [active_xids] AND xmin < "myXmax")))
         AND (xmax = NULL
               OR (xmax = "myXid" AND cmax >= "myCid")
               OR (xmax != "myXid"
-                    AND (({"terms":{"xmax":{"index":"$INDEX","path":"aborted_xids","type":"$TYPE","id":"aborted_xids"}}}) OR xmax = [active_xids] OR xmax >= "myXmax")
+                    AND NOT (NOT xmax = [aborted_ranges] AND (xmax < "xid_horizon" OR (NOT xmax = [active_xids] AND xmax < "myXmax")))
                  )
             )
         )
@@ -79,27 +107,54 @@ CREATE OR REPLACE FUNCTION visibility_clause(myXid bigint, myXmax bigint, myCid
               )
           ),
           dsl.must(
-              dsl.must(
-                  dsl.noteq(dsl.terms_lookup('zdb_xmin', zdb.index_name(index), type, 'zdb_aborted_xids', 'zdb_aborted_xids')),
-                  dsl.noteq(dsl.terms('zdb_xmin', VARIADIC active_xids)),
-                  dsl.noteq(dsl.range(field => 'zdb_xmin', gte => myXmax)),
-                  dsl.should(
-                      dsl.field_missing('zdb_xmax'),
-                      dsl.must(
-                          dsl.term('zdb_xmax', myXid),
-                          dsl.range(field => 'zdb_cmax', gte => myCid)
-                      ),
-                      dsl.must(
-                          dsl.noteq(dsl.term('zdb_xmax', myXid)),
-                          dsl.should(
-                              dsl.terms_lookup('zdb_xmax', zdb.index_name(index), type, 'zdb_aborted_xids', 'zdb_aborted_xids'),
-                              dsl.terms('zdb_xmax', VARIADIC active_xids),
-                              dsl.range(field => 'zdb_xmax', gte => myXmax)
-                          )
-                      )
+              zdb.xid_is_committed('zdb_xmin', myXmax, active_xids, aborted_ranges, xid_horizon),
+              dsl.should(
+                  dsl.field_missing('zdb_xmax'),
+                  dsl.must(
+                      dsl.term('zdb_xmax', myXid),
+                      dsl.range(field => 'zdb_cmax', gte => myCid)
+                  ),
+                  dsl.must(
+                      dsl.noteq(dsl.term('zdb_xmax', myXid)),
+                      dsl.noteq(zdb.xid_is_committed('zdb_xmax', myXmax, active_xids, aborted_ranges, xid_horizon))
                   )
               )
           )
       )
   );
 $$;
+
+CREATE OR REPLACE FUNCTION visibility_clause_tombstones(myXid bigint, myXmax bigint, myCid int, active_xids bigint[], aborted_ranges bigint[], xid_horizon bigint) RETURNS zdbquery PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
+/*
+ * The same as visibility_clause(), for indexes WITH (tombstones=true).  Their rows don't have an xmax.
+ * Instead, each UPDATE or DELETE adds a "zdb_tombstone" child document with its xmax and cmax, and
+ * a row is visible unless it has a tombstone that hides it:
+ *
+ *  (Xmax == my-transaction &&              deleted by the current transaction
+ *   Cmax < my-command)                     before this command
+ *  ||                                      or
+ *  (Xmax != my-transaction &&              deleted by another transaction
+ *   Xmax is committed)                     that has committed
+ */
+  SELECT dsl.must(
+      dsl.noteq('_id:zdb_aborted_xids'),
+      dsl.should(
+          dsl.must(
+              dsl.term('zdb_xmin', myXid),
+              dsl.range(field => 'zdb_cmin', lt => myCid)
+          ),
+          zdb.xid_is_committed('zdb_xmin', myXmax, active_xids, aborted_ranges, xid_horizon)
+      ),
+      dsl.noteq(json_build_object('has_child', json_build_object('type', 'zdb_tombstone', 'query',
+          dsl.should(
+              dsl.must(
+                  dsl.term('zdb_xmax', myXid),
+                  dsl.range(field => 'zdb_cmax', lt => myCid)
+              ),
+              dsl.must(
+                  dsl.noteq(dsl.term('zdb_xmax', myXid)),
+                  zdb.xid_is_committed('zdb_xmax', myXmax, active_xids, aborted_ranges, xid_horizon)
+              )
+          )::json))::zdbquery)
+  );
+$$;
@@ -21,3 +21,5 @@ $$;
 CREATE OR REPLACE FUNCTION all_es_index_names() RETURNS SETOF text PARALLEL SAFE IMMUTABLE STRICT LANGUAGE sql AS $$
     SELECT zdb.index_name(oid::regclass) FROM pg_class WHERE relam = (SELECT oid FROM pg_am WHERE amname = 'zombodb');
 $$;
+CREATE OR REPLACE FUNCTION bulk_admission() RETURNS TABLE (pid int, url text, max_requests int, in_flight int, holding int, waiting boolean, waiting_since timestamptz) VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'zdb_bulk_admission';
+CREATE OR REPLACE FUNCTION bulk_memory() RETURNS TABLE (bytes bigint, peak_bytes bigint, max_bytes bigint) VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'zdb_bulk_memory';
@@ -29,3 +29,22 @@ CREATE OR REPLACE VIEW index_stats AS
     (zdb.request(indexrelid, 'doc/_count', 'GET') :: JSON) -> 'count'                      AS doc_count,
     coalesce(json_array_length((zdb.request(indexrelid, 'doc/zdb_aborted_xids', 'GET') :: JSON) -> '_source'->'zdb_aborted_xids'), 0) AS aborted_xids
   FROM stats;
+
+--
+-- which backends are holding, or waiting for, cluster-wide _bulk request tokens
+--
+CREATE OR REPLACE VIEW bulk_admission_status AS
+  SELECT
+    admission.pid,
+    activity.datname,
+    activity.usename,
+    admission.url,
+    admission.max_requests,
+    admission.in_flight,
+    admission.holding,
+    admission.waiting,
+    admission.waiting_since,
+    now() - admission.waiting_since AS waiting_for,
+    activity.query
+  FROM zdb.bulk_admission() admission
+    LEFT JOIN pg_stat_activity activity ON activity.pid = admission.pid;
@@ -0,0 +1,93 @@
+#
+# Copyright 2018 ZomboDB, LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+#! /bin/bash
+#
+# Compares the 'json' and 'smile' bulk_formats, with and without deflate, by indexing the same
+# rows with each and reporting:
+#
+#   - the bytes of _bulk request bodies ZomboDB sent over the wire
+#   - the CPU time of the Postgres backend that built the index
+#   - the CPU time, and time spent indexing, of the Elasticsearch nodes
+#
+# Postgres must be running on this machine and we must connect as a superuser, as the backend
+# reads its own CPU time from /proc.  The bytes come from the "sent N bytes" line ZomboDB logs
+# at the end of each build.
+#
+# usage:  bulk-format.sh [elasticsearch url] [rows]
+#
+
+ES_URL=${1:-http://localhost:9200/}
+ROWS=${2:-1000000}
+PSQL="psql -X -q -At -v ON_ERROR_STOP=1"
+
+# the Elasticsearch nodes' total CPU time and indexing time, in milliseconds
+es_stats() {
+    ${PSQL} -v stats="$(curl -s "${ES_URL}_nodes/stats/process,indices")" <<'EOF'
+SELECT sum((n.value->'process'->'cpu'->>'total_in_millis')::bigint) || ' ' ||
+       sum((n.value->'indices'->'indexing'->>'index_time_in_millis')::bigint)
+  FROM jsonb_each((:'stats')::jsonb->'nodes') n;
+EOF
+}
+
+${PSQL} <<EOF
+DROP TABLE IF EXISTS bulk_format_bench CASCADE;
+CREATE TABLE bulk_format_bench AS
+    SELECT i                                      AS id,
+           i * 1.5                                AS price,
+           (random() * 1000000)::float8           AS score,
+           (random() * 100)::int                  AS quantity,
+           now() - (i || ' seconds')::interval    AS created_at,
+           md5(i::text)                           AS hash,
+           ARRAY[i, i + 1, i + 2]                 AS ids,
+           jsonb_build_object('a', i, 'b', md5(i::text)) AS doc
+      FROM generate_series(1, ${ROWS}) i;
+EOF
+
+ticks=$(getconf CLK_TCK)
+printf "%-8s %-11s %14s %12s %12s %14s\n" format compression wire_bytes pg_cpu_ms es_cpu_ms es_index_ms
+
+for format in json smile; do
+    for compression in 0 1; do
+        read es_cpu_before es_index_before <<< "$(es_stats)"
+
+        # a single session, so it reports the CPU time (fields 14 and 15 of /proc/<pid>/stat) of
+        # the backend that built the index
+        output=$(${PSQL} 2>&1 <<EOF
+SET zdb.log_level TO info;
+SET zdb.max_parallel_build_workers TO 0;
+CREATE INDEX idxbulk_format_bench ON bulk_format_bench USING zombodb ((bulk_format_bench.*))
+       WITH (url='${ES_URL}', bulk_format='${format}', compression_level=${compression}, shards=5, replicas=0);
+SELECT 'cpu ' || string_agg(x, ' ' ORDER BY n)
+  FROM regexp_split_to_table(pg_read_file('/proc/' || pg_backend_pid() || '/stat'), ' ') WITH ORDINALITY AS t(x, n)
+ WHERE n IN (14, 15);
+DROP INDEX idxbulk_format_bench;
+EOF
+)
+        read es_cpu_after es_index_after <<< "$(es_stats)"
+
+        wire_bytes=$(echo "${output}" | grep -o 'sent [0-9]* bytes' | awk '{sum += $2} END {print sum + 0}')
+        read utime stime <<< "$(echo "${output}" | grep '^cpu ' | awk '{print $2, $3}')"
+
+        printf "%-8s %-11s %14d %12d %12d %14d\n" \
+            ${format} ${compression} \
+            ${wire_bytes} \
+            $(( (utime + stime) * 1000 / ticks )) \
+            $(( es_cpu_after - es_cpu_before )) \
+            $(( es_index_after - es_index_before ))
+    done
+done
+
+${PSQL} -c "DROP TABLE bulk_format_bench CASCADE;"
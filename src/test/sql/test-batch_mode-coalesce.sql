@@ -0,0 +1,41 @@
+CREATE TABLE coalesce_json (
+    id serial8 not null primary key,
+    title varchar(64)
+) WITH (autovacuum_enabled = false);
+CREATE TABLE coalesce_smile (
+    id serial8 not null primary key,
+    title varchar(64)
+) WITH (autovacuum_enabled = false);
+CREATE INDEX idxcoalesce_json ON coalesce_json USING zombodb ((coalesce_json.*));
+CREATE INDEX idxcoalesce_smile ON coalesce_smile USING zombodb ((coalesce_smile.*)) WITH (bulk_format='smile');
+
+SET zdb.batch_mode TO ON;
+BEGIN;
+INSERT INTO coalesce_json (title) VALUES ('one'), ('two'), ('three'), ('four');
+INSERT INTO coalesce_smile (title) VALUES ('one'), ('two'), ('three'), ('four');
+
+-- by the transaction that inserted them, so their documents aren't sent at all
+UPDATE coalesce_json SET title = 'one, updated' WHERE id = 1;
+UPDATE coalesce_smile SET title = 'one, updated' WHERE id = 1;
+DELETE FROM coalesce_json WHERE id = 2;
+DELETE FROM coalesce_smile WHERE id = 2;
+
+-- by a subtransaction, so their documents are sent with its xmax
+SAVEPOINT s;
+UPDATE coalesce_json SET title = 'three, updated' WHERE id = 3;
+UPDATE coalesce_smile SET title = 'three, updated' WHERE id = 3;
+DELETE FROM coalesce_json WHERE id = 4;
+DELETE FROM coalesce_smile WHERE id = 4;
+RELEASE SAVEPOINT s;
+COMMIT;
+SET zdb.batch_mode TO OFF;
+
+SELECT zdb.count('idxcoalesce_json', dsl.match_all());
+SELECT * FROM zdb.terms('idxcoalesce_json', 'title', dsl.match_all()) ORDER BY term;
+SELECT zdb.raw_count('idxcoalesce_json', dsl.field_exists('zdb_xmax')) AS deleted;
+SELECT zdb.count('idxcoalesce_smile', dsl.match_all());
+SELECT * FROM zdb.terms('idxcoalesce_smile', 'title', dsl.match_all()) ORDER BY term;
+SELECT zdb.raw_count('idxcoalesce_smile', dsl.field_exists('zdb_xmax')) AS deleted;
+
+DROP TABLE coalesce_json CASCADE;
+DROP TABLE coalesce_smile CASCADE;
\ No newline at end of file
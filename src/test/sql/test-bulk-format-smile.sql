@@ -0,0 +1,36 @@
+CREATE TABLE bulk_smile (
+    id serial8 not null primary key,
+    name varchar(64),
+    body text,
+    tags varchar[],
+    nums int[],
+    score float8,
+    data json,
+    datab jsonb
+);
+-- Elasticsearch won't index NaN or Infinity as a double, but we can still see what we sent it
+SELECT zdb.define_field_mapping('bulk_smile', 'score', '{"type":"keyword"}');
+
+INSERT INTO bulk_smile (name, body, tags, nums, score, data, datab) VALUES
+    ('plain', 'the quick brown fox', ARRAY['a', 'b'], ARRAY[1, 2, 3], 1.5, '{"a": 1, "b": [1, 2, 3]}', '{"x": {"y": "z"}}'),
+    ('Ünïcödé', 'naïve café façade', ARRAY['日本', '中文'], ARRAY[]::int[], 'NaN', '{"a": 2, "s": "日本語"}', '{"x": {"y": "ü"}}');
+
+CREATE INDEX idxbulk_smile ON bulk_smile USING zombodb ((bulk_smile.*)) WITH (bulk_format='smile');
+
+-- these go through the bulk stream of an INSERT rather than through the index build
+INSERT INTO bulk_smile (name, body, tags, nums, score, data, datab) VALUES
+    ('elephant', 'smörgåsbord', ARRAY['🐘'], ARRAY[4, NULL, 5], 'Infinity', '{"a": 3, "b": []}', '{"x": {"y": "🐘"}}'),
+    ('negative', NULL, NULL, NULL, '-Infinity', NULL, NULL);
+
+SELECT zdb.count('idxbulk_smile', dsl.match_all());
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.term('name', 'ünïcödé') ORDER BY id;
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.match('body', 'smörgåsbord') ORDER BY id;
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.terms('tags', '日本', '🐘') ORDER BY id;
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.terms('nums', 2, 5) ORDER BY id;
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.terms('score', 'NaN', 'Infinity', '-Infinity') ORDER BY id;
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.term('data.s', '日本語') ORDER BY id;
+SELECT id, name FROM bulk_smile WHERE bulk_smile ==> dsl.term('datab.x.y', '🐘') ORDER BY id;
+SELECT * FROM zdb.terms('idxbulk_smile', 'name', dsl.match_all()) ORDER BY term COLLATE "C";
+SELECT * FROM zdb.terms('idxbulk_smile', 'score', dsl.match_all()) ORDER BY term COLLATE "C";
+
+DROP TABLE bulk_smile CASCADE;
\ No newline at end of file
@@ -0,0 +1,26 @@
+CREATE TYPE multiline_meta AS (
+    label text,
+    data json
+);
+CREATE TABLE multiline_json (
+    id serial8 not null primary key,
+    meta multiline_meta
+);
+
+-- row_to_json() writes the json in a composite column as-is, line breaks and all
+INSERT INTO multiline_json (meta) VALUES (ROW('built', E'{\n  "a": 1,\n  "s": "one"\n}')::multiline_meta);
+
+CREATE INDEX idxmultiline_json ON multiline_json USING zombodb ((multiline_json.*));
+
+-- these go through the bulk stream of an INSERT rather than through the index build
+INSERT INTO multiline_json (meta) VALUES
+    (ROW('inserted', E'{\r\n  "a": 2,\r\n  "s": "two"\r\n}')::multiline_meta),
+    (ROW('nested', E'{\n  "a": 3,\n  "s": "three",\n  "b": {\n    "c": [\n      1,\n      2\n    ]\n  }\n}')::multiline_meta);
+
+SELECT zdb.count('idxmultiline_json', dsl.match_all());
+SELECT id, (meta).label FROM multiline_json WHERE multiline_json ==> dsl.term('meta.data.s', 'two') ORDER BY id;
+SELECT id, (meta).label FROM multiline_json WHERE multiline_json ==> dsl.term('meta.data.b.c', '2') ORDER BY id;
+SELECT * FROM zdb.terms('idxmultiline_json', 'meta.data.s', dsl.match_all()) ORDER BY term;
+
+DROP TABLE multiline_json CASCADE;
+DROP TYPE multiline_meta;
\ No newline at end of file
@@ -0,0 +1,79 @@
+-- zdb.internal_visibility_clause() is built in C, but it has to agree with zdb.visibility_clause()
+-- and zdb.visibility_clause_tombstones() about which docs are visible to the same snapshot
+CREATE FUNCTION visibility_clauses_agree(index regclass, tombstones bool, cid int, aborted bigint[])
+    RETURNS TABLE (c_count bigint, sql_count bigint, only_c bigint, only_sql bigint) LANGUAGE plpgsql AS $$
+DECLARE
+    source     jsonb    := (zdb.request(index, 'doc/zdb_aborted_xids')::jsonb)->'_source';
+    snapshot   txid_snapshot := txid_current_snapshot();
+    active     bigint[] := ARRAY(SELECT txid_snapshot_xip(snapshot)) || aborted;
+    ranges     bigint[];
+    horizon    bigint   := coalesce((source->>'zdb_xid_horizon')::bigint, 0);
+    c_clause   zdbquery := zdb.internal_visibility_clause(index);
+    sql_clause zdbquery;
+BEGIN
+    -- what Elasticsearch knows didn't commit, as flattened [lo, hi] pairs
+    ranges := ARRAY(SELECT x::bigint FROM jsonb_array_elements_text(coalesce(source->'zdb_aborted_ranges', '[]')) WITH ORDINALITY r(x, n) ORDER BY n) ||
+              ARRAY(SELECT x::bigint FROM jsonb_array_elements_text(coalesce(source->'zdb_aborted_xids', '[]')) WITH ORDINALITY r(x, n), generate_series(1, 2) ORDER BY n);
+
+    IF tombstones THEN
+        sql_clause := zdb.visibility_clause_tombstones(txid_current(), txid_snapshot_xmax(snapshot), cid, active, ranges, horizon);
+    ELSE
+        sql_clause := zdb.visibility_clause(txid_current(), txid_snapshot_xmax(snapshot), cid, active, ranges, horizon);
+    END IF;
+
+    RETURN QUERY SELECT zdb.raw_count(index, c_clause),
+                        zdb.raw_count(index, sql_clause),
+                        zdb.raw_count(index, dsl.must(c_clause, dsl.noteq(sql_clause))),
+                        zdb.raw_count(index, dsl.must(sql_clause, dsl.noteq(c_clause)));
+END;
+$$;
+
+CREATE TABLE visibility (
+    id serial8 not null primary key,
+    title varchar(64)
+) WITH (autovacuum_enabled = false);
+CREATE TABLE visibility_tombstones (
+    id serial8 not null primary key,
+    title varchar(64)
+) WITH (autovacuum_enabled = false);
+CREATE INDEX idxvisibility ON visibility USING zombodb ((visibility.*));
+CREATE INDEX idxvisibility_tombstones ON visibility_tombstones USING zombodb ((visibility_tombstones.*)) WITH (tombstones=true);
+
+-- so both indexes have an xid horizon
+VACUUM visibility;
+VACUUM visibility_tombstones;
+
+-- rows in each of the states the visibility clause tells apart
+INSERT INTO visibility (title) VALUES ('committed'), ('deleted'), ('updated'), ('delete aborted');
+INSERT INTO visibility_tombstones (title) VALUES ('committed'), ('deleted'), ('updated'), ('delete aborted');
+DELETE FROM visibility WHERE title = 'deleted';
+DELETE FROM visibility_tombstones WHERE title = 'deleted';
+UPDATE visibility SET title = 'updated, again' WHERE title = 'updated';
+UPDATE visibility_tombstones SET title = 'updated, again' WHERE title = 'updated';
+
+BEGIN;
+INSERT INTO visibility (title) VALUES ('insert aborted');
+INSERT INTO visibility_tombstones (title) VALUES ('insert aborted');
+SELECT txid_current() AS aborted_insert \gset
+ABORT;
+
+BEGIN;
+DELETE FROM visibility WHERE title = 'delete aborted';
+DELETE FROM visibility_tombstones WHERE title = 'delete aborted';
+SELECT txid_current() AS aborted_delete \gset
+ABORT;
+
+BEGIN;
+INSERT INTO visibility (title) VALUES ('ours');
+INSERT INTO visibility_tombstones (title) VALUES ('ours');
+DELETE FROM visibility WHERE title = 'committed';
+DELETE FROM visibility_tombstones WHERE title = 'committed';
+
+-- after four commands that wrote, this is command #4
+SELECT * FROM visibility_clauses_agree('idxvisibility', false, 4, ARRAY[:aborted_insert, :aborted_delete]::bigint[]);
+SELECT * FROM visibility_clauses_agree('idxvisibility_tombstones', true, 4, ARRAY[:aborted_insert, :aborted_delete]::bigint[]);
+ABORT;
+
+DROP TABLE visibility CASCADE;
+DROP TABLE visibility_tombstones CASCADE;
+DROP FUNCTION visibility_clauses_agree(regclass, bool, int, bigint[]);
\ No newline at end of file
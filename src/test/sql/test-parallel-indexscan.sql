@@ -0,0 +1,30 @@
+SET enable_seqscan TO OFF;
+SET enable_bitmapscan TO OFF;
+SET enable_indexscan TO ON;
+SET parallel_setup_cost TO 0;
+SET parallel_tuple_cost TO 0;
+SET min_parallel_table_scan_size TO 0;
+SET min_parallel_index_scan_size TO 0;
+SET max_parallel_workers_per_gather TO 2;
+
+-- the workers split the index's scroll slices between them, so every row should come back exactly once
+EXPLAIN (COSTS OFF) SELECT id FROM events WHERE events ==> 'beer';
+SELECT count(*) = count(DISTINCT id)                        AS each_row_once,
+       count(*) = (SELECT zdb.count('idxevents', 'beer')) AS every_row
+  FROM events WHERE events ==> 'beer';
+
+-- sorted, the scroll is a single slice, which only one of them can read
+EXPLAIN (COSTS OFF) SELECT id FROM events WHERE events ==> 'beer' ORDER BY id LIMIT 10;
+SELECT id FROM events WHERE events ==> 'beer' ORDER BY id LIMIT 10;
+SELECT count(*) = count(DISTINCT id)                        AS each_row_once,
+       count(*) = (SELECT zdb.count('idxevents', 'beer')) AS every_row
+  FROM (SELECT id FROM events WHERE events ==> 'beer' ORDER BY id) sorted;
+
+RESET enable_seqscan;
+RESET enable_bitmapscan;
+RESET enable_indexscan;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET min_parallel_index_scan_size;
+RESET max_parallel_workers_per_gather;
\ No newline at end of file
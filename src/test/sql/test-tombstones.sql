@@ -0,0 +1,33 @@
+CREATE TABLE tombstones (
+    id serial8 not null primary key,
+    title varchar(64)
+) WITH (autovacuum_enabled = false);
+CREATE INDEX idxtombstones ON tombstones USING zombodb ((tombstones.*)) WITH (tombstones=true);
+INSERT INTO tombstones (title) VALUES ('one'), ('two'), ('three'), ('four');
+
+-- the old version of an UPDATEd row, and a DELETEd row, are hidden by their tombstones
+UPDATE tombstones SET title = 'two, updated' WHERE id = 2;
+DELETE FROM tombstones WHERE id = 3;
+SELECT zdb.count('idxtombstones', dsl.match_all());
+SELECT * FROM zdb.terms('idxtombstones', 'title', dsl.match_all()) ORDER BY term;
+SELECT * FROM tombstones WHERE tombstones ==> dsl.match_all() ORDER BY id;
+SELECT zdb.raw_count('idxtombstones', dsl.term('zdb_join', 'zdb_tombstone')) AS tombstones;
+
+-- a DELETE is visible to its own transaction, but not once it aborts
+BEGIN;
+DELETE FROM tombstones WHERE id = 1;
+SELECT zdb.count('idxtombstones', dsl.match_all());
+SELECT * FROM zdb.terms('idxtombstones', 'title', dsl.match_all()) ORDER BY term;
+ABORT;
+SELECT zdb.count('idxtombstones', dsl.match_all());
+SELECT * FROM zdb.terms('idxtombstones', 'title', dsl.match_all()) ORDER BY term;
+SELECT zdb.raw_count('idxtombstones', dsl.term('zdb_join', 'zdb_tombstone')) AS tombstones;
+
+-- VACUUM removes committed tombstones along with their rows, and aborted tombstones
+VACUUM tombstones;
+SELECT zdb.count('idxtombstones', dsl.match_all());
+SELECT * FROM zdb.terms('idxtombstones', 'title', dsl.match_all()) ORDER BY term;
+SELECT zdb.raw_count('idxtombstones', dsl.term('zdb_join', 'zdb_tombstone')) AS tombstones;
+SELECT zdb.raw_count('idxtombstones', dsl.term('zdb_join', 'zdb_row')) AS rows;
+
+DROP TABLE tombstones CASCADE;
\ No newline at end of file
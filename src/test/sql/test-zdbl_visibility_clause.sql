@@ -1 +1 @@
-select jsonb_pretty(regexp_replace(zdb.visibility_clause(42, 99, 0, ARRAY[1,2,3,4,5]::bigint[], 'idxevents', 'doc')::text, '"index":".*?"', '"index":"xxx"', 'g')::jsonb);
\ No newline at end of file
+select jsonb_pretty(zdb.visibility_clause(42, 99, 0, ARRAY[1,2,3,4,5]::bigint[], ARRAY[10,12,20,20]::bigint[], 7)::text::jsonb);
\ No newline at end of file